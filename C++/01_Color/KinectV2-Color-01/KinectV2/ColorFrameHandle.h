@@ -0,0 +1,289 @@
+﻿#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+
+#include <Kinect.h>
+#include <opencv2\opencv.hpp>
+
+#include "ComPtr.h"
+#include "Yuy2Converter.h"
+
+// カラーフレームをコピーせずに扱うハンドル
+//
+// CopyConvertedFrameDataToArray() は毎フレーム、SDKのバッファー(YUY2、4MB)を読んで
+// BGRA(8MB)に変換して書き込みます。このハンドルは AccessRawUnderlyingBuffer() で
+// SDKのバッファーをそのまま参照し、BGRAやグレースケールは使う側が求めたときに、
+// 求められた範囲だけ、求められた大きさに縮小しながら変換します。
+//
+// ハンドルはコピーでき、最後のハンドルがなくなったときにフレームを解放します。
+// Kinectは1つのリーダーから同時に1つのフレームしか取得できないので、
+// 次のフレームを取得する前にすべてのハンドルを手放してください。
+class ColorFrameHandle
+{
+public:
+
+    // メモリーの読み書きの量(変換で読んだバイト数と書いたバイト数)
+    struct Statistics
+    {
+        UINT64 frames;          // 取得したフレーム数
+        UINT64 conversions;     // 変換した回数
+        UINT64 readBytes;
+        UINT64 writtenBytes;
+    };
+
+    // フレームをまたいで共有するもの(変換用のバッファーと統計)
+    struct Shared
+    {
+        Yuy2Converter converter;
+
+        std::mutex mutex;
+        std::vector<cv::Mat> freeImages;
+        Statistics statistics;
+
+        Shared()
+        {
+            memset( &statistics, 0, sizeof( statistics ) );
+        }
+
+        void add( UINT64 readBytes, UINT64 writtenBytes )
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            ++statistics.conversions;
+            statistics.readBytes += readBytes;
+            statistics.writtenBytes += writtenBytes;
+        }
+    };
+
+private:
+
+    struct Frame
+    {
+        IColorFrame* frame = nullptr;
+        std::shared_ptr<Shared> shared;
+
+        int width = 0;
+        int height = 0;
+        ColorImageFormat rawFormat = ColorImageFormat_None;
+        BYTE* raw = nullptr;
+        UINT rawSize = 0;
+
+        // 変換したBGRA(bgra() を呼ぶまで作らない)
+        std::mutex mutex;
+        cv::Mat bgra;
+
+        ~Frame()
+        {
+            // 変換用のバッファーは次のフレームで使う
+            if ( !bgra.empty() && (rawFormat != ColorImageFormat_Bgra) ){
+                std::lock_guard<std::mutex> lock( shared->mutex );
+                shared->freeImages.push_back( bgra );
+            }
+
+            if ( frame != nullptr ){
+                frame->Release();
+            }
+        }
+    };
+
+    std::shared_ptr<Frame> frame;
+
+public:
+
+    // 最新のフレームを取得する(なければ空のハンドルを返す)
+    static ColorFrameHandle acquireLatestFrame( IColorFrameReader* reader, const std::shared_ptr<Shared>& shared )
+    {
+        ColorFrameHandle handle;
+
+        IColorFrame* colorFrame = nullptr;
+        if ( reader->AcquireLatestFrame( &colorFrame ) != S_OK ){
+            return handle;
+        }
+
+        handle.frame = std::make_shared<Frame>();
+        Frame& f = *handle.frame;
+        f.frame = colorFrame;
+        f.shared = shared;
+
+        ComPtr<IFrameDescription> frameDescription;
+        check( colorFrame->get_FrameDescription( &frameDescription ), "get_FrameDescription" );
+        check( frameDescription->get_Width( &f.width ), "get_Width" );
+        check( frameDescription->get_Height( &f.height ), "get_Height" );
+
+        // コピーせずにSDKのバッファーを参照する
+        check( colorFrame->get_RawColorImageFormat( &f.rawFormat ), "get_RawColorImageFormat" );
+        check( colorFrame->AccessRawUnderlyingBuffer( &f.rawSize, &f.raw ), "AccessRawUnderlyingBuffer" );
+
+        std::lock_guard<std::mutex> lock( shared->mutex );
+        ++shared->statistics.frames;
+
+        return handle;
+    }
+
+    bool isValid() const
+    {
+        return frame != nullptr;
+    }
+
+    void reset()
+    {
+        frame.reset();
+    }
+
+    int getWidth() const
+    {
+        return frame->width;
+    }
+
+    int getHeight() const
+    {
+        return frame->height;
+    }
+
+    IColorFrame* get() const
+    {
+        return frame->frame;
+    }
+
+    // SDKのバッファー(ハンドルがある間だけ有効)
+    ColorImageFormat getRawFormat() const
+    {
+        return frame->rawFormat;
+    }
+
+    const BYTE* getRawData() const
+    {
+        return frame->raw;
+    }
+
+    UINT getRawSize() const
+    {
+        return frame->rawSize;
+    }
+
+    // SDKのバッファーを画像として参照する(YUY2は1画素2バイト)
+    cv::Mat rawImage() const
+    {
+        int type = (frame->rawFormat == ColorImageFormat_Bgra) ? CV_8UC4 : CV_8UC2;
+        return cv::Mat( frame->height, frame->width, type, frame->raw );
+    }
+
+    // フレーム全体のBGRA(最初に呼ばれたときに1回だけ変換する)
+    // 変換用のバッファーは次のフレームで使い回すので、ハンドルがある間だけ有効
+    cv::Mat bgra() const
+    {
+        Frame& f = *frame;
+        std::lock_guard<std::mutex> lock( f.mutex );
+        if ( !f.bgra.empty() ){
+            return f.bgra;
+        }
+
+        if ( f.rawFormat == ColorImageFormat_Bgra ){
+            f.bgra = rawImage();
+            return f.bgra;
+        }
+
+        f.bgra = allocate( f.height, f.width, CV_8UC4 );
+        size_t pixels = (size_t)f.width * f.height;
+        if ( f.rawFormat == ColorImageFormat_Yuy2 ){
+            f.shared->converter.convertBgra( f.raw, f.width, 0, 0, f.width, f.height, 1, f.bgra.data );
+        }
+        else {
+            // YUY2以外はSDKに変換してもらう
+            check( f.frame->CopyConvertedFrameDataToArray( (UINT)(pixels * 4), f.bgra.data, ColorImageFormat_Bgra ), "CopyConvertedFrameDataToArray" );
+        }
+        f.shared->add( f.rawSize, pixels * 4 );
+
+        return f.bgra;
+    }
+
+    // 指定した範囲を 1/scale (1、2、4)に縮小しながらBGRAに変換する
+    // (YUY2は2画素で1組なので、範囲は Yuy2Converter::alignRegion() で揃える。画像の外にはみ出した部分は切り捨てる)
+    void copyBgra( cv::Mat& dst, cv::Rect roi, int scale = 1 ) const
+    {
+        convert( dst, roi, scale, true );
+    }
+
+    void copyBgra( cv::Mat& dst, int scale = 1 ) const
+    {
+        convert( dst, cv::Rect( 0, 0, frame->width, frame->height ), scale, true );
+    }
+
+    // グレースケールに変換する(YUY2は輝度をそのまま使う)
+    void copyGray( cv::Mat& dst, cv::Rect roi, int scale = 1 ) const
+    {
+        convert( dst, roi, scale, false );
+    }
+
+    void copyGray( cv::Mat& dst, int scale = 1 ) const
+    {
+        convert( dst, cv::Rect( 0, 0, frame->width, frame->height ), scale, false );
+    }
+
+private:
+
+    void convert( cv::Mat& dst, cv::Rect roi, int scale, bool isBgra ) const
+    {
+        Frame& f = *frame;
+
+        // 画像の外は変換しない
+        roi &= cv::Rect( 0, 0, f.width, f.height );
+        Yuy2Converter::alignRegion( roi.x, roi.y, roi.width, roi.height, scale );
+
+        int rows = roi.height / scale;
+        int cols = roi.width / scale;
+        int bytesPerPixel = isBgra ? 4 : 1;
+        dst.create( rows, cols, isBgra ? CV_8UC4 : CV_8UC1 );
+
+        if ( f.rawFormat == ColorImageFormat_Yuy2 ){
+            // 変換しながら縮小する(縮小は平均なので、範囲の画素はすべて読む)
+            if ( isBgra ){
+                f.shared->converter.convertBgra( f.raw, f.width, roi.x, roi.y, roi.width, roi.height, scale, dst.data );
+            }
+            else {
+                f.shared->converter.convertGray( f.raw, f.width, roi.x, roi.y, roi.width, roi.height, scale, dst.data );
+            }
+            f.shared->add( (UINT64)roi.width * roi.height * 2, (UINT64)rows * cols * bytesPerPixel );
+            return;
+        }
+
+        // YUY2以外はBGRAを縮小する
+        cv::Mat region = bgra()( roi );
+        cv::Mat resized;
+        cv::resize( region, resized, cv::Size( cols, rows ) );
+        if ( isBgra ){
+            resized.copyTo( dst );
+        }
+        else {
+            cv::cvtColor( resized, dst, CV_BGRA2GRAY );
+        }
+        f.shared->add( (UINT64)roi.width * roi.height * 4, (UINT64)rows * cols * bytesPerPixel );
+    }
+
+    cv::Mat allocate( int rows, int cols, int type ) const
+    {
+        Shared& shared = *frame->shared;
+        std::lock_guard<std::mutex> lock( shared.mutex );
+        while ( !shared.freeImages.empty() ){
+            cv::Mat image = shared.freeImages.back();
+            shared.freeImages.pop_back();
+            if ( (image.rows == rows) && (image.cols == cols) && (image.type() == type) ){
+                return image;
+            }
+        }
+
+        return cv::Mat( rows, cols, type );
+    }
+
+    static void check( HRESULT ret, const char* name )
+    {
+        if ( ret != S_OK ){
+            std::stringstream ss;
+            ss << "failed " << name << " " << std::hex << ret << std::endl;
+            throw std::runtime_error( ss.str().c_str() );
+        }
+    }
+};
@@ -0,0 +1,423 @@
+﻿#pragma once
+
+#include <stdexcept>
+
+#include <Windows.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// カラーフレームのYUY2データをBGRAやグレーに変換する
+//
+// 変換と同時に1/2、1/4に縮小し、指定した範囲だけを切り出せます。
+// 縮小は隣り合う画素の平均((a + b + 1) / 2 を縦、横の順に重ねたもの)で、
+// 変換はBT.601の係数を6ビットの固定小数点にしたものです。
+//   R = (74(Y - 16) + 102(V - 128) + 32) >> 6
+//   G = (74(Y - 16) - 25(U - 128) - 52(V - 128) + 32) >> 6
+//   B = (74(Y - 16) + 129(U - 128) + 32) >> 6
+// SIMDの実装はスカラーの実装と完全に一致します。
+class Yuy2Converter
+{
+public:
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSE2,
+        Path_AVX2,
+    };
+
+private:
+
+    Path path;
+
+public:
+
+    Yuy2Converter()
+    {
+        path = fastestPath();
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        switch ( path ){
+        case Path_SSE2: return "SSE2";
+        case Path_AVX2: return "AVX2";
+        default:        return "Scalar";
+        }
+    }
+
+    // 実行中のCPUで使える実装かどうか
+    static bool isSupported( Path path )
+    {
+        switch ( path ){
+        case Path_Scalar:
+            return true;
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            return true;
+        case Path_AVX2:
+            return isAvx2Supported();
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Path fastestPath()
+    {
+        if ( isSupported( Path_AVX2 ) ){
+            return Path_AVX2;
+        }
+        if ( isSupported( Path_SSE2 ) ){
+            return Path_SSE2;
+        }
+        return Path_Scalar;
+    }
+
+    // 指定した範囲を変換できる形に揃える
+    // (xは2画素単位、幅と高さは縮小率の倍数。幅は1/1でも2画素単位)
+    static void alignRegion( int& x, int& y, int& width, int& height, int scale )
+    {
+        checkScale( scale );
+
+        int unit = (scale < 2) ? 2 : scale;
+        int right = x + width;
+        x &= ~1;
+        width = ((right - x) / unit) * unit;
+        height = (height / scale) * scale;
+    }
+
+    // src : YUY2の画像(1行 srcWidth * 2 バイト)
+    // (x, y, width, height) の範囲を 1/scale に縮小してBGRAにする
+    // dst には (width / scale) * (height / scale) 画素を詰めて書き込む
+    void convertBgra( const BYTE* src, int srcWidth, int x, int y, int width, int height, int scale, BYTE* dst ) const
+    {
+        convert( src, srcWidth, x, y, width, height, scale, dst, true );
+    }
+
+    // 同じ範囲を1画素1バイトの輝度(Y)にする
+    void convertGray( const BYTE* src, int srcWidth, int x, int y, int width, int height, int scale, BYTE* dst ) const
+    {
+        convert( src, srcWidth, x, y, width, height, scale, dst, false );
+    }
+
+private:
+
+    void convert( const BYTE* src, int srcWidth, int x, int y, int width, int height, int scale, BYTE* dst, bool isBgra ) const
+    {
+        checkScale( scale );
+        if ( (x & 1) || (width % ((scale < 2) ? 2 : scale)) || (height % scale) ){
+            throw std::runtime_error( "変換する範囲が揃っていません(alignRegionを使ってください)" );
+        }
+        if ( (x < 0) || (y < 0) || (x + width > srcWidth) ){
+            throw std::runtime_error( "変換する範囲が画像の外にあります" );
+        }
+
+        int outWidth = width / scale;
+        int outHeight = height / scale;
+        int bytesPerPixel = isBgra ? 4 : 1;
+        size_t stride = (size_t)srcWidth * 2;
+
+        for ( int row = 0; row < outHeight; ++row ){
+            // 縮小する行の先頭
+            const BYTE* rows[4];
+            for ( int i = 0; i < scale; ++i ){
+                rows[i] = src + ((y + (row * scale) + i) * stride) + (x * 2);
+            }
+
+            BYTE* out = dst + ((size_t)row * outWidth * bytesPerPixel);
+            int done = 0;
+
+            switch ( path ){
+#if defined(_M_IX86) || defined(_M_X64)
+            case Path_SSE2:
+                done = convertRowSSE2( rows, scale, outWidth, out, isBgra );
+                break;
+            case Path_AVX2:
+                done = (scale == 1) ? convertRowAVX2( rows[0], outWidth, out, isBgra ) : convertRowSSE2( rows, scale, outWidth, out, isBgra );
+                break;
+#endif
+            default:
+                break;
+            }
+
+            // 端数はスカラーで処理する
+            convertRowScalar( rows, scale, done, outWidth, out, isBgra );
+        }
+    }
+
+    static void checkScale( int scale )
+    {
+        if ( (scale != 1) && (scale != 2) && (scale != 4) ){
+            throw std::runtime_error( "縮小率は1、2、4のどれかです" );
+        }
+    }
+
+    static int average( int a, int b )
+    {
+        return (a + b + 1) >> 1;
+    }
+
+    static BYTE clip( int value )
+    {
+        return (BYTE)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+    }
+
+    // 縦に平均したYUY2の k バイト目
+    static int sample( const BYTE* const* rows, int scale, int k )
+    {
+        switch ( scale ){
+        case 2:
+            return average( rows[0][k], rows[1][k] );
+        case 4:
+            return average( average( rows[0][k], rows[1][k] ), average( rows[2][k], rows[3][k] ) );
+        default:
+            return rows[0][k];
+        }
+    }
+
+    static void convertRowScalar( const BYTE* const* rows, int scale, int begin, int end, BYTE* dst, bool isBgra )
+    {
+        for ( int j = begin; j < end; ++j ){
+            int Y, U, V;
+            if ( scale == 1 ){
+                int pair = (j >> 1) * 4;
+                Y = rows[0][j * 2];
+                U = rows[0][pair + 1];
+                V = rows[0][pair + 3];
+            }
+            else if ( scale == 2 ){
+                int k = j * 4;
+                Y = average( sample( rows, scale, k ), sample( rows, scale, k + 2 ) );
+                U = sample( rows, scale, k + 1 );
+                V = sample( rows, scale, k + 3 );
+            }
+            else {
+                int k = j * 8;
+                Y = average( average( sample( rows, scale, k ), sample( rows, scale, k + 2 ) ),
+                             average( sample( rows, scale, k + 4 ), sample( rows, scale, k + 6 ) ) );
+                U = average( sample( rows, scale, k + 1 ), sample( rows, scale, k + 5 ) );
+                V = average( sample( rows, scale, k + 3 ), sample( rows, scale, k + 7 ) );
+            }
+
+            if ( !isBgra ){
+                dst[j] = (BYTE)Y;
+                continue;
+            }
+
+            int yy = ((Y - 16) * 74) + 32;
+            int d = U - 128;
+            int e = V - 128;
+            dst[j * 4 + 0] = clip( (yy + (129 * d)) >> 6 );
+            dst[j * 4 + 1] = clip( (yy - (25 * d) - (52 * e)) >> 6 );
+            dst[j * 4 + 2] = clip( (yy + (102 * e)) >> 6 );
+            dst[j * 4 + 3] = 255;
+        }
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    static bool isAvx2Supported()
+    {
+        int info[4];
+        __cpuid( info, 0 );
+        if ( info[0] < 7 ){
+            return false;
+        }
+
+        // OSがAVXのレジスタを保存するか(OSXSAVE, AVX)
+        __cpuid( info, 1 );
+        if ( (info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 ){
+            return false;
+        }
+        if ( (_xgetbv( 0 ) & 0x6) != 0x6 ){
+            return false;
+        }
+
+        __cpuidex( info, 7, 0 );
+        return (info[1] & (1 << 5)) != 0;
+    }
+
+    // 縦に平均した16バイト(8画素)
+    static __m128i loadSSE2( const BYTE* const* rows, int scale, int k )
+    {
+        __m128i a = _mm_loadu_si128( (const __m128i*)(rows[0] + k) );
+        if ( scale == 1 ){
+            return a;
+        }
+
+        a = _mm_avg_epu8( a, _mm_loadu_si128( (const __m128i*)(rows[1] + k) ) );
+        if ( scale == 2 ){
+            return a;
+        }
+
+        __m128i b = _mm_avg_epu8( _mm_loadu_si128( (const __m128i*)(rows[2] + k) ), _mm_loadu_si128( (const __m128i*)(rows[3] + k) ) );
+        return _mm_avg_epu8( a, b );
+    }
+
+    // 横に2画素を平均したY(UINT32に1つずつ)
+    static __m128i halveY( __m128i yuy2 )
+    {
+        __m128i y = _mm_and_si128( yuy2, _mm_set1_epi16( 0xFF ) );
+        return _mm_avg_epu16( _mm_and_si128( y, _mm_set1_epi32( 0xFFFF ) ), _mm_srli_epi32( y, 16 ) );
+    }
+
+    // UINT64に1つずつ入った値を4つ分、8個のINT16に詰める
+    static __m128i pack64( __m128i a, __m128i b, __m128i c, __m128i d )
+    {
+        return _mm_packs_epi32( _mm_packs_epi32( a, b ), _mm_packs_epi32( c, d ) );
+    }
+
+    // 出力の8画素分のY、U、V(INT16)を取り出す
+    static void yuvSSE2( const BYTE* const* rows, int scale, int j, __m128i& y, __m128i& u, __m128i& v )
+    {
+        if ( scale == 1 ){
+            __m128i m = loadSSE2( rows, scale, j * 2 );
+            __m128i uv = _mm_srli_epi16( m, 8 );
+            y = _mm_and_si128( m, _mm_set1_epi16( 0xFF ) );
+            u = _mm_shufflehi_epi16( _mm_shufflelo_epi16( uv, _MM_SHUFFLE( 2, 2, 0, 0 ) ), _MM_SHUFFLE( 2, 2, 0, 0 ) );
+            v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( uv, _MM_SHUFFLE( 3, 3, 1, 1 ) ), _MM_SHUFFLE( 3, 3, 1, 1 ) );
+        }
+        else if ( scale == 2 ){
+            __m128i m0 = loadSSE2( rows, scale, j * 4 );
+            __m128i m1 = loadSSE2( rows, scale, j * 4 + 16 );
+            __m128i uv0 = _mm_srli_epi16( m0, 8 );
+            __m128i uv1 = _mm_srli_epi16( m1, 8 );
+            const __m128i low = _mm_set1_epi32( 0xFFFF );
+            y = _mm_packs_epi32( halveY( m0 ), halveY( m1 ) );
+            u = _mm_packs_epi32( _mm_and_si128( uv0, low ), _mm_and_si128( uv1, low ) );
+            v = _mm_packs_epi32( _mm_srli_epi32( uv0, 16 ), _mm_srli_epi32( uv1, 16 ) );
+        }
+        else {
+            const __m128i low32 = _mm_set_epi32( 0, -1, 0, -1 );
+            const __m128i low16 = _mm_set_epi32( 0, 0xFFFF, 0, 0xFFFF );
+            __m128i ys[4], us[4], vs[4];
+            for ( int i = 0; i < 4; ++i ){
+                __m128i m = loadSSE2( rows, scale, j * 8 + i * 16 );
+
+                // 2組のYUY2をさらに平均する
+                __m128i y2 = halveY( m );
+                __m128i uv = _mm_srli_epi16( m, 8 );
+                __m128i uv4 = _mm_avg_epu16( _mm_and_si128( uv, low32 ), _mm_srli_epi64( uv, 32 ) );
+                ys[i] = _mm_avg_epu16( _mm_and_si128( y2, low32 ), _mm_srli_epi64( y2, 32 ) );
+                us[i] = _mm_and_si128( uv4, low16 );
+                vs[i] = _mm_and_si128( _mm_srli_epi64( uv4, 16 ), low16 );
+            }
+            y = pack64( ys[0], ys[1], ys[2], ys[3] );
+            u = pack64( us[0], us[1], us[2], us[3] );
+            v = pack64( vs[0], vs[1], vs[2], vs[3] );
+        }
+    }
+
+    // 8画素分のB、G、R(INT16)を求める
+    static void bgrSSE2( __m128i y, __m128i u, __m128i v, __m128i& b, __m128i& g, __m128i& r )
+    {
+        const __m128i bias = _mm_set1_epi16( 128 );
+        __m128i yy = _mm_add_epi16( _mm_mullo_epi16( _mm_sub_epi16( y, _mm_set1_epi16( 16 ) ), _mm_set1_epi16( 74 ) ), _mm_set1_epi16( 32 ) );
+        __m128i d = _mm_sub_epi16( u, bias );
+        __m128i e = _mm_sub_epi16( v, bias );
+
+        // 明るい色は32767を超えるが、飽和しても255になるので結果は変わらない
+        b = _mm_srai_epi16( _mm_adds_epi16( yy, _mm_mullo_epi16( d, _mm_set1_epi16( 129 ) ) ), 6 );
+        g = _mm_srai_epi16( _mm_adds_epi16( _mm_adds_epi16( yy, _mm_mullo_epi16( d, _mm_set1_epi16( -25 ) ) ),
+                                            _mm_mullo_epi16( e, _mm_set1_epi16( -52 ) ) ), 6 );
+        r = _mm_srai_epi16( _mm_adds_epi16( yy, _mm_mullo_epi16( e, _mm_set1_epi16( 102 ) ) ), 6 );
+    }
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    static int convertRowSSE2( const BYTE* const* rows, int scale, int count, BYTE* dst, bool isBgra )
+    {
+        const __m128i alpha = _mm_set1_epi8( -1 );
+
+        int j = 0;
+        for ( ; j + 8 <= count; j += 8 ){
+            __m128i y, u, v;
+            yuvSSE2( rows, scale, j, y, u, v );
+
+            if ( !isBgra ){
+                _mm_storel_epi64( (__m128i*)(dst + j), _mm_packus_epi16( y, y ) );
+                continue;
+            }
+
+            __m128i b, g, r;
+            bgrSSE2( y, u, v, b, g, r );
+
+            __m128i bg = _mm_unpacklo_epi8( _mm_packus_epi16( b, b ), _mm_packus_epi16( g, g ) );
+            __m128i ra = _mm_unpacklo_epi8( _mm_packus_epi16( r, r ), alpha );
+            _mm_storeu_si128( (__m128i*)(dst + j * 4), _mm_unpacklo_epi16( bg, ra ) );
+            _mm_storeu_si128( (__m128i*)(dst + j * 4 + 16), _mm_unpackhi_epi16( bg, ra ) );
+        }
+
+        return j;
+    }
+
+    // 縮小しないときは16画素(グレーは32画素)ずつ処理し、処理した画素数を返す
+    static int convertRowAVX2( const BYTE* src, int count, BYTE* dst, bool isBgra )
+    {
+        const __m256i lowByte = _mm256_set1_epi16( 0xFF );
+
+        int j = 0;
+        if ( !isBgra ){
+            for ( ; j + 32 <= count; j += 32 ){
+                __m256i y0 = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*)(src + j * 2) ), lowByte );
+                __m256i y1 = _mm256_and_si256( _mm256_loadu_si256( (const __m256i*)(src + j * 2 + 32) ), lowByte );
+
+                // packusはレーンごとに詰めるので、64ビット単位で並べ直す
+                __m256i packed = _mm256_permute4x64_epi64( _mm256_packus_epi16( y0, y1 ), 0xD8 );
+                _mm256_storeu_si256( (__m256i*)(dst + j), packed );
+            }
+            return j;
+        }
+
+        const __m256i bias = _mm256_set1_epi16( 128 );
+        const __m256i alpha = _mm256_set1_epi8( -1 );
+
+        for ( ; j + 16 <= count; j += 16 ){
+            __m256i m = _mm256_loadu_si256( (const __m256i*)(src + j * 2) );
+            __m256i uv = _mm256_srli_epi16( m, 8 );
+            __m256i y = _mm256_and_si256( m, lowByte );
+            __m256i u = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( uv, _MM_SHUFFLE( 2, 2, 0, 0 ) ), _MM_SHUFFLE( 2, 2, 0, 0 ) );
+            __m256i v = _mm256_shufflehi_epi16( _mm256_shufflelo_epi16( uv, _MM_SHUFFLE( 3, 3, 1, 1 ) ), _MM_SHUFFLE( 3, 3, 1, 1 ) );
+
+            __m256i yy = _mm256_add_epi16( _mm256_mullo_epi16( _mm256_sub_epi16( y, _mm256_set1_epi16( 16 ) ), _mm256_set1_epi16( 74 ) ), _mm256_set1_epi16( 32 ) );
+            __m256i d = _mm256_sub_epi16( u, bias );
+            __m256i e = _mm256_sub_epi16( v, bias );
+
+            __m256i b = _mm256_srai_epi16( _mm256_adds_epi16( yy, _mm256_mullo_epi16( d, _mm256_set1_epi16( 129 ) ) ), 6 );
+            __m256i g = _mm256_srai_epi16( _mm256_adds_epi16( _mm256_adds_epi16( yy, _mm256_mullo_epi16( d, _mm256_set1_epi16( -25 ) ) ),
+                                                              _mm256_mullo_epi16( e, _mm256_set1_epi16( -52 ) ) ), 6 );
+            __m256i r = _mm256_srai_epi16( _mm256_adds_epi16( yy, _mm256_mullo_epi16( e, _mm256_set1_epi16( 102 ) ) ), 6 );
+
+            // レーンごとに 0-3, 8-11 と 4-7, 12-15 の画素ができるので並べ直す
+            __m256i bg = _mm256_unpacklo_epi8( _mm256_packus_epi16( b, b ), _mm256_packus_epi16( g, g ) );
+            __m256i ra = _mm256_unpacklo_epi8( _mm256_packus_epi16( r, r ), alpha );
+            __m256i lo = _mm256_unpacklo_epi16( bg, ra );
+            __m256i hi = _mm256_unpackhi_epi16( bg, ra );
+            _mm256_storeu_si256( (__m256i*)(dst + j * 4), _mm256_permute2x128_si256( lo, hi, 0x20 ) );
+            _mm256_storeu_si256( (__m256i*)(dst + j * 4 + 32), _mm256_permute2x128_si256( lo, hi, 0x31 ) );
+        }
+
+        return j;
+    }
+
+#endif
+};
@@ -8,6 +8,9 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "ColorFrameHandle.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -25,11 +28,35 @@ private:
     IKinectSensor* kinect = nullptr;
 
     IColorFrameReader* colorFrameReader = nullptr;
+
+    // フレームの到着イベント(届くまで待って、AcquireLatestFrame を空振りしない)
+    WAITABLE_HANDLE colorFrameEvent = 0;
     std::vector<BYTE> colorBuffer;
     int colorWidth;
     int colorHeight;
     unsigned int colorBytesPerPixel;
 
+    // フレームをまたいで使い回す変換用のバッファー
+    std::shared_ptr<ColorFrameHandle::Shared> colorShared = std::make_shared<ColorFrameHandle::Shared>();
+
+    // 表示する画像(必要な分だけ変換する)
+    // 既定は1/2の縮小で、2x2画素の平均を取るのでYUY2の4MBはすべて読み、書き込むのは2MB
+    // 1フレームの読み書きは約6MB(元の処理は約12MB)
+    // 'c' キーでフレーム全体を表示すると、元の処理と同じく8MBのBGRAを書き込みます
+    enum DisplayMode
+    {
+        Display_Color,      // フレーム全体をBGRAで
+        Display_Half,       // 1/2に縮小したBGRA(960x540)
+        Display_Gray,       // 輝度だけ
+        Display_Center,     // 中央の1/4だけをBGRAで
+    };
+    DisplayMode displayMode = Display_Half;
+    cv::Mat displayImage;
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
 public:
 
     // 初期化
@@ -51,6 +78,7 @@ public:
         ComPtr<IColorFrameSource> colorFrameSource;
         ERROR_CHECK( kinect->get_ColorFrameSource( &colorFrameSource ) );
         ERROR_CHECK( colorFrameSource->OpenReader( &colorFrameReader ) );
+        ERROR_CHECK( colorFrameReader->SubscribeFrameArrived( &colorFrameEvent ) );
 
         // カラー画像のサイズを取得する
         ComPtr<IFrameDescription> colorFrameDescription;
@@ -66,48 +94,246 @@ public:
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         while ( 1 ) {
+            // フレームが届くまで待つ(届かなくてもキーを受け付けるように、100msで戻る)
+            waitForFrame( 100 );
             update();
             draw();
 
-            auto key = cv::waitKey( 10 );
+            auto key = cv::waitKey( 1 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'c' ){
+                displayMode = Display_Color;
+            }
+            else if ( key == 'h' ){
+                displayMode = Display_Half;
+            }
+            else if ( key == 'g' ){
+                displayMode = Display_Gray;
+            }
+            else if ( key == 'r' ){
+                displayMode = Display_Center;
+            }
+            else if ( key == 'b' ){
+                benchmarkColorFrame();
+                benchmarkYuy2Converter();
+            }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
         }
     }
 
 private:
 
+    // フレームが届くまで待つ(milliseconds 待っても届かなければ戻る)
+    void waitForFrame( DWORD milliseconds )
+    {
+        if ( ::WaitForSingleObject( reinterpret_cast<HANDLE>( colorFrameEvent ), milliseconds ) == WAIT_OBJECT_0 ){
+            // イベントのデータを受け取ってイベントを戻す(受け取らないとシグナルのままになり、待たずに戻り続ける)
+            ComPtr<IColorFrameArrivedEventArgs> args;
+            colorFrameReader->GetFrameArrivedEventData( colorFrameEvent, &args );
+        }
+    }
+
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
         updateColorFrame();
     }
 
     // カラーフレームの更新
     void updateColorFrame()
     {
-        // フレームを取得する
-        ComPtr<IColorFrame> colorFrame;
-        auto ret = colorFrameReader->AcquireLatestFrame( &colorFrame );
-        if ( ret == S_OK ){
-            // BGRAの形式でデータを取得する
-            ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
-                colorBuffer.size(), &colorBuffer[0], ColorImageFormat::ColorImageFormat_Bgra ) );
+        STAGE_TIMER( profiler, "updateColorFrame" );
 
-            // カラーデータを表示する
-            cv::Mat colorImage( colorHeight, colorWidth, CV_8UC4, &colorBuffer[0] );
-            cv::imshow( "Color Image", colorImage );
+        // フレームを取得する(データはコピーせずに参照する)
+        auto colorFrame = ColorFrameHandle::acquireLatestFrame( colorFrameReader, colorShared );
+        if ( !colorFrame.isValid() ){
+            return;
+        }
 
-            // スマートポインタを使ってない場合は、自分でフレームを解放する
-            // colorFrame->Release();
+        // 表示に必要な分だけ変換する
+        cv::Mat image;
+        {
+            STAGE_TIMER( profiler, "convert" );
+            if ( displayMode == Display_Color ){
+                image = colorFrame.bgra();
+            }
+            else if ( displayMode == Display_Half ){
+                colorFrame.copyBgra( displayImage, 2 );
+                image = displayImage;
+            }
+            else if ( displayMode == Display_Gray ){
+                colorFrame.copyGray( displayImage );
+                image = displayImage;
+            }
+            else {
+                colorFrame.copyBgra( displayImage, centerRect() );
+                image = displayImage;
+            }
         }
+
+        {
+            STAGE_TIMER( profiler, "imshow" );
+            cv::imshow( "Color Image", image );
+        }
+
+        // ハンドルがなくなるとフレームが解放される
+    }
+
+    // 画面中央の1/4の範囲
+    cv::Rect centerRect() const
+    {
+        return cv::Rect( colorWidth / 4, colorHeight / 4, colorWidth / 2, colorHeight / 2 );
     }
 
     void draw()
     {
     }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
+
+    // 1フレームあたりの変換時間とメモリーの読み書きの量を比べる
+    void benchmarkColorFrame()
+    {
+        const int Count = 30;
+
+        // 計測に使うフレームを取得する
+        ColorFrameHandle colorFrame;
+        for ( int i = 0; (i < 100) && !colorFrame.isValid(); ++i ){
+            colorFrame = ColorFrameHandle::acquireLatestFrame( colorFrameReader, colorShared );
+            cv::waitKey( 10 );
+        }
+        if ( !colorFrame.isValid() ){
+            std::cout << "カラーフレームを取得できません" << std::endl;
+            return;
+        }
+
+        // 元の処理 : SDKのバッファー(YUY2)を読んでBGRAをコピーする
+        auto begin = cv::getTickCount();
+        for ( int i = 0; i < Count; ++i ){
+            ERROR_CHECK( colorFrame.get()->CopyConvertedFrameDataToArray(
+                colorBuffer.size(), &colorBuffer[0], ColorImageFormat::ColorImageFormat_Bgra ) );
+        }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        printBenchmark( "CopyConvertedFrameDataToArray", time, colorFrame.getRawSize() + colorBuffer.size() );
+
+        cv::Mat image;
+        benchmarkHandle( "BGRA (全体)", [&]{ colorFrame.copyBgra( image ); } );
+        benchmarkHandle( "BGRA (1/2)", [&]{ colorFrame.copyBgra( image, 2 ); } );
+        benchmarkHandle( "BGRA (中央の1/4)", [&]{ colorFrame.copyBgra( image, centerRect() ); } );
+        benchmarkHandle( "Gray", [&]{ colorFrame.copyGray( image ); } );
+    }
+
+    // 記録したYUY2のフレームで、変換の実装ごとの時間を比べる
+    void benchmarkYuy2Converter()
+    {
+        const int FrameCount = 10;
+
+        // YUY2のフレームを記録する(取得できなければ疑似的なデータを使う)
+        std::vector<std::vector<BYTE>> frames;
+        for ( int i = 0; (i < 100) && (frames.size() < FrameCount); ++i ){
+            auto colorFrame = ColorFrameHandle::acquireLatestFrame( colorFrameReader, colorShared );
+            if ( colorFrame.isValid() && (colorFrame.getRawFormat() == ColorImageFormat_Yuy2) ){
+                frames.push_back( std::vector<BYTE>( colorFrame.getRawData(), colorFrame.getRawData() + colorFrame.getRawSize() ) );
+            }
+            cv::waitKey( 10 );
+        }
+        if ( frames.empty() ){
+            std::cout << "YUY2のフレームを取得できないので、疑似的なデータを使います" << std::endl;
+            frames.push_back( std::vector<BYTE>( colorWidth * colorHeight * 2 ) );
+            cv::randu( cv::Mat( colorHeight, colorWidth * 2, CV_8UC1, &frames[0][0] ), 0, 256 );
+        }
+
+        struct Case
+        {
+            const char* name;
+            bool isBgra;
+            int scale;
+            cv::Rect roi;
+        };
+        Case cases[] = {
+            { "BGRA", true, 1, cv::Rect( 0, 0, colorWidth, colorHeight ) },
+            { "BGRA 1/2", true, 2, cv::Rect( 0, 0, colorWidth, colorHeight ) },
+            { "BGRA 1/4", true, 4, cv::Rect( 0, 0, colorWidth, colorHeight ) },
+            { "BGRA 中央の1/4", true, 1, centerRect() },
+            { "Gray", false, 1, cv::Rect( 0, 0, colorWidth, colorHeight ) },
+            { "Gray 1/2", false, 2, cv::Rect( 0, 0, colorWidth, colorHeight ) },
+            { "Gray 1/4", false, 4, cv::Rect( 0, 0, colorWidth, colorHeight ) },
+        };
+
+        for ( auto& c : cases ){
+            Yuy2Converter::alignRegion( c.roi.x, c.roi.y, c.roi.width, c.roi.height, c.scale );
+            size_t size = (c.roi.width / c.scale) * (c.roi.height / c.scale) * (c.isBgra ? 4 : 1);
+            std::vector<BYTE> expected( size * frames.size() );
+            std::vector<BYTE> actual( expected.size() );
+
+            for ( int path = Yuy2Converter::Path_Scalar; path <= Yuy2Converter::Path_AVX2; ++path ){
+                if ( !Yuy2Converter::isSupported( (Yuy2Converter::Path)path ) ){
+                    continue;
+                }
+
+                // スカラーの結果を基準にする
+                auto& dst = (path == Yuy2Converter::Path_Scalar) ? expected : actual;
+
+                Yuy2Converter converter;
+                converter.setPath( (Yuy2Converter::Path)path );
+
+                auto begin = cv::getTickCount();
+                for ( size_t i = 0; i < frames.size(); ++i ){
+                    if ( c.isBgra ){
+                        converter.convertBgra( &frames[i][0], colorWidth, c.roi.x, c.roi.y, c.roi.width, c.roi.height, c.scale, &dst[i * size] );
+                    }
+                    else {
+                        converter.convertGray( &frames[i][0], colorWidth, c.roi.x, c.roi.y, c.roi.width, c.roi.height, c.scale, &dst[i * size] );
+                    }
+                }
+                auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / frames.size();
+
+                std::cout << c.name << " " << Yuy2Converter::pathName( converter.getPath() ) << " : " << time << "ms"
+                    << (((path == Yuy2Converter::Path_Scalar) || (actual == expected)) ? "" : " (結果が一致しません)") << std::endl;
+            }
+        }
+    }
+
+    template<typename Function>
+    void benchmarkHandle( const char* name, Function function )
+    {
+        const int Count = 30;
+
+        auto before = colorShared->statistics;
+        auto begin = cv::getTickCount();
+        for ( int i = 0; i < Count; ++i ){
+            function();
+        }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        auto after = colorShared->statistics;
+
+        printBenchmark( name, time, ((after.readBytes - before.readBytes) + (after.writtenBytes - before.writtenBytes)) / Count );
+    }
+
+    void printBenchmark( const char* name, double time, UINT64 bytes )
+    {
+        std::cout << name << " : " << time << "ms, " << (bytes / (1024.0 * 1024.0)) << "MB/フレーム" << std::endl;
+    }
 };
 
 void main()
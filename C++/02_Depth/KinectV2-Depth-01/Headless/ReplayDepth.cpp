@@ -0,0 +1,275 @@
+﻿#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+
+#include "ReplayFrameSource.h"
+#include "DepthConverter.h"
+#include "TemporalDepthFilter.h"
+#include "SpatialDepthFilter.h"
+#include "AllocationCounter.h"
+
+// 記録したファイルのDepthを、Depth-01 と同じ処理(時間方向のフィルター、空間フィルター、グレーへの変換)に
+// 最大の速度で通して、段階ごとの時間と結果のハッシュを表示する(Kinect も OpenCV も使わない)
+//
+//   ReplayDepth depth.kfrm [--filter average|median] [--spatial] [--guide] [--threads n] [--frames n] [--no-allocations]
+//
+// 2フレーム目からのメモリーの確保(operator new)も数えます。--no-allocations を指定すると、
+// 確保があったときに失敗します(リリース版でフレームごとに確保していないかを確かめる)。
+// ハッシュは変換したグレー画像をすべてのフレームでつないだもの(FNV-1a)なので、処理を変えたときに
+// 結果が変わっていないかをセンサーなしで確かめられます。
+class DepthReplay
+{
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    // 段階ごとの合計時間(ms)
+    struct Stage
+    {
+        const char* name;
+        double total;
+    };
+
+    ReplayFrameSource source;
+
+    int depthWidth;
+    int depthHeight;
+    std::vector<UINT16> depthBuffer;
+    std::vector<UINT16> infraredBuffer;
+    std::vector<BYTE> depthGray;
+
+    DepthConverter depthConverter;
+
+    TemporalDepthFilter depthFilter;
+    bool isFilterEnabled = false;
+
+    SpatialDepthFilter spatialFilter;
+    bool isSpatialFilterEnabled = false;
+    bool isInfraredGuideEnabled = false;
+
+    enum
+    {
+        Stage_Acquire,
+        Stage_Temporal,
+        Stage_Spatial,
+        Stage_Convert,
+        Stage_Count,
+    };
+    Stage stages[Stage_Count];
+
+    UINT64 hash = 14695981039346656037ull;
+    int frames = 0;
+
+    // 2フレーム目からのメモリー確保の回数
+    unsigned long long allocations = 0;
+
+public:
+
+    DepthReplay( const std::string& fileName )
+        : source( fileName, ReplayFrameSource::Mode_MaxSpeed, false )
+    {
+        Stage names[Stage_Count] = {
+            { "acquireLatestFrame", 0 },
+            { "TemporalDepthFilter", 0 },
+            { "SpatialDepthFilter", 0 },
+            { "DepthConverter", 0 },
+        };
+        for ( int i = 0; i < Stage_Count; ++i ){
+            stages[i] = names[i];
+        }
+
+        source.open( FrameStream_Depth );
+        FrameFormat depthFormat = source.getFormat( FrameStream_Depth );
+        depthWidth = depthFormat.width;
+        depthHeight = depthFormat.height;
+
+        depthBuffer.resize( depthWidth * depthHeight );
+        depthGray.resize( depthWidth * depthHeight );
+        depthFilter.initialize( depthWidth * depthHeight );
+        spatialFilter.initialize( depthWidth, depthHeight );
+
+        // 赤外線は記録されていて、Depthと同じ大きさのときだけ使う
+        try {
+            source.open( FrameStream_Infrared );
+            FrameFormat infraredFormat = source.getFormat( FrameStream_Infrared );
+            if ( (infraredFormat.width == depthWidth) && (infraredFormat.height == depthHeight) ){
+                infraredBuffer.resize( depthWidth * depthHeight );
+            }
+        }
+        catch ( std::exception& ){
+        }
+    }
+
+    void setFilter( TemporalDepthFilter::Mode mode )
+    {
+        isFilterEnabled = true;
+        depthFilter.setMode( mode );
+        depthFilter.reset();
+    }
+
+    void setSpatialFilter( bool isInfraredGuide, int threadCount )
+    {
+        if ( isInfraredGuide && infraredBuffer.empty() ){
+            throw std::runtime_error( "記録したファイルに赤外線がないので、赤外線をガイドにできません" );
+        }
+
+        isSpatialFilterEnabled = true;
+        isInfraredGuideEnabled = isInfraredGuide;
+        if ( threadCount > 0 ){
+            spatialFilter.setThreadCount( threadCount );
+        }
+    }
+
+    // 最後のフレームまで(maxFrames が0より大きければそのフレーム数まで)処理する
+    // 2フレーム目から確保した回数を返す
+    unsigned long long run( int maxFrames )
+    {
+        std::cout << "Depth : " << depthWidth << " x " << depthHeight
+            << ", 変換 : " << DepthConverter::pathName( depthConverter.getPath() )
+            << ", フィルター : " << (isFilterEnabled ? TemporalDepthFilter::modeName( depthFilter.getMode() ) : "なし")
+            << ", 空間フィルター : " << (isSpatialFilterEnabled ? (isInfraredGuideEnabled ? "赤外線" : "Depth") : "なし") << std::endl;
+
+        while ( (maxFrames <= 0) || (frames < maxFrames) ){
+            // 最初のフレームはバッファーの準備があるので数えない
+            auto before = AllocationCounter::count();
+            if ( !update() ){
+                break;
+            }
+            if ( frames > 1 ){
+                allocations += AllocationCounter::count() - before;
+            }
+        }
+
+        if ( frames == 0 ){
+            throw std::runtime_error( "Depthのフレームがありません" );
+        }
+
+        std::cout << "フレーム数 : " << frames << std::endl;
+        double total = 0;
+        for ( const auto& stage : stages ){
+            // 使わなかった段階は表示しない
+            if ( stage.total == 0 ){
+                continue;
+            }
+
+            std::cout << "  " << stage.name << " : " << (stage.total / frames) << "ms/フレーム" << std::endl;
+            total += stage.total;
+        }
+        std::cout << "  計 : " << (total / frames) << "ms/フレーム" << std::endl;
+
+        std::stringstream ss;
+        ss << std::hex << hash;
+        std::cout << "ハッシュ : " << ss.str() << std::endl;
+        std::cout << "メモリーの確保 : " << allocations << "回 / " << (frames - 1) << "フレーム" << std::endl;
+
+        return allocations;
+    }
+
+private:
+
+    bool update()
+    {
+        auto begin = Clock::now();
+
+        // 赤外線はDepthと同じフレームで撮られるので、先に取得しておく
+        if ( !infraredBuffer.empty() ){
+            source.acquireLatestFrame( FrameStream_Infrared, &infraredBuffer[0], (UINT)(infraredBuffer.size() * sizeof( UINT16 )), nullptr );
+        }
+
+        if ( !source.acquireLatestFrame( FrameStream_Depth, &depthBuffer[0], (UINT)(depthBuffer.size() * sizeof( UINT16 )), nullptr ) ){
+            return false;
+        }
+        begin = measure( Stage_Acquire, begin );
+
+        if ( isFilterEnabled ){
+            depthFilter.apply( &depthBuffer[0], &depthBuffer[0] );
+            begin = measure( Stage_Temporal, begin );
+        }
+
+        if ( isSpatialFilterEnabled ){
+            spatialFilter.apply( &depthBuffer[0], isInfraredGuideEnabled ? &infraredBuffer[0] : nullptr );
+            begin = measure( Stage_Spatial, begin );
+        }
+
+        depthConverter.convert( &depthBuffer[0], &depthGray[0], depthGray.size() );
+        measure( Stage_Convert, begin );
+
+        for ( auto value : depthGray ){
+            hash = (hash ^ value) * 1099511628211ull;
+        }
+
+        ++frames;
+        return true;
+    }
+
+    Clock::time_point measure( int stage, Clock::time_point begin )
+    {
+        auto end = Clock::now();
+        stages[stage].total += std::chrono::duration<double, std::milli>( end - begin ).count();
+        return end;
+    }
+};
+
+int main( int argc, char* argv[] )
+{
+    if ( argc < 2 ){
+        std::cout << "ReplayDepth depth.kfrm [--filter average|median] [--spatial] [--guide] [--threads n] [--frames n] [--no-allocations]" << std::endl;
+        return 1;
+    }
+
+    try {
+        DepthReplay replay( argv[1] );
+
+        bool isSpatial = false;
+        bool isGuide = false;
+        int threads = 0;
+        int maxFrames = 0;
+        bool isNoAllocations = false;
+        for ( int i = 2; i < argc; ++i ){
+            std::string option = argv[i];
+            bool hasValue = (i + 1 < argc);
+            if ( (option == "--filter") && hasValue ){
+                std::string mode = argv[++i];
+                replay.setFilter( (mode == "median") ? TemporalDepthFilter::Mode_Median : TemporalDepthFilter::Mode_Average );
+            }
+            else if ( option == "--spatial" ){
+                isSpatial = true;
+            }
+            else if ( option == "--guide" ){
+                isSpatial = true;
+                isGuide = true;
+            }
+            else if ( (option == "--threads") && hasValue ){
+                threads = atoi( argv[++i] );
+            }
+            else if ( (option == "--frames") && hasValue ){
+                maxFrames = atoi( argv[++i] );
+            }
+            else if ( option == "--no-allocations" ){
+                isNoAllocations = true;
+            }
+            else {
+                throw std::runtime_error( "不明なオプションです : " + option );
+            }
+        }
+
+        if ( isSpatial ){
+            replay.setSpatialFilter( isGuide, threads );
+        }
+
+        if ( (replay.run( maxFrames ) > 0) && isNoAllocations ){
+            std::cout << "フレームごとにメモリーを確保しています" << std::endl;
+            return 1;
+        }
+    }
+    catch ( std::exception& ex ){
+        std::cout << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,309 @@
+﻿#pragma once
+
+#include <stdexcept>
+
+#include "FrameTypes.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#elif defined(_M_ARM)
+#include <arm_neon.h>
+#endif
+
+// Depthデータ(UINT16)を0-255のグレーデータに変換する
+//
+// 結果は ~((depth * 255) / range) を BYTE にしたものと完全に一致します。
+// 画素ごとの整数除算の代わりに、固定小数点の逆数との乗算とシフトで商を求めます。
+// (depth * 255 は24ビットに収まるので、l = ceil(log2(range)) として
+//  m = floor(2^(24 + l) / range) + 1 を掛けて 24 + l ビット右シフトすれば正確な商になります)
+class DepthConverter
+{
+public:
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSE2,
+        Path_AVX2,
+        Path_NEON,
+    };
+
+private:
+
+    static const int DividendBits = 24;
+
+    UINT16 range;
+    UINT32 multiplier;
+    int shift;
+
+    Path path;
+
+public:
+
+    DepthConverter( UINT16 range = 8000 )
+    {
+        setRange( range );
+        path = fastestPath();
+    }
+
+    // 変換に使う距離の範囲(get_DepthMaxReliableDistance の値など)を設定する
+    void setRange( UINT16 newRange )
+    {
+        if ( newRange == 0 ){
+            throw std::runtime_error( "Depthの範囲に0は指定できません" );
+        }
+
+        int l = 0;
+        while ( (1u << l) < newRange ){
+            ++l;
+        }
+
+        range = newRange;
+        shift = DividendBits + l;
+        multiplier = (UINT32)(((UINT64)1 << shift) / range) + 1;
+    }
+
+    UINT16 getRange() const
+    {
+        return range;
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        switch ( path ){
+        case Path_SSE2: return "SSE2";
+        case Path_AVX2: return "AVX2";
+        case Path_NEON: return "NEON";
+        default:        return "Scalar";
+        }
+    }
+
+    // 実行中のCPUで使える実装かどうか
+    static bool isSupported( Path path )
+    {
+        switch ( path ){
+        case Path_Scalar:
+            return true;
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            return true;
+        case Path_AVX2:
+            return isAvx2Supported();
+#elif defined(_M_ARM)
+        case Path_NEON:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Path fastestPath()
+    {
+        if ( isSupported( Path_AVX2 ) ){
+            return Path_AVX2;
+        }
+        if ( isSupported( Path_SSE2 ) ){
+            return Path_SSE2;
+        }
+        if ( isSupported( Path_NEON ) ){
+            return Path_NEON;
+        }
+        return Path_Scalar;
+    }
+
+    // size 個(画素数)のDepthデータを変換する(フレームの画素数なので、内部では int で数える)
+    void convert( const UINT16* src, BYTE* dst, size_t size ) const
+    {
+        int count = static_cast<int>( size );
+        int done = 0;
+
+        switch ( path ){
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            done = convertSSE2( src, dst, count );
+            break;
+        case Path_AVX2:
+            done = convertAVX2( src, dst, count );
+            break;
+#elif defined(_M_ARM)
+        case Path_NEON:
+            done = convertNEON( src, dst, count );
+            break;
+#endif
+        default:
+            break;
+        }
+
+        // 端数はスカラーで処理する
+        convertScalar( src + done, dst + done, count - done );
+    }
+
+    // 除算を使った元の計算(結果の比較用)
+    static void convertReference( const UINT16* src, BYTE* dst, size_t count, UINT16 range )
+    {
+        for ( size_t i = 0; i < count; ++i ){
+            dst[i] = ~((src[i] * 255) / range);
+        }
+    }
+
+private:
+
+    void convertScalar( const UINT16* src, BYTE* dst, int count ) const
+    {
+        for ( int i = 0; i < count; ++i ){
+            UINT32 q = (UINT32)(((UINT64)(src[i] * 255) * multiplier) >> shift);
+            dst[i] = (BYTE)~q;
+        }
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    static bool isAvx2Supported()
+    {
+        int info[4];
+        __cpuid( info, 0 );
+        if ( info[0] < 7 ){
+            return false;
+        }
+
+        // OSがAVXのレジスタを保存するか(OSXSAVE, AVX)
+        __cpuid( info, 1 );
+        if ( (info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 ){
+            return false;
+        }
+        if ( (_xgetbv( 0 ) & 0x6) != 0x6 ){
+            return false;
+        }
+
+        __cpuidex( info, 7, 0 );
+        return (info[1] & (1 << 5)) != 0;
+    }
+
+    // 4画素分(UINT32)の商を求める
+    static __m128i divideSSE2( __m128i depth, __m128i multiplier, __m128i shift )
+    {
+        // depth * 255 = (depth << 8) - depth
+        __m128i n = _mm_sub_epi32( _mm_slli_epi32( depth, 8 ), depth );
+
+        // 64ビットの積を偶数・奇数レーンに分けて求める
+        __m128i even = _mm_srl_epi64( _mm_mul_epu32( n, multiplier ), shift );
+        __m128i odd = _mm_srl_epi64( _mm_mul_epu32( _mm_srli_epi64( n, 32 ), multiplier ), shift );
+
+        return _mm_or_si128( even, _mm_slli_epi64( odd, 32 ) );
+    }
+
+    // 16画素ずつ処理し、処理した画素数を返す
+    int convertSSE2( const UINT16* src, BYTE* dst, int count ) const
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lowByte = _mm_set1_epi32( 0xFF );
+        const __m128i allOne = _mm_set1_epi8( -1 );
+        const __m128i m = _mm_set1_epi32( multiplier );
+        const __m128i s = _mm_cvtsi32_si128( shift );
+
+        int i = 0;
+        for ( ; i + 16 <= count; i += 16 ){
+            __m128i d0 = _mm_loadu_si128( (const __m128i*)(src + i) );
+            __m128i d1 = _mm_loadu_si128( (const __m128i*)(src + i + 8) );
+
+            __m128i q0 = _mm_and_si128( divideSSE2( _mm_unpacklo_epi16( d0, zero ), m, s ), lowByte );
+            __m128i q1 = _mm_and_si128( divideSSE2( _mm_unpackhi_epi16( d0, zero ), m, s ), lowByte );
+            __m128i q2 = _mm_and_si128( divideSSE2( _mm_unpacklo_epi16( d1, zero ), m, s ), lowByte );
+            __m128i q3 = _mm_and_si128( divideSSE2( _mm_unpackhi_epi16( d1, zero ), m, s ), lowByte );
+
+            // 下位8ビットを残して詰め、反転する
+            __m128i packed = _mm_packus_epi16( _mm_packs_epi32( q0, q1 ), _mm_packs_epi32( q2, q3 ) );
+            _mm_storeu_si128( (__m128i*)(dst + i), _mm_xor_si128( packed, allOne ) );
+        }
+
+        return i;
+    }
+
+    // 8画素分(UINT32)の商を求める
+    static __m256i divideAVX2( __m256i depth, __m256i multiplier, __m128i shift )
+    {
+        __m256i n = _mm256_sub_epi32( _mm256_slli_epi32( depth, 8 ), depth );
+
+        __m256i even = _mm256_srl_epi64( _mm256_mul_epu32( n, multiplier ), shift );
+        __m256i odd = _mm256_srl_epi64( _mm256_mul_epu32( _mm256_srli_epi64( n, 32 ), multiplier ), shift );
+
+        return _mm256_or_si256( even, _mm256_slli_epi64( odd, 32 ) );
+    }
+
+    // 16画素ずつ処理し、処理した画素数を返す
+    int convertAVX2( const UINT16* src, BYTE* dst, int count ) const
+    {
+        const __m256i lowByte = _mm256_set1_epi32( 0xFF );
+        const __m128i allOne = _mm_set1_epi8( -1 );
+        const __m256i m = _mm256_set1_epi32( multiplier );
+        const __m128i s = _mm_cvtsi32_si128( shift );
+
+        int i = 0;
+        for ( ; i + 16 <= count; i += 16 ){
+            __m256i d0 = _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i*)(src + i) ) );
+            __m256i d1 = _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i*)(src + i + 8) ) );
+
+            __m256i q0 = _mm256_and_si256( divideAVX2( d0, m, s ), lowByte );
+            __m256i q1 = _mm256_and_si256( divideAVX2( d1, m, s ), lowByte );
+
+            // packsはレーンごとに詰めるので、64ビット単位で並べ直す
+            __m256i words = _mm256_permute4x64_epi64( _mm256_packs_epi32( q0, q1 ), 0xD8 );
+            __m128i packed = _mm_packus_epi16( _mm256_castsi256_si128( words ), _mm256_extracti128_si256( words, 1 ) );
+            _mm_storeu_si128( (__m128i*)(dst + i), _mm_xor_si128( packed, allOne ) );
+        }
+
+        return i;
+    }
+
+#elif defined(_M_ARM)
+
+    static uint32x4_t divideNEON( uint32x4_t depth, uint32x2_t multiplier, int64x2_t shift )
+    {
+        uint32x4_t n = vmulq_n_u32( depth, 255 );
+
+        uint64x2_t lo = vshlq_u64( vmull_u32( vget_low_u32( n ), multiplier ), shift );
+        uint64x2_t hi = vshlq_u64( vmull_u32( vget_high_u32( n ), multiplier ), shift );
+
+        return vcombine_u32( vmovn_u64( lo ), vmovn_u64( hi ) );
+    }
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    int convertNEON( const UINT16* src, BYTE* dst, int count ) const
+    {
+        const uint32x2_t m = vdup_n_u32( multiplier );
+        const int64x2_t s = vdupq_n_s64( -shift );
+
+        int i = 0;
+        for ( ; i + 8 <= count; i += 8 ){
+            uint16x8_t d = vld1q_u16( src + i );
+
+            uint32x4_t q0 = divideNEON( vmovl_u16( vget_low_u16( d ) ), m, s );
+            uint32x4_t q1 = divideNEON( vmovl_u16( vget_high_u16( d ) ), m, s );
+
+            uint16x8_t words = vcombine_u16( vmovn_u32( q0 ), vmovn_u32( q1 ) );
+            vst1_u8( dst + i, vmvn_u8( vmovn_u16( words ) ) );
+        }
+
+        return i;
+    }
+
+#endif
+};
@@ -0,0 +1,634 @@
+﻿#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstddef>
+#include <utility>
+
+#include "FrameSource.h"
+#include "FrameCodec.h"
+
+//
+//  フレームを記録するファイルの形式(バージョン2):
+//
+//  ヘッダー           : "KFRM", バージョン, ストリームごとの FrameFormat, Depthの信頼できる距離の範囲, 索引の位置
+//  チャンク(繰り返し) : FrameChunkHeader, 圧縮したデータ
+//  索引               : 件数(UINT32), FrameIndexEntry の並び
+//
+//  チャンクは1フレームで、ストリームごとに圧縮方法を選べます(FrameCodec.h)。
+//  索引はファイルを閉じるときに書き込みます。索引の位置が0(正しく閉じられなかった)ときは
+//  チャンクをたどって索引を作り直します。
+//
+
+struct FrameFileHeader
+{
+    char magic[4];
+    UINT32 version;
+    FrameFormat formats[FrameStream_Count];
+    UINT16 minDepthReliableDistance;
+    UINT16 maxDepthReliableDistance;
+    UINT64 indexOffset;
+};
+
+struct FrameChunkHeader
+{
+    UINT32 stream;
+    UINT32 codec;
+    TIMESPAN relativeTime;
+    UINT32 rawSize;
+    UINT32 storedSize;
+};
+
+struct FrameIndexEntry
+{
+    UINT32 stream;
+    UINT32 codec;
+    TIMESPAN relativeTime;
+    UINT64 offset;          // 圧縮したデータの位置
+    UINT32 rawSize;
+    UINT32 storedSize;
+};
+
+// フレームをファイルに書き込む
+//
+// write() はフレームを書き込み待ちに積むだけです。圧縮はストリームごとのスレッドで並列に行い
+// (カラーのJPEGとDepthの圧縮が同時に進む)、ファイルへの書き込みはさらに別のスレッドで行います。
+//
+// Holder はデータを持っているハンドルの型です(FramePool::Frame など、コピーしても同じデータを指すもの)。
+// ハンドルを渡す write() はデータをコピーせず、書き込みが終わるまでハンドルを持っておきます。
+// ハンドルを渡さない write() は、使い回しているバッファーにデータをコピーします。
+//
+// 書き込み待ちが MaxPendingBytes を超えるときは、空くまで write() を待たせます(フレームは捨てません)。
+// 待った回数と時間は getStatistics() で分かります。捨てるのはエラーが起きた後のフレームだけです。
+template<typename Holder>
+class BasicFrameFileWriter
+{
+public:
+
+    struct Statistics
+    {
+        UINT64 written;         // 書き込んだフレーム数
+        UINT64 dropped;         // 捨てたフレーム数(エラーの後、閉じた後)
+        UINT64 waited;          // 書き込み待ちが空くのを待った回数
+        double waitedTime;      // 待った時間の合計(ミリ秒)
+        UINT64 rawBytes;        // 圧縮前のサイズ
+        UINT64 storedBytes;     // 圧縮後のサイズ
+    };
+
+    // 書き込み待ちにできるデータの量
+    static const size_t MaxPendingBytes = 256 * 1024 * 1024;
+
+private:
+
+    struct Chunk
+    {
+        FrameStream stream;
+        TIMESPAN relativeTime;
+        Holder holder;                  // データを持っているハンドル
+        std::vector<BYTE> buffer;       // コピーしたデータ(ハンドルがないとき)
+        const BYTE* data;               // 圧縮前のデータ(holder か buffer の中)
+        UINT size;
+        FrameCodec codec;
+        std::vector<BYTE> stored;       // 圧縮したデータ(Codec_Raw のときは使わない)
+
+        Chunk()
+            : stream( FrameStream_Count )
+            , relativeTime( 0 )
+            , holder()
+            , data( nullptr )
+            , size( 0 )
+            , codec( Codec_Raw )
+        {
+        }
+
+        void swap( Chunk& other )
+        {
+            std::swap( stream, other.stream );
+            std::swap( relativeTime, other.relativeTime );
+            std::swap( holder, other.holder );
+            buffer.swap( other.buffer );
+            std::swap( data, other.data );
+            std::swap( size, other.size );
+            std::swap( codec, other.codec );
+            stored.swap( other.stored );
+        }
+    };
+
+    std::ofstream file;
+    FrameFileHeader header;
+    FrameCodec codecs[FrameStream_Count];
+    std::vector<FrameIndexEntry> index;
+
+    std::thread encoders[FrameStream_Count];
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable encodeConditions[FrameStream_Count];
+    std::condition_variable writeCondition;
+    std::condition_variable spaceCondition;
+    std::deque<Chunk> encodeQueues[FrameStream_Count];
+    std::deque<Chunk> writeQueue;
+    std::vector<std::vector<BYTE>> freeBuffers;
+    size_t pendingBytes = 0;
+    int runningEncoders = 0;
+    bool isClosing = false;
+    std::string error;
+
+    Statistics statistics;
+
+public:
+
+    BasicFrameFileWriter()
+    {
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            codecs[i] = FrameCodecs::defaultCodec( (FrameStream)i );
+        }
+        memset( &statistics, 0, sizeof( statistics ) );
+    }
+
+    ~BasicFrameFileWriter()
+    {
+        close();
+    }
+
+    // ストリームの圧縮方法を変える(open() の前に呼ぶ)
+    void setCodec( FrameStream stream, FrameCodec codec )
+    {
+        codecs[stream] = codec;
+    }
+
+    void open( const std::string& fileName, FrameSource& source )
+    {
+        FrameFormat formats[FrameStream_Count];
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            formats[i] = source.getFormat( (FrameStream)i );
+        }
+
+        UINT16 minDistance = 0;
+        UINT16 maxDistance = 0;
+        source.getDepthReliableDistance( minDistance, maxDistance );
+
+        open( fileName, formats, minDistance, maxDistance );
+    }
+
+    void open( const std::string& fileName, const FrameFormat formats[FrameStream_Count], UINT16 minDistance, UINT16 maxDistance )
+    {
+        file.open( fileName, std::ios::out | std::ios::binary );
+        if ( !file.is_open() ){
+            throw std::runtime_error( "記録するファイルを開けません" );
+        }
+
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic, "KFRM", sizeof( header.magic ) );
+        header.version = 2;
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            header.formats[i] = formats[i];
+        }
+        header.minDepthReliableDistance = minDistance;
+        header.maxDepthReliableDistance = maxDistance;
+
+        file.write( (const char*)&header, sizeof( header ) );
+
+        index.clear();
+        memset( &statistics, 0, sizeof( statistics ) );
+        error.clear();
+        isClosing = false;
+        runningEncoders = FrameStream_Count;
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            encoders[i] = std::thread( &BasicFrameFileWriter::encodeThread, this, (FrameStream)i );
+        }
+        writer = std::thread( &BasicFrameFileWriter::writeThread, this );
+    }
+
+    bool isOpen() const
+    {
+        return file.is_open();
+    }
+
+    // フレームをコピーして書き込み待ちに積む
+    bool write( FrameStream stream, TIMESPAN relativeTime, const void* data, UINT size )
+    {
+        Chunk chunk;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            if ( !reserve( lock, size ) ){
+                return false;
+            }
+
+            if ( !freeBuffers.empty() ){
+                chunk.buffer.swap( freeBuffers.back() );
+                freeBuffers.pop_back();
+            }
+        }
+
+        // コピーはロックの外で行う
+        chunk.buffer.assign( (const BYTE*)data, (const BYTE*)data + size );
+        chunk.data = chunk.buffer.data();
+        chunk.size = size;
+
+        push( stream, relativeTime, chunk );
+        return true;
+    }
+
+    // データを持っているハンドルを書き込み待ちに積む(コピーしない)
+    bool write( FrameStream stream, TIMESPAN relativeTime, const Holder& holder, const void* data, UINT size )
+    {
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            if ( !reserve( lock, size ) ){
+                return false;
+            }
+        }
+
+        Chunk chunk;
+        chunk.holder = holder;
+        chunk.data = (const BYTE*)data;
+        chunk.size = size;
+
+        push( stream, relativeTime, chunk );
+        return true;
+    }
+
+    // 書き込み待ちをすべて書き込んでから、索引を書いて閉じる
+    void close()
+    {
+        if ( !file.is_open() ){
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            isClosing = true;
+        }
+        for ( auto& condition : encodeConditions ){
+            condition.notify_one();
+        }
+        spaceCondition.notify_all();
+
+        for ( auto& encoder : encoders ){
+            encoder.join();
+        }
+        writer.join();
+
+        // 索引を書き込んで、ヘッダーに位置を入れる
+        header.indexOffset = (UINT64)file.tellp();
+        UINT32 count = (UINT32)index.size();
+        file.write( (const char*)&count, sizeof( count ) );
+        if ( count > 0 ){
+            file.write( (const char*)&index[0], sizeof( FrameIndexEntry ) * count );
+        }
+
+        file.seekp( 0, std::ios::beg );
+        file.write( (const char*)&header, sizeof( header ) );
+        file.close();
+    }
+
+    Statistics getStatistics()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        return statistics;
+    }
+
+    // 書き込みスレッドで起きたエラー(なければ空)
+    std::string getError()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        return error;
+    }
+
+private:
+
+    // 書き込み待ちに size バイトの空きができるまで待つ(mutex をロックして呼ぶ)
+    // 1フレームが MaxPendingBytes より大きくても、待ちが空なら受け付ける
+    bool reserve( std::unique_lock<std::mutex>& lock, UINT size )
+    {
+        auto hasSpace = [&]{
+            return isClosing || !error.empty() || (pendingBytes == 0) || (pendingBytes + size <= MaxPendingBytes);
+        };
+
+        if ( !hasSpace() ){
+            auto begin = std::chrono::steady_clock::now();
+            spaceCondition.wait( lock, hasSpace );
+            ++statistics.waited;
+            statistics.waitedTime += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - begin ).count();
+        }
+
+        if ( isClosing || !error.empty() ){
+            ++statistics.dropped;
+            return false;
+        }
+
+        pendingBytes += size;
+        return true;
+    }
+
+    void push( FrameStream stream, TIMESPAN relativeTime, Chunk& chunk )
+    {
+        chunk.stream = stream;
+        chunk.relativeTime = relativeTime;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            encodeQueues[stream].push_back( Chunk() );
+            encodeQueues[stream].back().swap( chunk );
+        }
+        encodeConditions[stream].notify_one();
+    }
+
+    // ストリームごとに圧縮する
+    void encodeThread( FrameStream stream )
+    {
+        auto& queue = encodeQueues[stream];
+        const FrameFormat& format = header.formats[stream];
+
+        while ( 1 ) {
+            Chunk chunk;
+            bool hasError = false;
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                encodeConditions[stream].wait( lock, [&]{ return isClosing || !queue.empty(); } );
+                if ( queue.empty() ){
+                    --runningEncoders;
+                    break;
+                }
+
+                chunk.swap( queue.front() );
+                queue.pop_front();
+                hasError = !error.empty();
+                if ( !freeBuffers.empty() ){
+                    chunk.stored.swap( freeBuffers.back() );
+                    freeBuffers.pop_back();
+                }
+            }
+
+            // 形式どおりの大きさでないフレームは圧縮しない
+            chunk.codec = codecs[stream];
+            if ( hasError || (chunk.size != format.frameSize()) ){
+                chunk.codec = Codec_Raw;
+            }
+
+            if ( chunk.codec != Codec_Raw ){
+                try {
+                    FrameCodecs::encode( chunk.codec, chunk.data, format.width, format.height, format.bytesPerPixel, chunk.stored );
+                }
+                catch ( std::exception& ex ){
+                    std::lock_guard<std::mutex> lock( mutex );
+                    error = ex.what();
+                }
+            }
+
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                writeQueue.push_back( Chunk() );
+                writeQueue.back().swap( chunk );
+            }
+            writeCondition.notify_one();
+        }
+
+        writeCondition.notify_one();
+    }
+
+    // 圧縮したフレームを届いた順に書き込む(索引はストリームごとにタイムスタンプ順に並べ直して読む)
+    void writeThread()
+    {
+        while ( 1 ) {
+            Chunk chunk;
+            bool hasError = false;
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                writeCondition.wait( lock, [this]{ return (runningEncoders == 0) || !writeQueue.empty(); } );
+                if ( writeQueue.empty() ){
+                    return;
+                }
+
+                chunk.swap( writeQueue.front() );
+                writeQueue.pop_front();
+                hasError = !error.empty();
+            }
+
+            size_t storedSize = 0;
+            if ( !hasError ){
+                try {
+                    const BYTE* payload = chunk.data;
+                    storedSize = chunk.size;
+                    if ( chunk.codec != Codec_Raw ){
+                        payload = chunk.stored.data();
+                        storedSize = chunk.stored.size();
+                    }
+
+                    FrameChunkHeader chunkHeader = { (UINT32)chunk.stream, (UINT32)chunk.codec, chunk.relativeTime,
+                        chunk.size, (UINT32)storedSize };
+                    file.write( (const char*)&chunkHeader, sizeof( chunkHeader ) );
+
+                    FrameIndexEntry entry = { chunkHeader.stream, chunkHeader.codec, chunkHeader.relativeTime,
+                        (UINT64)file.tellp(), chunkHeader.rawSize, chunkHeader.storedSize };
+                    file.write( (const char*)payload, storedSize );
+                    if ( !file ){
+                        throw std::runtime_error( "記録するファイルに書き込めません" );
+                    }
+
+                    index.push_back( entry );
+                }
+                catch ( std::exception& ex ){
+                    std::lock_guard<std::mutex> lock( mutex );
+                    error = ex.what();
+                    hasError = true;
+                }
+            }
+
+            // ハンドルを手放してから(プールに戻る)、バッファーを次の write() で使い回す
+            chunk.holder = Holder();
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                pendingBytes -= chunk.size;
+                if ( !hasError ){
+                    ++statistics.written;
+                    statistics.rawBytes += chunk.size;
+                    statistics.storedBytes += storedSize;
+                }
+                else {
+                    ++statistics.dropped;
+                }
+
+                if ( chunk.buffer.capacity() > 0 ){
+                    freeBuffers.push_back( std::vector<BYTE>() );
+                    freeBuffers.back().swap( chunk.buffer );
+                }
+                if ( chunk.stored.capacity() > 0 ){
+                    freeBuffers.push_back( std::vector<BYTE>() );
+                    freeBuffers.back().swap( chunk.stored );
+                }
+            }
+            spaceCondition.notify_all();
+        }
+    }
+};
+
+// データをコピーして記録する(ハンドルを渡さないとき)
+typedef BasicFrameFileWriter<std::nullptr_t> FrameFileWriter;
+
+// ファイルからフレームを読み込む
+class FrameFileReader
+{
+public:
+
+    typedef FrameIndexEntry Entry;
+
+private:
+
+    std::ifstream file;
+    FrameFileHeader header;
+
+    std::vector<Entry> entries[FrameStream_Count];
+    std::vector<BYTE> stored;
+
+public:
+
+    void open( const std::string& fileName )
+    {
+        file.open( fileName, std::ios::in | std::ios::binary );
+        if ( !file.is_open() ){
+            throw std::runtime_error( "記録したファイルを開けません" );
+        }
+
+        file.read( (char*)&header, sizeof( header ) );
+        if ( !file || (memcmp( header.magic, "KFRM", sizeof( header.magic ) ) != 0) || (header.version != 2) ){
+            throw std::runtime_error( "記録したファイルの形式が違います" );
+        }
+
+        if ( header.indexOffset != 0 ){
+            readIndex();
+        }
+        else {
+            scanChunks();
+        }
+
+        // 索引はストリームごとにタイムスタンプ順にしておく
+        // 圧縮したデータを読むバッファーは、再生中に確保しないように最大の大きさにしておく
+        size_t maxStoredSize = 0;
+        for ( auto& list : entries ){
+            std::stable_sort( list.begin(), list.end(), []( const Entry& a, const Entry& b ){
+                return a.relativeTime < b.relativeTime;
+            } );
+            for ( const auto& entry : list ){
+                if ( (entry.codec != Codec_Raw) && (maxStoredSize < entry.storedSize) ){
+                    maxStoredSize = entry.storedSize;
+                }
+            }
+        }
+        stored.reserve( maxStoredSize );
+    }
+
+    const FrameFileHeader& getHeader() const
+    {
+        return header;
+    }
+
+    const std::vector<Entry>& getEntries( FrameStream stream ) const
+    {
+        return entries[stream];
+    }
+
+    // relativeTime 以降で最初のフレームの番号を探す(なければフレーム数)
+    size_t findEntry( FrameStream stream, TIMESPAN relativeTime ) const
+    {
+        const auto& list = entries[stream];
+        auto it = std::lower_bound( list.begin(), list.end(), relativeTime, []( const Entry& entry, TIMESPAN time ){
+            return entry.relativeTime < time;
+        } );
+        return it - list.begin();
+    }
+
+    // フレームを読み込んで展開する
+    void read( const Entry& entry, void* buffer, UINT size )
+    {
+        if ( size < entry.rawSize ){
+            throw std::runtime_error( "バッファーが小さすぎます" );
+        }
+
+        // 索引の大きさは信用せず、バッファーをあふれないことを確かめる
+        const FrameFormat& format = header.formats[entry.stream];
+        if ( (entry.codec == Codec_Raw) ? (entry.storedSize != entry.rawSize) : (entry.rawSize != format.frameSize()) ){
+            throw std::runtime_error( "記録したファイルのフレームの大きさが壊れています" );
+        }
+
+        file.seekg( entry.offset, std::ios::beg );
+        if ( entry.codec == Codec_Raw ){
+            file.read( (char*)buffer, entry.storedSize );
+            if ( !file ){
+                throw std::runtime_error( "記録したファイルからフレームを読み込めません" );
+            }
+            return;
+        }
+
+        stored.resize( entry.storedSize );
+        if ( entry.storedSize > 0 ){
+            file.read( (char*)&stored[0], entry.storedSize );
+        }
+        if ( !file ){
+            throw std::runtime_error( "記録したファイルからフレームを読み込めません" );
+        }
+
+        FrameCodecs::decode( (FrameCodec)entry.codec, stored.data(), stored.size(), (BYTE*)buffer, format.width, format.height, format.bytesPerPixel );
+    }
+
+private:
+
+    void readIndex()
+    {
+        file.seekg( header.indexOffset, std::ios::beg );
+
+        UINT32 count = 0;
+        file.read( (char*)&count, sizeof( count ) );
+
+        std::vector<Entry> all( count );
+        if ( count > 0 ){
+            file.read( (char*)&all[0], sizeof( Entry ) * count );
+        }
+        if ( !file ){
+            throw std::runtime_error( "記録したファイルの索引が壊れています" );
+        }
+
+        for ( const auto& entry : all ){
+            if ( entry.stream < FrameStream_Count ){
+                entries[entry.stream].push_back( entry );
+            }
+        }
+    }
+
+    // 索引がないときはチャンクをたどる
+    void scanChunks()
+    {
+        file.seekg( 0, std::ios::end );
+        UINT64 fileSize = (UINT64)file.tellg();
+        file.seekg( sizeof( header ), std::ios::beg );
+
+        while ( 1 ) {
+            FrameChunkHeader chunk;
+            file.read( (char*)&chunk, sizeof( chunk ) );
+            if ( !file || (chunk.stream >= FrameStream_Count) ){
+                break;
+            }
+
+            Entry entry = { chunk.stream, chunk.codec, chunk.relativeTime,
+                (UINT64)file.tellg(), chunk.rawSize, chunk.storedSize };
+
+            // 途中で切れているチャンクは使わない
+            if ( entry.offset + chunk.storedSize > fileSize ){
+                break;
+            }
+
+            entries[chunk.stream].push_back( entry );
+            file.seekg( chunk.storedSize, std::ios::cur );
+        }
+
+        file.clear();
+    }
+};
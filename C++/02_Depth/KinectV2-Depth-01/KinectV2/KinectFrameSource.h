@@ -0,0 +1,457 @@
+﻿#pragma once
+
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <stdexcept>
+
+#include <Windows.h>
+#include <Kinect.h>
+
+#include "ComPtr.h"
+#include "FrameSource.h"
+
+// ボディ1人分のデータ(COMを介さずにコピーや保存ができる形。Body のストリームはこれを BODY_COUNT 人分並べる)
+struct BodyData
+{
+    UINT64 trackingId;
+    BOOLEAN isTracked;
+    Joint joints[JointType::JointType_Count];
+    HandState handLeftState;
+    HandState handRightState;
+    TrackingConfidence handLeftConfidence;
+    TrackingConfidence handRightConfidence;
+};
+
+// Kinectからフレームを取得する
+class KinectFrameSource : public FrameSource
+{
+private:
+
+    IKinectSensor* kinect = nullptr;
+
+    IColorFrameReader* colorFrameReader = nullptr;
+    IDepthFrameReader* depthFrameReader = nullptr;
+    IInfraredFrameReader* infraredFrameReader = nullptr;
+    IBodyIndexFrameReader* bodyIndexFrameReader = nullptr;
+    IBodyFrameReader* bodyFrameReader = nullptr;
+    IAudioBeamFrameReader* audioBeamFrameReader = nullptr;
+
+    FrameFormat formats[FrameStream_Count];
+
+    // フレームの到着イベント(開いていないストリームは0)
+    WAITABLE_HANDLE frameEvents[FrameStream_Count];
+
+    UINT16 minDepthReliableDistance = 0;
+    UINT16 maxDepthReliableDistance = 0;
+
+    IBody* bodies[BODY_COUNT];
+
+    // 取得したビームフレームのサブフレーム(まだ返していないもの)
+    std::vector<BYTE> audioData;
+    std::vector<TIMESPAN> audioTimes;
+    size_t audioNext = 0;
+
+public:
+
+    KinectFrameSource()
+    {
+        for ( auto& format : formats ){
+            format.width = format.height = format.bytesPerPixel = 0;
+        }
+        for ( auto& frameEvent : frameEvents ){
+            frameEvent = 0;
+        }
+        for ( auto& body : bodies ){
+            body = nullptr;
+        }
+
+        // デフォルトのKinectを取得する
+        check( ::GetDefaultKinectSensor( &kinect ), "GetDefaultKinectSensor" );
+
+        // Kinectを開く
+        check( kinect->Open(), "Open" );
+
+        BOOLEAN isOpen = false;
+        check( kinect->get_IsOpen( &isOpen ), "get_IsOpen" );
+        if ( !isOpen ){
+            throw std::runtime_error( "Kinectが開けません" );
+        }
+    }
+
+    ~KinectFrameSource()
+    {
+        unsubscribe( colorFrameReader, FrameStream_Color );
+        unsubscribe( depthFrameReader, FrameStream_Depth );
+        unsubscribe( infraredFrameReader, FrameStream_Infrared );
+        unsubscribe( bodyIndexFrameReader, FrameStream_BodyIndex );
+        unsubscribe( bodyFrameReader, FrameStream_Body );
+        unsubscribe( audioBeamFrameReader, FrameStream_Audio );
+
+        release( colorFrameReader );
+        release( depthFrameReader );
+        release( infraredFrameReader );
+        release( bodyIndexFrameReader );
+        release( bodyFrameReader );
+        release( audioBeamFrameReader );
+        for ( auto& body : bodies ){
+            release( body );
+        }
+
+        if ( kinect != nullptr ){
+            kinect->Close();
+            release( kinect );
+        }
+    }
+
+    IKinectSensor* getSensor()
+    {
+        return kinect;
+    }
+
+    virtual void open( FrameStream stream )
+    {
+        ComPtr<IFrameDescription> description;
+
+        switch ( stream ){
+        case FrameStream_Color:
+        {
+            ComPtr<IColorFrameSource> source;
+            check( kinect->get_ColorFrameSource( &source ), "get_ColorFrameSource" );
+            check( source->OpenReader( &colorFrameReader ), "OpenReader(Color)" );
+            check( colorFrameReader->SubscribeFrameArrived( &frameEvents[stream] ), "SubscribeFrameArrived(Color)" );
+            check( source->CreateFrameDescription( ColorImageFormat::ColorImageFormat_Bgra, &description ), "CreateFrameDescription" );
+            setFormat( stream, description, 4 );
+            break;
+        }
+        case FrameStream_Depth:
+        {
+            ComPtr<IDepthFrameSource> source;
+            check( kinect->get_DepthFrameSource( &source ), "get_DepthFrameSource" );
+            check( source->OpenReader( &depthFrameReader ), "OpenReader(Depth)" );
+            check( depthFrameReader->SubscribeFrameArrived( &frameEvents[stream] ), "SubscribeFrameArrived(Depth)" );
+            check( source->get_FrameDescription( &description ), "get_FrameDescription" );
+            check( source->get_DepthMinReliableDistance( &minDepthReliableDistance ), "get_DepthMinReliableDistance" );
+            check( source->get_DepthMaxReliableDistance( &maxDepthReliableDistance ), "get_DepthMaxReliableDistance" );
+            setFormat( stream, description, sizeof( UINT16 ) );
+            break;
+        }
+        case FrameStream_Infrared:
+        {
+            ComPtr<IInfraredFrameSource> source;
+            check( kinect->get_InfraredFrameSource( &source ), "get_InfraredFrameSource" );
+            check( source->OpenReader( &infraredFrameReader ), "OpenReader(Infrared)" );
+            check( infraredFrameReader->SubscribeFrameArrived( &frameEvents[stream] ), "SubscribeFrameArrived(Infrared)" );
+            check( source->get_FrameDescription( &description ), "get_FrameDescription" );
+            setFormat( stream, description, sizeof( UINT16 ) );
+            break;
+        }
+        case FrameStream_BodyIndex:
+        {
+            ComPtr<IBodyIndexFrameSource> source;
+            check( kinect->get_BodyIndexFrameSource( &source ), "get_BodyIndexFrameSource" );
+            check( source->OpenReader( &bodyIndexFrameReader ), "OpenReader(BodyIndex)" );
+            check( bodyIndexFrameReader->SubscribeFrameArrived( &frameEvents[stream] ), "SubscribeFrameArrived(BodyIndex)" );
+            check( source->get_FrameDescription( &description ), "get_FrameDescription" );
+            setFormat( stream, description, sizeof( BYTE ) );
+            break;
+        }
+        case FrameStream_Body:
+        {
+            ComPtr<IBodyFrameSource> source;
+            check( kinect->get_BodyFrameSource( &source ), "get_BodyFrameSource" );
+            check( source->OpenReader( &bodyFrameReader ), "OpenReader(Body)" );
+            check( bodyFrameReader->SubscribeFrameArrived( &frameEvents[stream] ), "SubscribeFrameArrived(Body)" );
+            formats[stream].width = BODY_COUNT;
+            formats[stream].height = 1;
+            formats[stream].bytesPerPixel = sizeof( BodyData );
+            break;
+        }
+        case FrameStream_Audio:
+        {
+            ComPtr<IAudioSource> source;
+            check( kinect->get_AudioSource( &source ), "get_AudioSource" );
+            check( source->OpenReader( &audioBeamFrameReader ), "OpenReader(Audio)" );
+            check( audioBeamFrameReader->SubscribeFrameArrived( &frameEvents[stream] ), "SubscribeFrameArrived(Audio)" );
+
+            UINT subFrameLengthInBytes = 0;
+            check( source->get_SubFrameLengthInBytes( &subFrameLengthInBytes ), "get_SubFrameLengthInBytes" );
+            formats[stream].width = subFrameLengthInBytes / sizeof( float );
+            formats[stream].height = 1;
+            formats[stream].bytesPerPixel = sizeof( float );
+            break;
+        }
+        default:
+            throw std::runtime_error( "不明なストリームです" );
+        }
+    }
+
+    virtual FrameFormat getFormat( FrameStream stream )
+    {
+        return formats[stream];
+    }
+
+    virtual void getDepthReliableDistance( UINT16& minDistance, UINT16& maxDistance )
+    {
+        minDistance = minDepthReliableDistance;
+        maxDistance = maxDepthReliableDistance;
+    }
+
+    virtual bool acquireLatestFrame( FrameStream stream, void* buffer, UINT size, TIMESPAN* relativeTime )
+    {
+        if ( size < formats[stream].frameSize() ){
+            throw std::runtime_error( "バッファーが小さすぎます" );
+        }
+
+        TIMESPAN time = 0;
+
+        switch ( stream ){
+        case FrameStream_Color:
+        {
+            ComPtr<IColorFrame> frame;
+            if ( (colorFrameReader == nullptr) || (colorFrameReader->AcquireLatestFrame( &frame ) != S_OK) ){
+                return false;
+            }
+            check( frame->CopyConvertedFrameDataToArray( size, (BYTE*)buffer, ColorImageFormat::ColorImageFormat_Bgra ), "CopyConvertedFrameDataToArray" );
+            frame->get_RelativeTime( &time );
+            break;
+        }
+        case FrameStream_Depth:
+        {
+            ComPtr<IDepthFrame> frame;
+            if ( (depthFrameReader == nullptr) || (depthFrameReader->AcquireLatestFrame( &frame ) != S_OK) ){
+                return false;
+            }
+            check( frame->CopyFrameDataToArray( size / sizeof( UINT16 ), (UINT16*)buffer ), "CopyFrameDataToArray(Depth)" );
+            frame->get_RelativeTime( &time );
+            break;
+        }
+        case FrameStream_Infrared:
+        {
+            ComPtr<IInfraredFrame> frame;
+            if ( (infraredFrameReader == nullptr) || (infraredFrameReader->AcquireLatestFrame( &frame ) != S_OK) ){
+                return false;
+            }
+            check( frame->CopyFrameDataToArray( size / sizeof( UINT16 ), (UINT16*)buffer ), "CopyFrameDataToArray(Infrared)" );
+            frame->get_RelativeTime( &time );
+            break;
+        }
+        case FrameStream_BodyIndex:
+        {
+            ComPtr<IBodyIndexFrame> frame;
+            if ( (bodyIndexFrameReader == nullptr) || (bodyIndexFrameReader->AcquireLatestFrame( &frame ) != S_OK) ){
+                return false;
+            }
+            check( frame->CopyFrameDataToArray( size, (BYTE*)buffer ), "CopyFrameDataToArray(BodyIndex)" );
+            frame->get_RelativeTime( &time );
+            break;
+        }
+        case FrameStream_Body:
+        {
+            ComPtr<IBodyFrame> frame;
+            if ( (bodyFrameReader == nullptr) || (bodyFrameReader->AcquireLatestFrame( &frame ) != S_OK) ){
+                return false;
+            }
+            check( frame->GetAndRefreshBodyData( BODY_COUNT, &bodies[0] ), "GetAndRefreshBodyData" );
+            frame->get_RelativeTime( &time );
+            copyBodies( (BodyData*)buffer );
+            break;
+        }
+        case FrameStream_Audio:
+        {
+            // 前に取得したサブフレームを返し終わったら、次のビームフレームを取得する
+            if ( (audioNext >= audioTimes.size()) && !acquireAudioBeamFrames() ){
+                return false;
+            }
+
+            UINT subFrameSize = formats[stream].frameSize();
+            memcpy( buffer, &audioData[audioNext * subFrameSize], subFrameSize );
+            time = audioTimes[audioNext];
+            ++audioNext;
+            break;
+        }
+        default:
+            return false;
+        }
+
+        if ( relativeTime != nullptr ){
+            *relativeTime = time;
+        }
+
+        return true;
+    }
+
+    virtual bool waitForFrame( UINT milliseconds )
+    {
+        HANDLE handles[FrameStream_Count];
+        FrameStream streams[FrameStream_Count];
+        DWORD count = 0;
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            if ( frameEvents[i] != 0 ){
+                handles[count] = reinterpret_cast<HANDLE>( frameEvents[i] );
+                streams[count] = (FrameStream)i;
+                ++count;
+            }
+        }
+
+        if ( count == 0 ){
+            return false;
+        }
+
+        auto ret = ::WaitForMultipleObjects( count, handles, FALSE, milliseconds );
+        if ( (ret < WAIT_OBJECT_0) || (ret >= WAIT_OBJECT_0 + count) ){
+            return false;
+        }
+
+        // イベントのデータを受け取ってイベントを戻す(受け取らないとシグナルのままになり、待たずに戻り続ける)
+        // フレームは acquireLatestFrame() で最新のものを取得する
+        resetFrameEvent( streams[ret - WAIT_OBJECT_0] );
+        return true;
+    }
+
+private:
+
+    void resetFrameEvent( FrameStream stream )
+    {
+        switch ( stream ){
+        case FrameStream_Color:
+        {
+            ComPtr<IColorFrameArrivedEventArgs> args;
+            colorFrameReader->GetFrameArrivedEventData( frameEvents[stream], &args );
+            break;
+        }
+        case FrameStream_Depth:
+        {
+            ComPtr<IDepthFrameArrivedEventArgs> args;
+            depthFrameReader->GetFrameArrivedEventData( frameEvents[stream], &args );
+            break;
+        }
+        case FrameStream_Infrared:
+        {
+            ComPtr<IInfraredFrameArrivedEventArgs> args;
+            infraredFrameReader->GetFrameArrivedEventData( frameEvents[stream], &args );
+            break;
+        }
+        case FrameStream_BodyIndex:
+        {
+            ComPtr<IBodyIndexFrameArrivedEventArgs> args;
+            bodyIndexFrameReader->GetFrameArrivedEventData( frameEvents[stream], &args );
+            break;
+        }
+        case FrameStream_Body:
+        {
+            ComPtr<IBodyFrameArrivedEventArgs> args;
+            bodyFrameReader->GetFrameArrivedEventData( frameEvents[stream], &args );
+            break;
+        }
+        case FrameStream_Audio:
+        {
+            ComPtr<IAudioBeamFrameArrivedEventArgs> args;
+            audioBeamFrameReader->GetFrameArrivedEventData( frameEvents[stream], &args );
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    template<typename T>
+    void unsubscribe( T* reader, FrameStream stream )
+    {
+        if ( (reader != nullptr) && (frameEvents[stream] != 0) ){
+            reader->UnsubscribeFrameArrived( frameEvents[stream] );
+            frameEvents[stream] = 0;
+        }
+    }
+
+    // すべてのビームフレームの、すべてのサブフレームを取り出す
+    bool acquireAudioBeamFrames()
+    {
+        audioData.clear();
+        audioTimes.clear();
+        audioNext = 0;
+
+        ComPtr<IAudioBeamFrameList> frameList;
+        if ( (audioBeamFrameReader == nullptr) || (audioBeamFrameReader->AcquireLatestBeamFrames( &frameList ) != S_OK) ){
+            return false;
+        }
+
+        UINT beamCount = 0;
+        check( frameList->get_BeamCount( &beamCount ), "get_BeamCount" );
+
+        UINT subFrameSize = formats[FrameStream_Audio].frameSize();
+        for ( UINT beam = 0; beam < beamCount; ++beam ){
+            ComPtr<IAudioBeamFrame> frame;
+            check( frameList->OpenAudioBeamFrame( beam, &frame ), "OpenAudioBeamFrame" );
+
+            UINT32 subFrameCount = 0;
+            check( frame->get_SubFrameCount( &subFrameCount ), "get_SubFrameCount" );
+
+            for ( UINT32 i = 0; i < subFrameCount; ++i ){
+                ComPtr<IAudioBeamSubFrame> subFrame;
+                check( frame->GetSubFrame( i, &subFrame ), "GetSubFrame" );
+
+                // バッファーは使い回すので、いちど大きくなれば確保し直さない
+                size_t offset = audioData.size();
+                audioData.resize( offset + subFrameSize );
+                check( subFrame->CopyFrameDataToArray( subFrameSize, &audioData[offset] ), "CopyFrameDataToArray(Audio)" );
+
+                TIMESPAN time = 0;
+                subFrame->get_RelativeTime( &time );
+                audioTimes.push_back( time );
+            }
+        }
+
+        return !audioTimes.empty();
+    }
+
+    void setFormat( FrameStream stream, IFrameDescription* description, int bytesPerPixel )
+    {
+        check( description->get_Width( &formats[stream].width ), "get_Width" );
+        check( description->get_Height( &formats[stream].height ), "get_Height" );
+        formats[stream].bytesPerPixel = bytesPerPixel;
+    }
+
+    // IBodyからデータを取り出す
+    void copyBodies( BodyData* data )
+    {
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            BodyData& body = data[i];
+            memset( &body, 0, sizeof( body ) );
+
+            if ( bodies[i] == nullptr ){
+                continue;
+            }
+
+            bodies[i]->get_IsTracked( &body.isTracked );
+            if ( !body.isTracked ){
+                continue;
+            }
+
+            bodies[i]->get_TrackingId( &body.trackingId );
+            bodies[i]->GetJoints( JointType::JointType_Count, body.joints );
+            bodies[i]->get_HandLeftState( &body.handLeftState );
+            bodies[i]->get_HandRightState( &body.handRightState );
+            bodies[i]->get_HandLeftConfidence( &body.handLeftConfidence );
+            bodies[i]->get_HandRightConfidence( &body.handRightConfidence );
+        }
+    }
+
+    template<typename T>
+    static void release( T*& ptr )
+    {
+        if ( ptr != nullptr ){
+            ptr->Release();
+            ptr = nullptr;
+        }
+    }
+
+    static void check( HRESULT ret, const char* name )
+    {
+        if ( ret != S_OK ){
+            std::stringstream ss;
+            ss << "failed " << name << " " << std::hex << ret << std::endl;
+            throw std::runtime_error( ss.str().c_str() );
+        }
+    }
+};
@@ -0,0 +1,313 @@
+﻿#pragma once
+
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <stdexcept>
+
+#include "FrameTypes.h"
+
+#include "ThreadPool.h"
+
+// Depthデータの穴埋めと、輪郭を残す平滑化(バイラテラルフィルター)
+//
+// 1. 穴埋め : 横、縦の順に、両側を有効な画素に挟まれた短い0の並び(holeRadius * 2 画素まで)を
+//             両側の遠い方の値で埋める(手前の物が背景ににじまないように)
+// 2. 平滑化 : 横、縦の順に分けてかける近似のバイラテラルフィルター
+//             重みは距離のガウス関数と、値の差のガウス関数の積。値の差は Depth そのもの、
+//             または赤外線画像(ジョイントバイラテラル)で求める。0の画素は使わず、0のまま残す。
+//
+// どの段階も行(または列)のタイルに分けて ThreadPool で並列に処理し、結果は入力のバッファーに書き戻します。
+// 段階ごとの処理時間は getTimings() で取得できます。
+class SpatialDepthFilter
+{
+public:
+
+    // 最後に apply() したときの段階ごとの処理時間(ms)
+    struct Timings
+    {
+        double holeFill;
+        double horizontal;
+        double vertical;
+        double total;
+    };
+
+private:
+
+    static const int MaxRadius = 7;
+    static const int RangeTableSize = 256;
+    static const int TileRows = 16;
+    static const int TileColumns = 32;
+
+    typedef std::chrono::steady_clock Clock;
+
+    ThreadPool pool;
+
+    int width = 0;
+    int height = 0;
+
+    // 横にかけた結果(縦の入力)
+    std::vector<UINT16> temp;
+
+    int holeRadius = 4;
+    int radius = 2;
+
+    // 値の差をこのビット数だけ右シフトして、重みの表を引く
+    int depthRangeShift = 1;
+    int infraredRangeShift = 6;
+
+    float spatialWeights[MaxRadius * 2 + 1];
+    float depthRangeWeights[RangeTableSize];
+    float infraredRangeWeights[RangeTableSize];
+
+    Timings timings;
+
+public:
+
+    SpatialDepthFilter( int threadCount = 0 )
+        : pool( threadCount )
+    {
+        memset( &timings, 0, sizeof( timings ) );
+        setSigma( 1.5f, 30.0f, 1500.0f );
+    }
+
+    void initialize( int depthWidth, int depthHeight )
+    {
+        width = depthWidth;
+        height = depthHeight;
+        temp.resize( width * height );
+    }
+
+    void setThreadCount( int threadCount )
+    {
+        pool.resize( threadCount );
+    }
+
+    int getThreadCount() const
+    {
+        return pool.size();
+    }
+
+    // 穴埋めする0の並びの半分の長さ(0なら穴埋めしない)
+    void setHoleRadius( int newRadius )
+    {
+        holeRadius = newRadius;
+    }
+
+    // 平滑化の半径(0なら平滑化しない)
+    void setRadius( int newRadius )
+    {
+        if ( (newRadius < 0) || (MaxRadius < newRadius) ){
+            throw std::runtime_error( "平滑化の半径が大きすぎます" );
+        }
+
+        radius = newRadius;
+    }
+
+    // 距離(画素)、Depthの差(mm)、赤外線の差のガウス関数の標準偏差
+    void setSigma( float spatial, float depthRange, float infraredRange )
+    {
+        for ( int i = -MaxRadius; i <= MaxRadius; ++i ){
+            spatialWeights[i + MaxRadius] = gaussian( (float)i, spatial );
+        }
+
+        // 表の最後が3σ程度になるようにシフト量を選ぶ
+        depthRangeShift = rangeShift( depthRange );
+        infraredRangeShift = rangeShift( infraredRange );
+        for ( int i = 0; i < RangeTableSize; ++i ){
+            depthRangeWeights[i] = gaussian( (float)(i << depthRangeShift), depthRange );
+            infraredRangeWeights[i] = gaussian( (float)(i << infraredRangeShift), infraredRange );
+        }
+    }
+
+    const Timings& getTimings() const
+    {
+        return timings;
+    }
+
+    // depth を書き換える。infrared を指定すると、平滑化の重みを赤外線画像の差で求める
+    void apply( UINT16* depth, const UINT16* infrared = nullptr )
+    {
+        if ( (int)temp.size() != width * height ){
+            throw std::runtime_error( "initialize() を呼んでください" );
+        }
+
+        auto start = Clock::now();
+
+        if ( holeRadius > 0 ){
+            pool.parallelFor( height, TileRows, [=]( int begin, int end ){
+                for ( int y = begin; y < end; ++y ){
+                    fillHoles( depth + (y * width), 1, width );
+                }
+            } );
+            pool.parallelFor( width, TileColumns, [=]( int begin, int end ){
+                for ( int x = begin; x < end; ++x ){
+                    fillHoles( depth + x, width, height );
+                }
+            } );
+        }
+        auto filled = Clock::now();
+
+        // 横は depth から temp へ、縦は temp から depth へ書き込む
+        UINT16* tempData = &temp[0];
+        if ( radius > 0 ){
+            pool.parallelFor( height, TileRows, [=]( int begin, int end ){
+                for ( int y = begin; y < end; ++y ){
+                    int offset = y * width;
+                    filterLine( depth + offset, (infrared != nullptr) ? (infrared + offset) : (depth + offset), tempData + offset );
+                }
+            } );
+        }
+        auto horizontal = Clock::now();
+
+        if ( radius > 0 ){
+            // 縦は行ごとに、上下の行を読んで書き込む(列ごとに走査するより速い)
+            pool.parallelFor( height, TileRows, [=]( int begin, int end ){
+                for ( int y = begin; y < end; ++y ){
+                    filterRow( tempData, (infrared != nullptr) ? infrared : tempData, y, depth + (y * width) );
+                }
+            } );
+        }
+        auto vertical = Clock::now();
+
+        timings.holeFill = milliseconds( start, filled );
+        timings.horizontal = milliseconds( filled, horizontal );
+        timings.vertical = milliseconds( horizontal, vertical );
+        timings.total = milliseconds( start, vertical );
+    }
+
+private:
+
+    static float gaussian( float x, float sigma )
+    {
+        return expf( -(x * x) / (2 * sigma * sigma) );
+    }
+
+    static int rangeShift( float sigma )
+    {
+        int shift = 0;
+        while ( (shift < 15) && ((float)(RangeTableSize << shift) < sigma * 3) ){
+            ++shift;
+        }
+        return shift;
+    }
+
+    static double milliseconds( Clock::time_point begin, Clock::time_point end )
+    {
+        return std::chrono::duration<double, std::milli>( end - begin ).count();
+    }
+
+    // 1本の線(横なら step = 1、縦なら step = width)の穴を埋める
+    void fillHoles( UINT16* line, int step, int length ) const
+    {
+        int maxLength = holeRadius * 2;
+
+        int i = 0;
+        while ( i < length ){
+            if ( line[i * step] != 0 ){
+                ++i;
+                continue;
+            }
+
+            // 0の並びの終わりを探す
+            int end = i;
+            while ( (end < length) && (line[end * step] == 0) ){
+                ++end;
+            }
+
+            // 両側が有効で、短い並びだけを埋める
+            if ( (i > 0) && (end < length) && (end - i <= maxLength) ){
+                UINT16 left = line[(i - 1) * step];
+                UINT16 right = line[end * step];
+                UINT16 value = (left > right) ? left : right;
+                for ( int k = i; k < end; ++k ){
+                    line[k * step] = value;
+                }
+            }
+
+            i = end;
+        }
+    }
+
+    // 横の平滑化(1行分)
+    void filterLine( const UINT16* src, const UINT16* guide, UINT16* dst ) const
+    {
+        const float* rangeWeights = (guide == src) ? depthRangeWeights : infraredRangeWeights;
+        int shift = (guide == src) ? depthRangeShift : infraredRangeShift;
+
+        for ( int x = 0; x < width; ++x ){
+            UINT16 center = src[x];
+            if ( center == 0 ){
+                dst[x] = 0;
+                continue;
+            }
+
+            int begin = (x - radius < 0) ? -x : -radius;
+            int end = (x + radius >= width) ? (width - 1 - x) : radius;
+
+            float sum = 0;
+            float weightSum = 0;
+            for ( int k = begin; k <= end; ++k ){
+                UINT16 value = src[x + k];
+                if ( value == 0 ){
+                    continue;
+                }
+
+                int difference = (int)guide[x + k] - guide[x];
+                int index = ((difference < 0) ? -difference : difference) >> shift;
+                if ( index >= RangeTableSize ){
+                    continue;
+                }
+
+                float weight = spatialWeights[k + MaxRadius] * rangeWeights[index];
+                sum += weight * value;
+                weightSum += weight;
+            }
+
+            dst[x] = (UINT16)((sum / weightSum) + 0.5f);
+        }
+    }
+
+    // 縦の平滑化(y行目の1行分)
+    void filterRow( const UINT16* src, const UINT16* guide, int y, UINT16* dst ) const
+    {
+        const float* rangeWeights = (guide == src) ? depthRangeWeights : infraredRangeWeights;
+        int shift = (guide == src) ? depthRangeShift : infraredRangeShift;
+
+        int begin = (y - radius < 0) ? -y : -radius;
+        int end = (y + radius >= height) ? (height - 1 - y) : radius;
+
+        const UINT16* centerRow = src + (y * width);
+        const UINT16* centerGuide = guide + (y * width);
+
+        for ( int x = 0; x < width; ++x ){
+            UINT16 center = centerRow[x];
+            if ( center == 0 ){
+                dst[x] = 0;
+                continue;
+            }
+
+            float sum = 0;
+            float weightSum = 0;
+            for ( int k = begin; k <= end; ++k ){
+                int index = ((y + k) * width) + x;
+                UINT16 value = src[index];
+                if ( value == 0 ){
+                    continue;
+                }
+
+                int difference = (int)guide[index] - centerGuide[x];
+                int rangeIndex = ((difference < 0) ? -difference : difference) >> shift;
+                if ( rangeIndex >= RangeTableSize ){
+                    continue;
+                }
+
+                float weight = spatialWeights[k + MaxRadius] * rangeWeights[rangeIndex];
+                sum += weight * value;
+                weightSum += weight;
+            }
+
+            dst[x] = (UINT16)((sum / weightSum) + 0.5f);
+        }
+    }
+};
@@ -0,0 +1,338 @@
+﻿#pragma once
+
+#include <vector>
+#include <stdexcept>
+
+#include "FrameTypes.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Depthデータのちらつき(飛んだ画素、一瞬だけの穴)を、前のフレームを使って抑える
+//
+// Mode_Average : 画素ごとの指数移動平均
+//                平均から離れすぎた値(平均の1/32 + 20mm より遠い)と0は使わずに平均を出力し、
+//                maxMisses フレーム続いたら新しい値で平均を作り直します(物が動いたとき)。
+// Mode_Median  : 直近 MedianFrames フレームのうち、0以外の値の中央値
+//                0以外の値が1つでもあれば、穴はそれで埋まります。
+//
+// 状態はすべてUINT16の面(画素数の配列)で持ち、直近のフレームは面のリングにします。
+// SIMDの実装はスカラーの実装と完全に一致します。
+class TemporalDepthFilter
+{
+public:
+
+    enum Mode
+    {
+        Mode_Average,
+        Mode_Median,
+    };
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSE2,
+    };
+
+    static const int MedianFrames = 5;
+
+private:
+
+    static const int ThresholdShift = 5;
+    static const int MinThreshold = 20;
+
+    int count = 0;
+
+    Mode mode = Mode_Average;
+    Path path;
+
+    // 新しい値の重み(1/16単位)と、外れ値が続いたら作り直すフレーム数
+    int weight = 4;
+    int maxMisses = 1;
+
+    // Mode_Average : 平均と、外れ値(または0)が続いたフレーム数
+    std::vector<UINT16> average;
+    std::vector<UINT16> misses;
+
+    // Mode_Median : 直近のフレームのリング
+    std::vector<UINT16> ring;
+    int head = 0;
+
+public:
+
+    TemporalDepthFilter( int pixelCount = 0 )
+    {
+        path = fastestPath();
+        initialize( pixelCount );
+    }
+
+    void initialize( int pixelCount )
+    {
+        count = pixelCount;
+        average.resize( count );
+        misses.resize( count );
+        ring.resize( count * MedianFrames );
+        reset();
+    }
+
+    // 前のフレームを忘れる
+    void reset()
+    {
+        std::fill( average.begin(), average.end(), (UINT16)0 );
+        std::fill( misses.begin(), misses.end(), (UINT16)0 );
+        std::fill( ring.begin(), ring.end(), (UINT16)0 );
+        head = 0;
+    }
+
+    void setMode( Mode newMode )
+    {
+        if ( mode != newMode ){
+            mode = newMode;
+            reset();
+        }
+    }
+
+    Mode getMode() const
+    {
+        return mode;
+    }
+
+    static const char* modeName( Mode mode )
+    {
+        return (mode == Mode_Median) ? "Median" : "Average";
+    }
+
+    // 新しい値の重み(1-15、1/16単位)
+    void setWeight( int sixteenths )
+    {
+        if ( (sixteenths < 1) || (15 < sixteenths) ){
+            throw std::runtime_error( "重みは1から15の間で指定してください" );
+        }
+
+        weight = sixteenths;
+    }
+
+    void setMaxMisses( int frames )
+    {
+        maxMisses = frames;
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        return (path == Path_SSE2) ? "SSE2" : "Scalar";
+    }
+
+    // 実行中のCPUで使える実装かどうか
+    static bool isSupported( Path path )
+    {
+        switch ( path ){
+        case Path_Scalar:
+            return true;
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Path fastestPath()
+    {
+        return isSupported( Path_SSE2 ) ? Path_SSE2 : Path_Scalar;
+    }
+
+    // 1フレーム分(initialize() で指定した画素数)を処理する。src と dst は同じでもよい
+    void apply( const UINT16* src, UINT16* dst )
+    {
+        if ( mode == Mode_Median ){
+            // リングの一番古い面を新しいフレームで上書きする
+            memcpy( &ring[head * count], src, count * sizeof( UINT16 ) );
+            head = (head + 1) % MedianFrames;
+        }
+
+        int done = 0;
+        if ( path == Path_SSE2 ){
+#if defined(_M_IX86) || defined(_M_X64)
+            done = (mode == Mode_Median) ? medianSSE2( dst ) : averageSSE2( src, dst );
+#endif
+        }
+
+        // 端数はスカラーで処理する
+        if ( mode == Mode_Median ){
+            medianScalar( done, dst );
+        }
+        else {
+            averageScalar( src, done, dst );
+        }
+    }
+
+private:
+
+    void averageScalar( const UINT16* src, int begin, UINT16* dst )
+    {
+        for ( int i = begin; i < count; ++i ){
+            int d = src[i];
+            int a = average[i];
+            int difference = (d > a) ? (d - a) : (a - d);
+            int threshold = (a >> ThresholdShift) + MinThreshold;
+
+            if ( (d != 0) && ((a == 0) || (difference <= threshold)) ){
+                average[i] = (UINT16)((a == 0) ? d : (a + ((((d - a) * weight) + 8) >> 4)));
+                misses[i] = 0;
+            }
+            else if ( misses[i] + 1 > maxMisses ){
+                // 外れ値が続いたら、そちらを新しい平均にする
+                average[i] = (UINT16)d;
+                misses[i] = 0;
+            }
+            else {
+                ++misses[i];
+            }
+
+            dst[i] = average[i];
+        }
+    }
+
+    void medianScalar( int begin, UINT16* dst ) const
+    {
+        for ( int i = begin; i < count; ++i ){
+            // 0以外の値を並べる
+            UINT16 values[MedianFrames];
+            int valid = 0;
+            for ( int f = 0; f < MedianFrames; ++f ){
+                UINT16 v = ring[(f * count) + i];
+                if ( v == 0 ){
+                    continue;
+                }
+
+                int j = valid++;
+                while ( (j > 0) && (values[j - 1] > v) ){
+                    values[j] = values[j - 1];
+                    --j;
+                }
+                values[j] = v;
+            }
+
+            dst[i] = (valid > 0) ? values[(valid - 1) / 2] : 0;
+        }
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    int averageSSE2( const UINT16* src, UINT16* dst )
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i allOne = _mm_set1_epi16( -1 );
+        const __m128i minThreshold = _mm_set1_epi16( MinThreshold );
+        const __m128i w = _mm_set1_epi16( (short)weight );
+        const __m128i round = _mm_set1_epi16( 8 );
+        const __m128i one = _mm_set1_epi16( 1 );
+        const __m128i limit = _mm_set1_epi16( (short)maxMisses );
+
+        int i = 0;
+        for ( ; i + 8 <= count; i += 8 ){
+            __m128i d = _mm_loadu_si128( (const __m128i*)(src + i) );
+            __m128i a = _mm_loadu_si128( (const __m128i*)&average[i] );
+            __m128i m = _mm_loadu_si128( (const __m128i*)&misses[i] );
+
+            // |d - a| > threshold を符号なしの飽和減算で判定する
+            __m128i threshold = _mm_adds_epu16( _mm_srli_epi16( a, ThresholdShift ), minThreshold );
+            __m128i difference = _mm_or_si128( _mm_subs_epu16( d, a ), _mm_subs_epu16( a, d ) );
+            __m128i isNear = _mm_cmpeq_epi16( _mm_subs_epu16( difference, threshold ), zero );
+            __m128i isEmpty = _mm_cmpeq_epi16( a, zero );
+            __m128i isValid = _mm_andnot_si128( _mm_cmpeq_epi16( d, zero ), _mm_or_si128( isEmpty, isNear ) );
+
+            // 差は閾値以下なので、16ビットで重みを掛けても溢れない
+            __m128i delta = _mm_srai_epi16( _mm_add_epi16( _mm_mullo_epi16( _mm_sub_epi16( d, a ), w ), round ), 4 );
+            __m128i blended = _mm_add_epi16( a, delta );
+            __m128i updated = _mm_or_si128( _mm_and_si128( isEmpty, d ), _mm_andnot_si128( isEmpty, blended ) );
+
+            // 外れ値が続いたら、そちらを新しい平均にする
+            __m128i m1 = _mm_add_epi16( m, one );
+            __m128i isReset = _mm_andnot_si128( isValid, _mm_cmpgt_epi16( m1, limit ) );
+            __m128i isMiss = _mm_andnot_si128( _mm_or_si128( isValid, isReset ), allOne );
+
+            a = _mm_or_si128( _mm_or_si128( _mm_and_si128( isValid, updated ), _mm_and_si128( isReset, d ) ), _mm_and_si128( isMiss, a ) );
+            m = _mm_and_si128( isMiss, m1 );
+
+            _mm_storeu_si128( (__m128i*)&average[i], a );
+            _mm_storeu_si128( (__m128i*)&misses[i], m );
+            _mm_storeu_si128( (__m128i*)(dst + i), a );
+        }
+
+        return i;
+    }
+
+    // 符号なしの最小・最大(符号ビットを反転した値で比べる)
+    static void sortPair( __m128i& a, __m128i& b )
+    {
+        __m128i lo = _mm_min_epi16( a, b );
+        b = _mm_max_epi16( a, b );
+        a = lo;
+    }
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    int medianSSE2( UINT16* dst ) const
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi16( 1 );
+        const __m128i sign = _mm_set1_epi16( (short)0x8000 );
+        const __m128i frames = _mm_set1_epi16( MedianFrames );
+
+        int i = 0;
+        for ( ; i + 8 <= count; i += 8 ){
+            __m128i v[MedianFrames];
+            __m128i valid = frames;
+            for ( int f = 0; f < MedianFrames; ++f ){
+                __m128i x = _mm_loadu_si128( (const __m128i*)&ring[(f * count) + i] );
+
+                // 0を数えて、一番大きい値(0xFFFF)にして後ろに並べる
+                valid = _mm_add_epi16( valid, _mm_cmpeq_epi16( x, zero ) );
+                v[f] = _mm_xor_si128( _mm_sub_epi16( x, one ), sign );
+            }
+
+            // 5要素の整列ネットワーク
+            sortPair( v[0], v[1] );
+            sortPair( v[3], v[4] );
+            sortPair( v[2], v[4] );
+            sortPair( v[2], v[3] );
+            sortPair( v[0], v[3] );
+            sortPair( v[0], v[2] );
+            sortPair( v[1], v[4] );
+            sortPair( v[1], v[3] );
+            sortPair( v[1], v[2] );
+
+            // 0以外の値の中央は (valid - 1) / 2 番目(valid が0ならどれも選ばない)
+            __m128i rank = _mm_srai_epi16( _mm_sub_epi16( valid, one ), 1 );
+            __m128i median = zero;
+            for ( int r = 0; r <= (MedianFrames - 1) / 2; ++r ){
+                __m128i value = _mm_add_epi16( _mm_xor_si128( v[r], sign ), one );
+                median = _mm_or_si128( median, _mm_and_si128( _mm_cmpeq_epi16( rank, _mm_set1_epi16( (short)r ) ), value ) );
+            }
+
+            _mm_storeu_si128( (__m128i*)(dst + i), median );
+        }
+
+        return i;
+    }
+
+#endif
+};
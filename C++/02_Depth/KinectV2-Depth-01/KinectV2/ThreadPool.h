@@ -0,0 +1,169 @@
+﻿#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// 行などの範囲を小さなタイルに分けて、複数のスレッドで処理する
+//
+// スレッドは最初に作っておき、parallelFor() のたびに作り直しません。
+// 呼び出したスレッドも処理に参加するので、threadCount が1のときは呼び出したスレッドだけで処理します。
+// 関数は std::function に入れずにポインターで渡すので、parallelFor() のたびにメモリーを確保しません。
+class ThreadPool
+{
+private:
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+
+    // parallelFor() に渡された関数と、それを呼び出す関数
+    const void* task = nullptr;
+    void (*invoke)( const void* task, int begin, int end ) = nullptr;
+    int taskCount = 0;
+    int taskTile = 1;
+    std::atomic<int> nextBegin;
+
+    unsigned int generation = 0;
+    size_t busyWorkers = 0;
+    bool isStopping = false;
+
+public:
+
+    ThreadPool( int threadCount = 0 )
+    {
+        nextBegin = 0;
+        resize( threadCount );
+    }
+
+    ~ThreadPool()
+    {
+        stop();
+    }
+
+    // スレッド数を変更する(0ならCPUの論理コア数)
+    void resize( int threadCount )
+    {
+        stop();
+
+        if ( threadCount <= 0 ){
+            threadCount = std::thread::hardware_concurrency();
+        }
+
+        // 新しいスレッドは今の generation から待つ(前の parallelFor() で起きないように)
+        std::lock_guard<std::mutex> lock( mutex );
+        isStopping = false;
+        for ( int i = 1; i < threadCount; ++i ){
+            workers.push_back( std::thread( &ThreadPool::workerLoop, this, generation ) );
+        }
+    }
+
+    int size() const
+    {
+        return (int)workers.size() + 1;
+    }
+
+    // 処理中のスレッド数(parallelFor() の外では0になる。動作の確認用)
+    size_t getBusyWorkers()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        return busyWorkers;
+    }
+
+    // [0, count) を tile 個ずつに分けて func( begin, end ) を並列に呼び出す
+    template<typename Func>
+    void parallelFor( int count, int tile, const Func& func )
+    {
+        if ( workers.empty() || (count <= tile) ){
+            func( 0, count );
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            task = &func;
+            invoke = &invokeTask<Func>;
+            taskCount = count;
+            taskTile = tile;
+            nextBegin = 0;
+            busyWorkers = workers.size();
+            ++generation;
+        }
+        startCondition.notify_all();
+
+        runTiles();
+
+        // すべてのスレッドが終わるまで待つ
+        std::unique_lock<std::mutex> lock( mutex );
+        doneCondition.wait( lock, [this]{ return busyWorkers == 0; } );
+        task = nullptr;
+        invoke = nullptr;
+    }
+
+private:
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            isStopping = true;
+        }
+        startCondition.notify_all();
+
+        for ( auto& worker : workers ){
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    void workerLoop( unsigned int seen )
+    {
+        while ( 1 ) {
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                startCondition.wait( lock, [&]{ return isStopping || (generation != seen); } );
+                if ( isStopping ){
+                    return;
+                }
+                seen = generation;
+            }
+
+            runTiles();
+
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                if ( --busyWorkers == 0 ){
+                    doneCondition.notify_one();
+                }
+            }
+        }
+    }
+
+    // 残っているタイルがなくなるまで処理する
+    void runTiles()
+    {
+        while ( 1 ) {
+            int begin = nextBegin.fetch_add( taskTile );
+            if ( begin >= taskCount ){
+                break;
+            }
+
+            int end = begin + taskTile;
+            if ( end > taskCount ){
+                end = taskCount;
+            }
+
+            invoke( task, begin, end );
+        }
+    }
+
+    template<typename Func>
+    static void invokeTask( const void* task, int begin, int end )
+    {
+        (*static_cast<const Func*>( task ))( begin, end );
+    }
+};
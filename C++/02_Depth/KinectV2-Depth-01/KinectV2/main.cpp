@@ -1,5 +1,7 @@
 ﻿#include <iostream>
 #include <sstream>
+#include <memory>
+#include <algorithm>
 
 #include <Kinect.h>
 #include <opencv2\opencv.hpp>
@@ -8,6 +10,13 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "DepthConverter.h"
+#include "TemporalDepthFilter.h"
+#include "SpatialDepthFilter.h"
+#include "KinectFrameSource.h"
+#include "ReplayFrameSource.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -22,10 +31,18 @@ class KinectApp
 {
 private:
 
-    IKinectSensor* kinect = nullptr;
+    // フレームの取得元(Kinectまたは記録したファイル)
+    std::unique_ptr<FrameSource> source;
+
+    // フレームの記録
+    FrameFileWriter recorder;
+    const char* RecordFileName = "depth.kfrm";
 
-    IDepthFrameReader* depthFrameReader = nullptr;
     std::vector<UINT16> depthBuffer;
+    cv::Mat depthImage;
+
+    // 赤外線画像(空間フィルターのガイドに使う。開けなければ空のまま)
+    std::vector<UINT16> infraredBuffer;
 
     const char* DepthWindowName = "Depth Image";
 
@@ -38,40 +55,49 @@ private:
     int depthPointX;
     int depthPointY;
 
-public:
+    // Depthデータを0-255のグレーデータに変換する
+    DepthConverter depthConverter;
 
-    // 初期化
-    void initialize()
-    {
-        // デフォルトのKinectを取得する
-        ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
+    // フレーム間でちらつきを抑える
+    TemporalDepthFilter depthFilter;
+    bool isFilterEnabled = false;
+
+    // 穴埋めと輪郭を残す平滑化
+    SpatialDepthFilter spatialFilter;
+    bool isSpatialFilterEnabled = false;
+    bool isInfraredGuideEnabled = false;
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
 
-        // Kinectを開く
-        ERROR_CHECK( kinect->Open() );
+public:
 
-        BOOLEAN isOpen = false;
-        ERROR_CHECK( kinect->get_IsOpen( &isOpen ) );
-        if ( !isOpen ){
-            throw std::runtime_error("Kinectが開けません");
+    // 初期化(replayFileNameを指定すると、Kinectの代わりに記録したファイルを再生する)
+    void initialize( const char* replayFileName = nullptr )
+    {
+        if ( replayFileName == nullptr ){
+            // デフォルトのKinectを開く
+            source.reset( new KinectFrameSource() );
+        }
+        else {
+            // 記録したファイルを開く
+            source.reset( new ReplayFrameSource( replayFileName ) );
         }
 
-        // Depthリーダーを取得する
-        ComPtr<IDepthFrameSource> depthFrameSource;
-        ERROR_CHECK( kinect->get_DepthFrameSource( &depthFrameSource ) );
-        ERROR_CHECK( depthFrameSource->OpenReader( &depthFrameReader ) );
+        // Depthのストリームを開く
+        source->open( FrameStream_Depth );
 
         // Depth画像のサイズを取得する
-        ComPtr<IFrameDescription> depthFrameDescription;
-        ERROR_CHECK( depthFrameSource->get_FrameDescription( &depthFrameDescription ) );
-        ERROR_CHECK( depthFrameDescription->get_Width( &depthWidth ) );
-        ERROR_CHECK( depthFrameDescription->get_Height( &depthHeight ) );
+        FrameFormat depthFormat = source->getFormat( FrameStream_Depth );
+        depthWidth = depthFormat.width;
+        depthHeight = depthFormat.height;
 
         depthPointX = depthWidth / 2;
         depthPointY = depthHeight / 2;
 
         // Depthの最大値、最小値を取得する
-        ERROR_CHECK( depthFrameSource->get_DepthMinReliableDistance( &minDepthReliableDistance ) );
-        ERROR_CHECK( depthFrameSource->get_DepthMaxReliableDistance( &maxDepthReliableDistance ) );
+        source->getDepthReliableDistance( minDepthReliableDistance, maxDepthReliableDistance );
 
         std::cout << "Depthデータの幅   : " << depthWidth << std::endl;
         std::cout << "Depthデータの高さ : " << depthHeight << std::endl;
@@ -79,8 +105,27 @@ public:
         std::cout << "Depth最小値       : " << minDepthReliableDistance << std::endl;
         std::cout << "Depth最大値       : " << maxDepthReliableDistance << std::endl;
 
+        // 変換する距離の範囲を設定する(既定は8000mm)
+        //depthConverter.setRange( maxDepthReliableDistance );
+        std::cout << "Depth変換         : " << DepthConverter::pathName( depthConverter.getPath() ) << std::endl;
+
         // バッファーを作成する
         depthBuffer.resize( depthWidth * depthHeight );
+        depthImage.create( depthHeight, depthWidth, CV_8UC1 );
+        depthFilter.initialize( depthWidth * depthHeight );
+        spatialFilter.initialize( depthWidth, depthHeight );
+
+        // 赤外線のストリームを開く(記録したファイルになければ、Depthだけで平滑化する)
+        try {
+            source->open( FrameStream_Infrared );
+            FrameFormat infraredFormat = source->getFormat( FrameStream_Infrared );
+            if ( (infraredFormat.width == depthWidth) && (infraredFormat.height == depthHeight) ){
+                infraredBuffer.resize( depthWidth * depthHeight );
+            }
+        }
+        catch ( std::exception& ex ){
+            std::cout << "赤外線 : " << ex.what() << std::endl;
+        }
 
         // マウスクリックのイベントを登録する
         cv::namedWindow( DepthWindowName );
@@ -103,14 +148,38 @@ public:
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         while ( 1 ) {
+            // フレームが届くまで待つ(届かなくてもキーを受け付けるように、100msで戻る)
+            source->waitForFrame( 100 );
             update();
             draw();
 
-            auto key = cv::waitKey( 10 );
+            auto key = cv::waitKey( 1 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
+            else if ( key == 'b' ){
+                benchmarkDepthConverter();
+                benchmarkTemporalFilter();
+                benchmarkSpatialFilter();
+            }
+            else if ( key == 'f' ){
+                toggleFilter();
+            }
+            else if ( key == 's' ){
+                toggleSpatialFilter();
+            }
+            else if ( key == 'g' ){
+                toggleInfraredGuide();
+            }
+            else if ( key == 'r' ){
+                toggleRecording();
+            }
         }
     }
 
@@ -119,39 +188,137 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
+
+        // 赤外線はDepthと同じフレームで撮られるので、先に取得しておく
+        updateInfraredFrame();
         updateDepthFrame();
     }
 
+    void updateInfraredFrame()
+    {
+        if ( infraredBuffer.empty() ){
+            return;
+        }
+
+        STAGE_TIMER( profiler, "updateInfraredFrame" );
+
+        // 赤外線フレームのデータを取得する
+        TIMESPAN relativeTime = 0;
+        UINT size = (UINT)(infraredBuffer.size() * sizeof( UINT16 ));
+        if ( !source->acquireLatestFrame( FrameStream_Infrared, &infraredBuffer[0], size, &relativeTime ) ){
+            return;
+        }
+
+        if ( recorder.isOpen() ){
+            recorder.write( FrameStream_Infrared, relativeTime, &infraredBuffer[0], size );
+        }
+    }
+
     void updateDepthFrame()
     {
-        // Depthフレームを取得する
-        ComPtr<IDepthFrame> depthFrame;
-        auto ret = depthFrameReader->AcquireLatestFrame( &depthFrame );
-        if ( ret != S_OK ){
+        STAGE_TIMER( profiler, "updateDepthFrame" );
+
+        // Depthフレームのデータを取得する
+        TIMESPAN relativeTime = 0;
+        UINT size = (UINT)(depthBuffer.size() * sizeof( UINT16 ));
+        {
+            STAGE_TIMER( profiler, "acquireLatestFrame" );
+            if ( !source->acquireLatestFrame( FrameStream_Depth, &depthBuffer[0], size, &relativeTime ) ){
+                return;
+            }
+        }
+
+        // 記録中ならファイルに書き込む
+        if ( recorder.isOpen() ){
+            recorder.write( FrameStream_Depth, relativeTime, &depthBuffer[0], size );
+        }
+
+        // 記録するのは元のデータで、表示するのはフィルターをかけたデータ
+        if ( isFilterEnabled ){
+            STAGE_TIMER( profiler, "TemporalDepthFilter" );
+            depthFilter.apply( &depthBuffer[0], &depthBuffer[0] );
+        }
+
+        // 時間方向で残った穴を埋めてから、空間方向に平滑化する
+        if ( isSpatialFilterEnabled ){
+            STAGE_TIMER( profiler, "SpatialDepthFilter" );
+            spatialFilter.apply( &depthBuffer[0], isInfraredGuideEnabled ? &infraredBuffer[0] : nullptr );
+        }
+    }
+
+    // フィルターを なし → Average → Median → なし の順に切り替える
+    void toggleFilter()
+    {
+        if ( !isFilterEnabled ){
+            isFilterEnabled = true;
+            depthFilter.setMode( TemporalDepthFilter::Mode_Average );
+        }
+        else if ( depthFilter.getMode() == TemporalDepthFilter::Mode_Average ){
+            depthFilter.setMode( TemporalDepthFilter::Mode_Median );
+        }
+        else {
+            isFilterEnabled = false;
+        }
+
+        depthFilter.reset();
+        std::cout << "フィルター : " << (isFilterEnabled ? TemporalDepthFilter::modeName( depthFilter.getMode() ) : "なし") << std::endl;
+    }
+
+    void toggleSpatialFilter()
+    {
+        isSpatialFilterEnabled = !isSpatialFilterEnabled;
+        std::cout << "空間フィルター : " << (isSpatialFilterEnabled ? "あり" : "なし")
+            << " (" << spatialFilter.getThreadCount() << "スレッド)" << std::endl;
+    }
+
+    // 平滑化の重みを、Depthの差で求めるか赤外線画像の差で求めるかを切り替える
+    void toggleInfraredGuide()
+    {
+        if ( infraredBuffer.empty() ){
+            std::cout << "赤外線画像がありません" << std::endl;
             return;
         }
 
-        // データを取得する
-        ERROR_CHECK( depthFrame->CopyFrameDataToArray( depthBuffer.size(), &depthBuffer[0] ) );
+        isInfraredGuideEnabled = !isInfraredGuideEnabled;
+        std::cout << "平滑化のガイド : " << (isInfraredGuideEnabled ? "赤外線" : "Depth") << std::endl;
+    }
 
-        // 自動解放を使わない場合には、フレームを解放する
-        // depthFrame->Release();
+    // 記録の開始・終了を切り替える
+    void toggleRecording()
+    {
+        if ( recorder.isOpen() ){
+            recorder.close();
+            std::cout << "記録を終了しました : " << RecordFileName << std::endl;
+
+            auto statistics = recorder.getStatistics();
+            std::cout << "記録したフレーム : " << statistics.written << ", 捨てたフレーム : " << statistics.dropped
+                << ", 空きを待った回数 : " << statistics.waited << " (" << statistics.waitedTime << "ms)"
+                << ", 圧縮率 : " << ((statistics.rawBytes > 0) ? ((double)statistics.storedBytes / statistics.rawBytes) : 1.0) << std::endl;
+            if ( !recorder.getError().empty() ){
+                std::cout << recorder.getError() << std::endl;
+            }
+        }
+        else {
+            recorder.open( RecordFileName, *source );
+            std::cout << "記録を開始しました : " << RecordFileName << std::endl;
+        }
     }
 
     void draw()
     {
+        STAGE_TIMER( profiler, "draw" );
         drawDepthFrame();
     }
 
     void drawDepthFrame()
     {
-        // Depthデータを表示する
-        cv::Mat depthImage( depthHeight, depthWidth, CV_8UC1 );
+        STAGE_TIMER( profiler, "drawDepthFrame" );
 
         // Depthデータを0-255のグレーデータにする
-        for ( int i = 0; i < depthImage.total(); ++i ){
-            //depthImage.data[i] = ~((depthBuffer[i] * 255) / maxDepthReliableDistance);
-            depthImage.data[i] = ~((depthBuffer[i] * 255) / 8000);
+        {
+            STAGE_TIMER( profiler, "DepthConverter" );
+            depthConverter.convert( &depthBuffer[0], depthImage.data, depthImage.total() );
         }
 
         // Depthデータのインデックスを取得して、その場所の距離を表示する
@@ -162,15 +329,252 @@ private:
         cv::circle( depthImage, cv::Point( depthPointX, depthPointY ), 10, cv::Scalar( 0, 0, 255 ), 2 );
         cv::putText( depthImage, ss.str(), cv::Point( depthPointX, depthPointY ), 0, 1, cv::Scalar( 0, 255, 255 ) );
 
+        // 空間フィルターの段階ごとの処理時間を表示する
+        if ( isSpatialFilterEnabled ){
+            const auto& timings = spatialFilter.getTimings();
+            std::stringstream ts;
+            ts.precision( 2 );
+            ts << std::fixed << "fill " << timings.holeFill << " h " << timings.horizontal
+                << " v " << timings.vertical << " total " << timings.total << "ms";
+            cv::putText( depthImage, ts.str(), cv::Point( 10, depthHeight - 10 ), 0, 0.5, cv::Scalar( 255 ) );
+        }
+
+        STAGE_TIMER( profiler, "imshow" );
         cv::imshow( DepthWindowName, depthImage );
     }
+
+    // Depthデータの変換処理の速度を計測する
+    void benchmarkDepthConverter()
+    {
+        const int Count = 100;
+
+        // 0-65535を含む疑似的なDepthデータを作成する
+        std::vector<UINT16> src( depthWidth * depthHeight );
+        cv::randu( cv::Mat( depthHeight, depthWidth, CV_16UC1, &src[0] ), 0, 65536 );
+
+        std::vector<BYTE> expected( src.size() );
+        std::vector<BYTE> actual( src.size() );
+
+        // 除算を使った元の計算
+        auto begin = cv::getTickCount();
+        for ( int i = 0; i < Count; ++i ){
+            DepthConverter::convertReference( &src[0], &expected[0], src.size(), depthConverter.getRange() );
+        }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        std::cout << "Reference : " << time << "ms" << std::endl;
+
+        DepthConverter converter( depthConverter.getRange() );
+        for ( int path = DepthConverter::Path_Scalar; path <= DepthConverter::Path_NEON; ++path ){
+            if ( !DepthConverter::isSupported( (DepthConverter::Path)path ) ){
+                continue;
+            }
+
+            converter.setPath( (DepthConverter::Path)path );
+
+            begin = cv::getTickCount();
+            for ( int i = 0; i < Count; ++i ){
+                converter.convert( &src[0], &actual[0], src.size() );
+            }
+            time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+
+            std::cout << DepthConverter::pathName( converter.getPath() ) << " : " << time << "ms"
+                << ((actual == expected) ? "" : " (結果が一致しません)") << std::endl;
+        }
+    }
+
+    // ノイズを加えたDepthの連続したフレームで、フィルターの品質と速度を計測する
+    void benchmarkTemporalFilter()
+    {
+        const int FrameCount = 60;
+        const int WarmUp = TemporalDepthFilter::MedianFrames;
+        int pixels = depthWidth * depthHeight;
+
+        // 正解 : 奥の壁(3m)と、横に動く手前の箱(1.2m)、上端の計測できない帯(0)
+        std::vector<std::vector<UINT16>> truth( FrameCount, std::vector<UINT16>( pixels ) );
+        std::vector<std::vector<UINT16>> noisy( FrameCount, std::vector<UINT16>( pixels ) );
+        cv::Mat gauss( depthHeight, depthWidth, CV_32FC1 );
+        cv::Mat uniform( depthHeight, depthWidth, CV_32FC1 );
+        for ( int f = 0; f < FrameCount; ++f ){
+            cv::randn( gauss, 0, 1 );
+            cv::randu( uniform, 0, 1 );
+
+            int boxLeft = (f * 4) % depthWidth;
+            for ( int y = 0; y < depthHeight; ++y ){
+                for ( int x = 0; x < depthWidth; ++x ){
+                    int i = (y * depthWidth) + x;
+                    int depth = 3000 - (y * 2);
+                    if ( y < 20 ){
+                        depth = 0;
+                    }
+                    else if ( (boxLeft <= x) && (x < boxLeft + 100) && (150 <= y) && (y < 300) ){
+                        depth = 1200;
+                    }
+                    truth[f][i] = (UINT16)depth;
+
+                    // 距離の2乗に比例するノイズ、1%の飛んだ画素、2%の一瞬の穴
+                    float r = uniform.at<float>( y, x );
+                    float sigma = 1.5f + (depth * depth * 1.5e-6f);
+                    int value = depth + (int)(gauss.at<float>( y, x ) * sigma);
+                    if ( (depth == 0) || (r < 0.02f) ){
+                        value = 0;
+                    }
+                    else if ( r < 0.03f ){
+                        value = 500 + (int)(r * 100000) % 4000;
+                    }
+                    noisy[f][i] = (UINT16)((value < 0) ? 0 : value);
+                }
+            }
+        }
+
+        std::cout << "フィルター(" << FrameCount << "フレーム) : 誤差のRMS(100mm以内), 外れた画素, 穴" << std::endl;
+        evaluateTemporalFilter( "なし", truth, noisy, WarmUp, nullptr );
+
+        TemporalDepthFilter filter( pixels );
+        for ( int mode = TemporalDepthFilter::Mode_Average; mode <= TemporalDepthFilter::Mode_Median; ++mode ){
+            for ( int path = TemporalDepthFilter::Path_Scalar; path <= TemporalDepthFilter::Path_SSE2; ++path ){
+                if ( !TemporalDepthFilter::isSupported( (TemporalDepthFilter::Path)path ) ){
+                    continue;
+                }
+
+                filter.setMode( (TemporalDepthFilter::Mode)mode );
+                filter.setPath( (TemporalDepthFilter::Path)path );
+                filter.reset();
+
+                std::string name = std::string( TemporalDepthFilter::modeName( filter.getMode() ) ) + " " + TemporalDepthFilter::pathName( filter.getPath() );
+                evaluateTemporalFilter( name.c_str(), truth, noisy, WarmUp, &filter );
+            }
+        }
+    }
+
+    // 穴と飛んだ画素を含む1枚のDepthで、空間フィルターの速度をスレッド数ごとに計測する
+    void benchmarkSpatialFilter()
+    {
+        const int Count = 50;
+        int pixels = depthWidth * depthHeight;
+
+        // 奥の壁と手前の箱、3%の穴、赤外線は箱の部分だけ明るくする
+        std::vector<UINT16> src( pixels );
+        std::vector<UINT16> infrared( pixels );
+        cv::Mat gauss( depthHeight, depthWidth, CV_32FC1 );
+        cv::Mat uniform( depthHeight, depthWidth, CV_32FC1 );
+        cv::randn( gauss, 0, 1 );
+        cv::randu( uniform, 0, 1 );
+        for ( int y = 0; y < depthHeight; ++y ){
+            for ( int x = 0; x < depthWidth; ++x ){
+                int i = (y * depthWidth) + x;
+                bool isBox = (200 <= x) && (x < 300) && (150 <= y) && (y < 300);
+                int depth = isBox ? 1200 : 3000;
+                int value = depth + (int)(gauss.at<float>( y, x ) * 10);
+                src[i] = (uniform.at<float>( y, x ) < 0.03f) ? 0 : (UINT16)value;
+                infrared[i] = isBox ? 20000 : 4000;
+            }
+        }
+
+        std::vector<UINT16> depth( pixels );
+        // hardware_concurrency() はわからないと0を返すので、少なくとも1スレッドは計る
+        // (Windows.h の max マクロと衝突しないように括弧で囲む)
+        int maxThreads = (int)(std::max)( 1u, std::thread::hardware_concurrency() );
+        for ( int threads = 1; threads <= maxThreads; threads *= 2 ){
+            SpatialDepthFilter filter( threads );
+            filter.initialize( depthWidth, depthHeight );
+
+            for ( int guide = 0; guide < 2; ++guide ){
+                SpatialDepthFilter::Timings sum = { 0 };
+                for ( int i = 0; i < Count; ++i ){
+                    depth = src;
+                    filter.apply( &depth[0], guide ? &infrared[0] : nullptr );
+
+                    const auto& timings = filter.getTimings();
+                    sum.holeFill += timings.holeFill;
+                    sum.horizontal += timings.horizontal;
+                    sum.vertical += timings.vertical;
+                    sum.total += timings.total;
+                }
+
+                std::cout << "空間フィルター " << threads << "スレッド" << (guide ? "(赤外線)" : "(Depth)")
+                    << " : 穴埋め " << sum.holeFill / Count << "ms, 横 " << sum.horizontal / Count
+                    << "ms, 縦 " << sum.vertical / Count << "ms, 計 " << sum.total / Count << "ms" << std::endl;
+            }
+        }
+    }
+
+    void evaluateTemporalFilter( const char* name, const std::vector<std::vector<UINT16>>& truth,
+        const std::vector<std::vector<UINT16>>& noisy, int warmUp, TemporalDepthFilter* filter )
+    {
+        size_t pixels = truth[0].size();
+        std::vector<UINT16> output( pixels );
+
+        double squaredError = 0;
+        UINT64 inliers = 0;
+        UINT64 outliers = 0;
+        UINT64 holes = 0;
+        UINT64 total = 0;
+        double time = 0;
+
+        for ( size_t f = 0; f < truth.size(); ++f ){
+            auto begin = cv::getTickCount();
+            if ( filter != nullptr ){
+                filter->apply( &noisy[f][0], &output[0] );
+            }
+            else {
+                output = noisy[f];
+            }
+            time += (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency();
+
+            if ( (int)f < warmUp ){
+                continue;
+            }
+
+            for ( size_t i = 0; i < pixels; ++i ){
+                if ( truth[f][i] == 0 ){
+                    continue;
+                }
+
+                ++total;
+                int error = (int)output[i] - truth[f][i];
+                if ( output[i] == 0 ){
+                    ++holes;
+                }
+                else if ( (error < -100) || (100 < error) ){
+                    ++outliers;
+                }
+                else {
+                    squaredError += error * error;
+                    ++inliers;
+                }
+            }
+        }
+
+        time /= truth.size();
+        std::cout << name << " : " << sqrt( squaredError / (inliers ? inliers : 1) ) << "mm, "
+            << (100.0 * outliers / total) << "%, " << (100.0 * holes / total) << "%, " << time << "ms/フレーム";
+        if ( filter != nullptr ){
+            std::cout << " (30fpsで " << (int)(1000.0 / 30 / time) << "台分)";
+        }
+        std::cout << std::endl;
+    }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
 };
 
-void main()
+// 引数に記録したファイルを指定すると、Kinectの代わりにそのファイルを再生します
+void main( int argc, char* argv[] )
 {
     try {
         KinectApp app;
-        app.initialize();
+        app.initialize( (argc > 1) ? argv[1] : nullptr );
         app.run();
     }
     catch ( std::exception& ex ){
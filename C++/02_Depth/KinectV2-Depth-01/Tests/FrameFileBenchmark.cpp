@@ -0,0 +1,165 @@
+﻿#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+
+#include "FrameFile.h"
+
+// 記録(FrameFileWriter)の速度の確認
+//
+// Kinect v2 のすべてのストリーム(カラー 1920x1080 BGRA、Depth、赤外線、ボディインデックス、ボディ、オーディオ)を
+// 1フレームずつ最大の速度で書き込み、閉じ終わるまでの時間から何fpsで記録できるかを調べます。
+// 書き込み待ちがいっぱいのときは write() が待つので、この値がディスクと圧縮で続けられる速度になります。
+// カラーはハンドル(shared_ptr)で渡してコピーせず、ほかのストリームは write() でコピーします。
+// データは先に作っておき、計る時間には入れません。
+//
+//   FrameFileBenchmark [ファイル名] [--frames n] [--min-fps f]
+//
+// 書き込んだ後に読み直して、すべてのフレームがあり、最後のフレームが書き込んだデータと同じことを確かめます。
+// --min-fps を指定すると、それより遅いときに失敗します(時間はマシンの負荷で変わるので、ctest では指定しません)。
+// このビルドにはJPEGがないので、カラーは Codec_Raw(1フレーム約8MB)で書き込みます。
+
+int main( int argc, char* argv[] )
+{
+    std::string fileName = "benchmark.kfrm";
+    int frameCount = 90;
+    double minFps = 0.0;
+    for ( int i = 1; i < argc; ++i ){
+        std::string arg = argv[i];
+        if ( (arg == "--frames") && (i + 1 < argc) ){
+            frameCount = atoi( argv[++i] );
+        }
+        else if ( (arg == "--min-fps") && (i + 1 < argc) ){
+            minFps = atof( argv[++i] );
+        }
+        else {
+            fileName = arg;
+        }
+    }
+
+    const int ColorWidth = 1920;
+    const int ColorHeight = 1080;
+    const int Width = 512;
+    const int Height = 424;
+    const int BodySize = 6 * 536;
+    const int AudioSamples = 256;
+    const int AudioSubFrames = 2;
+    const TIMESPAN Interval = 10000000 / 30;
+
+    FrameFormat formats[FrameStream_Count] = {};
+    formats[FrameStream_Color].width = ColorWidth;
+    formats[FrameStream_Color].height = ColorHeight;
+    formats[FrameStream_Color].bytesPerPixel = 4;
+    formats[FrameStream_Depth].width = formats[FrameStream_Infrared].width = formats[FrameStream_BodyIndex].width = Width;
+    formats[FrameStream_Depth].height = formats[FrameStream_Infrared].height = formats[FrameStream_BodyIndex].height = Height;
+    formats[FrameStream_Depth].bytesPerPixel = formats[FrameStream_Infrared].bytesPerPixel = sizeof( UINT16 );
+    formats[FrameStream_BodyIndex].bytesPerPixel = sizeof( BYTE );
+    formats[FrameStream_Body].width = BodySize;
+    formats[FrameStream_Body].height = 1;
+    formats[FrameStream_Body].bytesPerPixel = 1;
+    formats[FrameStream_Audio].width = AudioSamples;
+    formats[FrameStream_Audio].height = 1;
+    formats[FrameStream_Audio].bytesPerPixel = sizeof( float );
+
+    // 奥の壁と横に動く箱にノイズをのせる(圧縮の速さが実際に近くなるように)
+    const int Variations = 8;
+    srand( 1 );
+    std::vector<std::shared_ptr<std::vector<BYTE>>> color( Variations );
+    std::vector<std::vector<UINT16>> depth( Variations, std::vector<UINT16>( Width * Height ) );
+    std::vector<std::vector<UINT16>> infrared( Variations, std::vector<UINT16>( Width * Height ) );
+    std::vector<std::vector<BYTE>> bodyIndex( Variations, std::vector<BYTE>( Width * Height ) );
+    for ( int v = 0; v < Variations; ++v ){
+        color[v] = std::make_shared<std::vector<BYTE>>( formats[FrameStream_Color].frameSize() );
+        for ( auto& value : *color[v] ){
+            value = (BYTE)(rand() & 0xFF);
+        }
+
+        int boxLeft = (v * 8) % Width;
+        for ( int y = 0; y < Height; ++y ){
+            for ( int x = 0; x < Width; ++x ){
+                int i = (y * Width) + x;
+                bool isBox = (boxLeft <= x) && (x < boxLeft + 100) && (150 <= y) && (y < 300);
+                int noise = (rand() % 21) - 10;
+                depth[v][i] = ((rand() % 50) == 0) ? 0 : (UINT16)((isBox ? 1200 : 3000 - y) + noise);
+                infrared[v][i] = (UINT16)((isBox ? 20000 : 4000) + (rand() % 1000));
+                bodyIndex[v][i] = isBox ? 0 : 255;
+            }
+        }
+    }
+    std::vector<BYTE> body( BodySize );
+    std::vector<float> audio( AudioSamples );
+
+    double maxWriteTime = 0.0;
+    auto begin = std::chrono::steady_clock::now();
+
+    BasicFrameFileWriter<std::shared_ptr<std::vector<BYTE>>> writer;
+    writer.open( fileName, formats, 500, 4500 );
+    for ( int f = 0; f < frameCount; ++f ){
+        int v = f % Variations;
+        TIMESPAN time = f * Interval;
+        auto writeBegin = std::chrono::steady_clock::now();
+        writer.write( FrameStream_Color, time, color[v], color[v]->data(), (UINT)color[v]->size() );
+        writer.write( FrameStream_Depth, time, &depth[v][0], (UINT)(depth[v].size() * sizeof( UINT16 )) );
+        writer.write( FrameStream_Infrared, time, &infrared[v][0], (UINT)(infrared[v].size() * sizeof( UINT16 )) );
+        writer.write( FrameStream_BodyIndex, time, &bodyIndex[v][0], (UINT)bodyIndex[v].size() );
+        writer.write( FrameStream_Body, time, &body[0], (UINT)body.size() );
+        for ( int s = 0; s < AudioSubFrames; ++s ){
+            writer.write( FrameStream_Audio, time + (s * Interval / AudioSubFrames), &audio[0], (UINT)(audio.size() * sizeof( float )) );
+        }
+        maxWriteTime = std::max( maxWriteTime, std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - writeBegin ).count() );
+    }
+    writer.close();
+
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - begin ).count();
+    double fps = frameCount / seconds;
+    auto statistics = writer.getStatistics();
+
+    // 読み直す
+    bool isRoundTrip = true;
+    try {
+        FrameFileReader reader;
+        reader.open( fileName );
+
+        int v = (frameCount - 1) % Variations;
+        const FrameStream streams[] = { FrameStream_Color, FrameStream_Depth, FrameStream_Infrared, FrameStream_BodyIndex, FrameStream_Body };
+        const BYTE* expected[] = { color[v]->data(), (const BYTE*)&depth[v][0], (const BYTE*)&infrared[v][0], &bodyIndex[v][0], &body[0] };
+        for ( int i = 0; i < 5; ++i ){
+            const auto& entries = reader.getEntries( streams[i] );
+            if ( (int)entries.size() != frameCount ){
+                isRoundTrip = false;
+                continue;
+            }
+
+            std::vector<BYTE> buffer( formats[streams[i]].frameSize() );
+            reader.read( entries.back(), &buffer[0], (UINT)buffer.size() );
+            isRoundTrip = isRoundTrip && (memcmp( &buffer[0], expected[i], buffer.size() ) == 0);
+        }
+        isRoundTrip = isRoundTrip && (reader.getEntries( FrameStream_Audio ).size() == (size_t)frameCount * AudioSubFrames);
+    }
+    catch ( std::exception& ex ){
+        std::cout << ex.what() << std::endl;
+        isRoundTrip = false;
+    }
+    remove( fileName.c_str() );
+
+    std::cout << "フレーム数 : " << frameCount << ", 時間 : " << seconds << "秒, " << fps << "fps" << std::endl;
+    std::cout << "書き込んだフレーム : " << statistics.written << ", 捨てたフレーム : " << statistics.dropped
+        << ", 空きを待った回数 : " << statistics.waited << " (" << statistics.waitedTime << "ms)" << std::endl;
+    std::cout << "1フレームの write() の最大 : " << maxWriteTime << "ms, 圧縮率 : "
+        << ((double)statistics.storedBytes / statistics.rawBytes) << ", " << (statistics.storedBytes / seconds / (1024 * 1024)) << "MB/s" << std::endl;
+    if ( !isRoundTrip ){
+        std::cout << "読み直したフレームが書き込んだものと違います" << std::endl;
+    }
+
+    bool isOk = writer.getError().empty() && (statistics.dropped == 0) && (statistics.written == (UINT64)frameCount * (5 + AudioSubFrames)) && isRoundTrip && (fps >= minFps);
+    if ( !writer.getError().empty() ){
+        std::cout << writer.getError() << std::endl;
+    }
+    std::cout << "FrameFileBenchmark : " << (isOk ? "OK" : "NG") << std::endl;
+    return isOk ? 0 : 1;
+}
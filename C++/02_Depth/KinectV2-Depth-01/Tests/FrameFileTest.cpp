@@ -0,0 +1,161 @@
+﻿#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+#include "FrameFile.h"
+#include "ReplayFrameSource.h"
+
+// 記録(FrameFileWriter)と再生(ReplayFrameSource)の確認
+//
+// 疑似的なDepth、赤外線、ボディインデックス、オーディオを記録して、最大の速度で再生したときに
+// すべてのフレームが同じ順番、同じタイムスタンプ、同じデータで返ることを確かめます。
+// 途中で切れたり大きさが違ったりする圧縮データを、展開せずに例外にすることも確かめます。
+// 記録したファイル(引数で指定、既定は replay_test.kfrm)は ReplayDepth の確認にも使います。
+
+static int failures = 0;
+
+static void check( bool condition, const std::string& message )
+{
+    if ( !condition ){
+        std::cout << "失敗 : " << message << std::endl;
+        ++failures;
+    }
+}
+
+// 展開すると例外になるか
+static bool throws( FrameCodec codec, const BYTE* data, size_t size, BYTE* dst, int width, int height, int bytesPerPixel )
+{
+    try {
+        FrameCodecs::decode( codec, data, size, dst, width, height, bytesPerPixel );
+    }
+    catch ( std::exception& ){
+        return true;
+    }
+    return false;
+}
+
+int main( int argc, char* argv[] )
+{
+    const char* fileName = (argc > 1) ? argv[1] : "replay_test.kfrm";
+
+    const int Width = 512;
+    const int Height = 424;
+    const int FrameCount = 30;
+    const int AudioSamples = 256;
+    const int AudioSubFrames = 3;
+    const TIMESPAN Interval = 10000000 / 30;
+
+    FrameFormat formats[FrameStream_Count] = {};
+    formats[FrameStream_Depth].width = formats[FrameStream_Infrared].width = formats[FrameStream_BodyIndex].width = Width;
+    formats[FrameStream_Depth].height = formats[FrameStream_Infrared].height = formats[FrameStream_BodyIndex].height = Height;
+    formats[FrameStream_Depth].bytesPerPixel = formats[FrameStream_Infrared].bytesPerPixel = sizeof( UINT16 );
+    formats[FrameStream_BodyIndex].bytesPerPixel = sizeof( BYTE );
+    formats[FrameStream_Audio].width = AudioSamples;
+    formats[FrameStream_Audio].height = 1;
+    formats[FrameStream_Audio].bytesPerPixel = sizeof( float );
+
+    // 奥の壁、横に動く箱、ノイズと穴(乱数の種を固定して、毎回同じデータにする)
+    srand( 1 );
+    std::vector<std::vector<UINT16>> depth( FrameCount, std::vector<UINT16>( Width * Height ) );
+    std::vector<std::vector<UINT16>> infrared( FrameCount, std::vector<UINT16>( Width * Height ) );
+    std::vector<std::vector<BYTE>> bodyIndex( FrameCount, std::vector<BYTE>( Width * Height ) );
+    std::vector<std::vector<float>> audio( FrameCount * AudioSubFrames, std::vector<float>( AudioSamples ) );
+    for ( int f = 0; f < FrameCount; ++f ){
+        int boxLeft = (f * 8) % Width;
+        for ( int y = 0; y < Height; ++y ){
+            for ( int x = 0; x < Width; ++x ){
+                int i = (y * Width) + x;
+                bool isBox = (boxLeft <= x) && (x < boxLeft + 100) && (150 <= y) && (y < 300);
+                int noise = (rand() % 21) - 10;
+                depth[f][i] = ((rand() % 50) == 0) ? 0 : (UINT16)((isBox ? 1200 : 3000 - y) + noise);
+                infrared[f][i] = (UINT16)((isBox ? 20000 : 4000) + (rand() % 1000));
+                bodyIndex[f][i] = isBox ? 0 : 255;
+            }
+        }
+    }
+    for ( auto& subFrame : audio ){
+        for ( auto& sample : subFrame ){
+            sample = (rand() % 2001 - 1000) / 1000.0f;
+        }
+    }
+
+    {
+        FrameFileWriter writer;
+        writer.open( fileName, formats, 500, 4500 );
+        for ( int f = 0; f < FrameCount; ++f ){
+            TIMESPAN time = f * Interval;
+            writer.write( FrameStream_Infrared, time, &infrared[f][0], (UINT)(infrared[f].size() * sizeof( UINT16 )) );
+            writer.write( FrameStream_Depth, time, &depth[f][0], (UINT)(depth[f].size() * sizeof( UINT16 )) );
+            writer.write( FrameStream_BodyIndex, time, &bodyIndex[f][0], (UINT)bodyIndex[f].size() );
+            for ( int s = 0; s < AudioSubFrames; ++s ){
+                const auto& subFrame = audio[(f * AudioSubFrames) + s];
+                writer.write( FrameStream_Audio, time + (s * Interval / AudioSubFrames), &subFrame[0], (UINT)(subFrame.size() * sizeof( float )) );
+            }
+        }
+        writer.close();
+
+        auto statistics = writer.getStatistics();
+        check( writer.getError().empty(), "書き込みのエラー : " + writer.getError() );
+        check( statistics.written == FrameCount * (3 + AudioSubFrames), "書き込んだフレーム数が違う" );
+        check( statistics.dropped == 0, "捨てたフレームがある" );
+        std::cout << "圧縮率 : " << ((double)statistics.storedBytes / statistics.rawBytes) << std::endl;
+    }
+
+    ReplayFrameSource source( fileName, ReplayFrameSource::Mode_MaxSpeed, false );
+    source.open( FrameStream_Depth );
+    source.open( FrameStream_Infrared );
+    source.open( FrameStream_BodyIndex );
+    source.open( FrameStream_Audio );
+
+    UINT16 minDistance = 0;
+    UINT16 maxDistance = 0;
+    source.getDepthReliableDistance( minDistance, maxDistance );
+    check( (minDistance == 500) && (maxDistance == 4500), "Depthの距離の範囲が違う" );
+    check( source.getFormat( FrameStream_Depth ).frameSize() == Width * Height * sizeof( UINT16 ), "Depthの形式が違う" );
+
+    std::vector<UINT16> depthBuffer( Width * Height );
+    std::vector<UINT16> infraredBuffer( Width * Height );
+    std::vector<BYTE> bodyIndexBuffer( Width * Height );
+    std::vector<float> audioBuffer( AudioSamples );
+    for ( int f = 0; f < FrameCount; ++f ){
+        std::string frame = " (" + std::to_string( f ) + "フレーム目)";
+        TIMESPAN time = -1;
+
+        check( source.waitForFrame( 0 ), "返すフレームがあるのに待つ" + frame );
+        check( source.acquireLatestFrame( FrameStream_Depth, &depthBuffer[0], (UINT)(depthBuffer.size() * sizeof( UINT16 )), &time ), "Depthを取得できない" + frame );
+        check( (time == f * Interval) && (depthBuffer == depth[f]), "Depthが違う" + frame );
+
+        check( source.acquireLatestFrame( FrameStream_Infrared, &infraredBuffer[0], (UINT)(infraredBuffer.size() * sizeof( UINT16 )), &time ), "赤外線を取得できない" + frame );
+        check( infraredBuffer == infrared[f], "赤外線が違う" + frame );
+
+        check( source.acquireLatestFrame( FrameStream_BodyIndex, &bodyIndexBuffer[0], (UINT)bodyIndexBuffer.size(), &time ), "ボディインデックスを取得できない" + frame );
+        check( bodyIndexBuffer == bodyIndex[f], "ボディインデックスが違う" + frame );
+
+        for ( int s = 0; s < AudioSubFrames; ++s ){
+            check( source.acquireLatestFrame( FrameStream_Audio, &audioBuffer[0], (UINT)(audioBuffer.size() * sizeof( float )), &time ), "オーディオを取得できない" + frame );
+            check( (time == f * Interval + (s * Interval / AudioSubFrames)) && (audioBuffer == audio[(f * AudioSubFrames) + s]), "オーディオが違う" + frame );
+        }
+    }
+
+    check( !source.acquireLatestFrame( FrameStream_Depth, &depthBuffer[0], (UINT)(depthBuffer.size() * sizeof( UINT16 )), nullptr ), "最後のフレームの後も取得できる" );
+    check( !source.waitForFrame( 0 ), "最後のフレームの後もフレームがあると返す" );
+
+    // 途中で切れたデータや大きさの違うデータは、展開せずに例外にする
+    {
+        std::vector<BYTE> encoded;
+        std::vector<UINT16> decoded( Width * Height );
+        FrameCodecs::encode( Codec_DeltaRice, (const BYTE*)&depth[0][0], Width, Height, sizeof( UINT16 ), encoded );
+        check( throws( Codec_DeltaRice, &encoded[0], encoded.size() / 2, (BYTE*)&decoded[0], Width, Height, sizeof( UINT16 ) ), "途中で切れたDeltaRiceを展開できる" );
+
+        std::vector<BYTE> decodedIndex( Width * Height );
+        FrameCodecs::encode( Codec_Rle, &bodyIndex[0][0], Width, Height, sizeof( BYTE ), encoded );
+        check( throws( Codec_Rle, &encoded[0], encoded.size() / 2, &decodedIndex[0], Width, Height, sizeof( BYTE ) ), "途中で切れたRleを展開できる" );
+
+        std::vector<BYTE> large( (Width * Height * sizeof( UINT16 )) + 1 );
+        check( throws( Codec_Raw, &large[0], large.size(), (BYTE*)&decoded[0], Width, Height, sizeof( UINT16 ) ), "大きすぎるRawを展開できる" );
+    }
+
+    std::cout << "FrameFile : " << ((failures == 0) ? "OK" : "NG") << std::endl;
+    return (failures == 0) ? 0 : 1;
+}
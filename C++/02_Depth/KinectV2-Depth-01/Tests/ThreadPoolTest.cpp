@@ -0,0 +1,54 @@
+﻿#include <iostream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include "ThreadPool.h"
+
+// ThreadPool の確認
+//
+// parallelFor() の後に resize() で作ったスレッドが、前の parallelFor() の合図で起きて
+// 処理中のスレッド数を減らしすぎない(0から引いて大きな値にならない)ことを確かめます。
+
+static int failures = 0;
+
+static void check( bool condition, const char* message, int iteration )
+{
+    if ( !condition ){
+        std::cout << "失敗 : " << message << " (" << iteration << "回目)" << std::endl;
+        ++failures;
+    }
+}
+
+int main()
+{
+    const int Iterations = 200;
+    const int Count = 64;
+
+    ThreadPool pool( 2 );
+    for ( int i = 0; i < Iterations; ++i ){
+        // 新しいスレッドが待ち始めるまで待ってから、処理中のスレッド数を調べる
+        pool.resize( 2 + (i % 3) );
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+        check( pool.getBusyWorkers() == 0, "resize() の後に処理中のスレッドがある", i );
+
+        // resize() の直後に parallelFor() を呼んでも、すべてのタイルが終わってから戻る
+        pool.resize( 2 + ((i + 1) % 3) );
+
+        std::atomic<int> active( 0 );
+        std::atomic<int> done( 0 );
+        pool.parallelFor( Count, 1, [&]( int begin, int end ){
+            ++active;
+            std::this_thread::yield();
+            done += end - begin;
+            --active;
+        } );
+
+        check( done == Count, "処理していないタイルがある", i );
+        check( active == 0, "処理中のタイルがあるのに戻った", i );
+        check( pool.getBusyWorkers() == 0, "parallelFor() の後に処理中のスレッドがある", i );
+    }
+
+    std::cout << "ThreadPool : " << ((failures == 0) ? "OK" : "NG") << std::endl;
+    return (failures == 0) ? 0 : 1;
+}
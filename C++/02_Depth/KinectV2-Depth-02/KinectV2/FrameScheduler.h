@@ -0,0 +1,154 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <stdexcept>
+
+#include <Windows.h>
+#include <Kinect.h>
+
+// フレームの到着イベント(SubscribeFrameArrived)で動くスケジューラー
+//
+// ストリームごとにスレッドを作って到着イベントを待ち、フレームが届くとそのスレッドで
+// process を呼びます。届いていないのにAcquireLatestFrameを繰り返すことがなくなります。
+// process では GetFrameArrivedEventData でイベントを受け取ってからフレームを取得してください。
+//
+// 処理結果ができたら notifyOutput() を呼び、表示スレッドは waitForOutput() で待ちます。
+class FrameScheduler
+{
+public:
+
+    typedef std::chrono::steady_clock Clock;
+    typedef std::function<void( Clock::time_point arrivalTime )> Process;
+
+private:
+
+    struct Stream
+    {
+        WAITABLE_HANDLE handle;
+        Process process;
+    };
+
+    std::vector<Stream> streams;
+    std::vector<std::thread> threads;
+    HANDLE stopEvent = nullptr;
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    UINT64 outputCount = 0;
+    UINT64 shownCount = 0;
+
+    // スレッドで起きたエラー(表示スレッドで例外にする)
+    std::string error;
+
+public:
+
+    ~FrameScheduler()
+    {
+        stop();
+
+        if ( stopEvent != nullptr ){
+            ::CloseHandle( stopEvent );
+        }
+    }
+
+    // ストリームを登録する(start() の前に呼ぶ)
+    void addStream( WAITABLE_HANDLE handle, Process process )
+    {
+        if ( !threads.empty() ){
+            throw std::runtime_error( "スケジューラーの実行中はストリームを追加できません" );
+        }
+
+        Stream stream = { handle, process };
+        streams.push_back( stream );
+    }
+
+    void start()
+    {
+        if ( stopEvent == nullptr ){
+            stopEvent = ::CreateEvent( nullptr, TRUE, FALSE, nullptr );
+            if ( stopEvent == nullptr ){
+                throw std::runtime_error( "イベントを作成できません" );
+            }
+        }
+        ::ResetEvent( stopEvent );
+
+        for ( size_t i = 0; i < streams.size(); ++i ){
+            threads.push_back( std::thread( &FrameScheduler::streamThread, this, i ) );
+        }
+    }
+
+    void stop()
+    {
+        if ( threads.empty() ){
+            return;
+        }
+
+        ::SetEvent( stopEvent );
+        for ( auto& thread : threads ){
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    // 処理結果ができたことを表示スレッドに知らせる
+    void notifyOutput()
+    {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            ++outputCount;
+        }
+        condition.notify_all();
+    }
+
+    // 新しい処理結果ができるまで待つ(タイムアウトしたらfalse)
+    bool waitForOutput( DWORD milliseconds )
+    {
+        std::unique_lock<std::mutex> lock( mutex );
+        condition.wait_for( lock, std::chrono::milliseconds( milliseconds ), [this]{
+            return (outputCount != shownCount) || !error.empty();
+        } );
+
+        if ( !error.empty() ){
+            throw std::runtime_error( error.c_str() );
+        }
+
+        if ( outputCount == shownCount ){
+            return false;
+        }
+
+        shownCount = outputCount;
+        return true;
+    }
+
+private:
+
+    void streamThread( size_t index )
+    {
+        HANDLE handles[] = { reinterpret_cast<HANDLE>( streams[index].handle ), stopEvent };
+
+        while ( 1 ) {
+            auto ret = ::WaitForMultipleObjects( 2, handles, FALSE, INFINITE );
+            if ( ret != WAIT_OBJECT_0 ){
+                break;
+            }
+
+            try {
+                streams[index].process( Clock::now() );
+            }
+            catch ( std::exception& ex ){
+                {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    error = ex.what();
+                }
+                condition.notify_all();
+                break;
+            }
+        }
+    }
+};
@@ -0,0 +1,113 @@
+﻿#pragma once
+
+#include <vector>
+#include <iostream>
+#include <iomanip>
+
+// 遅延時間(ms)のヒストグラム
+class LatencyHistogram
+{
+private:
+
+    // bucketWidth ms ごとに数え、最後のバケットはそれより長いものすべて
+    double bucketWidth;
+    std::vector<UINT64> buckets;
+
+    UINT64 count = 0;
+    double total = 0;
+    double maxValue = 0;
+
+public:
+
+    LatencyHistogram( double bucketWidth = 1.0, int bucketCount = 50 )
+        : bucketWidth( bucketWidth )
+        , buckets( bucketCount + 1, 0 )
+    {
+    }
+
+    void add( double milliseconds )
+    {
+        // 時計が戻ったときは0とする(負の値や大きすぎる値を size_t にしない)
+        if ( milliseconds < 0 ){
+            milliseconds = 0;
+        }
+        double position = milliseconds / bucketWidth;
+        size_t last = buckets.size() - 1;
+        size_t index = (position < (double)last) ? (size_t)position : last;
+        ++buckets[index];
+
+        ++count;
+        total += milliseconds;
+        if ( maxValue < milliseconds ){
+            maxValue = milliseconds;
+        }
+    }
+
+    void clear()
+    {
+        for ( auto& bucket : buckets ){
+            bucket = 0;
+        }
+        count = 0;
+        total = 0;
+        maxValue = 0;
+    }
+
+    UINT64 getCount() const
+    {
+        return count;
+    }
+
+    double getMean() const
+    {
+        return (count > 0) ? (total / count) : 0;
+    }
+
+    double getMax() const
+    {
+        return maxValue;
+    }
+
+    // 割合 p (0-1) の値(バケットの上限で返す)
+    double getPercentile( double p ) const
+    {
+        UINT64 target = (UINT64)(p * count);
+        UINT64 sum = 0;
+        for ( size_t i = 0; i < buckets.size() - 1; ++i ){
+            sum += buckets[i];
+            if ( sum > target ){
+                return (i + 1) * bucketWidth;
+            }
+        }
+        return maxValue;
+    }
+
+    void print( std::ostream& out ) const
+    {
+        out << "フレーム数 : " << count << ", 平均 : " << getMean() << "ms, 最大 : " << maxValue << "ms"
+            << ", 50% : " << getPercentile( 0.5 ) << "ms, 95% : " << getPercentile( 0.95 )
+            << "ms, 99% : " << getPercentile( 0.99 ) << "ms" << std::endl;
+
+        UINT64 peak = 0;
+        for ( auto bucket : buckets ){
+            if ( peak < bucket ){
+                peak = bucket;
+            }
+        }
+
+        // 空でないバケットを棒グラフで表示する
+        for ( size_t i = 0; i < buckets.size(); ++i ){
+            if ( buckets[i] == 0 ){
+                continue;
+            }
+
+            if ( i < buckets.size() - 1 ){
+                out << std::setw( 5 ) << (i * bucketWidth) << "-" << std::setw( 5 ) << ((i + 1) * bucketWidth) << "ms : ";
+            }
+            else {
+                out << std::setw( 5 ) << (i * bucketWidth) << "ms以上 : ";
+            }
+            out << std::setw( 6 ) << buckets[i] << " " << std::string( (size_t)(buckets[i] * 40 / peak), '#' ) << std::endl;
+        }
+    }
+};
@@ -0,0 +1,471 @@
+﻿#pragma once
+
+#include <cmath>
+#include <vector>
+#include <stdexcept>
+
+#include <Windows.h>
+#include <Kinect.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+// カメラ座標の点群(座標ごとに配列を分けて持つ)
+//
+// 配列は最大の点数(Depthの画素数)で確保したままにして、count までを使います。
+struct PointCloud
+{
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+
+    // 点の元になったDepthの画素の番号
+    std::vector<int> pixels;
+
+    int count = 0;
+
+    void reserve( int capacity )
+    {
+        if ( (int)x.size() < capacity ){
+            x.resize( capacity );
+            y.resize( capacity );
+            z.resize( capacity );
+            pixels.resize( capacity );
+        }
+    }
+};
+
+// DepthデータからPointCloudを作る
+//
+// 画素ごとの方向(GetDepthFrameToCameraSpaceTable)を起動後に一度だけ取得しておき、
+// Z = depth * 0.001、X = 方向X * Z、Y = 方向Y * Z で求めます。
+// 0(無効な値)と minDepth - maxDepth の範囲外の画素は点にしません。
+// SIMDの実装はスカラーの実装と完全に一致します。
+class PointCloudGenerator
+{
+public:
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSE2,
+        Path_AVX2,
+    };
+
+private:
+
+    int width = 0;
+    int height = 0;
+
+    // 画素ごとの方向
+    std::vector<float> rayX;
+    std::vector<float> rayY;
+
+    Path path;
+
+public:
+
+    PointCloudGenerator()
+    {
+        path = fastestPath();
+    }
+
+    // 画素ごとの方向を取得する(センサーが動き出すまでは取得できないので、取得できるまで呼ぶ)
+    bool loadRayTable( ICoordinateMapper* mapper, int depthWidth, int depthHeight )
+    {
+        if ( hasRayTable() ){
+            return true;
+        }
+
+        UINT32 count = 0;
+        PointF* table = nullptr;
+        if ( mapper->GetDepthFrameToCameraSpaceTable( &count, &table ) != S_OK ){
+            return false;
+        }
+
+        if ( count == (UINT32)(depthWidth * depthHeight) ){
+            setRayTable( table, depthWidth, depthHeight );
+        }
+
+        ::CoTaskMemFree( table );
+        return hasRayTable();
+    }
+
+    void setRayTable( const PointF* table, int depthWidth, int depthHeight )
+    {
+        width = depthWidth;
+        height = depthHeight;
+
+        int count = width * height;
+        rayX.resize( count );
+        rayY.resize( count );
+        for ( int i = 0; i < count; ++i ){
+            rayX[i] = table[i].X;
+            rayY[i] = table[i].Y;
+        }
+    }
+
+    bool hasRayTable() const
+    {
+        return !rayX.empty();
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        switch ( path ){
+        case Path_SSE2: return "SSE2";
+        case Path_AVX2: return "AVX2";
+        default:        return "Scalar";
+        }
+    }
+
+    // 実行中のCPUで使える実装かどうか
+    static bool isSupported( Path path )
+    {
+        switch ( path ){
+        case Path_Scalar:
+            return true;
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            return true;
+        case Path_AVX2:
+            return isAvx2Supported();
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Path fastestPath()
+    {
+        if ( isSupported( Path_AVX2 ) ){
+            return Path_AVX2;
+        }
+        if ( isSupported( Path_SSE2 ) ){
+            return Path_SSE2;
+        }
+        return Path_Scalar;
+    }
+
+    // Depthデータ(width * height)から点群を作る
+    void generate( const UINT16* depth, UINT16 minDepth, UINT16 maxDepth, PointCloud& cloud ) const
+    {
+        if ( !hasRayTable() ){
+            throw std::runtime_error( "画素ごとの方向を取得していません" );
+        }
+
+        int count = width * height;
+        cloud.reserve( count );
+        cloud.count = 0;
+
+        // 0は常に無効
+        if ( minDepth == 0 ){
+            minDepth = 1;
+        }
+
+        int done = 0;
+        switch ( path ){
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            done = generateSSE2( depth, count, minDepth, maxDepth, cloud );
+            break;
+        case Path_AVX2:
+            done = generateAVX2( depth, count, minDepth, maxDepth, cloud );
+            break;
+#endif
+        default:
+            break;
+        }
+
+        // 端数はスカラーで処理する
+        generateScalar( depth, done, count, minDepth, maxDepth, cloud );
+    }
+
+private:
+
+    void generateScalar( const UINT16* depth, int begin, int end, UINT16 minDepth, UINT16 maxDepth, PointCloud& cloud ) const
+    {
+        int n = cloud.count;
+        for ( int i = begin; i < end; ++i ){
+            if ( (depth[i] < minDepth) || (maxDepth < depth[i]) ){
+                continue;
+            }
+
+            float z = depth[i] * 0.001f;
+            cloud.x[n] = rayX[i] * z;
+            cloud.y[n] = rayY[i] * z;
+            cloud.z[n] = z;
+            cloud.pixels[n] = i;
+            ++n;
+        }
+        cloud.count = n;
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    static bool isAvx2Supported()
+    {
+        int info[4];
+        __cpuid( info, 0 );
+        if ( info[0] < 7 ){
+            return false;
+        }
+
+        // OSがAVXのレジスタを保存するか(OSXSAVE, AVX)
+        __cpuid( info, 1 );
+        if ( (info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 ){
+            return false;
+        }
+        if ( (_xgetbv( 0 ) & 0x6) != 0x6 ){
+            return false;
+        }
+
+        __cpuidex( info, 7, 0 );
+        return (info[1] & (1 << 5)) != 0;
+    }
+
+    // 範囲内の画素だけを詰める(mask は画素ごとに2ビット)
+    static void compact( const float* x, const float* y, const float* z, int base, int lanes, UINT32 mask, PointCloud& cloud )
+    {
+        int n = cloud.count;
+        for ( int k = 0; k < lanes; ++k ){
+            if ( mask & (1u << (k * 2)) ){
+                cloud.x[n] = x[k];
+                cloud.y[n] = y[k];
+                cloud.z[n] = z[k];
+                cloud.pixels[n] = base + k;
+                ++n;
+            }
+        }
+        cloud.count = n;
+    }
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    int generateSSE2( const UINT16* depth, int count, UINT16 minDepth, UINT16 maxDepth, PointCloud& cloud ) const
+    {
+        // 符号なしの比較にするため、符号ビットを反転して符号付きで比べる
+        const __m128i sign = _mm_set1_epi16( (short)0x8000 );
+        const __m128i lower = _mm_xor_si128( _mm_set1_epi16( (short)minDepth ), sign );
+        const __m128i upper = _mm_xor_si128( _mm_set1_epi16( (short)maxDepth ), sign );
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 scale = _mm_set1_ps( 0.001f );
+        const __m128i step = _mm_set_epi32( 3, 2, 1, 0 );
+
+        float x[8], y[8], z[8];
+
+        int i = 0;
+        for ( ; i + 8 <= count; i += 8 ){
+            __m128i d = _mm_loadu_si128( (const __m128i*)(depth + i) );
+            __m128i s = _mm_xor_si128( d, sign );
+            __m128i outside = _mm_or_si128( _mm_cmplt_epi16( s, lower ), _mm_cmpgt_epi16( s, upper ) );
+            UINT32 mask = ~_mm_movemask_epi8( outside ) & 0xFFFF;
+            if ( mask == 0 ){
+                continue;
+            }
+
+            __m128 z0 = _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpacklo_epi16( d, zero ) ), scale );
+            __m128 z1 = _mm_mul_ps( _mm_cvtepi32_ps( _mm_unpackhi_epi16( d, zero ) ), scale );
+            __m128 x0 = _mm_mul_ps( _mm_loadu_ps( &rayX[i] ), z0 );
+            __m128 x1 = _mm_mul_ps( _mm_loadu_ps( &rayX[i + 4] ), z1 );
+            __m128 y0 = _mm_mul_ps( _mm_loadu_ps( &rayY[i] ), z0 );
+            __m128 y1 = _mm_mul_ps( _mm_loadu_ps( &rayY[i + 4] ), z1 );
+
+            // すべて範囲内なら、そのまま書き込む
+            if ( mask == 0xFFFF ){
+                int n = cloud.count;
+                __m128i index = _mm_add_epi32( _mm_set1_epi32( i ), step );
+                _mm_storeu_ps( &cloud.x[n], x0 );
+                _mm_storeu_ps( &cloud.x[n + 4], x1 );
+                _mm_storeu_ps( &cloud.y[n], y0 );
+                _mm_storeu_ps( &cloud.y[n + 4], y1 );
+                _mm_storeu_ps( &cloud.z[n], z0 );
+                _mm_storeu_ps( &cloud.z[n + 4], z1 );
+                _mm_storeu_si128( (__m128i*)&cloud.pixels[n], index );
+                _mm_storeu_si128( (__m128i*)&cloud.pixels[n + 4], _mm_add_epi32( index, _mm_set1_epi32( 4 ) ) );
+                cloud.count = n + 8;
+                continue;
+            }
+
+            _mm_storeu_ps( x, x0 );
+            _mm_storeu_ps( x + 4, x1 );
+            _mm_storeu_ps( y, y0 );
+            _mm_storeu_ps( y + 4, y1 );
+            _mm_storeu_ps( z, z0 );
+            _mm_storeu_ps( z + 4, z1 );
+            compact( x, y, z, i, 8, mask, cloud );
+        }
+
+        return i;
+    }
+
+    // 16画素ずつ処理し、処理した画素数を返す
+    int generateAVX2( const UINT16* depth, int count, UINT16 minDepth, UINT16 maxDepth, PointCloud& cloud ) const
+    {
+        const __m256i sign = _mm256_set1_epi16( (short)0x8000 );
+        const __m256i lower = _mm256_xor_si256( _mm256_set1_epi16( (short)minDepth ), sign );
+        const __m256i upper = _mm256_xor_si256( _mm256_set1_epi16( (short)maxDepth ), sign );
+        const __m256 scale = _mm256_set1_ps( 0.001f );
+        const __m256i step = _mm256_set_epi32( 7, 6, 5, 4, 3, 2, 1, 0 );
+
+        float x[16], y[16], z[16];
+
+        int i = 0;
+        for ( ; i + 16 <= count; i += 16 ){
+            __m256i d = _mm256_loadu_si256( (const __m256i*)(depth + i) );
+            __m256i s = _mm256_xor_si256( d, sign );
+            __m256i outside = _mm256_or_si256( _mm256_cmpgt_epi16( lower, s ), _mm256_cmpgt_epi16( s, upper ) );
+            UINT32 mask = ~(UINT32)_mm256_movemask_epi8( outside );
+            if ( mask == 0 ){
+                continue;
+            }
+
+            __m256 z0 = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_castsi256_si128( d ) ) ), scale );
+            __m256 z1 = _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_extracti128_si256( d, 1 ) ) ), scale );
+            __m256 x0 = _mm256_mul_ps( _mm256_loadu_ps( &rayX[i] ), z0 );
+            __m256 x1 = _mm256_mul_ps( _mm256_loadu_ps( &rayX[i + 8] ), z1 );
+            __m256 y0 = _mm256_mul_ps( _mm256_loadu_ps( &rayY[i] ), z0 );
+            __m256 y1 = _mm256_mul_ps( _mm256_loadu_ps( &rayY[i + 8] ), z1 );
+
+            // すべて範囲内なら、そのまま書き込む
+            if ( mask == 0xFFFFFFFF ){
+                int n = cloud.count;
+                __m256i index = _mm256_add_epi32( _mm256_set1_epi32( i ), step );
+                _mm256_storeu_ps( &cloud.x[n], x0 );
+                _mm256_storeu_ps( &cloud.x[n + 8], x1 );
+                _mm256_storeu_ps( &cloud.y[n], y0 );
+                _mm256_storeu_ps( &cloud.y[n + 8], y1 );
+                _mm256_storeu_ps( &cloud.z[n], z0 );
+                _mm256_storeu_ps( &cloud.z[n + 8], z1 );
+                _mm256_storeu_si256( (__m256i*)&cloud.pixels[n], index );
+                _mm256_storeu_si256( (__m256i*)&cloud.pixels[n + 8], _mm256_add_epi32( index, _mm256_set1_epi32( 8 ) ) );
+                cloud.count = n + 16;
+                continue;
+            }
+
+            _mm256_storeu_ps( x, x0 );
+            _mm256_storeu_ps( x + 8, x1 );
+            _mm256_storeu_ps( y, y0 );
+            _mm256_storeu_ps( y + 8, y1 );
+            _mm256_storeu_ps( z, z0 );
+            _mm256_storeu_ps( z + 8, z1 );
+            compact( x, y, z, i, 16, mask, cloud );
+        }
+
+        return i;
+    }
+
+#endif
+};
+
+// 点群をボクセル(一辺 voxelSize の立方体)ごとの重心に間引く
+//
+// ハッシュ表は最大の点数に合わせて確保したままにして、フレームごとに確保しません。
+class VoxelGrid
+{
+private:
+
+    struct Cell
+    {
+        UINT64 key;
+        UINT32 generation;
+        int count;
+        float x;
+        float y;
+        float z;
+        int pixel;
+    };
+
+    std::vector<Cell> cells;
+    std::vector<int> used;
+    UINT32 generation = 0;
+
+public:
+
+    void downsample( const PointCloud& src, float voxelSize, PointCloud& dst )
+    {
+        dst.reserve( src.count );
+        dst.count = 0;
+        if ( src.count == 0 ){
+            return;
+        }
+
+        // 点数の2倍以上の2のべき乗の大きさにする
+        size_t capacity = 1024;
+        while ( capacity < (size_t)src.count * 2 ){
+            capacity *= 2;
+        }
+        if ( cells.size() < capacity ){
+            Cell empty = { 0, 0, 0, 0, 0, 0, 0 };
+            cells.assign( capacity, empty );
+            used.resize( capacity );
+            generation = 0;
+        }
+        size_t mask = cells.size() - 1;
+
+        // 世代を進めて、前のフレームのセルを空とみなす
+        if ( ++generation == 0 ){
+            for ( auto& cell : cells ){
+                cell.generation = 0;
+            }
+            generation = 1;
+        }
+
+        float inverse = 1.0f / voxelSize;
+        int usedCount = 0;
+        for ( int i = 0; i < src.count; ++i ){
+            // 座標はカメラから±数十mなので、21ビットずつに収まる
+            UINT64 ix = (UINT64)((int)floorf( src.x[i] * inverse ) & 0x1FFFFF);
+            UINT64 iy = (UINT64)((int)floorf( src.y[i] * inverse ) & 0x1FFFFF);
+            UINT64 iz = (UINT64)((int)floorf( src.z[i] * inverse ) & 0x1FFFFF);
+            UINT64 key = (ix << 42) | (iy << 21) | iz;
+
+            size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+            while ( (cells[slot].generation == generation) && (cells[slot].key != key) ){
+                slot = (slot + 1) & mask;
+            }
+
+            Cell& cell = cells[slot];
+            if ( cell.generation != generation ){
+                cell.key = key;
+                cell.generation = generation;
+                cell.count = 0;
+                cell.x = cell.y = cell.z = 0;
+                cell.pixel = src.pixels[i];
+                used[usedCount++] = (int)slot;
+            }
+
+            ++cell.count;
+            cell.x += src.x[i];
+            cell.y += src.y[i];
+            cell.z += src.z[i];
+        }
+
+        // 最初に見つかった順に重心を書き出す
+        for ( int n = 0; n < usedCount; ++n ){
+            const Cell& cell = cells[used[n]];
+            dst.x[n] = cell.x / cell.count;
+            dst.y[n] = cell.y / cell.count;
+            dst.z[n] = cell.z / cell.count;
+            dst.pixels[n] = cell.pixel;
+        }
+        dst.count = usedCount;
+    }
+};
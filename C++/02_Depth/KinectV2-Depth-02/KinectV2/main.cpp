@@ -1,5 +1,6 @@
 ﻿#include <iostream>
 #include <sstream>
+#include <mutex>
 
 #include <Kinect.h>
 #include <opencv2\opencv.hpp>
@@ -8,6 +9,13 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "ColorToDepthMap.h"
+#include "FrameScheduler.h"
+#include "LatencyHistogram.h"
+#include "PointCloud.h"
+#include "FrameCache.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -24,10 +32,14 @@ private:
 
     IKinectSensor* kinect = nullptr;
     IColorFrameReader* colorFrameReader = nullptr;
+    WAITABLE_HANDLE colorFrameEvent = 0;
     std::vector<BYTE> colorBuffer;
+    std::vector<BYTE> colorBackBuffer;
 
     IDepthFrameReader* depthFrameReader = nullptr;
+    WAITABLE_HANDLE depthFrameEvent = 0;
     std::vector<UINT16> depthBuffer;
+    std::vector<UINT16> depthBackBuffer;
 
     const char* ColorWindowName = "Color Image";
     const char* DepthWindowName = "Depth Image";
@@ -48,8 +60,53 @@ private:
     int depthPointX;
     int depthPointY;
 
+    // カラー座標からDepth座標への対応表
+    ComPtr<ICoordinateMapper> coordinateMapper;
+    ColorToDepthMap colorToDepth;
+
+    // Depthから作る点群(dataMutexで守る)
+    PointCloudGenerator pointCloudGenerator;
+    PointCloud pointCloud;
+    VoxelGrid voxelGrid;
+    PointCloud voxelCloud;
+    bool isVoxelEnabled = false;
+    const float VoxelSize = 0.02f;
+    double pointCloudTime = 0;
+
+    // フレームが届いたらストリームごとのスレッドで処理して、表示はメインスレッドで行う
+    FrameScheduler scheduler;
+
+    // 新しいフレームが届いたときだけ対応表や表示する画像を作り直す(dataMutexで守る)
+    FrameCache cache;
+    int colorStream;
+    int depthStream;
+    int mappingProduct;
+    int compositeProduct;
+
+    // colorBuffer, depthBuffer, colorToDepth, cache を守る
+    std::mutex dataMutex;
+
+    // 処理結果と、そのきっかけになったフレームが届いた時刻
+    std::mutex outputMutex;
+    cv::Mat processedImage;
+    cv::Mat outputImage;
+    FrameScheduler::Clock::time_point outputArrivalTime;
+
+    // フレームが届いてから表示するまでの時間
+    LatencyHistogram latency;
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
 public:
 
+    ~KinectApp()
+    {
+        // メンバーを破棄する前にスレッドを止める
+        scheduler.stop();
+    }
+
     // 初期化
     void initialize()
     {
@@ -102,7 +159,21 @@ public:
 
         // バッファーを作成する
         colorBuffer.resize( colorWidth * colorHeight * ColorBytesPerPixel );
+        colorBackBuffer.resize( colorBuffer.size() );
         depthBuffer.resize( depthWidth * depthHeight );
+        depthBackBuffer.resize( depthBuffer.size() );
+        processedImage.create( colorHeight, colorWidth, CV_8UC4 );
+        outputImage = cv::Mat::zeros( colorHeight, colorWidth, CV_8UC4 );
+
+        // 座標の対応表を作成する
+        ERROR_CHECK( kinect->get_CoordinateMapper( &coordinateMapper ) );
+        colorToDepth.initialize( coordinateMapper, colorWidth, colorHeight, depthWidth, depthHeight );
+
+        // フレームから作るデータの依存関係
+        colorStream = cache.addStream( "Color" );
+        depthStream = cache.addStream( "Depth" );
+        mappingProduct = cache.addProduct( "対応表", { depthStream } );
+        compositeProduct = cache.addProduct( "表示する画像", { colorStream, depthStream, mappingProduct } );
 
         // 画面を作成
         cv::namedWindow( ColorWindowName );
@@ -112,67 +183,216 @@ public:
         maxDepth = maxDepthReliableDistance;
         cv::createTrackbar( "Min Depth", ColorWindowName, &minDepth, maxDepthReliableDistance );
         cv::createTrackbar( "Max Depth", ColorWindowName, &maxDepth, maxDepthReliableDistance );
+
+        // フレームの到着イベントに登録する
+        ERROR_CHECK( colorFrameReader->SubscribeFrameArrived( &colorFrameEvent ) );
+        ERROR_CHECK( depthFrameReader->SubscribeFrameArrived( &depthFrameEvent ) );
+        scheduler.addStream( colorFrameEvent, [this]( FrameScheduler::Clock::time_point arrivalTime ){
+            updateColor( arrivalTime );
+        } );
+        scheduler.addStream( depthFrameEvent, [this]( FrameScheduler::Clock::time_point arrivalTime ){
+            updateDepth( arrivalTime );
+        } );
     }
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
+        scheduler.start();
+
         while ( 1 ) {
-            update();
-            draw();
+            // 処理結果ができていれば表示する
+            if ( scheduler.waitForOutput( 30 ) ){
+                draw();
+            }
 
-            auto key = cv::waitKey( 10 );
+            auto key = cv::waitKey( 1 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
+            else if ( key == 'm' ){
+                // 対応表の作り方を切り替える
+                std::lock_guard<std::mutex> lock( dataMutex );
+                colorToDepth.setMode( (colorToDepth.getMode() == ColorToDepthMap::Mode_ColorFrame) ?
+                    ColorToDepthMap::Mode_DepthTable : ColorToDepthMap::Mode_ColorFrame );
+                std::cout << "座標の対応表 : " << ColorToDepthMap::modeName( colorToDepth.getMode() ) << std::endl;
+            }
+            else if ( key == 'h' ){
+                latency.print( std::cout );
+            }
+            else if ( key == 'v' ){
+                // 点群をボクセルで間引くかどうかを切り替える
+                std::lock_guard<std::mutex> lock( dataMutex );
+                isVoxelEnabled = !isVoxelEnabled;
+            }
+            else if ( key == 'b' ){
+                benchmarkPointCloud();
+            }
+            else if ( key == 's' ){
+                std::lock_guard<std::mutex> lock( dataMutex );
+                cache.print( std::cout );
+            }
         }
+
+        scheduler.stop();
+
+        std::cout << "フレームが届いてから表示するまでの時間" << std::endl;
+        latency.print( std::cout );
     }
 
 private:
 
-    // データの更新処理
-    void update()
+    // カラーフレームが届いた(カラーのスレッド)
+    void updateColor( FrameScheduler::Clock::time_point arrivalTime )
     {
-        updateColor();
-        updateDepth();
-    }
+        STAGE_TIMER( profiler, "updateColor" );
+
+        // イベントのデータからフレームを取得する
+        ComPtr<IColorFrameArrivedEventArgs> args;
+        if ( colorFrameReader->GetFrameArrivedEventData( colorFrameEvent, &args ) != S_OK ){
+            return;
+        }
+
+        ComPtr<IColorFrameReference> colorFrameReference;
+        ERROR_CHECK( args->get_FrameReference( &colorFrameReference ) );
 
-    void updateColor()
-    {
-        // フレームを取得する
         ComPtr<IColorFrame> colorFrame;
-        auto ret = colorFrameReader->AcquireLatestFrame( &colorFrame );
-        if ( ret == S_OK ){
-            // BGRAの形式でデータを取得する
-            ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
-                colorBuffer.size(), &colorBuffer[0], ColorImageFormat_Bgra ) );
+        if ( colorFrameReference->AcquireFrame( &colorFrame ) != S_OK ){
+            return;
+        }
 
-            // 自動解放を使わない場合には、フレームを解放する
-            // colorFrame->Release();
+        // BGRAの形式でデータを取得する(ロックせずに裏のバッファーに書き込む)
+        {
+            STAGE_TIMER( profiler, "CopyConvertedFrameDataToArray" );
+            ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
+                colorBackBuffer.size(), &colorBackBuffer[0], ColorImageFormat_Bgra ) );
         }
+
+        TIMESPAN relativeTime = 0;
+        ERROR_CHECK( colorFrame->get_RelativeTime( &relativeTime ) );
+
+        std::lock_guard<std::mutex> lock( dataMutex );
+        colorBuffer.swap( colorBackBuffer );
+        cache.touch( colorStream, relativeTime );
+        process( arrivalTime );
     }
 
-    void updateDepth()
+    // Depthフレームが届いた(Depthのスレッド)
+    void updateDepth( FrameScheduler::Clock::time_point arrivalTime )
     {
-        // フレームを取得する
+        STAGE_TIMER( profiler, "updateDepth" );
+
+        ComPtr<IDepthFrameArrivedEventArgs> args;
+        if ( depthFrameReader->GetFrameArrivedEventData( depthFrameEvent, &args ) != S_OK ){
+            return;
+        }
+
+        ComPtr<IDepthFrameReference> depthFrameReference;
+        ERROR_CHECK( args->get_FrameReference( &depthFrameReference ) );
+
         ComPtr<IDepthFrame> depthFrame;
-        auto ret = depthFrameReader->AcquireLatestFrame( &depthFrame );
-        if ( ret == S_OK ){
-            // データを取得する
-            ERROR_CHECK( depthFrame->CopyFrameDataToArray( depthBuffer.size(), &depthBuffer[0] ) );
+        if ( depthFrameReference->AcquireFrame( &depthFrame ) != S_OK ){
+            return;
+        }
+
+        // データを取得する
+        {
+            STAGE_TIMER( profiler, "CopyFrameDataToArray" );
+            ERROR_CHECK( depthFrame->CopyFrameDataToArray( depthBackBuffer.size(), &depthBackBuffer[0] ) );
+        }
+
+        TIMESPAN relativeTime = 0;
+        ERROR_CHECK( depthFrame->get_RelativeTime( &relativeTime ) );
+
+        std::lock_guard<std::mutex> lock( dataMutex );
+        depthBuffer.swap( depthBackBuffer );
+
+        // 前と同じ時刻のフレームなら点群は作り直さない
+        if ( cache.touch( depthStream, relativeTime ) ){
+            updatePointCloud();
+        }
+        process( arrivalTime );
+    }
+
+    // Depthの範囲内の画素から点群を作る(dataMutexをロックして呼ぶ)
+    void updatePointCloud()
+    {
+        STAGE_TIMER( profiler, "updatePointCloud" );
+
+        // 画素ごとの方向はセンサーが動き出してから取得できる
+        if ( !pointCloudGenerator.loadRayTable( coordinateMapper, depthWidth, depthHeight ) ){
+            return;
+        }
 
-            // 自動解放を使わない場合には、フレームを解放する
-            // depthFrame->Release();
+        auto begin = cv::getTickCount();
+        pointCloudGenerator.generate( &depthBuffer[0], (UINT16)minDepth, (UINT16)maxDepth, pointCloud );
+        if ( isVoxelEnabled ){
+            voxelGrid.downsample( pointCloud, VoxelSize, voxelCloud );
         }
+        pointCloudTime = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency();
     }
 
+    // 表示する画像を作って、表示スレッドに渡す(dataMutexをロックして呼ぶ)
+    void process( FrameScheduler::Clock::time_point arrivalTime )
+    {
+        STAGE_TIMER( profiler, "process" );
+
+        // Depthか作り方が変わったときだけ対応表を作り直す
+        if ( cache.needsUpdate( mappingProduct, colorToDepth.getMode() ) ){
+            STAGE_TIMER( profiler, (colorToDepth.getMode() == ColorToDepthMap::Mode_ColorFrame) ? "MapColorFrameToDepthSpace" : "mapFromDepthTable" );
+            colorToDepth.invalidate();
+            colorToDepth.update( &depthBuffer[0] );
+        }
+
+        // カラー、Depth、表示する距離の範囲のどれも変わっていなければ、前に渡した画像のままにする
+        UINT64 depthRange = ((UINT64)(UINT32)minDepth << 32) | (UINT32)maxDepth;
+        if ( !cache.needsUpdate( compositeProduct, depthRange ) ){
+            return;
+        }
+
+        composeDepthMap( processedImage );
+
+        // 点群の点数と作るのにかかった時間
+        std::stringstream ss;
+        ss << "Points : " << pointCloud.count;
+        if ( isVoxelEnabled ){
+            ss << " -> " << voxelCloud.count << " (Voxel " << VoxelSize << "m)";
+        }
+        ss << "  " << pointCloudTime << "ms";
+        cv::putText( processedImage, ss.str(), cv::Point( 20, 50 ), 0, 1.5, cv::Scalar( 0, 0, 255 ), 2 );
+
+        {
+            std::lock_guard<std::mutex> lock( outputMutex );
+            std::swap( processedImage, outputImage );
+            outputArrivalTime = arrivalTime;
+        }
+        scheduler.notifyOutput();
+    }
+
+    // 表示スレッド
     void draw()
     {
-        //drawColorMap();
-        drawDepthMap();
+        STAGE_TIMER( profiler, "draw" );
+
+        FrameScheduler::Clock::time_point arrivalTime;
+        {
+            std::lock_guard<std::mutex> lock( outputMutex );
+            STAGE_TIMER( profiler, "imshow" );
+            cv::imshow( ColorWindowName, outputImage );
+            arrivalTime = outputArrivalTime;
+        }
+
+        latency.add( std::chrono::duration<double, std::milli>( FrameScheduler::Clock::now() - arrivalTime ).count() );
     }
 
     void drawColorMap()
     {
+        STAGE_TIMER( profiler, "drawColorMap" );
+
         ComPtr<ICoordinateMapper> mapper;
         ERROR_CHECK( kinect->get_CoordinateMapper( &mapper ) );
 
@@ -205,21 +425,14 @@ private:
         cv::imshow( ColorWindowName, colorImage );
     }
 
-    void drawDepthMap()
+    // Depthの範囲内にあるカラーだけを残す
+    void composeDepthMap( cv::Mat& colorImage )
     {
-        ComPtr<ICoordinateMapper> mapper;
-        ERROR_CHECK( kinect->get_CoordinateMapper( &mapper ) );
-
-        std::vector<DepthSpacePoint> depthSpacePoints( colorWidth * colorHeight );
-        ERROR_CHECK( mapper->MapColorFrameToDepthSpace( depthBuffer.size(), &depthBuffer[0],
-            depthSpacePoints.size(), &depthSpacePoints[0] ) );
-
-        // カラーデータを表示する
-        cv::Mat colorImage( colorHeight, colorWidth, CV_8UC4 );
+        STAGE_TIMER( profiler, "composeDepthMap" );
 
         for ( int i = 0; i < colorImage.total(); ++i ){
-            int x = (int)depthSpacePoints[i].X;
-            int y = (int)depthSpacePoints[i].Y;
+            int x = (int)colorToDepth[i].X;
+            int y = (int)colorToDepth[i].Y;
 
             int depthIndex = (y * depthWidth) + x;
             int colorIndex = i * ColorBytesPerPixel;
@@ -235,8 +448,74 @@ private:
                 colorImage.data[colorIndex + 2] = 255;
             }
         }
+    }
 
-        cv::imshow( ColorWindowName, colorImage );
+    // 点群を作る実装ごとの時間を比べる
+    void benchmarkPointCloud()
+    {
+        const int Count = 100;
+
+        std::vector<UINT16> depth;
+        UINT16 lower = 0;
+        UINT16 upper = 0;
+        {
+            std::lock_guard<std::mutex> lock( dataMutex );
+            if ( !pointCloudGenerator.loadRayTable( coordinateMapper, depthWidth, depthHeight ) ){
+                std::cout << "画素ごとの方向を取得できません" << std::endl;
+                return;
+            }
+
+            depth = depthBuffer;
+            lower = (UINT16)minDepth;
+            upper = (UINT16)maxDepth;
+        }
+
+        // SDKで全画素をカメラ座標にする
+        std::vector<CameraSpacePoint> cameraSpacePoints( depth.size() );
+        auto begin = cv::getTickCount();
+        for ( int i = 0; i < Count; ++i ){
+            ERROR_CHECK( coordinateMapper->MapDepthFrameToCameraSpace( depth.size(), &depth[0],
+                cameraSpacePoints.size(), &cameraSpacePoints[0] ) );
+        }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        std::cout << "MapDepthFrameToCameraSpace : " << time << "ms" << std::endl;
+
+        PointCloudGenerator generator( pointCloudGenerator );
+        PointCloud expected;
+        PointCloud actual;
+        for ( int path = PointCloudGenerator::Path_Scalar; path <= PointCloudGenerator::Path_AVX2; ++path ){
+            if ( !PointCloudGenerator::isSupported( (PointCloudGenerator::Path)path ) ){
+                continue;
+            }
+
+            // スカラーの結果を基準にする
+            auto& cloud = (path == PointCloudGenerator::Path_Scalar) ? expected : actual;
+            generator.setPath( (PointCloudGenerator::Path)path );
+
+            begin = cv::getTickCount();
+            for ( int i = 0; i < Count; ++i ){
+                generator.generate( &depth[0], lower, upper, cloud );
+            }
+            time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+
+            bool isMatch = (cloud.count == expected.count);
+            for ( int i = 0; isMatch && (i < cloud.count); ++i ){
+                isMatch = (cloud.x[i] == expected.x[i]) && (cloud.y[i] == expected.y[i]) &&
+                    (cloud.z[i] == expected.z[i]) && (cloud.pixels[i] == expected.pixels[i]);
+            }
+
+            std::cout << PointCloudGenerator::pathName( generator.getPath() ) << " : " << time << "ms, " << cloud.count << "点"
+                << (isMatch ? "" : " (結果が一致しません)") << std::endl;
+        }
+
+        VoxelGrid grid;
+        PointCloud downsampled;
+        begin = cv::getTickCount();
+        for ( int i = 0; i < Count; ++i ){
+            grid.downsample( expected, VoxelSize, downsampled );
+        }
+        time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        std::cout << "Voxel " << VoxelSize << "m : " << time << "ms, " << downsampled.count << "点" << std::endl;
     }
 
     bool isValidColorRange( int x, int y )
@@ -244,10 +523,25 @@ private:
         return ((0 <= x) && (x < colorWidth)) && ((0 <= y) && (y < colorHeight));
     }
 
+    // minDepth, maxDepth はトラックバー(表示スレッド)が書き換えるが、読むだけなので排他しない
     bool isValidDepthRange( int index )
     {
         return (minDepth <= depthBuffer[index]) && (depthBuffer[index] <= maxDepth);
     }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
 };
 
 void main()
@@ -0,0 +1,185 @@
+﻿#pragma once
+
+#include <stdexcept>
+
+#include <Windows.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <tmmintrin.h>
+#endif
+
+// ボディインデックス(BYTE)をBGRAの色に変換する
+//
+// 256要素のテーブルにBGRAを詰めた32ビット値を持っておき、1画素を1回の32ビット書き込みで変換します。
+// 色を変えたい場合(ビーム方向の人を強調するなど)は、画素ごとに分岐せずテーブルを書き換えます。
+// 人がいない画素の値は255なので、15以上のインデックスがすべて同じ色の場合はpshufbで16画素ずつ変換します。
+class BodyIndexColorizer
+{
+public:
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSSE3,
+    };
+
+private:
+
+    static const int TableSize = 256;
+    static const int ShuffleTableSize = 16;
+
+    UINT32 table[TableSize];
+    Path path;
+
+public:
+
+    BodyIndexColorizer()
+    {
+        setAllColors( bgra( 0, 0, 0 ) );
+        path = fastestPath();
+    }
+
+    // BGRAを32ビット値に詰める
+    static UINT32 bgra( BYTE b, BYTE g, BYTE r, BYTE a = 0 )
+    {
+        return b | (g << 8) | (r << 16) | ((UINT32)a << 24);
+    }
+
+    // ボディインデックスに対応する色を設定する
+    void setColor( int index, UINT32 color )
+    {
+        table[index] = color;
+    }
+
+    UINT32 getColor( int index ) const
+    {
+        return table[index];
+    }
+
+    void setAllColors( UINT32 color )
+    {
+        for ( int i = 0; i < TableSize; ++i ){
+            table[i] = color;
+        }
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        return (path == Path_SSSE3) ? "SSSE3" : "Scalar";
+    }
+
+    // 実行中のCPUで使える実装かどうか
+    static bool isSupported( Path path )
+    {
+        if ( path == Path_Scalar ){
+            return true;
+        }
+
+#if defined(_M_IX86) || defined(_M_X64)
+        int info[4];
+        __cpuid( info, 1 );
+        return (info[2] & (1 << 9)) != 0;
+#else
+        return false;
+#endif
+    }
+
+    static Path fastestPath()
+    {
+        return isSupported( Path_SSSE3 ) ? Path_SSSE3 : Path_Scalar;
+    }
+
+    // count 画素分のボディインデックスをBGRAに変換する
+    void colorize( const BYTE* src, BYTE* dst, int count ) const
+    {
+        UINT32* dst32 = (UINT32*)dst;
+        int done = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+        if ( (path == Path_SSSE3) && canShuffle() ){
+            done = colorizeSSSE3( src, dst32, count );
+        }
+#endif
+
+        // 端数はテーブルを直接引く
+        for ( int i = done; i < count; ++i ){
+            dst32[i] = table[src[i]];
+        }
+    }
+
+private:
+
+    // 15以上のインデックスがすべて同じ色ならpshufbの16要素に収まる
+    bool canShuffle() const
+    {
+        for ( int i = ShuffleTableSize; i < TableSize; ++i ){
+            if ( table[i] != table[ShuffleTableSize - 1] ){
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    // 16画素ずつ処理し、処理した画素数を返す
+    int colorizeSSSE3( const BYTE* src, UINT32* dst, int count ) const
+    {
+        // B,G,R,Aそれぞれのテーブルを作る
+        BYTE planes[4][ShuffleTableSize];
+        for ( int i = 0; i < ShuffleTableSize; ++i ){
+            for ( int c = 0; c < 4; ++c ){
+                planes[c][i] = (BYTE)(table[i] >> (c * 8));
+            }
+        }
+
+        const __m128i tableB = _mm_loadu_si128( (const __m128i*)planes[0] );
+        const __m128i tableG = _mm_loadu_si128( (const __m128i*)planes[1] );
+        const __m128i tableR = _mm_loadu_si128( (const __m128i*)planes[2] );
+        const __m128i tableA = _mm_loadu_si128( (const __m128i*)planes[3] );
+        const __m128i maxIndex = _mm_set1_epi8( ShuffleTableSize - 1 );
+
+        int i = 0;
+        for ( ; i + 16 <= count; i += 16 ){
+            // 15以上のインデックスは15に丸める
+            __m128i index = _mm_min_epu8( _mm_loadu_si128( (const __m128i*)(src + i) ), maxIndex );
+
+            __m128i b = _mm_shuffle_epi8( tableB, index );
+            __m128i g = _mm_shuffle_epi8( tableG, index );
+            __m128i r = _mm_shuffle_epi8( tableR, index );
+            __m128i a = _mm_shuffle_epi8( tableA, index );
+
+            // BGRAの順に並べる
+            __m128i bgLow = _mm_unpacklo_epi8( b, g );
+            __m128i bgHigh = _mm_unpackhi_epi8( b, g );
+            __m128i raLow = _mm_unpacklo_epi8( r, a );
+            __m128i raHigh = _mm_unpackhi_epi8( r, a );
+
+            _mm_storeu_si128( (__m128i*)(dst + i + 0), _mm_unpacklo_epi16( bgLow, raLow ) );
+            _mm_storeu_si128( (__m128i*)(dst + i + 4), _mm_unpackhi_epi16( bgLow, raLow ) );
+            _mm_storeu_si128( (__m128i*)(dst + i + 8), _mm_unpacklo_epi16( bgHigh, raHigh ) );
+            _mm_storeu_si128( (__m128i*)(dst + i + 12), _mm_unpackhi_epi16( bgHigh, raHigh ) );
+        }
+
+        return i;
+    }
+
+#endif
+};
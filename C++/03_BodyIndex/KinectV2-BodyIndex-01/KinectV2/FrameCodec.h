@@ -0,0 +1,376 @@
+﻿#pragma once
+
+#include <vector>
+#include <cstring>
+#include <stdexcept>
+
+// JPEGの符号化だけ OpenCV を使う。OpenCV のない環境(ヘッドレスの再生など)では
+// FRAME_CODEC_NO_JPEG を定義してビルドすると、ほかの圧縮方法だけが使えます。
+#ifndef FRAME_CODEC_NO_JPEG
+#include <opencv2\opencv.hpp>
+#endif
+
+#include "FrameTypes.h"
+
+// フレームを記録するときの圧縮方法
+//
+// Codec_Raw       : そのまま
+// Codec_DeltaRice : UINT16の画像(Depth、赤外線)を左隣(行の先頭は上)との差分にし、
+//                   32画素ごとにパラメーターを選んだRice符号で符号化する(可逆)
+// Codec_Rle       : BYTEの画像(ボディインデックス)を値と長さの組で符号化する(可逆)
+// Codec_Jpeg      : BGRAのカラー画像をJPEGで符号化する(非可逆、アルファは255になる)
+//                   FRAME_CODEC_NO_JPEG を定義したときは、カラーの標準は Codec_Raw になり、JPEGの符号化と展開は例外になります
+enum FrameCodec
+{
+    Codec_Raw,
+    Codec_DeltaRice,
+    Codec_Rle,
+    Codec_Jpeg,
+};
+
+namespace FrameCodecs
+{
+    // Rice符号のパラメーターを選ぶ画素数
+    const int RiceBlockSize = 32;
+
+    // これ以上の商はエスケープして値をそのまま書く
+    const UINT32 RiceEscape = 24;
+    const int RiceRawBits = 17;
+
+    // ビット単位の書き込み
+    class BitWriter
+    {
+    private:
+
+        std::vector<BYTE>& out;
+        UINT64 bits = 0;
+        int count = 0;
+
+    public:
+
+        BitWriter( std::vector<BYTE>& out )
+            : out( out )
+        {
+        }
+
+        void write( UINT32 value, int length )
+        {
+            bits |= (UINT64)value << count;
+            count += length;
+            while ( count >= 8 ){
+                out.push_back( (BYTE)bits );
+                bits >>= 8;
+                count -= 8;
+            }
+        }
+
+        // 1をcount個、0を1個書く
+        void writeUnary( UINT32 ones )
+        {
+            while ( ones >= 16 ){
+                write( 0xFFFF, 16 );
+                ones -= 16;
+            }
+            write( (1u << ones) - 1, ones + 1 );
+        }
+
+        void flush()
+        {
+            if ( count > 0 ){
+                out.push_back( (BYTE)bits );
+                bits = 0;
+                count = 0;
+            }
+        }
+    };
+
+    // ビット単位の読み込み
+    class BitReader
+    {
+    private:
+
+        const BYTE* data;
+        const BYTE* end;
+        UINT64 bits = 0;
+        int count = 0;
+
+    public:
+
+        BitReader( const BYTE* data, size_t size )
+            : data( data )
+            , end( data + size )
+        {
+        }
+
+        UINT32 read( int length )
+        {
+            fill();
+            if ( count < length ){
+                throw std::runtime_error( "圧縮されたデータが壊れています" );
+            }
+
+            UINT32 value = (UINT32)(bits & ((1ull << length) - 1));
+            bits >>= length;
+            count -= length;
+            return value;
+        }
+
+        UINT32 readUnary()
+        {
+            UINT32 ones = 0;
+            while ( 1 ) {
+                fill();
+                if ( count == 0 ){
+                    throw std::runtime_error( "圧縮されたデータが壊れています" );
+                }
+
+                // 連続する1の数を数える
+                while ( (count > 0) && (bits & 1) ){
+                    bits >>= 1;
+                    --count;
+                    ++ones;
+                }
+                if ( count > 0 ){
+                    bits >>= 1;
+                    --count;
+                    return ones;
+                }
+            }
+        }
+
+    private:
+
+        void fill()
+        {
+            while ( (count <= 56) && (data < end) ){
+                bits |= (UINT64)*data++ << count;
+                count += 8;
+            }
+        }
+    };
+
+    // 符号付きの差分を符号なしにする(0, -1, 1, -2, ... → 0, 1, 2, 3, ...)
+    inline UINT32 zigzag( int value )
+    {
+        return (UINT32)((value << 1) ^ (value >> 31));
+    }
+
+    inline int unzigzag( UINT32 value )
+    {
+        return (int)(value >> 1) ^ -(int)(value & 1);
+    }
+
+    inline void encodeDeltaRice( const UINT16* src, int width, int height, std::vector<BYTE>& out )
+    {
+        int count = width * height;
+        std::vector<UINT32> residuals( count );
+
+        // 左隣(行の先頭は上)との差分
+        for ( int y = 0; y < height; ++y ){
+            for ( int x = 0; x < width; ++x ){
+                int i = (y * width) + x;
+                int prediction = (x > 0) ? src[i - 1] : ((y > 0) ? src[i - width] : 0);
+                residuals[i] = zigzag( src[i] - prediction );
+            }
+        }
+
+        BitWriter writer( out );
+        for ( int begin = 0; begin < count; begin += RiceBlockSize ){
+            int end = (begin + RiceBlockSize < count) ? (begin + RiceBlockSize) : count;
+
+            // 平均に合わせてパラメーターを選ぶ
+            UINT64 sum = 0;
+            for ( int i = begin; i < end; ++i ){
+                sum += residuals[i];
+            }
+            int k = 0;
+            while ( (k < 16) && (((UINT64)(end - begin) << (k + 1)) <= sum) ){
+                ++k;
+            }
+            writer.write( k, 5 );
+
+            for ( int i = begin; i < end; ++i ){
+                UINT32 q = residuals[i] >> k;
+                if ( q < RiceEscape ){
+                    writer.writeUnary( q );
+                    writer.write( residuals[i] & ((1u << k) - 1), k );
+                }
+                else {
+                    writer.writeUnary( RiceEscape );
+                    writer.write( residuals[i], RiceRawBits );
+                }
+            }
+        }
+        writer.flush();
+    }
+
+    inline void decodeDeltaRice( const BYTE* data, size_t size, UINT16* dst, int width, int height )
+    {
+        int count = width * height;
+        BitReader reader( data, size );
+
+        for ( int begin = 0; begin < count; begin += RiceBlockSize ){
+            int end = (begin + RiceBlockSize < count) ? (begin + RiceBlockSize) : count;
+            int k = reader.read( 5 );
+
+            for ( int i = begin; i < end; ++i ){
+                UINT32 q = reader.readUnary();
+                UINT32 residual = (q < RiceEscape) ? ((q << k) | reader.read( k )) : reader.read( RiceRawBits );
+
+                int x = i % width;
+                int prediction = (x > 0) ? dst[i - 1] : ((i >= width) ? dst[i - width] : 0);
+                dst[i] = (UINT16)(prediction + unzigzag( residual ));
+            }
+        }
+    }
+
+    // 長さは7ビットずつ、続きがあれば最上位ビットを立てて書く
+    inline void encodeRle( const BYTE* src, int count, std::vector<BYTE>& out )
+    {
+        int i = 0;
+        while ( i < count ){
+            BYTE value = src[i];
+            UINT32 run = 1;
+            while ( (i + (int)run < count) && (src[i + run] == value) ){
+                ++run;
+            }
+
+            out.push_back( value );
+            UINT32 length = run;
+            while ( length >= 0x80 ){
+                out.push_back( (BYTE)(length | 0x80) );
+                length >>= 7;
+            }
+            out.push_back( (BYTE)length );
+
+            i += run;
+        }
+    }
+
+    inline void decodeRle( const BYTE* data, size_t size, BYTE* dst, int count )
+    {
+        const BYTE* end = data + size;
+        int i = 0;
+        while ( (data < end) && (i < count) ){
+            BYTE value = *data++;
+
+            UINT32 run = 0;
+            int shift = 0;
+            while ( data < end ){
+                BYTE b = *data++;
+                run |= (UINT32)(b & 0x7F) << shift;
+                shift += 7;
+                if ( (b & 0x80) == 0 ){
+                    break;
+                }
+            }
+
+            if ( run > (UINT32)(count - i) ){
+                throw std::runtime_error( "圧縮されたデータが壊れています" );
+            }
+            memset( dst + i, value, run );
+            i += run;
+        }
+
+        // 途中で切れていると、残りが前のフレームのままになる
+        if ( i != count ){
+            throw std::runtime_error( "圧縮されたデータが壊れています" );
+        }
+    }
+
+#ifndef FRAME_CODEC_NO_JPEG
+    inline void encodeJpeg( const BYTE* src, int width, int height, int quality, std::vector<BYTE>& out )
+    {
+        cv::Mat bgra( height, width, CV_8UC4, (void*)src );
+        cv::Mat bgr;
+        cv::cvtColor( bgra, bgr, CV_BGRA2BGR );
+
+        std::vector<int> params( 2 );
+        params[0] = CV_IMWRITE_JPEG_QUALITY;
+        params[1] = quality;
+        cv::imencode( ".jpg", bgr, out, params );
+    }
+
+    inline void decodeJpeg( const BYTE* data, size_t size, BYTE* dst, int width, int height )
+    {
+        cv::Mat bgr = cv::imdecode( std::vector<BYTE>( data, data + size ), 1 );
+        if ( (bgr.cols != width) || (bgr.rows != height) ){
+            throw std::runtime_error( "JPEGの大きさが違います" );
+        }
+
+        cv::Mat bgra( height, width, CV_8UC4, dst );
+        cv::cvtColor( bgr, bgra, CV_BGR2BGRA );
+    }
+#endif
+
+    // 1フレームを圧縮する。out は上書きされる
+    inline void encode( FrameCodec codec, const BYTE* src, int width, int height, int bytesPerPixel, std::vector<BYTE>& out )
+    {
+        out.clear();
+
+        switch ( codec ){
+        case Codec_DeltaRice:
+            encodeDeltaRice( (const UINT16*)src, width, height, out );
+            break;
+        case Codec_Rle:
+            encodeRle( src, width * height, out );
+            break;
+        case Codec_Jpeg:
+#ifndef FRAME_CODEC_NO_JPEG
+            encodeJpeg( src, width, height, 90, out );
+            break;
+#else
+            throw std::runtime_error( "このビルドではJPEGで圧縮できません" );
+#endif
+        default:
+            out.assign( src, src + (width * height * bytesPerPixel) );
+            break;
+        }
+    }
+
+    // 1フレームを展開する。dst には width * height * bytesPerPixel バイト書き込む
+    inline void decode( FrameCodec codec, const BYTE* data, size_t size, BYTE* dst, int width, int height, int bytesPerPixel )
+    {
+        switch ( codec ){
+        case Codec_DeltaRice:
+            decodeDeltaRice( data, size, (UINT16*)dst, width, height );
+            break;
+        case Codec_Rle:
+            decodeRle( data, size, dst, width * height );
+            break;
+        case Codec_Jpeg:
+#ifndef FRAME_CODEC_NO_JPEG
+            decodeJpeg( data, size, dst, width, height );
+            break;
+#else
+            throw std::runtime_error( "このビルドではJPEGのフレームを展開できません" );
+#endif
+        default:
+            if ( size != (size_t)(width * height * bytesPerPixel) ){
+                throw std::runtime_error( "フレームの大きさが違います" );
+            }
+            memcpy( dst, data, size );
+            break;
+        }
+    }
+
+    // ストリームごとの標準の圧縮方法
+    inline FrameCodec defaultCodec( FrameStream stream )
+    {
+        switch ( stream ){
+        case FrameStream_Color:
+#ifndef FRAME_CODEC_NO_JPEG
+            return Codec_Jpeg;
+#else
+            return Codec_Raw;
+#endif
+        case FrameStream_Depth:
+        case FrameStream_Infrared:
+            return Codec_DeltaRice;
+        case FrameStream_BodyIndex:
+            return Codec_Rle;
+        default:
+            return Codec_Raw;
+        }
+    }
+}
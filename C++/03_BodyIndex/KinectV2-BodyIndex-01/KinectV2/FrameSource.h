@@ -0,0 +1,35 @@
+﻿#pragma once
+
+#include "FrameTypes.h"
+
+// フレームの取得元(Kinectや記録したファイル)を切り替えるためのインタフェース
+//
+// update*Frame() はこのインタフェースからデータを受け取るだけにしておけば、
+// センサーがなくても記録したファイルで処理の速度計測や動作確認ができます。
+// Kinect.h を使わないので、再生(ReplayFrameSource.h)は Kinect がない環境でもビルドできます。
+class FrameSource
+{
+public:
+
+    virtual ~FrameSource()
+    {
+    }
+
+    // ストリームを開く
+    virtual void open( FrameStream stream ) = 0;
+
+    // ストリームのフレームの形式を取得する
+    virtual FrameFormat getFormat( FrameStream stream ) = 0;
+
+    // Depthの信頼できる距離の範囲を取得する
+    virtual void getDepthReliableDistance( UINT16& minDistance, UINT16& maxDistance ) = 0;
+
+    // 新しいフレームがあれば buffer にコピーしてtrueを返す
+    // relativeTime には、nullptrでなければフレームのタイムスタンプ(100ns単位)が入る
+    // Audio はサブフレームを1つずつ、届いた順にすべて返すので、falseになるまで呼んでください
+    virtual bool acquireLatestFrame( FrameStream stream, void* buffer, UINT size, TIMESPAN* relativeTime ) = 0;
+
+    // 開いたストリームのどれかに新しいフレームが届くまで待つ(milliseconds 待っても届かなければfalse)
+    // cv::waitKey(10) の間隔で acquireLatestFrame() を呼び続ける代わりに、ループの先頭で呼びます
+    virtual bool waitForFrame( UINT milliseconds ) = 0;
+};
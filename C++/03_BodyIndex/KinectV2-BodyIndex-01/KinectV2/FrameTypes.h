@@ -0,0 +1,51 @@
+﻿#pragma once
+
+// 記録と再生、Depthの処理で使う型(標準ライブラリだけで使えるように、Windows.h や Kinect.h を読み込まない)
+//
+// Windows と同じ型にしているので、Windows.h や Kinect.h と一緒に読み込んでもかまいません。
+// これだけを使うヘッダーは、Kinect や OpenCV がない環境(ヘッドレスの再生など)でもビルドできます。
+typedef unsigned char BYTE;
+typedef unsigned char BOOLEAN;
+typedef unsigned short UINT16;
+typedef unsigned int UINT;
+typedef unsigned int UINT32;
+typedef long long INT64;
+typedef unsigned long long UINT64;
+
+// Kinect.h と同じ定義(100ns単位のタイムスタンプ)
+#ifndef _TIMESPAN_
+#define _TIMESPAN_
+typedef INT64 TIMESPAN;
+#endif // _TIMESPAN_
+
+// ストリームの種類
+enum FrameStream
+{
+    FrameStream_Color,
+    FrameStream_Depth,
+    FrameStream_Infrared,
+    FrameStream_BodyIndex,
+    FrameStream_Body,
+    FrameStream_Audio,
+    FrameStream_Count,
+};
+
+// フレームの形式
+//
+// Color     : width x height, BGRA(4バイト)
+// Depth     : width x height, UINT16
+// Infrared  : width x height, UINT16
+// BodyIndex : width x height, BYTE
+// Body      : BODY_COUNT x 1, BodyData(KinectFrameSource.h)
+// Audio     : サブフレームのサンプル数 x 1, float
+struct FrameFormat
+{
+    int width;
+    int height;
+    int bytesPerPixel;
+
+    UINT frameSize() const
+    {
+        return width * height * bytesPerPixel;
+    }
+};
@@ -0,0 +1,203 @@
+﻿#pragma once
+
+#include <chrono>
+#include <thread>
+
+#include "FrameFile.h"
+
+// 記録したファイルからフレームを取得する
+//
+// Mode_RealTime : 記録したときと同じ間隔でフレームを返す
+// Mode_MaxSpeed : 呼ばれるたびに次のフレームを返す(処理の速度計測用)
+class ReplayFrameSource : public FrameSource
+{
+public:
+
+    enum Mode
+    {
+        Mode_RealTime,
+        Mode_MaxSpeed,
+    };
+
+private:
+
+    typedef std::chrono::steady_clock Clock;
+
+    FrameFileReader reader;
+
+    Mode mode;
+    bool isLoop;
+
+    // 次に返すフレームの番号
+    size_t next[FrameStream_Count];
+
+    // open() したストリーム(waitForFrame() で待つもの)
+    bool isOpened[FrameStream_Count];
+
+    // 再生を始めた時刻と、その時刻に対応するタイムスタンプ
+    Clock::time_point startClock;
+    TIMESPAN startTime;
+    TIMESPAN endTime;
+
+public:
+
+    ReplayFrameSource( const std::string& fileName, Mode mode = Mode_RealTime, bool isLoop = true )
+        : mode( mode )
+        , isLoop( isLoop )
+    {
+        reader.open( fileName );
+
+        for ( auto& opened : isOpened ){
+            opened = false;
+        }
+
+        // 記録の最初と最後のタイムスタンプ
+        startTime = -1;
+        endTime = 0;
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            const auto& entries = reader.getEntries( (FrameStream)i );
+            if ( entries.empty() ){
+                continue;
+            }
+
+            if ( (startTime < 0) || (entries.front().relativeTime < startTime) ){
+                startTime = entries.front().relativeTime;
+            }
+            if ( endTime < entries.back().relativeTime ){
+                endTime = entries.back().relativeTime;
+            }
+        }
+
+        rewind();
+    }
+
+    // 最初から再生し直す
+    void rewind()
+    {
+        for ( auto& n : next ){
+            n = 0;
+        }
+
+        startClock = Clock::now();
+    }
+
+    // 指定したタイムスタンプの位置から再生する(ファイルの索引から探す)
+    void seek( TIMESPAN relativeTime )
+    {
+        if ( relativeTime < startTime ){
+            relativeTime = startTime;
+        }
+
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            next[i] = reader.findEntry( (FrameStream)i, relativeTime );
+        }
+
+        startClock = Clock::now() - std::chrono::microseconds( (relativeTime - startTime) / 10 );
+    }
+
+    virtual void open( FrameStream stream )
+    {
+        if ( reader.getEntries( stream ).empty() ){
+            throw std::runtime_error( "記録したファイルにストリームがありません" );
+        }
+
+        isOpened[stream] = true;
+    }
+
+    virtual FrameFormat getFormat( FrameStream stream )
+    {
+        return reader.getHeader().formats[stream];
+    }
+
+    virtual void getDepthReliableDistance( UINT16& minDistance, UINT16& maxDistance )
+    {
+        minDistance = reader.getHeader().minDepthReliableDistance;
+        maxDistance = reader.getHeader().maxDepthReliableDistance;
+    }
+
+    virtual bool acquireLatestFrame( FrameStream stream, void* buffer, UINT size, TIMESPAN* relativeTime )
+    {
+        const auto& entries = reader.getEntries( stream );
+        if ( entries.empty() ){
+            return false;
+        }
+
+        size_t index = 0;
+        if ( mode == Mode_MaxSpeed ){
+            if ( next[stream] >= entries.size() ){
+                if ( !isLoop ){
+                    return false;
+                }
+                next[stream] = 0;
+            }
+
+            index = next[stream];
+        }
+        else {
+            // 経過時間をタイムスタンプに換算する(100ns単位)
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - startClock ).count() * 10;
+            // 最後のフレームを返し終わっていれば最初に戻る
+            if ( isLoop && (startTime + elapsed > endTime) && (next[stream] >= entries.size()) ){
+                rewind();
+                elapsed = 0;
+            }
+
+            // 経過時間までに届いているはずの最新のフレームを探す
+            size_t latest = next[stream];
+            while ( (latest < entries.size()) && (entries[latest].relativeTime <= startTime + elapsed) ){
+                ++latest;
+            }
+
+            if ( latest == next[stream] ){
+                return false;
+            }
+
+            // Audio は飛ばさずに、届いているはずのサブフレームを古い順に返す
+            index = (stream == FrameStream_Audio) ? next[stream] : (latest - 1);
+        }
+
+        reader.read( entries[index], buffer, size );
+        next[stream] = index + 1;
+
+        if ( relativeTime != nullptr ){
+            *relativeTime = entries[index].relativeTime;
+        }
+
+        return true;
+    }
+
+    // Mode_RealTime では、開いたストリームの次のフレームのタイムスタンプまで眠る
+    // Mode_MaxSpeed では待たずに、返すフレームが残っているかを返す
+    virtual bool waitForFrame( UINT milliseconds )
+    {
+        // 開いたストリームの中で、次のフレームが一番早いもの
+        TIMESPAN nextTime = -1;
+        for ( int i = 0; i < FrameStream_Count; ++i ){
+            const auto& entries = reader.getEntries( (FrameStream)i );
+            if ( isOpened[i] && (next[i] < entries.size()) ){
+                if ( (nextTime < 0) || (entries[next[i]].relativeTime < nextTime) ){
+                    nextTime = entries[next[i]].relativeTime;
+                }
+            }
+        }
+
+        // 最後まで返していれば、繰り返すときは acquireLatestFrame() で最初に戻る
+        if ( nextTime < 0 ){
+            return isLoop;
+        }
+
+        if ( mode == Mode_MaxSpeed ){
+            return true;
+        }
+
+        auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>( Clock::now() - startClock ).count() * 10;
+        TIMESPAN wait = (nextTime - startTime) - elapsed;
+        if ( wait <= 0 ){
+            return true;
+        }
+
+        TIMESPAN timeout = (TIMESPAN)milliseconds * 10000;
+        std::this_thread::sleep_for( std::chrono::microseconds( ((wait < timeout) ? wait : timeout) / 10 ) );
+        return wait <= timeout;
+    }
+};
@@ -1,5 +1,6 @@
 ﻿#include <iostream>
 #include <sstream>
+#include <memory>
 
 #include <Kinect.h>
 #include <opencv2\opencv.hpp>
@@ -8,6 +9,11 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "BodyIndexColorizer.h"
+#include "KinectFrameSource.h"
+#include "ReplayFrameSource.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -22,45 +28,52 @@ class KinectApp
 {
 private:
 
-    IKinectSensor* kinect = nullptr;
+    // フレームの取得元(Kinectまたは記録したファイル)
+    std::unique_ptr<FrameSource> source;
+
+    // フレームの記録
+    FrameFileWriter recorder;
+    const char* RecordFileName = "bodyindex.kfrm";
 
-    IBodyIndexFrameReader* bodyIndexFrameReader = nullptr;
     int BodyIndexWidth;
     int BodyIndexHeight;
     std::vector<BYTE> bodyIndexBuffer;
 
     cv::Scalar colors[6];
 
-public:
+    // ボディインデックスを色に変換するテーブル
+    BodyIndexColorizer colorizer;
+    cv::Mat bodyIndexImage;
 
-    // 初期化
-    void initialize()
-    {
-        // デフォルトのKinectを取得する
-        ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
 
-        // Kinectを開く
-        ERROR_CHECK( kinect->Open() );
+public:
 
-        BOOLEAN isOpen = false;
-        ERROR_CHECK( kinect->get_IsOpen( &isOpen ) );
-        if ( !isOpen ){
-            throw std::runtime_error( "Kinectが開けません" );
+    // 初期化(replayFileNameを指定すると、Kinectの代わりに記録したファイルを再生する)
+    void initialize( const char* replayFileName = nullptr )
+    {
+        if ( replayFileName == nullptr ){
+            // デフォルトのKinectを開く
+            source.reset( new KinectFrameSource() );
+        }
+        else {
+            // 記録したファイルを開く
+            source.reset( new ReplayFrameSource( replayFileName ) );
         }
 
-        // ボディインデックスリーダーを取得する
-        ComPtr<IBodyIndexFrameSource> bodyIndexFrameSource;
-        ERROR_CHECK( kinect->get_BodyIndexFrameSource( &bodyIndexFrameSource ) );
-        ERROR_CHECK( bodyIndexFrameSource->OpenReader( &bodyIndexFrameReader ) );
+        // ボディインデックスのストリームを開く
+        source->open( FrameStream_BodyIndex );
 
         // ボディインデックスの解像度を取得する
-        ComPtr<IFrameDescription> bodyIndexFrameDescription;
-        ERROR_CHECK( bodyIndexFrameSource->get_FrameDescription( &bodyIndexFrameDescription ) );
-        bodyIndexFrameDescription->get_Width( &BodyIndexWidth );
-        bodyIndexFrameDescription->get_Height( &BodyIndexHeight );
+        FrameFormat bodyIndexFormat = source->getFormat( FrameStream_BodyIndex );
+        BodyIndexWidth = bodyIndexFormat.width;
+        BodyIndexHeight = bodyIndexFormat.height;
 
         // バッファーを作成する
         bodyIndexBuffer.resize( BodyIndexWidth * BodyIndexHeight );
+        bodyIndexImage.create( BodyIndexHeight, BodyIndexWidth, CV_8UC4 );
 
         // プレイヤーの色を設定する
         colors[0] = cv::Scalar( 255,   0,   0 );
@@ -69,18 +82,36 @@ public:
         colors[3] = cv::Scalar( 255, 255,   0 );
         colors[4] = cv::Scalar( 255,   0, 255 );
         colors[5] = cv::Scalar(   0, 255, 255 );
+
+        // 変換テーブルに色を設定する(人がいない場所は黒)
+        for ( int i = 0; i < 6; ++i ){
+            colorizer.setColor( i, BodyIndexColorizer::bgra( colors[i][0], colors[i][1], colors[i][2] ) );
+        }
     }
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         while ( 1 ) {
+            // フレームが届くまで待つ(届かなくてもキーを受け付けるように、100msで戻る)
+            source->waitForFrame( 100 );
             update();
             draw();
 
-            auto key = cv::waitKey( 10 );
+            auto key = cv::waitKey( 1 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
+            else if ( key == 'b' ){
+                benchmarkColorizer();
+            }
+            else if ( key == 'r' ){
+                toggleRecording();
+            }
         }
     }
 
@@ -89,59 +120,151 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
         updateBodyIndexFrame();
     }
 
     // ボディインデックスフレームの更新
     void updateBodyIndexFrame()
     {
-        // フレームを取得する
-        ComPtr<IBodyIndexFrame> bodyIndexFrame;
-        auto ret = bodyIndexFrameReader->AcquireLatestFrame( &bodyIndexFrame );
-        if ( ret == S_OK ){
-            // データを取得する
-            ERROR_CHECK( bodyIndexFrame->CopyFrameDataToArray( bodyIndexBuffer.size(), &bodyIndexBuffer[0] ) );
-
-            // スマートポインタを使ってない場合は、自分でフレームを解放する
-            // bodyIndexFrame->Release();
+        STAGE_TIMER( profiler, "updateBodyIndexFrame" );
+
+        // ボディインデックスフレームのデータを取得する
+        TIMESPAN relativeTime = 0;
+        {
+            STAGE_TIMER( profiler, "acquireLatestFrame" );
+            if ( !source->acquireLatestFrame( FrameStream_BodyIndex, &bodyIndexBuffer[0], (UINT)bodyIndexBuffer.size(), &relativeTime ) ){
+                return;
+            }
+        }
+
+        // 記録中ならファイルに書き込む
+        if ( recorder.isOpen() ){
+            recorder.write( FrameStream_BodyIndex, relativeTime, &bodyIndexBuffer[0], (UINT)bodyIndexBuffer.size() );
+        }
+    }
+
+    // 記録の開始・終了を切り替える
+    void toggleRecording()
+    {
+        if ( recorder.isOpen() ){
+            recorder.close();
+            std::cout << "記録を終了しました : " << RecordFileName << std::endl;
+
+            auto statistics = recorder.getStatistics();
+            std::cout << "記録したフレーム : " << statistics.written << ", 捨てたフレーム : " << statistics.dropped
+                << ", 空きを待った回数 : " << statistics.waited << " (" << statistics.waitedTime << "ms)"
+                << ", 圧縮率 : " << ((statistics.rawBytes > 0) ? ((double)statistics.storedBytes / statistics.rawBytes) : 1.0) << std::endl;
+            if ( !recorder.getError().empty() ){
+                std::cout << recorder.getError() << std::endl;
+            }
+        }
+        else {
+            recorder.open( RecordFileName, *source );
+            std::cout << "記録を開始しました : " << RecordFileName << std::endl;
         }
     }
 
     void draw()
     {
+        STAGE_TIMER( profiler, "draw" );
         drawBodyIndexFrame();
     }
 
     void drawBodyIndexFrame()
     {
+        STAGE_TIMER( profiler, "drawBodyIndexFrame" );
+
         // ボディインデックスをカラーデータに変換して表示する
-        cv::Mat bodyIndexImage( BodyIndexHeight, BodyIndexWidth, CV_8UC4 );
-
-        for ( int i = 0; i < BodyIndexWidth * BodyIndexHeight; ++i ){
-            int index = i * 4;
-            // 人がいれば255以外
-            if ( bodyIndexBuffer[i] != 255 ){
-                auto color = colors[bodyIndexBuffer[i]];
-                bodyIndexImage.data[index + 0] = color[0];
-                bodyIndexImage.data[index + 1] = color[1];
-                bodyIndexImage.data[index + 2] = color[2];
+        {
+            STAGE_TIMER( profiler, "BodyIndexColorizer" );
+            colorizer.colorize( &bodyIndexBuffer[0], bodyIndexImage.data, BodyIndexWidth * BodyIndexHeight );
+        }
+
+        STAGE_TIMER( profiler, "imshow" );
+        cv::imshow( "BodyIndex Image", bodyIndexImage );
+    }
+
+    // ボディインデックスの色付けの速度を計測する
+    void benchmarkColorizer()
+    {
+        const int Count = 100;
+
+        // 人がいる場所(0-5)といない場所(255)が混ざった疑似的なボディインデックスを作成する
+        std::vector<BYTE> src( BodyIndexWidth * BodyIndexHeight );
+        cv::Mat srcImage( BodyIndexHeight, BodyIndexWidth, CV_8UC1, &src[0] );
+        cv::randu( srcImage, 0, 12 );
+        for ( auto& index : src ){
+            if ( index >= 6 ){
+                index = 255;
             }
-            else{
-                bodyIndexImage.data[index + 0] = 0;
-                bodyIndexImage.data[index + 1] = 0;
-                bodyIndexImage.data[index + 2] = 0;
+        }
+
+        cv::Mat expected = cv::Mat::zeros( BodyIndexHeight, BodyIndexWidth, CV_8UC4 );
+        cv::Mat actual = cv::Mat::zeros( BodyIndexHeight, BodyIndexWidth, CV_8UC4 );
+
+        // テーブルを使わない元の処理
+        auto begin = cv::getTickCount();
+        for ( int n = 0; n < Count; ++n ){
+            for ( int i = 0; i < BodyIndexWidth * BodyIndexHeight; ++i ){
+                int index = i * 4;
+                if ( src[i] != 255 ){
+                    auto color = colors[src[i]];
+                    expected.data[index + 0] = color[0];
+                    expected.data[index + 1] = color[1];
+                    expected.data[index + 2] = color[2];
+                }
+                else{
+                    expected.data[index + 0] = 0;
+                    expected.data[index + 1] = 0;
+                    expected.data[index + 2] = 0;
+                }
             }
         }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        std::cout << "Reference : " << time << "ms" << std::endl;
 
-        cv::imshow( "BodyIndex Image", bodyIndexImage );
+        BodyIndexColorizer benchmark = colorizer;
+        for ( int path = BodyIndexColorizer::Path_Scalar; path <= BodyIndexColorizer::Path_SSSE3; ++path ){
+            if ( !BodyIndexColorizer::isSupported( (BodyIndexColorizer::Path)path ) ){
+                continue;
+            }
+
+            benchmark.setPath( (BodyIndexColorizer::Path)path );
+
+            begin = cv::getTickCount();
+            for ( int n = 0; n < Count; ++n ){
+                benchmark.colorize( &src[0], actual.data, BodyIndexWidth * BodyIndexHeight );
+            }
+            time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+
+            bool isSame = memcmp( expected.data, actual.data, expected.total() * 4 ) == 0;
+            std::cout << BodyIndexColorizer::pathName( benchmark.getPath() ) << " : " << time << "ms"
+                << (isSame ? "" : " (結果が一致しません)") << std::endl;
+        }
+    }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
     }
 };
 
-void main()
+// 引数に記録したファイルを指定すると、Kinectの代わりにそのファイルを再生します
+void main( int argc, char* argv[] )
 {
     try {
         KinectApp app;
-        app.initialize();
+        app.initialize( (argc > 1) ? argv[1] : nullptr );
         app.run();
     }
     catch ( std::exception& ex ){
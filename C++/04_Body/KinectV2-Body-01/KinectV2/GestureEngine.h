@@ -0,0 +1,466 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// 関節の位置と手の状態から、ジェスチャーを見つける
+//
+// ジェスチャーは1行に1つ、key=value を並べたテキストで定義します(# から行末まではコメント)。
+//
+//   name=SwipeRight type=motion joint=HandRight reference=SpineShoulder axis=x distance=0.4 time=0.5
+//   name=RaiseRightHand type=hold joint=HandRight reference=Head axis=y min=0.1 time=1.0
+//   name=GrabRight type=hand hand=right from=open to=closed time=0.3
+//
+// type=motion : joint の reference からの相対位置が、time 秒の間に axis 方向へ distance(m) 以上動いた
+//               (distance は必須で0以外、負なら逆向き)。min、max を指定すると、今の相対位置がその範囲にあるときだけ
+// type=hold   : joint の reference からの相対位置の axis 成分が min 以上 max 以下の状態が time 秒続いた
+// type=hand   : hand の手の状態が from から to に、time 秒以内に変わった
+// cooldown    : 一度見つけてから、同じボディで次に見つけるまでの時間(秒、既定は1秒)
+//
+// ボディごとに直近 HistoryLength フレームの相対位置をリングに持ち、motion は time 秒前の値を
+// 直接引きます。hold は続いたフレーム数、hand は最後に from だった時刻だけを持つので、
+// 1フレームの処理はジェスチャーの数に比例し、履歴の長さには関係しません。
+class GestureEngine
+{
+public:
+
+    enum Type
+    {
+        Type_Motion,
+        Type_Hold,
+        Type_Hand,
+    };
+
+    struct Gesture
+    {
+        std::string name;
+        Type type;
+        JointType joint;
+        JointType reference;
+        int axis;
+        float distance;
+        float min;
+        float max;
+        float time;
+        float cooldown;
+        bool isRightHand;
+        HandState from;
+        HandState to;
+    };
+
+    // 見つけたジェスチャー
+    struct Event
+    {
+        int body;
+        int gesture;
+        TIMESPAN relativeTime;
+    };
+
+    static const int HistoryLength = 64;
+
+private:
+
+    static const int JointCount = JointType::JointType_Count;
+
+    // フレームの間隔(100ns単位、30fps)
+    static const TIMESPAN FrameInterval = 333333;
+
+    std::vector<Gesture> gestures;
+
+    // ボディごとの状態
+    struct BodyState
+    {
+        UINT64 trackingId;
+        int frames;
+        int head;
+
+        // ジェスチャーごとの相対位置の履歴(axis 成分だけ)
+        std::vector<float> history;
+
+        // ジェスチャーごとの状態
+        std::vector<int> holdFrames;
+        std::vector<TIMESPAN> fromTimes;
+        std::vector<TIMESPAN> lastFired;
+    };
+
+    BodyState bodies[BODY_COUNT];
+
+    std::vector<Event> events;
+
+public:
+
+    GestureEngine()
+    {
+        for ( auto& body : bodies ){
+            body.trackingId = 0;
+            body.frames = 0;
+            body.head = 0;
+        }
+    }
+
+    // ファイルからジェスチャーの定義を読み込む(今までの定義は捨てる)
+    void load( const std::string& fileName )
+    {
+        std::ifstream file( fileName );
+        if ( !file.is_open() ){
+            throw std::runtime_error( "ジェスチャーの定義ファイルが開けません : " + fileName );
+        }
+
+        std::stringstream ss;
+        ss << file.rdbuf();
+        parse( ss.str() );
+    }
+
+    // 文字列からジェスチャーの定義を読み込む(今までの定義は捨てる)
+    void parse( const std::string& text )
+    {
+        std::vector<Gesture> parsed;
+
+        std::istringstream lines( text );
+        std::string line;
+        int lineNumber = 0;
+        while ( std::getline( lines, line ) ){
+            ++lineNumber;
+
+            auto comment = line.find( '#' );
+            if ( comment != std::string::npos ){
+                line.erase( comment );
+            }
+
+            std::istringstream tokens( line );
+            std::string token;
+            if ( !(tokens >> token) ){
+                continue;
+            }
+
+            Gesture gesture = defaultGesture();
+            do {
+                auto equal = token.find( '=' );
+                if ( equal == std::string::npos ){
+                    throw std::runtime_error( error( lineNumber, "key=value の形式ではありません : " + token ) );
+                }
+
+                setValue( gesture, token.substr( 0, equal ), token.substr( equal + 1 ), lineNumber );
+            } while ( tokens >> token );
+
+            if ( gesture.name.empty() ){
+                throw std::runtime_error( error( lineNumber, "name がありません" ) );
+            }
+
+            // 0だと毎フレーム見つけてしまう
+            if ( (gesture.type == Type_Motion) && (gesture.distance == 0) ){
+                throw std::runtime_error( error( lineNumber, "type=motion には0以外の distance が必要です" ) );
+            }
+
+            parsed.push_back( gesture );
+        }
+
+        gestures.swap( parsed );
+        resetAll();
+    }
+
+    const std::vector<Gesture>& getGestures() const
+    {
+        return gestures;
+    }
+
+    // 前のフレームで見つけたジェスチャー
+    const std::vector<Event>& getEvents() const
+    {
+        return events;
+    }
+
+    // 新しいフレームを処理する前に呼ぶ
+    void beginFrame()
+    {
+        events.clear();
+    }
+
+    // スロット body のボディを追跡していないときに呼ぶ
+    void reset( int body )
+    {
+        BodyState& state = bodies[body];
+        state.trackingId = 0;
+        state.frames = 0;
+        state.head = 0;
+
+        size_t count = gestures.size();
+        state.history.assign( count * HistoryLength, 0.0f );
+        state.holdFrames.assign( count, 0 );
+        state.fromTimes.assign( count, -1 );
+        state.lastFired.assign( count, -1 );
+    }
+
+    // スロット body の1フレーム分の関節と手の状態を処理する
+    void update( int body, UINT64 trackingId, TIMESPAN relativeTime, const Joint* joints, HandState handLeft, HandState handRight )
+    {
+        BodyState& state = bodies[body];
+        if ( (state.trackingId != trackingId) || (state.holdFrames.size() != gestures.size()) ){
+            reset( body );
+            state.trackingId = trackingId;
+        }
+
+        for ( size_t g = 0; g < gestures.size(); ++g ){
+            const Gesture& gesture = gestures[g];
+
+            bool isDetected = false;
+            switch ( gesture.type ){
+            case Type_Motion:
+                isDetected = updateMotion( state, g, gesture, joints );
+                break;
+            case Type_Hold:
+                isDetected = updateHold( state, g, gesture, joints );
+                break;
+            case Type_Hand:
+                isDetected = updateHand( state, g, gesture, relativeTime, gesture.isRightHand ? handRight : handLeft );
+                break;
+            }
+
+            if ( !isDetected ){
+                continue;
+            }
+
+            // 続けて見つからないように、cooldown の間は無視する
+            TIMESPAN cooldown = (TIMESPAN)(gesture.cooldown * 1e7);
+            if ( (state.lastFired[g] >= 0) && (relativeTime - state.lastFired[g] < cooldown) ){
+                continue;
+            }
+
+            state.lastFired[g] = relativeTime;
+            state.holdFrames[g] = 0;
+
+            Event event = { body, (int)g, relativeTime };
+            events.push_back( event );
+        }
+
+        state.head = (state.head + 1) % HistoryLength;
+        if ( state.frames < HistoryLength ){
+            ++state.frames;
+        }
+    }
+
+    static const char* jointName( JointType joint )
+    {
+        static const char* names[] = {
+            "SpineBase", "SpineMid", "Neck", "Head",
+            "ShoulderLeft", "ElbowLeft", "WristLeft", "HandLeft",
+            "ShoulderRight", "ElbowRight", "WristRight", "HandRight",
+            "HipLeft", "KneeLeft", "AnkleLeft", "FootLeft",
+            "HipRight", "KneeRight", "AnkleRight", "FootRight",
+            "SpineShoulder", "HandTipLeft", "ThumbLeft", "HandTipRight", "ThumbRight",
+        };
+
+        return ((0 <= joint) && (joint < JointCount)) ? names[joint] : "";
+    }
+
+private:
+
+    static Gesture defaultGesture()
+    {
+        Gesture gesture;
+        gesture.type = Type_Motion;
+        gesture.joint = JointType::JointType_HandRight;
+        gesture.reference = JointType::JointType_SpineShoulder;
+        gesture.axis = 0;
+        gesture.distance = 0;
+        gesture.min = -1e6f;
+        gesture.max = 1e6f;
+        gesture.time = 0.5f;
+        gesture.cooldown = 1.0f;
+        gesture.isRightHand = true;
+        gesture.from = HandState::HandState_Open;
+        gesture.to = HandState::HandState_Closed;
+        return gesture;
+    }
+
+    static std::string error( int lineNumber, const std::string& message )
+    {
+        std::stringstream ss;
+        ss << "ジェスチャーの定義 " << lineNumber << "行目 : " << message;
+        return ss.str();
+    }
+
+    static float toFloat( const std::string& value, int lineNumber )
+    {
+        std::istringstream ss( value );
+        float result = 0;
+        if ( !(ss >> result) ){
+            throw std::runtime_error( error( lineNumber, "数値ではありません : " + value ) );
+        }
+        return result;
+    }
+
+    static JointType toJoint( const std::string& value, int lineNumber )
+    {
+        for ( int i = 0; i < JointCount; ++i ){
+            if ( value == jointName( (JointType)i ) ){
+                return (JointType)i;
+            }
+        }
+
+        throw std::runtime_error( error( lineNumber, "関節の名前ではありません : " + value ) );
+    }
+
+    static HandState toHandState( const std::string& value, int lineNumber )
+    {
+        if ( value == "open" ){
+            return HandState::HandState_Open;
+        }
+        if ( value == "closed" ){
+            return HandState::HandState_Closed;
+        }
+        if ( value == "lasso" ){
+            return HandState::HandState_Lasso;
+        }
+
+        throw std::runtime_error( error( lineNumber, "手の状態ではありません : " + value ) );
+    }
+
+    static void setValue( Gesture& gesture, const std::string& key, const std::string& value, int lineNumber )
+    {
+        if ( key == "name" ){
+            gesture.name = value;
+        }
+        else if ( key == "type" ){
+            if ( value == "motion" ){
+                gesture.type = Type_Motion;
+            }
+            else if ( value == "hold" ){
+                gesture.type = Type_Hold;
+            }
+            else if ( value == "hand" ){
+                gesture.type = Type_Hand;
+            }
+            else {
+                throw std::runtime_error( error( lineNumber, "type は motion、hold、hand のどれかです : " + value ) );
+            }
+        }
+        else if ( key == "joint" ){
+            gesture.joint = toJoint( value, lineNumber );
+        }
+        else if ( key == "reference" ){
+            gesture.reference = toJoint( value, lineNumber );
+        }
+        else if ( key == "axis" ){
+            if ( (value.size() != 1) || (value[0] < 'x') || ('z' < value[0]) ){
+                throw std::runtime_error( error( lineNumber, "axis は x、y、z のどれかです : " + value ) );
+            }
+            gesture.axis = value[0] - 'x';
+        }
+        else if ( key == "distance" ){
+            gesture.distance = toFloat( value, lineNumber );
+        }
+        else if ( key == "min" ){
+            gesture.min = toFloat( value, lineNumber );
+        }
+        else if ( key == "max" ){
+            gesture.max = toFloat( value, lineNumber );
+        }
+        else if ( key == "time" ){
+            gesture.time = toFloat( value, lineNumber );
+        }
+        else if ( key == "cooldown" ){
+            gesture.cooldown = toFloat( value, lineNumber );
+        }
+        else if ( key == "hand" ){
+            if ( (value != "left") && (value != "right") ){
+                throw std::runtime_error( error( lineNumber, "hand は left か right です : " + value ) );
+            }
+            gesture.isRightHand = (value == "right");
+        }
+        else if ( key == "from" ){
+            gesture.from = toHandState( value, lineNumber );
+        }
+        else if ( key == "to" ){
+            gesture.to = toHandState( value, lineNumber );
+        }
+        else {
+            throw std::runtime_error( error( lineNumber, "知らない key です : " + key ) );
+        }
+    }
+
+    void resetAll()
+    {
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            reset( i );
+        }
+    }
+
+    // joint の reference からの相対位置の axis 成分
+    static float relative( const Gesture& gesture, const Joint* joints )
+    {
+        const CameraSpacePoint& p = joints[gesture.joint].Position;
+        const CameraSpacePoint& r = joints[gesture.reference].Position;
+        switch ( gesture.axis ){
+        case 0:  return p.X - r.X;
+        case 1:  return p.Y - r.Y;
+        default: return p.Z - r.Z;
+        }
+    }
+
+    static bool isAvailable( const Gesture& gesture, const Joint* joints )
+    {
+        return (joints[gesture.joint].TrackingState != TrackingState::TrackingState_NotTracked) &&
+            (joints[gesture.reference].TrackingState != TrackingState::TrackingState_NotTracked);
+    }
+
+    bool updateMotion( BodyState& state, size_t g, const Gesture& gesture, const Joint* joints )
+    {
+        float* history = &state.history[g * HistoryLength];
+        float value = relative( gesture, joints );
+        history[state.head] = value;
+
+        if ( !isAvailable( gesture, joints ) || (value < gesture.min) || (gesture.max < value) ){
+            return false;
+        }
+
+        // time 秒前の値と比べる(履歴が足りなければ一番古い値と比べる)
+        int back = (int)((gesture.time * 1e7) / FrameInterval + 0.5);
+        if ( back >= HistoryLength ){
+            back = HistoryLength - 1;
+        }
+        if ( back >= state.frames ){
+            back = state.frames - 1;
+        }
+        if ( back <= 0 ){
+            return false;
+        }
+
+        float moved = value - history[(state.head + HistoryLength - back) % HistoryLength];
+        return (gesture.distance >= 0) ? (moved >= gesture.distance) : (moved <= gesture.distance);
+    }
+
+    bool updateHold( BodyState& state, size_t g, const Gesture& gesture, const Joint* joints )
+    {
+        float value = relative( gesture, joints );
+        if ( !isAvailable( gesture, joints ) || (value < gesture.min) || (gesture.max < value) ){
+            state.holdFrames[g] = 0;
+            return false;
+        }
+
+        ++state.holdFrames[g];
+        return state.holdFrames[g] * FrameInterval >= (TIMESPAN)(gesture.time * 1e7);
+    }
+
+    bool updateHand( BodyState& state, size_t g, const Gesture& gesture, TIMESPAN relativeTime, HandState handState )
+    {
+        if ( handState == gesture.from ){
+            state.fromTimes[g] = relativeTime;
+            return false;
+        }
+
+        if ( (handState != gesture.to) || (state.fromTimes[g] < 0) ){
+            return false;
+        }
+
+        // 一度見つけたら、次にまた from になるまで見つけない
+        bool isDetected = (relativeTime - state.fromTimes[g]) <= (TIMESPAN)(gesture.time * 1e7);
+        state.fromTimes[g] = -1;
+        return isDetected;
+    }
+};
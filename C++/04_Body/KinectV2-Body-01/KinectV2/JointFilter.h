@@ -0,0 +1,290 @@
+﻿#pragma once
+
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// 関節の位置のぶれを抑え、少し先の位置を予測する
+//
+// Method_Holt    : 2重指数平滑化(Holt法)。ぶれの半径以内の動きはさらに弱め、
+//                  予測した位置が元の位置から maxDeviationRadius より離れないようにします。
+// Method_OneEuro : One Euro フィルター。速く動いているときほど遮断周波数を上げて、遅れを減らします。
+//
+// どちらも「位置」と「傾き(速度)」を持ち、prediction 秒先の位置を 位置 + 傾き * 時間 で予測します。
+// 状態は ボディのスロット x 関節 の順に並べた軸ごとの配列で持ち、TrackingId が変わったスロットは作り直します。
+// 推測状態(TrackingState_Inferred)の関節は新しい値の重みを半分にし、追跡できていない関節は状態を捨てます。
+class JointFilter
+{
+public:
+
+    enum Method
+    {
+        Method_None,
+        Method_Holt,
+        Method_OneEuro,
+    };
+
+    struct HoltParameters
+    {
+        float smoothing;            // 前の予測の重み(0-1)
+        float correction;           // 傾きの更新の重み(0-1)
+        float jitterRadius;         // この距離(m)以内の動きは弱める
+        float maxDeviationRadius;   // 予測が元の位置から離れられる距離(m)
+    };
+
+    struct OneEuroParameters
+    {
+        float minCutoff;            // 止まっているときの遮断周波数(Hz)
+        float beta;                 // 速さ(m/s)に対する遮断周波数の増え方
+        float derivativeCutoff;     // 速さの遮断周波数(Hz)
+    };
+
+    static const int JointCount = JointType::JointType_Count;
+    static const int StateCount = BODY_COUNT * JointCount;
+
+private:
+
+    Method method = Method_Holt;
+    HoltParameters holt;
+    OneEuroParameters oneEuro;
+    float prediction = 0;
+
+    // ボディのスロットごとの TrackingId と前のフレームのタイムスタンプ
+    UINT64 trackingIds[BODY_COUNT];
+    TIMESPAN times[BODY_COUNT];
+
+    // 関節ごとの位置と傾き(Holt は1フレームあたり、One Euro は1秒あたり)
+    float positionX[StateCount];
+    float positionY[StateCount];
+    float positionZ[StateCount];
+    float trendX[StateCount];
+    float trendY[StateCount];
+    float trendZ[StateCount];
+    bool hasState[StateCount];
+
+public:
+
+    JointFilter()
+    {
+        holt.smoothing = 0.5f;
+        holt.correction = 0.5f;
+        holt.jitterRadius = 0.05f;
+        holt.maxDeviationRadius = 0.04f;
+
+        oneEuro.minCutoff = 1.0f;
+        oneEuro.beta = 0.5f;
+        oneEuro.derivativeCutoff = 1.0f;
+
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            reset( i );
+        }
+    }
+
+    void setMethod( Method newMethod )
+    {
+        method = newMethod;
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            reset( i );
+        }
+    }
+
+    Method getMethod() const
+    {
+        return method;
+    }
+
+    static const char* methodName( Method method )
+    {
+        switch ( method ){
+        case Method_Holt:       return "Holt";
+        case Method_OneEuro:    return "OneEuro";
+        default:                return "None";
+        }
+    }
+
+    void setHoltParameters( const HoltParameters& parameters )
+    {
+        holt = parameters;
+    }
+
+    void setOneEuroParameters( const OneEuroParameters& parameters )
+    {
+        oneEuro = parameters;
+    }
+
+    // 何秒先の位置を出力するか(センサーから表示までの遅れを補う)
+    void setPrediction( float seconds )
+    {
+        if ( seconds < 0 ){
+            throw std::runtime_error( "予測する時間は0以上にしてください" );
+        }
+
+        prediction = seconds;
+    }
+
+    float getPrediction() const
+    {
+        return prediction;
+    }
+
+    // スロット body の状態を捨てる
+    void reset( int body )
+    {
+        trackingIds[body] = 0;
+        times[body] = 0;
+        for ( int i = body * JointCount; i < (body + 1) * JointCount; ++i ){
+            hasState[i] = false;
+        }
+    }
+
+    // スロット body の関節(joints)にフィルターをかけ、filtered にフィルターをかけた位置、
+    // predicted にさらに prediction 秒先を予測した位置を書き込む(joints は書き換えない)
+    // relativeTime はボディフレームのタイムスタンプ(100ns単位)
+    void apply( int body, UINT64 trackingId, TIMESPAN relativeTime, const Joint* joints, Joint* filtered, Joint* predicted )
+    {
+        std::copy( joints, joints + JointCount, filtered );
+        std::copy( joints, joints + JointCount, predicted );
+        if ( method == Method_None ){
+            return;
+        }
+
+        // 別の人になったら作り直す
+        if ( trackingIds[body] != trackingId ){
+            reset( body );
+            trackingIds[body] = trackingId;
+        }
+
+        // フレームの間隔(秒)。わからないとき(最初のフレーム)は30fpsとする
+        const float DefaultInterval = 1.0f / 30;
+        float interval = (times[body] != 0) ? ((relativeTime - times[body]) * 1e-7f) : DefaultInterval;
+        if ( interval <= 0 ){
+            interval = DefaultInterval;
+        }
+        times[body] = relativeTime;
+
+        int base = body * JointCount;
+        for ( int j = 0; j < JointCount; ++j ){
+            int i = base + j;
+            const Joint& joint = joints[j];
+
+            if ( joint.TrackingState == TrackingState::TrackingState_NotTracked ){
+                hasState[i] = false;
+                continue;
+            }
+
+            bool isInferred = (joint.TrackingState == TrackingState::TrackingState_Inferred);
+            if ( !hasState[i] ){
+                positionX[i] = joint.Position.X;
+                positionY[i] = joint.Position.Y;
+                positionZ[i] = joint.Position.Z;
+                trendX[i] = trendY[i] = trendZ[i] = 0;
+                hasState[i] = true;
+                continue;
+            }
+
+            if ( method == Method_Holt ){
+                applyHolt( i, isInferred, interval, joint.Position, filtered[j].Position, predicted[j].Position );
+            }
+            else {
+                applyOneEuro( i, isInferred, interval, joint.Position, filtered[j].Position, predicted[j].Position );
+            }
+        }
+    }
+
+private:
+
+    void applyHolt( int i, bool isInferred, float interval, const CameraSpacePoint& position, CameraSpacePoint& filtered, CameraSpacePoint& predicted )
+    {
+        // 推測状態の関節は、ぶれの半径を2倍にし、新しい値の重みを半分にする
+        float jitterRadius = isInferred ? (holt.jitterRadius * 2) : holt.jitterRadius;
+        float smoothing = isInferred ? (1 - ((1 - holt.smoothing) * 0.5f)) : holt.smoothing;
+
+        // ぶれの半径以内の動きは、前の位置に寄せる
+        float rawX = position.X;
+        float rawY = position.Y;
+        float rawZ = position.Z;
+        float dx = rawX - positionX[i];
+        float dy = rawY - positionY[i];
+        float dz = rawZ - positionZ[i];
+        float distance = sqrtf( (dx * dx) + (dy * dy) + (dz * dz) );
+        if ( (distance <= jitterRadius) && (jitterRadius > 0) ){
+            float rate = distance / jitterRadius;
+            rawX = positionX[i] + (dx * rate);
+            rawY = positionY[i] + (dy * rate);
+            rawZ = positionZ[i] + (dz * rate);
+        }
+
+        // 位置 = 新しい値と前の予測の重み付き平均、傾き = 位置の変化と前の傾きの重み付き平均
+        float x = (rawX * (1 - smoothing)) + ((positionX[i] + trendX[i]) * smoothing);
+        float y = (rawY * (1 - smoothing)) + ((positionY[i] + trendY[i]) * smoothing);
+        float z = (rawZ * (1 - smoothing)) + ((positionZ[i] + trendZ[i]) * smoothing);
+        trendX[i] = ((x - positionX[i]) * holt.correction) + (trendX[i] * (1 - holt.correction));
+        trendY[i] = ((y - positionY[i]) * holt.correction) + (trendY[i] * (1 - holt.correction));
+        trendZ[i] = ((z - positionZ[i]) * holt.correction) + (trendZ[i] * (1 - holt.correction));
+        positionX[i] = x;
+        positionY[i] = y;
+        positionZ[i] = z;
+        filtered.X = x;
+        filtered.Y = y;
+        filtered.Z = z;
+
+        // 傾きは1フレームあたりなので、予測する時間をフレーム数にする
+        float frames = prediction / interval;
+        float px = x + (trendX[i] * frames);
+        float py = y + (trendY[i] * frames);
+        float pz = z + (trendZ[i] * frames);
+
+        // 予測が元の位置から離れすぎないようにする
+        dx = px - position.X;
+        dy = py - position.Y;
+        dz = pz - position.Z;
+        distance = sqrtf( (dx * dx) + (dy * dy) + (dz * dz) );
+        if ( distance > holt.maxDeviationRadius ){
+            float rate = holt.maxDeviationRadius / distance;
+            px = position.X + (dx * rate);
+            py = position.Y + (dy * rate);
+            pz = position.Z + (dz * rate);
+        }
+
+        predicted.X = px;
+        predicted.Y = py;
+        predicted.Z = pz;
+    }
+
+    // 遮断周波数 cutoff の1次ローパスフィルターの、新しい値の重み
+    static float smoothingFactor( float cutoff, float interval )
+    {
+        float tau = 1 / (2 * 3.14159265f * cutoff);
+        return 1 / (1 + (tau / interval));
+    }
+
+    void applyOneEuro( int i, bool isInferred, float interval, const CameraSpacePoint& position, CameraSpacePoint& filtered, CameraSpacePoint& predicted )
+    {
+        // 速さ(1秒あたり)をローパスフィルターに通す
+        float derivativeAlpha = smoothingFactor( oneEuro.derivativeCutoff, interval );
+        trendX[i] += (((position.X - positionX[i]) / interval) - trendX[i]) * derivativeAlpha;
+        trendY[i] += (((position.Y - positionY[i]) / interval) - trendY[i]) * derivativeAlpha;
+        trendZ[i] += (((position.Z - positionZ[i]) / interval) - trendZ[i]) * derivativeAlpha;
+
+        // 速いほど遮断周波数を上げる(推測状態の関節は半分にする)
+        float speed = sqrtf( (trendX[i] * trendX[i]) + (trendY[i] * trendY[i]) + (trendZ[i] * trendZ[i]) );
+        float cutoff = oneEuro.minCutoff + (oneEuro.beta * speed);
+        if ( isInferred ){
+            cutoff *= 0.5f;
+        }
+
+        float alpha = smoothingFactor( cutoff, interval );
+        positionX[i] += (position.X - positionX[i]) * alpha;
+        positionY[i] += (position.Y - positionY[i]) * alpha;
+        positionZ[i] += (position.Z - positionZ[i]) * alpha;
+
+        filtered.X = positionX[i];
+        filtered.Y = positionY[i];
+        filtered.Z = positionZ[i];
+        predicted.X = positionX[i] + (trendX[i] * prediction);
+        predicted.Y = positionY[i] + (trendY[i] * prediction);
+        predicted.Z = positionZ[i] + (trendZ[i] * prediction);
+    }
+};
@@ -0,0 +1,104 @@
+﻿#pragma once
+
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// すべてのボディの関節の位置を、1回の呼び出しでDepth座標(とカラー座標)に変換する
+//
+// 関節ごとに MapCameraPointToDepthSpace を呼ぶと、6人 x 25関節で最大150回のCOMの呼び出しになります。
+// このクラスはボディのスロット順に関節の位置を並べた配列を持ち、フレームごとに
+// MapCameraPointsToDepthSpace (と MapCameraPointsToColorSpace)を1回だけ呼びます。
+// 結果はフレームの間そのまま使い回せるので、描画の処理は配列を引くだけになります。
+class JointProjector
+{
+public:
+
+    static const int JointCount = JointType::JointType_Count;
+    static const int PointCount = BODY_COUNT * JointCount;
+
+private:
+
+    ICoordinateMapper* mapper = nullptr;
+
+    bool isColorEnabled = false;
+
+    // ボディのスロット x 関節の順に並べた位置と、変換した結果
+    CameraSpacePoint cameraPoints[PointCount];
+    DepthSpacePoint depthPoints[PointCount];
+    ColorSpacePoint colorPoints[PointCount];
+
+    // 追跡しているボディのスロット数(変換はこの数のスロットまで)
+    int bodyCount = 0;
+
+public:
+
+    void initialize( ICoordinateMapper* coordinateMapper )
+    {
+        mapper = coordinateMapper;
+        clear();
+    }
+
+    // カラー座標にも変換するかどうか
+    void setColorEnabled( bool isEnabled )
+    {
+        isColorEnabled = isEnabled;
+    }
+
+    bool getColorEnabled() const
+    {
+        return isColorEnabled;
+    }
+
+    // 前のフレームの関節の位置を消す
+    void clear()
+    {
+        for ( auto& point : cameraPoints ){
+            point.X = point.Y = point.Z = 0;
+        }
+
+        bodyCount = 0;
+    }
+
+    // スロット body の関節の位置を設定する(追跡していないボディは設定しない)
+    void setJoints( int body, const Joint* joints )
+    {
+        CameraSpacePoint* points = &cameraPoints[body * JointCount];
+        for ( int i = 0; i < JointCount; ++i ){
+            points[i] = joints[i].Position;
+        }
+
+        if ( bodyCount < body + 1 ){
+            bodyCount = body + 1;
+        }
+    }
+
+    // 設定した関節の位置をまとめて変換する
+    void project()
+    {
+        if ( bodyCount == 0 ){
+            return;
+        }
+
+        UINT count = bodyCount * JointCount;
+        if ( mapper->MapCameraPointsToDepthSpace( count, cameraPoints, count, depthPoints ) != S_OK ){
+            throw std::runtime_error( "MapCameraPointsToDepthSpace に失敗しました" );
+        }
+
+        if ( isColorEnabled ){
+            if ( mapper->MapCameraPointsToColorSpace( count, cameraPoints, count, colorPoints ) != S_OK ){
+                throw std::runtime_error( "MapCameraPointsToColorSpace に失敗しました" );
+            }
+        }
+    }
+
+    const DepthSpacePoint& getDepthPoint( int body, int joint ) const
+    {
+        return depthPoints[(body * JointCount) + joint];
+    }
+
+    const ColorSpacePoint& getColorPoint( int body, int joint ) const
+    {
+        return colorPoints[(body * JointCount) + joint];
+    }
+};
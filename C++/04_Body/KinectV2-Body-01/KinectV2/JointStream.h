@@ -0,0 +1,111 @@
+﻿#pragma once
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// ボディの関節と手の状態を、1行に1人分のテキストで記録・再生する
+//
+// 形式 : タイムスタンプ スロット TrackingId 左手の状態 右手の状態 (X Y Z 追跡状態) x 25関節
+//
+// センサーがなくても、記録したファイルでジェスチャーの検出などを確かめられます。
+struct JointStreamRecord
+{
+    TIMESPAN relativeTime;
+    int body;
+    UINT64 trackingId;
+    HandState handLeft;
+    HandState handRight;
+    Joint joints[JointType::JointType_Count];
+};
+
+class JointStreamWriter
+{
+private:
+
+    std::ofstream file;
+
+public:
+
+    void open( const std::string& fileName )
+    {
+        file.open( fileName );
+        if ( !file.is_open() ){
+            throw std::runtime_error( "ファイルが作成できません : " + fileName );
+        }
+    }
+
+    void close()
+    {
+        file.close();
+    }
+
+    bool isOpen() const
+    {
+        return file.is_open();
+    }
+
+    void write( const JointStreamRecord& record )
+    {
+        file << record.relativeTime << " " << record.body << " " << record.trackingId << " "
+            << (int)record.handLeft << " " << (int)record.handRight;
+        for ( const auto& joint : record.joints ){
+            file << " " << joint.Position.X << " " << joint.Position.Y << " " << joint.Position.Z << " " << (int)joint.TrackingState;
+        }
+        file << "\n";
+    }
+};
+
+class JointStreamReader
+{
+private:
+
+    std::ifstream file;
+
+public:
+
+    void open( const std::string& fileName )
+    {
+        file.open( fileName );
+        if ( !file.is_open() ){
+            throw std::runtime_error( "ファイルが開けません : " + fileName );
+        }
+    }
+
+    // 次の1人分を読み込む(ファイルの終わりならfalse)
+    bool read( JointStreamRecord& record )
+    {
+        std::string line;
+        while ( std::getline( file, line ) ){
+            if ( line.empty() ){
+                continue;
+            }
+
+            std::istringstream ss( line );
+            int handLeft = 0;
+            int handRight = 0;
+            ss >> record.relativeTime >> record.body >> record.trackingId >> handLeft >> handRight;
+            record.handLeft = (HandState)handLeft;
+            record.handRight = (HandState)handRight;
+
+            for ( int i = 0; i < JointType::JointType_Count; ++i ){
+                Joint& joint = record.joints[i];
+                int state = 0;
+                ss >> joint.Position.X >> joint.Position.Y >> joint.Position.Z >> state;
+                joint.JointType = (JointType)i;
+                joint.TrackingState = (TrackingState)state;
+            }
+
+            if ( ss.fail() || (record.body < 0) || (BODY_COUNT <= record.body) ){
+                throw std::runtime_error( "記録の形式が正しくありません : " + line );
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+};
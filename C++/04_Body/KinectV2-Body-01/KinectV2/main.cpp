@@ -8,6 +8,13 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "BodySnapshot.h"
+#include "JointProjector.h"
+#include "JointFilter.h"
+#include "GestureEngine.h"
+#include "JointStream.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -27,6 +34,38 @@ private:
     IBodyFrameReader* bodyFrameReader = nullptr;
     IBody* bodies[6];
 
+    // フレームの到着イベント(届くまで待って、AcquireLatestFrame を空振りしない)
+    WAITABLE_HANDLE bodyFrameEvent = 0;
+
+    // 座標変換は最初に一度だけ取得しておく
+    ICoordinateMapper* coordinateMapper = nullptr;
+
+    // フレームごとに一度だけ取得したボディのデータと、関節をまとめてDepth座標にした結果
+    BodySnapshot bodySnapshot;
+    JointProjector jointProjector;
+
+    // 関節の位置のぶれを抑え、表示までの遅れの分だけ先を予測する
+    JointFilter jointFilter;
+
+    // ジェスチャーの検出(定義はファイルから読み込む)
+    GestureEngine gestureEngine;
+    const char* GestureFileName = "gestures.txt";
+
+    // ボディごとに最後に見つけたジェスチャーと、表示を続けるフレーム数
+    std::string gestureNames[BODY_COUNT];
+    int gestureFrames[BODY_COUNT];
+
+    // 関節の記録
+    JointStreamWriter jointRecorder;
+    const char* JointFileName = "joints.txt";
+
+    // 表示用の画像(フレームごとに確保しないように使い回す)
+    cv::Mat bodyImage;
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
 public:
 
     // 初期化
@@ -48,115 +87,239 @@ public:
         ComPtr<IBodyFrameSource> bodyFrameSource;
         ERROR_CHECK( kinect->get_BodyFrameSource( &bodyFrameSource ) );
         ERROR_CHECK( bodyFrameSource->OpenReader( &bodyFrameReader ) );
+        ERROR_CHECK( bodyFrameReader->SubscribeFrameArrived( &bodyFrameEvent ) );
+
+        // 座標変換インタフェースを取得する
+        ERROR_CHECK( kinect->get_CoordinateMapper( &coordinateMapper ) );
+        jointProjector.initialize( coordinateMapper );
+
+        for ( auto& frames : gestureFrames ){
+            frames = 0;
+        }
+
+        loadGestures();
     }
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         while ( 1 ) {
+            // フレームが届くまで待つ(届かなくてもキーを受け付けるように、100msで戻る)
+            waitForFrame( 100 );
             update();
             draw();
 
-            auto key = cv::waitKey( 10 );
+            auto key = cv::waitKey( 1 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
+            else if ( key == 'f' ){
+                toggleFilter();
+            }
+            else if ( key == 'p' ){
+                // センサーから表示まではおよそ60-100ms遅れる
+                jointFilter.setPrediction( (jointFilter.getPrediction() > 0) ? 0.0f : 0.08f );
+                std::cout << "予測 : " << jointFilter.getPrediction() * 1000 << "ms" << std::endl;
+            }
+            else if ( key == 'g' ){
+                loadGestures();
+            }
+            else if ( key == 'r' ){
+                toggleRecording();
+            }
+            else if ( key == 'b' ){
+                benchmarkJointProjection();
+                benchmarkJointFilter();
+                benchmarkGestures();
+            }
         }
     }
 
 private:
 
+    // フレームが届くまで待つ(milliseconds 待っても届かなければ戻る)
+    void waitForFrame( DWORD milliseconds )
+    {
+        if ( ::WaitForSingleObject( reinterpret_cast<HANDLE>( bodyFrameEvent ), milliseconds ) == WAIT_OBJECT_0 ){
+            // イベントのデータを受け取ってイベントを戻す(受け取らないとシグナルのままになり、待たずに戻り続ける)
+            ComPtr<IBodyFrameArrivedEventArgs> args;
+            bodyFrameReader->GetFrameArrivedEventData( bodyFrameEvent, &args );
+        }
+    }
+
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
         updateBodyFrame();
     }
 
     // ボディフレームの更新
     void updateBodyFrame()
     {
+        STAGE_TIMER( profiler, "updateBodyFrame" );
+
         // フレームを取得する
         ComPtr<IBodyFrame> bodyFrame;
         auto ret = bodyFrameReader->AcquireLatestFrame( &bodyFrame );
         if ( ret == S_OK ){
             // データを取得する
-            ERROR_CHECK( bodyFrame->GetAndRefreshBodyData( 6, &bodies[0] ) );
+            {
+                STAGE_TIMER( profiler, "GetAndRefreshBodyData" );
+                ERROR_CHECK( bodyFrame->GetAndRefreshBodyData( 6, &bodies[0] ) );
+            }
+
+            TIMESPAN relativeTime = 0;
+            ERROR_CHECK( bodyFrame->get_RelativeTime( &relativeTime ) );
+
+            // ボディのデータをまとめて取得する
+            ERROR_CHECK( bodySnapshot.update( bodies, relativeTime ) );
+
+            // 追跡しているボディの関節にフィルターをかけてから、予測した位置をまとめてDepth座標にする
+            jointProjector.clear();
+            gestureEngine.beginFrame();
+            for ( int i = 0; i < BODY_COUNT; ++i ){
+                auto& body = bodySnapshot[i];
+                if ( !body.isTracked ){
+                    jointFilter.reset( i );
+                    gestureEngine.reset( i );
+                    continue;
+                }
+
+                Joint filtered[JointType::JointType_Count];
+                Joint predicted[JointType::JointType_Count];
+                jointFilter.apply( i, body.trackingId, relativeTime, body.joints, filtered, predicted );
+                jointProjector.setJoints( i, predicted );
+
+                // フィルターをかけた(予測していない)関節と手の状態からジェスチャーを探す
+                gestureEngine.update( i, body.trackingId, relativeTime, filtered, body.handLeftState, body.handRightState );
+
+                // 記録するのはセンサーから取得したままの関節
+
+                if ( jointRecorder.isOpen() ){
+                    JointStreamRecord record;
+                    record.relativeTime = relativeTime;
+                    record.body = i;
+                    record.trackingId = body.trackingId;
+                    record.handLeft = body.handLeftState;
+                    record.handRight = body.handRightState;
+                    std::copy( body.joints, body.joints + JointType::JointType_Count, record.joints );
+                    jointRecorder.write( record );
+                }
+            }
+            {
+                STAGE_TIMER( profiler, "JointProjector" );
+                jointProjector.project();
+            }
+
+            for ( const auto& event : gestureEngine.getEvents() ){
+                gestureNames[event.body] = gestureEngine.getGestures()[event.gesture].name;
+                gestureFrames[event.body] = 30;
+                std::cout << event.body << " : " << gestureNames[event.body] << std::endl;
+            }
 
             // スマートポインタを使ってない場合は、自分でフレームを解放する
             // bodyFrame->Release();
         }
     }
 
+    // フィルターを なし → Holt → OneEuro → なし の順に切り替える
+    void toggleFilter()
+    {
+        jointFilter.setMethod( (JointFilter::Method)((jointFilter.getMethod() + 1) % (JointFilter::Method_OneEuro + 1)) );
+        std::cout << "フィルター : " << JointFilter::methodName( jointFilter.getMethod() ) << std::endl;
+    }
+
+    void loadGestures()
+    {
+        try {
+            gestureEngine.load( GestureFileName );
+            std::cout << "ジェスチャー : " << gestureEngine.getGestures().size() << "個" << std::endl;
+        }
+        catch ( std::exception& ex ){
+            // 読み込めなければ前の定義のまま続ける
+            std::cout << ex.what() << std::endl;
+        }
+    }
+
+    // 関節の記録の開始・終了を切り替える
+    void toggleRecording()
+    {
+        if ( jointRecorder.isOpen() ){
+            jointRecorder.close();
+            std::cout << "記録を終了しました : " << JointFileName << std::endl;
+        }
+        else {
+            jointRecorder.open( JointFileName );
+            std::cout << "記録を開始しました : " << JointFileName << std::endl;
+        }
+    }
+
     void draw()
     {
+        STAGE_TIMER( profiler, "draw" );
         drawBodyIndexFrame();
     }
 
     void drawBodyIndexFrame()
     {
-        // 関節の座標をDepth座標系で表示する
-        cv::Mat bodyImage = cv::Mat::zeros( 424, 512, CV_8UC4 );
+        STAGE_TIMER( profiler, "drawBodyIndexFrame" );
 
-        for ( auto body : bodies ){
-            if ( body == nullptr ){
-                continue;
-            }
+        // 関節の座標をDepth座標系で表示する
+        bodyImage.create( 424, 512, CV_8UC4 );
+        bodyImage.setTo( 0 );
 
-            BOOLEAN isTracked = false;
-            ERROR_CHECK( body->get_IsTracked( &isTracked ) );
-            if ( !isTracked ) {
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            const auto& body = bodySnapshot[i];
+            if ( !body.isTracked ) {
                 continue;
             }
 
             // 関節の位置を表示する
-            Joint joints[JointType::JointType_Count];
-            body->GetJoints( JointType::JointType_Count, joints );
-            for ( auto joint : joints ) {
+            for ( auto joint : body.joints ) {
+                const auto& point = jointProjector.getDepthPoint( i, joint.JointType );
+
                 // 手の位置が追跡状態
                 if ( joint.TrackingState == TrackingState::TrackingState_Tracked ) {
-                    drawEllipse( bodyImage, joint, 10, cv::Scalar( 255, 0, 0 ) );
+                    drawEllipse( bodyImage, point, 10, cv::Scalar( 255, 0, 0 ) );
 
                     // 左手を追跡していたら、手の状態を表示する
                     if ( joint.JointType == JointType::JointType_HandLeft ) {
-                        HandState handState;
-                        TrackingConfidence handConfidence;
-                        body->get_HandLeftState( &handState );
-                        body->get_HandLeftConfidence( &handConfidence );
-
-                        drawHandState( bodyImage, joint, handConfidence, handState );
+                        drawHandState( bodyImage, point, body.handLeftConfidence, body.handLeftState );
                     }
                     // 右手を追跡していたら、手の状態を表示する
                     else if ( joint.JointType == JointType::JointType_HandRight ) {
-                        HandState handState;
-                        TrackingConfidence handConfidence;
-                        body->get_HandRightState( &handState );
-                        body->get_HandRightConfidence( &handConfidence );
-
-                        drawHandState( bodyImage, joint, handConfidence, handState );
+                        drawHandState( bodyImage, point, body.handRightConfidence, body.handRightState );
                     }
                 }
                 // 手の位置が推測状態
                 else if ( joint.TrackingState == TrackingState::TrackingState_Inferred ) {
-                    drawEllipse( bodyImage, joint, 10, cv::Scalar( 255, 255, 0 ) );
+                    drawEllipse( bodyImage, point, 10, cv::Scalar( 255, 255, 0 ) );
                 }
             }
+
+            // 見つけたジェスチャーを頭の上に表示する
+            if ( gestureFrames[i] > 0 ){
+                --gestureFrames[i];
+                const auto& head = jointProjector.getDepthPoint( i, JointType::JointType_Head );
+                cv::putText( bodyImage, gestureNames[i], cv::Point( (int)head.X - 40, (int)head.Y - 30 ), 0, 0.7, cv::Scalar( 255, 255, 255, 255 ), 2 );
+            }
         }
 
+        STAGE_TIMER( profiler, "imshow" );
         cv::imshow( "Body Image", bodyImage );
     }
 
-    void drawEllipse( cv::Mat& bodyImage, const Joint& joint, int r, const cv::Scalar& color )
+    void drawEllipse( cv::Mat& bodyImage, const DepthSpacePoint& point, int r, const cv::Scalar& color )
     {
-        // カメラ座標系をDepth座標系に変換する
-        ComPtr<ICoordinateMapper> mapper;
-        ERROR_CHECK( kinect->get_CoordinateMapper( &mapper ) );
-
-        DepthSpacePoint point;
-        mapper->MapCameraPointToDepthSpace( joint.Position, &point );
-
         cv::circle( bodyImage, cv::Point( point.X, point.Y ), r, color, -1 );
     }
 
-    void drawHandState( cv::Mat& bodyImage, Joint joint, TrackingConfidence handConfidence, HandState handState )
+    void drawHandState( cv::Mat& bodyImage, const DepthSpacePoint& point, TrackingConfidence handConfidence, HandState handState )
     {
         const int R = 40;
 
@@ -164,13 +327,6 @@ private:
             return;
         }
 
-        // カメラ座標系をDepth座標系に変換する
-        ComPtr<ICoordinateMapper> mapper;
-        ERROR_CHECK( kinect->get_CoordinateMapper( &mapper ) );
-
-        DepthSpacePoint point;
-        mapper->MapCameraPointToDepthSpace( joint.Position, &point );
-
         // 手が開いている(パー)
         if ( handState == HandState::HandState_Open ){
             cv::circle( bodyImage, cv::Point( point.X, point.Y ), R, cv::Scalar( 0, 255, 255 ), R / 4 );
@@ -184,11 +340,244 @@ private:
             cv::circle( bodyImage, cv::Point( point.X, point.Y ), R, cv::Scalar( 255, 255, 0 ), R / 4 );
         }
     }
+
+    // 6人分の関節の変換にかかる時間を、関節ごとに変換する元の処理と比べる
+    void benchmarkJointProjection()
+    {
+        const int Count = 100;
+
+        // 1.5m-4mの範囲に6人が並んでいるような関節の位置
+        Joint testJoints[BODY_COUNT][JointType::JointType_Count];
+        cv::RNG rng;
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            for ( int j = 0; j < JointType::JointType_Count; ++j ){
+                testJoints[i][j].JointType = (JointType)j;
+                testJoints[i][j].TrackingState = TrackingState::TrackingState_Tracked;
+                testJoints[i][j].Position.X = (i - 2.5f) * 0.5f + rng.uniform( -0.3f, 0.3f );
+                testJoints[i][j].Position.Y = rng.uniform( -0.9f, 0.9f );
+                testJoints[i][j].Position.Z = 1.5f + (i * 0.5f);
+            }
+        }
+
+        // 関節ごとに座標変換インタフェースを取得して変換する(元の処理)
+        DepthSpacePoint expected[BODY_COUNT][JointType::JointType_Count];
+        auto begin = cv::getTickCount();
+        for ( int n = 0; n < Count; ++n ){
+            for ( int i = 0; i < BODY_COUNT; ++i ){
+                for ( int j = 0; j < JointType::JointType_Count; ++j ){
+                    ComPtr<ICoordinateMapper> mapper;
+                    ERROR_CHECK( kinect->get_CoordinateMapper( &mapper ) );
+                    mapper->MapCameraPointToDepthSpace( testJoints[i][j].Position, &expected[i][j] );
+                }
+            }
+        }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        std::cout << "関節ごと : " << time << "ms/フレーム" << std::endl;
+
+        // まとめて変換する
+        JointProjector projector;
+        projector.initialize( coordinateMapper );
+        begin = cv::getTickCount();
+        for ( int n = 0; n < Count; ++n ){
+            projector.clear();
+            for ( int i = 0; i < BODY_COUNT; ++i ){
+                projector.setJoints( i, testJoints[i] );
+            }
+            projector.project();
+        }
+        time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+
+        bool isMatched = true;
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            for ( int j = 0; j < JointType::JointType_Count; ++j ){
+                const auto& point = projector.getDepthPoint( i, j );
+                if ( (point.X != expected[i][j].X) || (point.Y != expected[i][j].Y) ){
+                    isMatched = false;
+                }
+            }
+        }
+
+        std::cout << "まとめて : " << time << "ms/フレーム" << (isMatched ? "" : " (結果が一致しません)") << std::endl;
+    }
+
+    // ぶれのある6人分の関節で、フィルターの品質と速度を計測する
+    void benchmarkJointFilter()
+    {
+        const int FrameCount = 300;
+        const TIMESPAN Interval = 333333;
+
+        // 1秒に1ラジアンで左右に動く関節に、1cmのぶれを加える
+        cv::RNG rng;
+        std::vector<float> truth( FrameCount );
+        std::vector<Joint> noisy( FrameCount * BODY_COUNT * JointType::JointType_Count );
+        for ( int f = 0; f < FrameCount; ++f ){
+            truth[f] = 0.1f * sinf( f / 30.0f );
+            for ( int i = 0; i < BODY_COUNT * JointType::JointType_Count; ++i ){
+                Joint& joint = noisy[(f * BODY_COUNT * JointType::JointType_Count) + i];
+                joint.JointType = (JointType)(i % JointType::JointType_Count);
+                joint.TrackingState = TrackingState::TrackingState_Tracked;
+                joint.Position.X = truth[f] + (float)rng.gaussian( 0.01 );
+                joint.Position.Y = (float)rng.gaussian( 0.01 );
+                joint.Position.Z = 2 + (float)rng.gaussian( 0.01 );
+            }
+        }
+
+        std::cout << "フィルター(6人、" << FrameCount << "フレーム) : 誤差のRMS, 処理時間" << std::endl;
+        for ( int method = JointFilter::Method_None; method <= JointFilter::Method_OneEuro; ++method ){
+            JointFilter filter;
+            filter.setMethod( (JointFilter::Method)method );
+
+            double squaredError = 0;
+            double time = 0;
+            std::vector<Joint> filtered( BODY_COUNT * JointType::JointType_Count );
+            std::vector<Joint> predicted( BODY_COUNT * JointType::JointType_Count );
+            for ( int f = 0; f < FrameCount; ++f ){
+                const Joint* frame = &noisy[f * filtered.size()];
+
+                auto begin = cv::getTickCount();
+                for ( int i = 0; i < BODY_COUNT; ++i ){
+                    int offset = i * JointType::JointType_Count;
+                    filter.apply( i, i + 1, f * Interval, frame + offset, &filtered[offset], &predicted[offset] );
+                }
+                time += (cv::getTickCount() - begin) * 1000000.0 / cv::getTickFrequency();
+
+                for ( const auto& joint : filtered ){
+                    squaredError += (joint.Position.X - truth[f]) * (joint.Position.X - truth[f]);
+                }
+            }
+
+            std::cout << JointFilter::methodName( filter.getMethod() ) << " : " << sqrt( squaredError / noisy.size() ) * 1000 << "mm, "
+                << time / FrameCount << "us/フレーム" << std::endl;
+        }
+    }
+
+    // 6人分の関節で、ジェスチャーの検出にかかる時間を計測する
+    void benchmarkGestures()
+    {
+        const int FrameCount = 300;
+        const TIMESPAN Interval = 333333;
+
+        GestureEngine engine;
+        try {
+            engine.load( GestureFileName );
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+            return;
+        }
+
+        // 6人が右手を左右に振り、ときどき握る
+        Joint frameJoints[BODY_COUNT][JointType::JointType_Count];
+        int detected = 0;
+        double time = 0;
+        for ( int f = 0; f < FrameCount; ++f ){
+            for ( int i = 0; i < BODY_COUNT; ++i ){
+                for ( int j = 0; j < JointType::JointType_Count; ++j ){
+                    Joint& joint = frameJoints[i][j];
+                    joint.JointType = (JointType)j;
+                    joint.TrackingState = TrackingState::TrackingState_Tracked;
+                    joint.Position.X = (i - 2.5f) * 0.5f;
+                    joint.Position.Y = 0;
+                    joint.Position.Z = 2;
+                }
+                frameJoints[i][JointType::JointType_HandRight].Position.X += 0.5f * sinf( (f + (i * 10)) / 5.0f );
+            }
+
+            HandState hand = ((f / 15) % 2) ? HandState::HandState_Closed : HandState::HandState_Open;
+
+            auto begin = cv::getTickCount();
+            engine.beginFrame();
+            for ( int i = 0; i < BODY_COUNT; ++i ){
+                engine.update( i, i + 1, f * Interval, frameJoints[i], hand, hand );
+            }
+            time += (cv::getTickCount() - begin) * 1000000.0 / cv::getTickFrequency();
+            detected += engine.getEvents().size();
+        }
+
+        std::cout << "ジェスチャー(" << engine.getGestures().size() << "個、6人) : "
+            << time / FrameCount << "us/フレーム、" << detected << "回検出" << std::endl;
+    }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
 };
 
-void main()
+// 記録した関節のファイルからジェスチャーを探して表示する(センサーは使わない)
+// ファイルにはセンサーから取得したままの関節があるので、表示中と同じように method のフィルターをかけてから探す
+void replayGestures( const char* gestureFileName, const char* jointFileName, JointFilter::Method method )
+{
+    GestureEngine engine;
+    engine.load( gestureFileName );
+
+    JointFilter filter;
+    filter.setMethod( method );
+    std::cout << "フィルター : " << JointFilter::methodName( method ) << std::endl;
+
+    JointStreamReader reader;
+    reader.open( jointFileName );
+
+    // 同じタイムスタンプの記録を1フレームとして処理する
+    JointStreamRecord record;
+    TIMESPAN frameTime = -1;
+    int frames = 0;
+    int detected = 0;
+    while ( reader.read( record ) ){
+        if ( record.relativeTime != frameTime ){
+            engine.beginFrame();
+            frameTime = record.relativeTime;
+            ++frames;
+        }
+
+        Joint filtered[JointType::JointType_Count];
+        Joint predicted[JointType::JointType_Count];
+        filter.apply( record.body, record.trackingId, record.relativeTime, record.joints, filtered, predicted );
+
+        engine.update( record.body, record.trackingId, record.relativeTime, filtered, record.handLeft, record.handRight );
+        for ( const auto& event : engine.getEvents() ){
+            if ( event.body == record.body ){
+                std::cout << event.relativeTime << " " << event.body << " : " << engine.getGestures()[event.gesture].name << std::endl;
+                ++detected;
+            }
+        }
+    }
+
+    std::cout << frames << "フレーム、" << detected << "個のジェスチャー" << std::endl;
+}
+
+// 引数に記録した関節のファイルを指定すると、そのファイルからジェスチャーを探します
+//   KinectV2.exe joints.txt [gestures.txt] [None|Holt|OneEuro]
+// フィルターは記録したときに選んでいたもの(既定は Holt)を指定してください
+void main( int argc, char* argv[] )
 {
     try {
+        if ( argc > 1 ){
+            JointFilter::Method method = JointFilter().getMethod();
+            if ( argc > 3 ){
+                int m = JointFilter::Method_None;
+                while ( (m <= JointFilter::Method_OneEuro) && (std::string( argv[3] ) != JointFilter::methodName( (JointFilter::Method)m )) ){
+                    ++m;
+                }
+                if ( m > JointFilter::Method_OneEuro ){
+                    throw std::runtime_error( std::string( "フィルターは None、Holt、OneEuro のどれかです : " ) + argv[3] );
+                }
+                method = (JointFilter::Method)m;
+            }
+
+            replayGestures( (argc > 2) ? argv[2] : "gestures.txt", argv[1], method );
+            return;
+        }
+
         KinectApp app;
         app.initialize();
         app.run();
@@ -0,0 +1,141 @@
+﻿#pragma once
+
+#include <vector>
+#include <string>
+#include <ostream>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// フレームの世代と、フレームから作るデータの依存関係を管理して、入力が変わったときだけ作り直す
+//
+// ストリーム(addStream)は、新しいフレームが届いて touch() を呼ぶたびに世代が1つ進みます。
+// RelativeTime が前と同じフレームは新しいフレームとは見なしません。
+//
+// 派生データ(addProduct)は、依存するストリームや他の派生データの世代を覚えておき、
+// needsUpdate() でどれかの世代が進んだか、パラメーター(表示モードなど)が変わったときだけ true を返します。
+// true を返すと派生データ自身の世代も進むので、それに依存する派生データも作り直されます。
+// 依存する派生データの needsUpdate() を先に呼んでください。
+class FrameCache
+{
+private:
+
+    struct Node
+    {
+        std::string name;
+        bool isProduct;
+
+        UINT64 generation;
+        TIMESPAN relativeTime;
+
+        // 依存するノードと、前に作ったときのそれらの世代
+        std::vector<int> inputs;
+        std::vector<UINT64> inputGenerations;
+        UINT64 parameter;
+
+        // 作り直した回数と、作り直しを省いた回数
+        UINT64 computed;
+        UINT64 skipped;
+    };
+
+    std::vector<Node> nodes;
+
+public:
+
+    // フレームが届くストリームを追加する
+    int addStream( const std::string& name )
+    {
+        return addNode( name, false, std::vector<int>() );
+    }
+
+    // inputs (先に追加したストリームや派生データ) から作るデータを追加する
+    int addProduct( const std::string& name, const std::vector<int>& inputs )
+    {
+        for ( auto input : inputs ){
+            if ( (input < 0) || ((int)nodes.size() <= input) ){
+                throw std::runtime_error( "依存するデータは先に追加してください : " + name );
+            }
+        }
+
+        return addNode( name, true, inputs );
+    }
+
+    // ストリームに新しいフレームが届いた(同じ時刻のフレームならfalse)
+    bool touch( int stream, TIMESPAN relativeTime )
+    {
+        Node& node = nodes[stream];
+        if ( (node.generation != 0) && (node.relativeTime == relativeTime) ){
+            ++node.skipped;
+            return false;
+        }
+
+        node.relativeTime = relativeTime;
+        ++node.generation;
+        ++node.computed;
+        return true;
+    }
+
+    UINT64 getGeneration( int node ) const
+    {
+        return nodes[node].generation;
+    }
+
+    // 派生データを作り直す必要があればtrueを返す(作り直したものとして世代を進める)
+    bool needsUpdate( int product, UINT64 parameter = 0 )
+    {
+        Node& node = nodes[product];
+
+        bool isDirty = (node.computed == 0) || (node.parameter != parameter);
+        for ( size_t i = 0; i < node.inputs.size(); ++i ){
+            UINT64 generation = nodes[node.inputs[i]].generation;
+            if ( node.inputGenerations[i] != generation ){
+                node.inputGenerations[i] = generation;
+                isDirty = true;
+            }
+        }
+
+        if ( !isDirty ){
+            ++node.skipped;
+            return false;
+        }
+
+        node.parameter = parameter;
+        ++node.generation;
+        ++node.computed;
+        return true;
+    }
+
+    // ストリームは届いたフレーム数と同じ時刻で捨てたフレーム数、
+    // 派生データは作り直した回数と省いた回数を表示する
+    void print( std::ostream& out ) const
+    {
+        for ( const auto& node : nodes ){
+            UINT64 total = node.computed + node.skipped;
+            out << node.name << " : " << (node.isProduct ? "作り直し " : "フレーム ") << node.computed
+                << ", " << (node.isProduct ? "省略 " : "重複 ") << node.skipped;
+            if ( node.isProduct && (total > 0) ){
+                out << " (" << (node.skipped * 100.0 / total) << "%を省略)";
+            }
+            out << std::endl;
+        }
+    }
+
+private:
+
+    int addNode( const std::string& name, bool isProduct, const std::vector<int>& inputs )
+    {
+        Node node;
+        node.name = name;
+        node.isProduct = isProduct;
+        node.generation = 0;
+        node.relativeTime = 0;
+        node.inputs = inputs;
+        node.inputGenerations.assign( inputs.size(), 0 );
+        node.parameter = 0;
+        node.computed = 0;
+        node.skipped = 0;
+
+        nodes.push_back( node );
+        return (int)nodes.size() - 1;
+    }
+};
@@ -0,0 +1,344 @@
+﻿#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <Windows.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// 赤外線画像(UINT16)を、見やすい明るさの0-255のグレーデータに変換する
+//
+// 1. 範囲 : 前のフレームのヒストグラムから、暗い方と明るい方の lowPercent、highPercent を
+//           外した範囲を求め、少しずつ追いかけます(急に明るさが変わらないように)。
+// 2. 正規化 : 範囲を 0-4095 の12ビットの値にします(固定小数点の乗算とシフト)。
+// 3. 曲線 : 12ビットの値を、ガンマまたは対数の表(4096バイト)で0-255にします。
+//           表は範囲に関係しないので、曲線を変えたときだけ作り直します。
+//
+// ヒストグラムは変換と同じ1回の走査で作り、次のフレームの範囲に使います。
+// SSE2の実装は8画素ずつ正規化までをまとめて計算し、スカラーの実装と完全に一致します。
+class InfraredToneMapper
+{
+public:
+
+    enum Curve
+    {
+        Curve_Gamma,
+        Curve_Log,
+    };
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSE2,
+    };
+
+private:
+
+    static const int IndexBits = 12;
+    static const int TableSize = 1 << IndexBits;
+    static const int BinShift = 6;
+    static const int BinCount = 65536 >> BinShift;
+
+    // 範囲の幅の最小値(ほとんど真っ暗なときにノイズを強調しすぎないように)
+    static const int MinSpan = 257;
+
+    Path path;
+
+    Curve curve = Curve_Gamma;
+    float curveParameter = 0.5f;
+
+    BYTE table[TableSize];
+
+    // 依存関係で遅くならないように、隣り合う画素は別のヒストグラムに数える
+    std::vector<UINT32> histograms;
+    std::vector<UINT32> histogram;
+    bool hasHistogram = false;
+
+    float lowPercent = 0.5f;
+    float highPercent = 0.5f;
+    float adaptation = 0.125f;
+
+    // 今の範囲
+    float low = 0;
+    float high = 65535;
+
+public:
+
+    InfraredToneMapper()
+        : histograms( BinCount * 4 )
+        , histogram( BinCount )
+    {
+        path = fastestPath();
+        setCurve( curve, curveParameter );
+    }
+
+    // 曲線を設定する(Curve_Gamma ならガンマ値、Curve_Log なら強さ)
+    void setCurve( Curve newCurve, float parameter )
+    {
+        if ( parameter <= 0 ){
+            throw std::runtime_error( "曲線のパラメーターは0より大きくしてください" );
+        }
+
+        curve = newCurve;
+        curveParameter = parameter;
+
+        for ( int i = 0; i < TableSize; ++i ){
+            float t = (float)i / (TableSize - 1);
+            float y = (curve == Curve_Gamma) ? powf( t, parameter ) : (logf( 1 + (parameter * t) ) / logf( 1 + parameter ));
+            table[i] = (BYTE)((y * 255) + 0.5f);
+        }
+    }
+
+    Curve getCurve() const
+    {
+        return curve;
+    }
+
+    float getCurveParameter() const
+    {
+        return curveParameter;
+    }
+
+    static const char* curveName( Curve curve )
+    {
+        return (curve == Curve_Log) ? "Log" : "Gamma";
+    }
+
+    // 範囲の外にする暗い方、明るい方の割合(%)と、1フレームで範囲を追いかける割合
+    void setAutoRange( float newLowPercent, float newHighPercent, float newAdaptation )
+    {
+        lowPercent = newLowPercent;
+        highPercent = newHighPercent;
+        adaptation = newAdaptation;
+    }
+
+    float getLow() const
+    {
+        return low;
+    }
+
+    float getHigh() const
+    {
+        return high;
+    }
+
+    // 前のフレームを忘れる(次のフレームで範囲を求め直す)
+    void reset()
+    {
+        hasHistogram = false;
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        return (path == Path_SSE2) ? "SSE2" : "Scalar";
+    }
+
+    static bool isSupported( Path path )
+    {
+        switch ( path ){
+        case Path_Scalar:
+            return true;
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Path fastestPath()
+    {
+        return isSupported( Path_SSE2 ) ? Path_SSE2 : Path_Scalar;
+    }
+
+    // count 個の赤外線データを変換し、次のフレームのためのヒストグラムを作る
+    void map( const UINT16* src, BYTE* dst, int count )
+    {
+        // 最初のフレームは、先にヒストグラムだけ作って範囲を決める
+        if ( !hasHistogram ){
+            clearHistograms();
+            countScalar( src, count );
+            updateRange( 1.0f );
+        }
+
+        clearHistograms();
+
+        // 範囲を固定小数点にする
+        int lowValue = (int)(low + 0.5f);
+        int span = (int)(high + 0.5f) - lowValue;
+        if ( span < MinSpan ){
+            span = MinSpan;
+        }
+        UINT32 scale = (1u << (IndexBits * 2)) / span;
+        if ( scale > 0xFFFF ){
+            scale = 0xFFFF;
+        }
+
+        int done = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+        if ( path == Path_SSE2 ){
+            done = mapSSE2( src, dst, count, (UINT16)lowValue, (UINT16)span, (UINT16)scale );
+        }
+#endif
+
+        // 端数はスカラーで処理する
+        mapScalar( src + done, dst + done, count - done, (UINT16)lowValue, (UINT16)span, (UINT16)scale, done );
+
+        updateRange( hasHistogram ? adaptation : 1.0f );
+    }
+
+private:
+
+    void clearHistograms()
+    {
+        std::fill( histograms.begin(), histograms.end(), 0 );
+    }
+
+    void countScalar( const UINT16* src, int count )
+    {
+        for ( int i = 0; i < count; ++i ){
+            ++histograms[((i & 3) * BinCount) + (src[i] >> BinShift)];
+        }
+    }
+
+    // ヒストグラムから範囲を求め、rate の割合だけ近づける
+    void updateRange( float rate )
+    {
+        UINT64 total = 0;
+        for ( int i = 0; i < BinCount; ++i ){
+            histogram[i] = histograms[i] + histograms[i + BinCount] + histograms[i + (BinCount * 2)] + histograms[i + (BinCount * 3)];
+            total += histogram[i];
+        }
+
+        if ( total == 0 ){
+            return;
+        }
+
+        UINT64 lowCount = (UINT64)(total * lowPercent / 100);
+        UINT64 highCount = (UINT64)(total * highPercent / 100);
+
+        // 暗い方から数えて lowCount を超えたビンの下端、明るい方から数えて highCount を超えたビンの上端
+        int lowBin = 0;
+        UINT64 sum = 0;
+        for ( ; lowBin < BinCount - 1; ++lowBin ){
+            sum += histogram[lowBin];
+            if ( sum > lowCount ){
+                break;
+            }
+        }
+
+        int highBin = BinCount - 1;
+        sum = 0;
+        for ( ; highBin > lowBin; --highBin ){
+            sum += histogram[highBin];
+            if ( sum > highCount ){
+                break;
+            }
+        }
+
+        float targetLow = (float)(lowBin << BinShift);
+        float targetHigh = (float)(((highBin + 1) << BinShift) - 1);
+
+        low += (targetLow - low) * rate;
+        high += (targetHigh - high) * rate;
+        hasHistogram = true;
+    }
+
+    // offset は src の先頭の画素番号(ヒストグラムを分けるため)
+    void mapScalar( const UINT16* src, BYTE* dst, int count, UINT16 lowValue, UINT16 span, UINT16 scale, int offset )
+    {
+        for ( int i = 0; i < count; ++i ){
+            UINT16 value = src[i];
+            ++histograms[(((i + offset) & 3) * BinCount) + (value >> BinShift)];
+
+            UINT32 d = (value > lowValue) ? (value - lowValue) : 0;
+            if ( d > span ){
+                d = span;
+            }
+
+            UINT32 index = (d * scale) >> IndexBits;
+            if ( index > TableSize - 1 ){
+                index = TableSize - 1;
+            }
+
+            dst[i] = table[index];
+        }
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    int mapSSE2( const UINT16* src, BYTE* dst, int count, UINT16 lowValue, UINT16 span, UINT16 scale )
+    {
+        const __m128i lowVector = _mm_set1_epi16( (short)lowValue );
+        const __m128i spanVector = _mm_set1_epi16( (short)span );
+        const __m128i scaleVector = _mm_set1_epi16( (short)scale );
+        const __m128i maxIndex = _mm_set1_epi16( TableSize - 1 );
+
+        UINT32* h0 = &histograms[0];
+        UINT32* h1 = h0 + BinCount;
+        UINT32* h2 = h1 + BinCount;
+        UINT32* h3 = h2 + BinCount;
+
+        int i = 0;
+        for ( ; i + 8 <= count; i += 8 ){
+            __m128i value = _mm_loadu_si128( (const __m128i*)(src + i) );
+
+            // min( max( value - low, 0 ), span ) (符号なしの min は a - subs( a, b ))
+            __m128i d = _mm_subs_epu16( value, lowVector );
+            d = _mm_sub_epi16( d, _mm_subs_epu16( d, spanVector ) );
+
+            // (d * scale) >> 12 は最大4096なので、32ビットの積の上位と下位から16ビットで取り出せる
+            __m128i productLow = _mm_mullo_epi16( d, scaleVector );
+            __m128i productHigh = _mm_mulhi_epu16( d, scaleVector );
+            __m128i index = _mm_or_si128( _mm_slli_epi16( productHigh, 16 - IndexBits ), _mm_srli_epi16( productLow, IndexBits ) );
+            index = _mm_sub_epi16( index, _mm_subs_epu16( index, maxIndex ) );
+
+            __m128i bin = _mm_srli_epi16( value, BinShift );
+
+            // 表を引く処理とヒストグラムはスカラーで行う
+            dst[i + 0] = table[_mm_extract_epi16( index, 0 )];
+            dst[i + 1] = table[_mm_extract_epi16( index, 1 )];
+            dst[i + 2] = table[_mm_extract_epi16( index, 2 )];
+            dst[i + 3] = table[_mm_extract_epi16( index, 3 )];
+            dst[i + 4] = table[_mm_extract_epi16( index, 4 )];
+            dst[i + 5] = table[_mm_extract_epi16( index, 5 )];
+            dst[i + 6] = table[_mm_extract_epi16( index, 6 )];
+            dst[i + 7] = table[_mm_extract_epi16( index, 7 )];
+
+            ++h0[_mm_extract_epi16( bin, 0 )];
+            ++h1[_mm_extract_epi16( bin, 1 )];
+            ++h2[_mm_extract_epi16( bin, 2 )];
+            ++h3[_mm_extract_epi16( bin, 3 )];
+            ++h0[_mm_extract_epi16( bin, 4 )];
+            ++h1[_mm_extract_epi16( bin, 5 )];
+            ++h2[_mm_extract_epi16( bin, 6 )];
+            ++h3[_mm_extract_epi16( bin, 7 )];
+        }
+
+        return i;
+    }
+
+#endif
+};
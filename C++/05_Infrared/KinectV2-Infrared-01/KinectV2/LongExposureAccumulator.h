@@ -0,0 +1,262 @@
+﻿#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <Windows.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// 連続した赤外線画像を足し合わせて、暗い場所でもノイズの少ない画像を作る(長時間露光)
+//
+// 直近 window フレームの和を画素ごとにUINT32で持ち、新しいフレームを足して
+// window フレーム前のフレームを引くので、1フレームの処理は window に関係なく一定です。
+// 直近のフレームは面のリングに持ち、最初は0で埋めておくので、たまるまでも同じ処理になります。
+//
+// 出力は和を shift ビット右シフトしてUINT16に収めたもので、足し合わせと同じ1回の走査で作ります。
+// shift は前のフレームの和の最大値が収まるように選ぶので、暗いときは足した分の精度がそのまま残ります。
+// SIMDの実装はスカラーの実装と完全に一致します。
+class LongExposureAccumulator
+{
+public:
+
+    enum Path
+    {
+        Path_Scalar,
+        Path_SSE2,
+    };
+
+    static const int MaxWindow = 64;
+
+private:
+
+    int count = 0;
+    int window = 8;
+
+    Path path;
+
+    // 和と、直近 window フレームのリング
+    std::vector<UINT32> sum;
+    std::vector<UINT16> ring;
+    int head = 0;
+    int frames = 0;
+
+    // 出力のシフト量と、今のフレームの和の最大値
+    int shift = 0;
+    UINT32 maxSum = 0;
+
+public:
+
+    LongExposureAccumulator( int pixelCount = 0 )
+    {
+        path = fastestPath();
+        initialize( pixelCount );
+    }
+
+    void initialize( int pixelCount )
+    {
+        count = pixelCount;
+        sum.resize( count );
+        ring.resize( count * window );
+        reset();
+    }
+
+    // 足し合わせるフレーム数を設定する(今までのフレームは忘れる)
+    void setWindow( int newWindow )
+    {
+        if ( (newWindow < 1) || (MaxWindow < newWindow) ){
+            throw std::runtime_error( "足し合わせるフレーム数が範囲外です" );
+        }
+
+        window = newWindow;
+        ring.resize( count * window );
+        reset();
+    }
+
+    int getWindow() const
+    {
+        return window;
+    }
+
+    // 今の和に入っているフレーム数
+    int getFrameCount() const
+    {
+        return frames;
+    }
+
+    int getShift() const
+    {
+        return shift;
+    }
+
+    // 今までのフレームを忘れる
+    void reset()
+    {
+        std::fill( sum.begin(), sum.end(), 0 );
+        std::fill( ring.begin(), ring.end(), 0 );
+        head = 0;
+        frames = 0;
+        shift = 0;
+        maxSum = 0;
+    }
+
+    // 変換に使う実装を切り替える(ベンチマーク用)
+    void setPath( Path newPath )
+    {
+        if ( !isSupported( newPath ) ){
+            throw std::runtime_error( "このCPUでは使えない実装です" );
+        }
+
+        path = newPath;
+    }
+
+    Path getPath() const
+    {
+        return path;
+    }
+
+    static const char* pathName( Path path )
+    {
+        return (path == Path_SSE2) ? "SSE2" : "Scalar";
+    }
+
+    static bool isSupported( Path path )
+    {
+        switch ( path ){
+        case Path_Scalar:
+            return true;
+#if defined(_M_IX86) || defined(_M_X64)
+        case Path_SSE2:
+            return true;
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Path fastestPath()
+    {
+        return isSupported( Path_SSE2 ) ? Path_SSE2 : Path_Scalar;
+    }
+
+    // src を足し合わせ、和を dst に出力する
+    void add( const UINT16* src, UINT16* dst )
+    {
+        // 一番古いフレームの面に新しいフレームを上書きする
+        UINT16* oldest = &ring[head * count];
+        maxSum = 0;
+
+        int done = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+        if ( path == Path_SSE2 ){
+            done = addSSE2( src, oldest, dst, count );
+        }
+#endif
+
+        // 端数はスカラーで処理する
+        addScalar( src + done, oldest + done, dst + done, count - done, done );
+
+        head = (head + 1) % window;
+        if ( frames < window ){
+            ++frames;
+        }
+
+        // 次のフレームは、今の最大値が16ビットに収まるシフト量で出力する
+        shift = 0;
+        while ( (maxSum >> shift) > 0xFFFF ){
+            ++shift;
+        }
+    }
+
+private:
+
+    // offset は src の先頭の画素番号
+    void addScalar( const UINT16* src, UINT16* oldest, UINT16* dst, int n, int offset )
+    {
+        UINT32* s = &sum[offset];
+        UINT32 m = maxSum;
+
+        for ( int i = 0; i < n; ++i ){
+            UINT32 value = s[i] + src[i] - oldest[i];
+            s[i] = value;
+            oldest[i] = src[i];
+
+            if ( value > m ){
+                m = value;
+            }
+
+            value >>= shift;
+            dst[i] = (UINT16)((value > 0xFFFF) ? 0xFFFF : value);
+        }
+
+        maxSum = m;
+    }
+
+#if defined(_M_IX86) || defined(_M_X64)
+
+    // 和は 65535 * MaxWindow より小さいので、32ビットの符号付きの比較が使える
+    static __m128i max32( __m128i a, __m128i b )
+    {
+        __m128i greater = _mm_cmpgt_epi32( a, b );
+        return _mm_or_si128( _mm_and_si128( greater, a ), _mm_andnot_si128( greater, b ) );
+    }
+
+    // 0-65535 に飽和させてから、符号を反転させた値で packs して戻す
+    static __m128i pack32( __m128i lo, __m128i hi, __m128i shiftCount )
+    {
+        const __m128i maxValue = _mm_set1_epi32( 0xFFFF );
+        const __m128i bias32 = _mm_set1_epi32( 0x8000 );
+        const __m128i bias16 = _mm_set1_epi16( (short)0x8000 );
+
+        lo = _mm_srl_epi32( lo, shiftCount );
+        hi = _mm_srl_epi32( hi, shiftCount );
+
+        __m128i loOver = _mm_cmpgt_epi32( lo, maxValue );
+        __m128i hiOver = _mm_cmpgt_epi32( hi, maxValue );
+        lo = _mm_or_si128( _mm_andnot_si128( loOver, lo ), _mm_and_si128( loOver, maxValue ) );
+        hi = _mm_or_si128( _mm_andnot_si128( hiOver, hi ), _mm_and_si128( hiOver, maxValue ) );
+
+        __m128i packed = _mm_packs_epi32( _mm_sub_epi32( lo, bias32 ), _mm_sub_epi32( hi, bias32 ) );
+        return _mm_xor_si128( packed, bias16 );
+    }
+
+    // 8画素ずつ処理し、処理した画素数を返す
+    int addSSE2( const UINT16* src, UINT16* oldest, UINT16* dst, int n )
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i shiftCount = _mm_cvtsi32_si128( shift );
+        UINT32* s = &sum[0];
+        __m128i m = zero;
+
+        int i = 0;
+        for ( ; i + 8 <= n; i += 8 ){
+            __m128i value = _mm_loadu_si128( (const __m128i*)(src + i) );
+            __m128i old = _mm_loadu_si128( (const __m128i*)(oldest + i) );
+            _mm_storeu_si128( (__m128i*)(oldest + i), value );
+
+            // 和 + 新しい値 - 古い値
+            __m128i lo = _mm_loadu_si128( (const __m128i*)(s + i) );
+            __m128i hi = _mm_loadu_si128( (const __m128i*)(s + i + 4) );
+            lo = _mm_sub_epi32( _mm_add_epi32( lo, _mm_unpacklo_epi16( value, zero ) ), _mm_unpacklo_epi16( old, zero ) );
+            hi = _mm_sub_epi32( _mm_add_epi32( hi, _mm_unpackhi_epi16( value, zero ) ), _mm_unpackhi_epi16( old, zero ) );
+            _mm_storeu_si128( (__m128i*)(s + i), lo );
+            _mm_storeu_si128( (__m128i*)(s + i + 4), hi );
+
+            m = max32( m, max32( lo, hi ) );
+
+            _mm_storeu_si128( (__m128i*)(dst + i), pack32( lo, hi, shiftCount ) );
+        }
+
+        // 4レーンの最大値をまとめる
+        m = max32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+        m = max32( m, _mm_shuffle_epi32( m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+        maxSum = (UINT32)_mm_cvtsi128_si32( m );
+
+        return i;
+    }
+
+#endif
+};
@@ -1,5 +1,6 @@
 ﻿#include <iostream>
 #include <sstream>
+#include <memory>
 
 #include <Kinect.h>
 #include <opencv2\opencv.hpp>
@@ -8,6 +9,13 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "InfraredToneMapper.h"
+#include "LongExposureAccumulator.h"
+#include "KinectFrameSource.h"
+#include "ReplayFrameSource.h"
+#include "StageProfiler.h"
+#include "FrameCache.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -22,55 +30,122 @@ class KinectApp
 {
 private:
 
-    IKinectSensor* kinect = nullptr;
-    IInfraredFrameReader* infraredFrameReader = nullptr;
+    // フレームの取得元(Kinectまたは記録したファイル)
+    std::unique_ptr<FrameSource> source;
+
+    // フレームの記録
+    FrameFileWriter recorder;
+    const char* RecordFileName = "infrared.kfrm";
+
     std::vector<UINT16> infraredBuffer;
 
     int infraredWidth;
     int infraredHeight;
 
-public:
+    // 赤外線画像を見やすい明るさの0-255にする
+    InfraredToneMapper toneMapper;
+    bool isToneMappingEnabled = true;
 
-    // 初期化
-    void initialize()
-    {
-        // デフォルトのKinectを取得する
-        ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
+    // 長時間露光(直近のフレームを足し合わせた画像)
+    LongExposureAccumulator accumulator;
+    std::vector<UINT16> exposureBuffer;
+    bool isLongExposureEnabled = false;
+
+    // 0-255にした表示用の画像
+    cv::Mat toneMappedImage;
 
-        // Kinectを開く
-        ERROR_CHECK( kinect->Open() );
+    // 新しいフレームが届いたか、表示の設定が変わったときだけ表示する画像を作り直す
+    // (階調の変換のヒストグラムも、同じフレームで何度も更新しない)
+    FrameCache cache;
+    int infraredStream;
+    int displayProduct;
+    UINT64 displaySettings = 0;
 
-        BOOLEAN isOpen = false;
-        ERROR_CHECK( kinect->get_IsOpen( &isOpen ) );
-        if ( !isOpen ){
-            throw std::runtime_error("Kinectが開けません");
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
+public:
+
+    // 初期化(replayFileNameを指定すると、Kinectの代わりに記録したファイルを再生する)
+    void initialize( const char* replayFileName = nullptr )
+    {
+        if ( replayFileName == nullptr ){
+            // デフォルトのKinectを開く
+            source.reset( new KinectFrameSource() );
+        }
+        else {
+            // 記録したファイルを開く
+            source.reset( new ReplayFrameSource( replayFileName ) );
         }
 
-        // 赤外線画像リーダーを取得する
-        ComPtr<IInfraredFrameSource> infraredFrameSource;
-        ERROR_CHECK( kinect->get_InfraredFrameSource( &infraredFrameSource ) );
-        ERROR_CHECK( infraredFrameSource->OpenReader( &infraredFrameReader ) );
+        // 赤外線画像のストリームを開く
+        source->open( FrameStream_Infrared );
 
         // 赤外線画像のサイズを取得する
-        ComPtr<IFrameDescription> infraredFrameDescription;
-        ERROR_CHECK( infraredFrameSource->get_FrameDescription( &infraredFrameDescription ) );
-        ERROR_CHECK( infraredFrameDescription->get_Width( &infraredWidth ) );
-        ERROR_CHECK( infraredFrameDescription->get_Height( &infraredHeight ) );
+        FrameFormat infraredFormat = source->getFormat( FrameStream_Infrared );
+        infraredWidth = infraredFormat.width;
+        infraredHeight = infraredFormat.height;
 
         // バッファーを作成する
         infraredBuffer.resize( infraredWidth * infraredHeight );
+        exposureBuffer.resize( infraredWidth * infraredHeight );
+        toneMappedImage.create( infraredHeight, infraredWidth, CV_8UC1 );
+        accumulator.initialize( infraredWidth * infraredHeight );
+
+        infraredStream = cache.addStream( "Infrared" );
+        displayProduct = cache.addProduct( "表示する画像", { infraredStream } );
+
+        std::cout << "階調の変換 : " << InfraredToneMapper::pathName( toneMapper.getPath() ) << std::endl;
     }
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         while ( 1 ) {
+            // フレームが届くまで待つ(届かなくてもキーを受け付けるように、100msで戻る)
+            source->waitForFrame( 100 );
             update();
             draw();
 
-            auto key = cv::waitKey( 10 );
+            auto key = cv::waitKey( 1 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
+            else if ( key == 't' ){
+                isToneMappingEnabled = !isToneMappingEnabled;
+                toneMapper.reset();
+                ++displaySettings;
+            }
+            else if ( key == 'c' ){
+                toggleCurve();
+            }
+            else if ( key == 'l' ){
+                isLongExposureEnabled = !isLongExposureEnabled;
+                accumulator.reset();
+                toneMapper.reset();
+                ++displaySettings;
+            }
+            else if ( key == '+' ){
+                changeWindow( accumulator.getWindow() * 2 );
+            }
+            else if ( key == '-' ){
+                changeWindow( accumulator.getWindow() / 2 );
+            }
+            else if ( key == 'b' ){
+                benchmarkToneMapper();
+                benchmarkAccumulator();
+            }
+            else if ( key == 'r' ){
+                toggleRecording();
+            }
+            else if ( key == 's' ){
+                cache.print( std::cout );
+            }
         }
     }
 
@@ -79,36 +154,245 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
         updateInfrared();
     }
 
     void updateInfrared()
     {
-        // フレームを取得する
-        ComPtr<IInfraredFrame> infraredFrame;
-        auto ret = infraredFrameReader->AcquireLatestFrame( &infraredFrame );
-        if ( ret == S_OK ){
-            // BGRAの形式でデータを取得する
-            ERROR_CHECK( infraredFrame->CopyFrameDataToArray( infraredBuffer.size(), &infraredBuffer[0] ) );
+        STAGE_TIMER( profiler, "updateInfrared" );
+
+        // 赤外線フレームのデータを取得する
+        TIMESPAN relativeTime = 0;
+        UINT size = (UINT)(infraredBuffer.size() * sizeof( UINT16 ));
+        {
+            STAGE_TIMER( profiler, "acquireLatestFrame" );
+            if ( !source->acquireLatestFrame( FrameStream_Infrared, &infraredBuffer[0], size, &relativeTime ) ){
+                return;
+            }
+        }
+        cache.touch( infraredStream, relativeTime );
+
+        // 記録中ならファイルに書き込む
+        if ( recorder.isOpen() ){
+            recorder.write( FrameStream_Infrared, relativeTime, &infraredBuffer[0], size );
+        }
+
+        // 長時間露光なら、新しいフレームが来たときだけ足し合わせる
+        if ( isLongExposureEnabled ){
+            STAGE_TIMER( profiler, "LongExposureAccumulator" );
+            accumulator.add( &infraredBuffer[0], &exposureBuffer[0] );
+        }
+    }
+
+    // 記録の開始・終了を切り替える
+    void toggleRecording()
+    {
+        if ( recorder.isOpen() ){
+            recorder.close();
+            std::cout << "記録を終了しました : " << RecordFileName << std::endl;
+
+            auto statistics = recorder.getStatistics();
+            std::cout << "記録したフレーム : " << statistics.written << ", 捨てたフレーム : " << statistics.dropped
+                << ", 空きを待った回数 : " << statistics.waited << " (" << statistics.waitedTime << "ms)"
+                << ", 圧縮率 : " << ((statistics.rawBytes > 0) ? ((double)statistics.storedBytes / statistics.rawBytes) : 1.0) << std::endl;
+            if ( !recorder.getError().empty() ){
+                std::cout << recorder.getError() << std::endl;
+            }
+        }
+        else {
+            recorder.open( RecordFileName, *source );
+            std::cout << "記録を開始しました : " << RecordFileName << std::endl;
+        }
+    }
+
+    // 足し合わせるフレーム数を変える
+    void changeWindow( int window )
+    {
+        if ( (window < 1) || (LongExposureAccumulator::MaxWindow < window) ){
+            return;
+        }
+
+        accumulator.setWindow( window );
+        toneMapper.reset();
+        ++displaySettings;
+        std::cout << "長時間露光 : " << window << "フレーム" << std::endl;
+    }
 
-            // フレームを解放する
-            // infraredFrame->Release();
+    // 曲線を ガンマ0.5 → ガンマ0.3 → 対数 の順に切り替える
+    void toggleCurve()
+    {
+        if ( toneMapper.getCurve() == InfraredToneMapper::Curve_Log ){
+            toneMapper.setCurve( InfraredToneMapper::Curve_Gamma, 0.5f );
+        }
+        else if ( toneMapper.getCurveParameter() > 0.4f ){
+            toneMapper.setCurve( InfraredToneMapper::Curve_Gamma, 0.3f );
         }
+        else {
+            toneMapper.setCurve( InfraredToneMapper::Curve_Log, 100.0f );
+        }
+        ++displaySettings;
+
+        std::cout << "曲線 : " << InfraredToneMapper::curveName( toneMapper.getCurve() )
+            << " " << toneMapper.getCurveParameter() << std::endl;
     }
 
     void draw()
     {
-        // カラーデータを表示する
-        cv::Mat colorImage( infraredHeight, infraredWidth, CV_16UC1, &infraredBuffer[0] );
-        cv::imshow( "Infrared Image", colorImage );
+        STAGE_TIMER( profiler, "draw" );
+
+        // 前に表示したときから変わっていなければ、変換も imshow もしない(ウィンドウは前の画像のまま)
+        if ( !cache.needsUpdate( displayProduct, displaySettings ) ){
+            return;
+        }
+
+        // 長時間露光なら、足し合わせた画像を通常と同じように表示する
+        UINT16* buffer = isLongExposureEnabled ? &exposureBuffer[0] : &infraredBuffer[0];
+
+        if ( !isToneMappingEnabled ){
+            // 赤外線データをそのまま表示する
+            cv::Mat infraredImage( infraredHeight, infraredWidth, CV_16UC1, buffer );
+            STAGE_TIMER( profiler, "imshow" );
+            cv::imshow( "Infrared Image", infraredImage );
+            return;
+        }
+
+        // 前のフレームから求めた範囲で0-255にして表示する
+        {
+            STAGE_TIMER( profiler, "InfraredToneMapper" );
+            toneMapper.map( buffer, toneMappedImage.data, toneMappedImage.total() );
+        }
+
+        std::stringstream ss;
+        ss << (int)toneMapper.getLow() << " - " << (int)toneMapper.getHigh();
+        if ( isLongExposureEnabled ){
+            ss << " (" << accumulator.getFrameCount() << "/" << accumulator.getWindow() << "フレーム)";
+        }
+        cv::putText( toneMappedImage, ss.str(), cv::Point( 10, infraredHeight - 10 ), 0, 0.5, cv::Scalar( 255 ) );
+
+        STAGE_TIMER( profiler, "imshow" );
+        cv::imshow( "Infrared Image", toneMappedImage );
+    }
+
+    // 階調の変換の速度を計測する
+    void benchmarkToneMapper()
+    {
+        const int Count = 100;
+
+        // 暗い部屋を想定した赤外線データ(ほとんどが0-3000で、1%だけ反射の強い画素)
+        std::vector<UINT16> src( infraredWidth * infraredHeight );
+        cv::Mat srcImage( infraredHeight, infraredWidth, CV_16UC1, &src[0] );
+        cv::randu( srcImage, 0, 3000 );
+        for ( size_t i = 0; i < src.size(); i += 100 ){
+            src[i] = 60000;
+        }
+
+        std::vector<BYTE> expected( src.size() );
+        std::vector<BYTE> actual( src.size() );
+
+        // OpenCVで最小値、最大値から8ビットにする(比較用)
+        cv::Mat normalized;
+        auto begin = cv::getTickCount();
+        for ( int i = 0; i < Count; ++i ){
+            cv::normalize( srcImage, normalized, 0, 255, cv::NORM_MINMAX, CV_8UC1 );
+        }
+        auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+        std::cout << "cv::normalize : " << time << "ms" << std::endl;
+
+        for ( int path = InfraredToneMapper::Path_Scalar; path <= InfraredToneMapper::Path_SSE2; ++path ){
+            if ( !InfraredToneMapper::isSupported( (InfraredToneMapper::Path)path ) ){
+                continue;
+            }
+
+            InfraredToneMapper mapper;
+            mapper.setPath( (InfraredToneMapper::Path)path );
+
+            begin = cv::getTickCount();
+            for ( int i = 0; i < Count; ++i ){
+                mapper.map( &src[0], &actual[0], src.size() );
+            }
+            time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+
+            // 最初の結果を基準にして、実装の結果が一致するか確認する
+            bool isMatched = true;
+            if ( path == InfraredToneMapper::Path_Scalar ){
+                expected = actual;
+            }
+            else {
+                isMatched = (actual == expected);
+            }
+
+            std::cout << InfraredToneMapper::pathName( mapper.getPath() ) << " : " << time << "ms"
+                << (isMatched ? "" : " (結果が一致しません)") << std::endl;
+        }
+    }
+
+    // 長時間露光の足し合わせの速度を、フレーム数ごとに計測する(フレーム数に関係なく一定になる)
+    void benchmarkAccumulator()
+    {
+        const int Count = 100;
+
+        std::vector<UINT16> src( infraredWidth * infraredHeight );
+        cv::randu( cv::Mat( infraredHeight, infraredWidth, CV_16UC1, &src[0] ), 0, 3000 );
+
+        std::vector<UINT16> expected( src.size() );
+        std::vector<UINT16> actual( src.size() );
+
+        for ( int window = 1; window <= LongExposureAccumulator::MaxWindow; window *= 4 ){
+            std::cout << "長時間露光 " << window << "フレーム";
+
+            for ( int path = LongExposureAccumulator::Path_Scalar; path <= LongExposureAccumulator::Path_SSE2; ++path ){
+                if ( !LongExposureAccumulator::isSupported( (LongExposureAccumulator::Path)path ) ){
+                    continue;
+                }
+
+                LongExposureAccumulator accumulator( src.size() );
+                accumulator.setPath( (LongExposureAccumulator::Path)path );
+                accumulator.setWindow( window );
+
+                auto begin = cv::getTickCount();
+                for ( int i = 0; i < Count; ++i ){
+                    accumulator.add( &src[0], &actual[0] );
+                }
+                auto time = (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency() / Count;
+
+                bool isMatched = true;
+                if ( path == LongExposureAccumulator::Path_Scalar ){
+                    expected = actual;
+                }
+                else {
+                    isMatched = (actual == expected);
+                }
+
+                std::cout << ", " << LongExposureAccumulator::pathName( accumulator.getPath() ) << " : " << time << "ms"
+                    << (isMatched ? "" : " (結果が一致しません)");
+            }
+
+            std::cout << std::endl;
+        }
+    }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
     }
 };
 
-void main()
+// 引数に記録したファイルを指定すると、Kinectの代わりにそのファイルを再生します
+void main( int argc, char* argv[] )
 {
     try {
         KinectApp app;
-        app.initialize();
+        app.initialize( (argc > 1) ? argv[1] : nullptr );
         app.run();
     }
     catch ( std::exception& ex ){
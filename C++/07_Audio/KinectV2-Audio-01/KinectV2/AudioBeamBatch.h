@@ -0,0 +1,239 @@
+﻿#pragma once
+
+#include <vector>
+#include <sstream>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+#include "ComPtr.h"
+
+// AcquireLatestBeamFrames() で取得したすべてのビームフレームとサブフレームを、
+// ビームごとに1つの連続したバッファーにまとめる
+//
+// ループが16ms(サブフレーム1つ分)より遅いと、1回の取得で複数のサブフレームが届きます。
+// サブフレーム0だけを使うと残りは失われるので、届いたものをすべて時刻順に並べます。
+//
+// サブフレームのタイムスタンプ(RelativeTime)から、取りこぼし(前のサブフレームの終わりから
+// 間が空いた)と重複(すでに受け取った時刻)を検出します。重複したものはバッファーに入れません。
+class AudioBeamBatch
+{
+public:
+
+    struct Statistics
+    {
+        UINT64 subFrames;       // バッファーに入れたサブフレーム数
+        UINT64 gaps;            // 間が空いた回数
+        UINT64 lostSubFrames;   // 間が空いて失われたサブフレーム数(推定)
+        UINT64 duplicates;      // 重複して捨てたサブフレーム数
+    };
+
+private:
+
+    struct Beam
+    {
+        std::vector<BYTE> buffer;
+        UINT subFrameCount;
+
+        // 次のサブフレームが始まるはずの時刻(-1はまだ受け取っていない)
+        TIMESPAN nextTime;
+
+        // 最後のサブフレームの角度と、ビーム方向の人
+        float beamAngle;
+        float beamAngleConfidence;
+        UINT64 bodyTrackingId;
+
+        Statistics statistics;
+    };
+
+    std::vector<Beam> beams;
+
+public:
+
+    // 新しいサブフレームがあればバッファーに入れてtrueを返す
+    bool acquire( IAudioBeamFrameReader* reader )
+    {
+        clear();
+
+        ComPtr<IAudioBeamFrameList> audioBeamFrameList;
+        auto ret = reader->AcquireLatestBeamFrames( &audioBeamFrameList );
+        if ( ret != S_OK ){
+            return false;
+        }
+
+        UINT beamCount = 0;
+        check( audioBeamFrameList->get_BeamCount( &beamCount ), "get_BeamCount" );
+        resize( beamCount );
+
+        bool isAdded = false;
+        for ( UINT beam = 0; beam < beamCount; ++beam ){
+            ComPtr<IAudioBeamFrame> audioBeamFrame;
+            check( audioBeamFrameList->OpenAudioBeamFrame( beam, &audioBeamFrame ), "OpenAudioBeamFrame" );
+
+            UINT32 subFrameCount = 0;
+            check( audioBeamFrame->get_SubFrameCount( &subFrameCount ), "get_SubFrameCount" );
+
+            for ( UINT32 i = 0; i < subFrameCount; ++i ){
+                ComPtr<IAudioBeamSubFrame> audioBeamSubFrame;
+                check( audioBeamFrame->GetSubFrame( i, &audioBeamSubFrame ), "GetSubFrame" );
+
+                TIMESPAN relativeTime = 0;
+                TIMESPAN duration = 0;
+                check( audioBeamSubFrame->get_RelativeTime( &relativeTime ), "get_RelativeTime" );
+                check( audioBeamSubFrame->get_Duration( &duration ), "get_Duration" );
+
+                // コピーせずにデータを参照する
+                UINT size = 0;
+                BYTE* data = nullptr;
+                check( audioBeamSubFrame->AccessUnderlyingBuffer( &size, &data ), "AccessUnderlyingBuffer" );
+
+                isAdded |= add( beam, data, size, relativeTime, duration );
+
+                // 角度とビーム方向の人は最後のサブフレームのものを使う
+                if ( i == subFrameCount - 1 ){
+                    updateBeamInfo( beams[beam], audioBeamSubFrame );
+                }
+            }
+        }
+
+        return isAdded;
+    }
+
+    // サブフレームを1つ追加する(合成したデータでの計測にも使う)
+    bool add( UINT beam, const BYTE* data, UINT size, TIMESPAN relativeTime, TIMESPAN duration )
+    {
+        resize( beam + 1 );
+        Beam& b = beams[beam];
+
+        if ( (b.nextTime >= 0) && (duration > 0) ){
+            TIMESPAN tolerance = duration / 2;
+            if ( relativeTime < b.nextTime - tolerance ){
+                ++b.statistics.duplicates;
+                return false;
+            }
+            if ( relativeTime > b.nextTime + tolerance ){
+                ++b.statistics.gaps;
+                b.statistics.lostSubFrames += (relativeTime - b.nextTime + tolerance) / duration;
+            }
+        }
+        b.nextTime = relativeTime + duration;
+
+        b.buffer.insert( b.buffer.end(), data, data + size );
+        ++b.subFrameCount;
+        ++b.statistics.subFrames;
+
+        return true;
+    }
+
+    // 前回の取得分を消す(統計と時刻は残す)
+    void clear()
+    {
+        for ( auto& b : beams ){
+            b.buffer.clear();
+            b.subFrameCount = 0;
+        }
+    }
+
+    // 統計と時刻を含めてすべて消す
+    void reset()
+    {
+        beams.clear();
+    }
+
+    UINT getBeamCount() const
+    {
+        return (UINT)beams.size();
+    }
+
+    // まとめたデータ(16kHz, float, 1ch)
+    const float* data( UINT beam = 0 ) const
+    {
+        return ((beam < beams.size()) && !beams[beam].buffer.empty()) ? (const float*)&beams[beam].buffer[0] : nullptr;
+    }
+
+    // まとめたデータのバイト数
+    UINT size( UINT beam = 0 ) const
+    {
+        return (beam < beams.size()) ? (UINT)beams[beam].buffer.size() : 0;
+    }
+
+    // 今回まとめたサブフレーム数
+    UINT getSubFrameCount( UINT beam = 0 ) const
+    {
+        return (beam < beams.size()) ? beams[beam].subFrameCount : 0;
+    }
+
+    // まとめたデータの終わりの時刻(最後のサブフレームの RelativeTime + Duration。まだ受け取っていなければ-1)
+    TIMESPAN getEndTime( UINT beam = 0 ) const
+    {
+        return (beam < beams.size()) ? beams[beam].nextTime : -1;
+    }
+
+    float getBeamAngle( UINT beam = 0 ) const
+    {
+        return (beam < beams.size()) ? beams[beam].beamAngle : 0;
+    }
+
+    float getBeamAngleConfidence( UINT beam = 0 ) const
+    {
+        return (beam < beams.size()) ? beams[beam].beamAngleConfidence : 0;
+    }
+
+    // ビーム方向の人のTrackingId(いなければ(UINT64)-1)
+    UINT64 getBodyTrackingId( UINT beam = 0 ) const
+    {
+        return (beam < beams.size()) ? beams[beam].bodyTrackingId : (UINT64)-1;
+    }
+
+    Statistics getStatistics( UINT beam = 0 ) const
+    {
+        if ( beam < beams.size() ){
+            return beams[beam].statistics;
+        }
+
+        Statistics statistics = { 0, 0, 0, 0 };
+        return statistics;
+    }
+
+private:
+
+    void resize( UINT beamCount )
+    {
+        while ( beams.size() < beamCount ){
+            Beam b;
+            b.subFrameCount = 0;
+            b.nextTime = -1;
+            b.beamAngle = 0;
+            b.beamAngleConfidence = 0;
+            b.bodyTrackingId = (UINT64)-1;
+            memset( &b.statistics, 0, sizeof( b.statistics ) );
+            beams.push_back( b );
+        }
+    }
+
+    void updateBeamInfo( Beam& b, IAudioBeamSubFrame* audioBeamSubFrame )
+    {
+        check( audioBeamSubFrame->get_BeamAngle( &b.beamAngle ), "get_BeamAngle" );
+        check( audioBeamSubFrame->get_BeamAngleConfidence( &b.beamAngleConfidence ), "get_BeamAngleConfidence" );
+
+        // ビーム方向にいる人のTrackingIdを取得する
+        b.bodyTrackingId = (UINT64)-1;
+
+        UINT32 count = 0;
+        check( audioBeamSubFrame->get_AudioBodyCorrelationCount( &count ), "get_AudioBodyCorrelationCount" );
+        if ( count > 0 ){
+            ComPtr<IAudioBodyCorrelation> audioBodyCorrelation;
+            check( audioBeamSubFrame->GetAudioBodyCorrelation( 0, &audioBodyCorrelation ), "GetAudioBodyCorrelation" );
+            check( audioBodyCorrelation->get_BodyTrackingId( &b.bodyTrackingId ), "get_BodyTrackingId" );
+        }
+    }
+
+    static void check( HRESULT ret, const char* name )
+    {
+        if ( ret != S_OK ){
+            std::stringstream ss;
+            ss << "failed " << name << " " << std::hex << ret << std::endl;
+            throw std::runtime_error( ss.str().c_str() );
+        }
+    }
+};
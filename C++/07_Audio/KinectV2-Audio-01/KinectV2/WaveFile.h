@@ -2,8 +2,14 @@
 #pragma once 
 
 #include <fstream>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 #include <Windows.h>
+#include <malloc.h>
 #include <mmreg.h>
 
 //
@@ -36,17 +42,56 @@ static const BYTE WaveHeaderTemplate[] =
 //  Static wave DATA tag.
 static const BYTE WaveData[] = { 'd', 'a', 't', 'a' };
 
+// Write() ̓Oobt@[ɃRs[邾ŁAt@Cւ݂͕̏ʃXbhōsB
+// ubNςɂȂ邩AFlushInterval o߂ƃubNPʂŏށB
+// Oobt@[ɋ󂫂ȂƂ͑҂Ƀf[^̂ĂāAoverruns 𐔂B
 class WaveFile
 {
 public:
 
+    // Oobt@[̃ubN̑傫(ZN^̔{)Ɛ
+    // 16kHz, float, 1chŁA1ubN1bAŜŖ16b
+    static const ULONG BlockSize = 64 * 1024;
+    static const int BlockCount = 16;
+    static const size_t BlockAlignment = 4096;
+
     std::ofstream audioFile;
     //HANDLE waveFile;
 
     ULONG written = 0;
     WAVEFORMATEX format;
 
+private:
+
+    struct Block
+    {
+        BYTE* data;
+        ULONG size;
+    };
+
+    BYTE* ringBuffer = nullptr;
+    Block blocks[BlockCount];
+
+    // Write() ݒ̃ubNƁA̎Oɂ鏑ݑ҂̃ubN
+    int fillIndex = 0;
+    int readyCount = 0;
+
+    std::thread ioThread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool isClosing = false;
+
+    // r܂ł̃ubNފԊu(0ȂAςɂȂubN)
+    std::chrono::milliseconds flushInterval;
+
+    ULONGLONG bytesQueued = 0;
+    ULONGLONG bytesWritten = 0;
+    ULONG overruns = 0;
+
+public:
+
     WaveFile()
+        : flushInterval( 1000 )
     {
         format.wFormatTag = WAVE_FORMAT_IEEE_FLOAT;
         format.nChannels = 1;
@@ -55,24 +100,62 @@ public:
         format.nBlockAlign = format.nChannels * format.wBitsPerSample / 8;
         format.nAvgBytesPerSec = format.nSamplesPerSec * format.nBlockAlign;
         format.cbSize = 0;
+
+        ringBuffer = (BYTE*)_aligned_malloc( BlockSize * BlockCount, BlockAlignment );
+        if ( ringBuffer == nullptr ){
+            throw std::bad_alloc();
+        }
+        for ( int i = 0; i < BlockCount; ++i ){
+            blocks[i].data = ringBuffer + (BlockSize * i);
+            blocks[i].size = 0;
+        }
     }
 
     ~WaveFile()
     {
         Close();
+        _aligned_free( ringBuffer );
     }
 
     void Open( const std::string& fileName )
     {
+        Close();
+
         written = 0;
+        bytesQueued = 0;
+        bytesWritten = 0;
+        overruns = 0;
+        fillIndex = 0;
+        readyCount = 0;
+        for ( auto& block : blocks ){
+            block.size = 0;
+        }
 
         audioFile.open( fileName, std::ios::out | std::ios::binary );
+        if ( !audioFile.is_open() ){
+            throw std::runtime_error( "t@CJ܂" );
+        }
+
         audioFile << std::noskipws;
         WriteWaveHeader( 0 );
+
+        isClosing = false;
+        ioThread = std::thread( &WaveFile::IoThread, this );
     }
 
+    // cĂf[^ׂďłAwb_[̃TCYĕ
     void Close()
     {
+        // ݃Xbhn߂ĂȂΑ҂Ȃ
+        if ( ioThread.joinable() ){
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                isClosing = true;
+            }
+            condition.notify_one();
+            ioThread.join();
+        }
+
         if ( audioFile.is_open() ){
             audioFile.seekp( 0, std::ios::beg );
             WriteWaveHeader( written );
@@ -80,12 +163,143 @@ public:
         }
     }
 
-    void Write( const void* data, int size )
+    // f[^Oobt@[ɃRs[B󂫂ȂΎ̂ĂfalseԂ
+    bool Write( const void* data, int size )
     {
-        audioFile.write( (char*)data, size );
-        written += size;
+        const BYTE* src = (const BYTE*)data;
+        bool isReady = false;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+
+            // ݒ̃ubN̎cƁA󂢂ĂubNɓ肫邩
+            ULONGLONG space = (BlockSize - blocks[fillIndex].size) + ((ULONGLONG)(BlockCount - 1 - readyCount) * BlockSize);
+            if ( (ULONGLONG)size > space ){
+                ++overruns;
+                return false;
+            }
+
+            while ( size > 0 ){
+                Block& block = blocks[fillIndex];
+                ULONG length = BlockSize - block.size;
+                if ( (ULONG)size < length ){
+                    length = size;
+                }
+
+                memcpy( block.data + block.size, src, length );
+                block.size += length;
+                src += length;
+                size -= length;
+                bytesQueued += length;
+
+                // ̃ubN󂢂ĂΏݑ҂ɂ(󂢂ĂȂΏ݃Xbhڂ)
+                if ( (block.size == BlockSize) && (readyCount < BlockCount - 1) ){
+                    SubmitBlock();
+                    isReady = true;
+                }
+            }
+        }
+
+        if ( isReady ){
+            condition.notify_one();
+        }
+
+        return true;
     }
 
+    // r܂ł̃ubNފԊuݒ肷(0Ŗ)
+    void SetFlushInterval( DWORD milliseconds )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        flushInterval = std::chrono::milliseconds( milliseconds );
+    }
+
+    // Write() Ŏ󂯎oCg
+    ULONGLONG GetBytesQueued()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        return bytesQueued;
+    }
+
+    // t@Cɏ񂾃oCg
+    ULONGLONG GetBytesWritten()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        return bytesWritten;
+    }
+
+    // Oobt@[ɋ󂫂ȂĎ̂Ă Write() ̉
+    ULONG GetOverruns()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        return overruns;
+    }
+
+private:
+
+    // ݒ̃ubNݑ҂ɂāÃubNɈڂ(mutexbNČĂ)
+    void SubmitBlock()
+    {
+        ++readyCount;
+        fillIndex = (fillIndex + 1) % BlockCount;
+    }
+
+    void IoThread()
+    {
+        auto lastFlush = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock( mutex );
+        while ( 1 ) {
+            if ( readyCount == 0 ){
+                auto hasWork = [this]{ return isClosing || (readyCount > 0); };
+                if ( flushInterval.count() > 0 ){
+                    condition.wait_until( lock, lastFlush + flushInterval, hasWork );
+                }
+                else {
+                    condition.wait( lock, hasWork );
+                }
+            }
+
+            // ƂƁA莞ԌoƂ͓r܂ł̃ubN
+            auto now = std::chrono::steady_clock::now();
+            bool isFlush = isClosing || ((flushInterval.count() > 0) && (now - lastFlush >= flushInterval));
+            if ( isFlush && (readyCount == 0) && (blocks[fillIndex].size > 0) ){
+                SubmitBlock();
+            }
+
+            if ( readyCount == 0 ){
+                if ( isClosing ){
+                    break;
+                }
+                if ( isFlush ){
+                    lastFlush = now;
+                }
+                continue;
+            }
+
+            // ԌÂubN(ݒWrite()GȂ)
+            Block& block = blocks[(fillIndex - readyCount + BlockCount) % BlockCount];
+            lock.unlock();
+
+            audioFile.write( (char*)block.data, block.size );
+            if ( isFlush ){
+                audioFile.flush();
+            }
+
+            lock.lock();
+            written += block.size;
+            bytesWritten += block.size;
+            block.size = 0;
+            --readyCount;
+
+            // ς̂܂܎cĂubNݑ҂ɂ
+            if ( blocks[fillIndex].size == BlockSize ){
+                SubmitBlock();
+            }
+        }
+    }
+
+public:
+
     /// <summary>
     /// Write the WAV file header contents. 
     /// </summary>
@@ -2,6 +2,7 @@
 #include <sstream>
 #include <fstream>
 #include <vector>
+#include <chrono>
 
 #include <Kinect.h>
 #include <conio.h>
@@ -11,6 +12,8 @@
 //#include <atlbase.h>
 
 #include "WaveFile.h"
+#include "AudioBeamBatch.h"
+#include "StageProfiler.h"
 
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
@@ -29,11 +32,18 @@ private:
     IKinectSensor* kinect = nullptr;
     IAudioBeamFrameReader* audioBeamFrameReader;
 
-    std::vector<float> audioBuffer;
     UINT subFrameLengthInBytes = 0;
+    TIMESPAN subFrameDuration = 0;
+
+    // 取得したすべてのサブフレームをまとめる
+    AudioBeamBatch audioBatch;
 
     WaveFile audioFile;
 
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
 public:
 
     // 初期化
@@ -56,16 +66,38 @@ public:
 
     void run()
     {
-        std::cout << "キーを押すと終了します" << std::endl;
+        profiler.setThreadName( "Main" );
+
+        std::cout << "bキーで書き込みの速度を計測し、xキーで処理時間を表示します。その他のキーを押すと終了します" << std::endl;
 
         while ( 1 ) {
             update();
             draw();
 
             if ( _kbhit() != 0 ){
+                auto key = _getch();
+                if ( key == 'b' ){
+                    benchmarkWaveFile();
+                    benchmarkAudioBatch();
+                    continue;
+                }
+                else if ( key == 'x' ){
+                    writeProfile();
+                    continue;
+                }
                 break;
             }
         }
+
+        audioFile.Close();
+        std::cout << "受け取ったバイト数     : " << audioFile.GetBytesQueued() << std::endl;
+        std::cout << "書き込んだバイト数     : " << audioFile.GetBytesWritten() << std::endl;
+        std::cout << "捨てた回数(オーバーラン) : " << audioFile.GetOverruns() << std::endl;
+
+        auto statistics = audioBatch.getStatistics();
+        std::cout << "サブフレーム数         : " << statistics.subFrames << std::endl;
+        std::cout << "途切れた回数           : " << statistics.gaps << " (失われたサブフレーム " << statistics.lostSubFrames << ")" << std::endl;
+        std::cout << "重複したサブフレーム数 : " << statistics.duplicates << std::endl;
     }
 
 private:
@@ -78,9 +110,7 @@ private:
 
         ERROR_CHECK( audioSource->OpenReader( &audioBeamFrameReader ) );
         ERROR_CHECK( audioSource->get_SubFrameLengthInBytes( &subFrameLengthInBytes ) );
-
-        // バッファを作成する
-        audioBuffer.resize( subFrameLengthInBytes / sizeof( float ) );
+        ERROR_CHECK( audioSource->get_SubFrameDuration( &subFrameDuration ) );
 
         audioFile.Open( "audio.wav" );
     }
@@ -88,31 +118,142 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
         updateAudioFrame();
     }
 
     // オーディオフレームの更新
     void updateAudioFrame()
     {
-        ComPtr<IAudioBeamFrameList> audioBeamFrameList;
-        auto ret = audioBeamFrameReader->AcquireLatestBeamFrames( &audioBeamFrameList );
-        if ( ret != S_OK ){
-            return;
+        STAGE_TIMER( profiler, "updateAudioFrame" );
+
+        // すべてのビームフレーム、サブフレームを取得する
+        {
+            STAGE_TIMER( profiler, "AudioBeamBatch" );
+            if ( !audioBatch.acquire( audioBeamFrameReader ) ){
+                return;
+            }
         }
 
-        ComPtr<IAudioBeamFrame> audioBeamFrame;
-        ERROR_CHECK( audioBeamFrameList->OpenAudioBeamFrame( 0, &audioBeamFrame ) );
+        // まとめて書き込む
+        STAGE_TIMER( profiler, "WaveFile" );
+        audioFile.Write( audioBatch.data(), audioBatch.size() );
+    }
+
+    void draw()
+    {
+    }
+
+    // 元の同期書き込みと、リングバッファーを使った書き込みの速度を比べる
+    void benchmarkWaveFile()
+    {
+        typedef std::chrono::high_resolution_clock Clock;
 
-        ComPtr<IAudioBeamSubFrame> audioBeamSubFrame;
-        ERROR_CHECK( audioBeamFrame->GetSubFrame( 0, &audioBeamSubFrame ) );
+        // サブフレーム16000個(16kHzで約256秒分)
+        const int Count = 16000;
+        std::vector<BYTE> data( subFrameLengthInBytes, 0 );
+
+        // 元の実装(Write()のたびにファイルに書き込む)
+        {
+            std::ofstream file( "benchmark_sync.wav", std::ios::out | std::ios::binary );
+
+            double maxLatency = 0;
+            auto begin = Clock::now();
+            for ( int i = 0; i < Count; ++i ){
+                auto start = Clock::now();
+                file.write( (char*)&data[0], data.size() );
+                double latency = std::chrono::duration<double, std::micro>( Clock::now() - start ).count();
+                if ( maxLatency < latency ){
+                    maxLatency = latency;
+                }
+            }
+            file.close();
+
+            printBenchmark( "同期書き込み   ", Clock::now() - begin, maxLatency, (double)Count * data.size() );
+        }
 
-        audioBeamSubFrame->CopyFrameDataToArray( subFrameLengthInBytes, (BYTE*)&audioBuffer[0] );
+        // リングバッファーと書き込みスレッド
+        {
+            WaveFile file;
+            file.Open( "benchmark_async.wav" );
 
-        audioFile.Write( &audioBuffer[0], subFrameLengthInBytes );
+            double maxLatency = 0;
+            auto begin = Clock::now();
+            for ( int i = 0; i < Count; ++i ){
+                auto start = Clock::now();
+                file.Write( &data[0], data.size() );
+                double latency = std::chrono::duration<double, std::micro>( Clock::now() - start ).count();
+                if ( maxLatency < latency ){
+                    maxLatency = latency;
+                }
+            }
+            file.Close();
+
+            printBenchmark( "非同期書き込み ", Clock::now() - begin, maxLatency, (double)file.GetBytesWritten() );
+            std::cout << "    オーバーラン : " << file.GetOverruns() << std::endl;
+        }
     }
 
-    void draw()
+    // 合成したサブフレームをまとめる速度と、途切れ・重複の検出を確認する
+    void benchmarkAudioBatch()
     {
+        typedef std::chrono::high_resolution_clock Clock;
+
+        // 1回の取得で届くサブフレーム数を変えながら、約100秒分のサブフレームを流す
+        const int Count = 6250;
+        std::vector<BYTE> data( subFrameLengthInBytes, 0 );
+
+        AudioBeamBatch batch;
+        UINT64 injectedGaps = 0;
+        UINT64 injectedDuplicates = 0;
+
+        auto begin = Clock::now();
+        int index = 0;
+        for ( int poll = 0; index < Count; ++poll ){
+            // 1～8個ずつ届ける
+            batch.clear();
+            int perPoll = (poll % 8) + 1;
+            for ( int i = 0; (i < perPoll) && (index < Count); ++i, ++index ){
+                // 時々1つ飛ばす、同じものをもう一度届ける
+                if ( (index % 97) == 96 ){
+                    ++index;
+                    ++injectedGaps;
+                }
+                batch.add( 0, &data[0], data.size(), index * subFrameDuration, subFrameDuration );
+                if ( (index % 89) == 88 ){
+                    batch.add( 0, &data[0], data.size(), index * subFrameDuration, subFrameDuration );
+                    ++injectedDuplicates;
+                }
+            }
+        }
+        double seconds = std::chrono::duration<double>( Clock::now() - begin ).count();
+
+        auto statistics = batch.getStatistics();
+        std::cout << "サブフレームの取り込み : " << (statistics.subFrames / seconds) << " サブフレーム/秒" << std::endl;
+        std::cout << "    途切れ : " << statistics.gaps << " / " << injectedGaps
+            << ", 重複 : " << statistics.duplicates << " / " << injectedDuplicates << std::endl;
+    }
+
+    template<typename Duration>
+    static void printBenchmark( const char* name, Duration elapsed, double maxLatency, double bytes )
+    {
+        double seconds = std::chrono::duration<double>( elapsed ).count();
+        std::cout << name << " : " << (bytes / seconds / (1024 * 1024)) << "MB/s, "
+            << "Write()の最大 " << maxLatency << "us" << std::endl;
+    }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
     }
 };
 
@@ -10,6 +10,9 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "AudioBeamBatch.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -26,10 +29,18 @@ private:
 
     IKinectSensor* kinect = nullptr;
     IAudioBeamFrameReader* audioBeamFrameReader;
+    AudioBeamBatch audioBatch;
 
     float beamAngle;
     float beamAngleConfidence;
 
+    // 表示用の画像(フレームごとに確保しないように使い回す)
+    cv::Mat image;
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
 public:
 
     // 初期化
@@ -52,6 +63,8 @@ public:
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         std::cout << "キーを押すと終了します" << std::endl;
 
         while ( 1 ) {
@@ -62,6 +75,9 @@ public:
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
         }
     }
 
@@ -79,32 +95,34 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
         updateAudioFrame();
     }
 
     // オーディオフレームの更新
     void updateAudioFrame()
     {
-        ComPtr<IAudioBeamFrameList> audioBeamFrameList;
-        auto ret = audioBeamFrameReader->AcquireLatestBeamFrames( &audioBeamFrameList );
-        if ( ret != S_OK ){
-            return;
-        }
+        STAGE_TIMER( profiler, "updateAudioFrame" );
 
-        ComPtr<IAudioBeamFrame> audioBeamFrame;
-        ERROR_CHECK( audioBeamFrameList->OpenAudioBeamFrame( 0, &audioBeamFrame ) );
-
-        ComPtr<IAudioBeamSubFrame> audioBeamSubFrame;
-        ERROR_CHECK( audioBeamFrame->GetSubFrame( 0, &audioBeamSubFrame ) );
+        // すべてのビームフレーム、サブフレームを取得する
+        {
+            STAGE_TIMER( profiler, "AudioBeamBatch" );
+            if ( !audioBatch.acquire( audioBeamFrameReader ) ){
+                return;
+            }
+        }
 
-        // 角度および角度の信頼性を取得する
-        ERROR_CHECK( audioBeamSubFrame->get_BeamAngle( &beamAngle ) );
-        ERROR_CHECK( audioBeamSubFrame->get_BeamAngleConfidence( &beamAngleConfidence ) );
+        // 角度および角度の信頼性を取得する(最後のサブフレームのもの)
+        beamAngle = audioBatch.getBeamAngle();
+        beamAngleConfidence = audioBatch.getBeamAngleConfidence();
     }
 
     void draw()
     {
-        cv::Mat image = cv::Mat::zeros(480, 640, CV_8UC4);
+        STAGE_TIMER( profiler, "draw" );
+
+        image.create( 480, 640, CV_8UC4 );
+        image.setTo( 0 );
 
         // ラジアンから度に変換する
         auto angle = beamAngle * 180 / 3.1416;
@@ -120,8 +138,23 @@ private:
         // 回転させた線を描画する
         cv::line( image, cv::Point( offsetX, 0 ), cv::Point( offsetX + X2, Y2 ), cv::Scalar( 255, 255, 255 ), 10 );
 
+        STAGE_TIMER( profiler, "imshow" );
         cv::imshow("AudioBeamAngle", image);
     }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
 };
 
 void main()
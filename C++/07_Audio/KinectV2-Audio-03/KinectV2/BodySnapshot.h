@@ -0,0 +1,183 @@
+﻿#pragma once
+
+#include <Kinect.h>
+
+// ボディフレームのデータを、COMを介さずに読める形でまとめて持つ
+//
+// GetAndRefreshBodyData の後に update() を1回呼ぶと、6人分の TrackingId、追跡状態、関節、
+// 関節の向き、手の状態をコピーします。描画や音声の方向との対応付けなどは、
+// IBody のメソッドを何度も呼ぶ代わりにこのデータを読みます。
+//
+// TrackingId からスロットを探す小さなハッシュ表も作るので、findSlot() は線形探索をしません。
+class BodySnapshot
+{
+public:
+
+    struct Body
+    {
+        UINT64 trackingId;
+        BOOLEAN isTracked;
+        Joint joints[JointType::JointType_Count];
+        JointOrientation orientations[JointType::JointType_Count];
+        HandState handLeftState;
+        HandState handRightState;
+        TrackingConfidence handLeftConfidence;
+        TrackingConfidence handRightConfidence;
+    };
+
+    static const int NotFound = -1;
+
+private:
+
+    // ハッシュ表の大きさ(ボディの数の2倍以上の2のべき乗)
+    static const int TableBits = 4;
+    static const int TableSize = 1 << TableBits;
+
+    Body bodies[BODY_COUNT];
+    TIMESPAN relativeTime = 0;
+    int trackedCount = 0;
+
+    // TrackingId とスロット(使っていない所は TrackingId が0)
+    UINT64 keys[TableSize];
+    int values[TableSize];
+
+public:
+
+    BodySnapshot()
+    {
+        clear();
+    }
+
+    // 追跡しているボディがない状態にする
+    void clear()
+    {
+        for ( auto& body : bodies ){
+            body.trackingId = 0;
+            body.isTracked = false;
+        }
+
+        for ( auto& key : keys ){
+            key = 0;
+        }
+
+        trackedCount = 0;
+    }
+
+    // GetAndRefreshBodyData で取得したボディからデータをコピーする(エラーのときは S_OK 以外を返す)
+    HRESULT update( IBody* const* source, TIMESPAN time )
+    {
+        clear();
+        relativeTime = time;
+
+        for ( int i = 0; i < BODY_COUNT; ++i ){
+            if ( source[i] == nullptr ){
+                continue;
+            }
+
+            Body& body = bodies[i];
+            HRESULT ret = source[i]->get_IsTracked( &body.isTracked );
+            if ( (ret != S_OK) || !body.isTracked ){
+                body.isTracked = false;
+                if ( ret != S_OK ){
+                    return ret;
+                }
+                continue;
+            }
+
+            ret = readBody( source[i], body );
+            if ( ret != S_OK ){
+                body.isTracked = false;
+                return ret;
+            }
+
+            insert( body.trackingId, i );
+            ++trackedCount;
+        }
+
+        return S_OK;
+    }
+
+    TIMESPAN getRelativeTime() const
+    {
+        return relativeTime;
+    }
+
+    int getTrackedCount() const
+    {
+        return trackedCount;
+    }
+
+    const Body& operator [] ( int slot ) const
+    {
+        return bodies[slot];
+    }
+
+    // 関節にフィルターをかけるときなどのために、書き換えられるようにする
+    Body& operator [] ( int slot )
+    {
+        return bodies[slot];
+    }
+
+    // TrackingId のボディのスロットを探す(いなければ NotFound)
+    int findSlot( UINT64 trackingId ) const
+    {
+        if ( (trackingId == 0) || (trackingId == (UINT64)-1) ){
+            return NotFound;
+        }
+
+        for ( int i = hash( trackingId ), n = 0; n < TableSize; i = (i + 1) & (TableSize - 1), ++n ){
+            if ( keys[i] == trackingId ){
+                return values[i];
+            }
+            if ( keys[i] == 0 ){
+                break;
+            }
+        }
+
+        return NotFound;
+    }
+
+private:
+
+    static HRESULT readBody( IBody* source, Body& body )
+    {
+        HRESULT ret = source->get_TrackingId( &body.trackingId );
+        if ( ret == S_OK ){
+            ret = source->GetJoints( JointType::JointType_Count, body.joints );
+        }
+        if ( ret == S_OK ){
+            ret = source->GetJointOrientations( JointType::JointType_Count, body.orientations );
+        }
+        if ( ret == S_OK ){
+            ret = source->get_HandLeftState( &body.handLeftState );
+        }
+        if ( ret == S_OK ){
+            ret = source->get_HandRightState( &body.handRightState );
+        }
+        if ( ret == S_OK ){
+            ret = source->get_HandLeftConfidence( &body.handLeftConfidence );
+        }
+        if ( ret == S_OK ){
+            ret = source->get_HandRightConfidence( &body.handRightConfidence );
+        }
+
+        return ret;
+    }
+
+    // TrackingId はほぼ連番なので、掛け算で上位のビットに散らす
+    static int hash( UINT64 trackingId )
+    {
+        return (int)((trackingId * 0x9E3779B97F4A7C15ull) >> (64 - TableBits));
+    }
+
+    void insert( UINT64 trackingId, int slot )
+    {
+        int i = hash( trackingId );
+        while ( keys[i] != 0 ){
+            i = (i + 1) & (TableSize - 1);
+        }
+
+        keys[i] = trackingId;
+        values[i] = slot;
+    }
+};
@@ -10,6 +10,12 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "BodyIndexColorizer.h"
+#include "AudioBeamBatch.h"
+#include "BodySnapshot.h"
+#include "FrameSynchronizer.h"
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -31,19 +37,44 @@ private:
     int BodyIndexWidth;
     int BodyIndexHeight;
     std::vector<BYTE> bodyIndexBuffer;
+    BodyIndexColorizer colorizer;
+    cv::Mat image;
 
     // Body
     IBodyFrameReader* bodyFrameReader = nullptr;
     IBody* bodies[6];
 
+    // ボディのデータ(フレームごとに一度だけIBodyから取得する)
+    BodySnapshot bodySnapshot;
+
     // Audio
     IAudioBeamFrameReader* audioBeamFrameReader;
+    AudioBeamBatch audioBatch;
     float beamAngle;
 
     // ビーム方向のTrackingIdとそのインデックス
     UINT64 audioTrackingId = (UINT64)-1;
     int audioTrackingIndex = -1;
 
+    // 同じ時刻のボディ、ボディインデックス、オーディオを組にする(ボディが基準)
+    // フレームはいったんスロットに取得し、組になったら表示に使うデータにする
+    struct AudioBeamInfo
+    {
+        float beamAngle;
+        UINT64 bodyTrackingId;
+    };
+
+    FrameSynchronizer synchronizer;
+    int bodySync;
+    int bodyIndexSync;
+    int audioSync;
+    BodySnapshot bodySlots[FrameSynchronizer::Slots];
+    std::vector<BYTE> bodyIndexSlots[FrameSynchronizer::Slots];
+    AudioBeamInfo audioSlots[FrameSynchronizer::Slots];
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
 
 public:
 
@@ -81,16 +112,32 @@ public:
 
         // バッファーを作成する
         bodyIndexBuffer.resize( BodyIndexWidth * BodyIndexHeight );
+        image.create( BodyIndexHeight, BodyIndexWidth, CV_8UC4 );
+        for ( auto& slot : bodyIndexSlots ){
+            slot.resize( bodyIndexBuffer.size() );
+        }
+
+        // 人がいない場所は白にする
+        colorizer.setAllColors( BodyIndexColorizer::bgra( 255, 255, 255 ) );
 
         // オーディオを開く
         ComPtr<IAudioSource> audioSource;
         ERROR_CHECK( kinect->get_AudioSource( &audioSource ) );
 
         ERROR_CHECK( audioSource->OpenReader( &audioBeamFrameReader ) );
+
+        // フレームを組にするストリーム(オーディオはサブフレームの区切りがボディと合わないので、
+        // 予算内にそろわなければ近いもので組にする)
+        bodySync = synchronizer.addStream( "Body" );
+        bodyIndexSync = synchronizer.addStream( "BodyIndex" );
+        audioSync = synchronizer.addStream( "Audio" );
+        synchronizer.setPolicy( FrameSynchronizer::Policy_Latest );
     }
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         std::cout << "キーを押すと終了します" << std::endl;
 
         while ( 1 ) {
@@ -101,6 +148,18 @@ public:
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
+            else if ( key == 's' ){
+                synchronizer.print( std::cout );
+            }
+            else if ( key == 'p' ){
+                // そろうまで待つか、予算内でそろわなければ組にするかを切り替える
+                synchronizer.setPolicy( (synchronizer.getPolicy() == FrameSynchronizer::Policy_WaitForAll) ?
+                    FrameSynchronizer::Policy_Latest : FrameSynchronizer::Policy_WaitForAll );
+                std::cout << "同期 : " << FrameSynchronizer::policyName( synchronizer.getPolicy() ) << std::endl;
+            }
         }
     }
 
@@ -109,59 +168,92 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
+
         updateAudioFrame();
         updateBodyFrame();
         updateBodyIndexFrame();
-    }
 
-    // オーディオフレームの更新
-    void updateAudioFrame()
-    {
-        ComPtr<IAudioBeamFrameList> audioBeamFrameList;
-        auto ret = audioBeamFrameReader->AcquireLatestBeamFrames( &audioBeamFrameList );
-        if ( ret != S_OK ){
+        // 同じ時刻のフレームがそろったら、表示に使うデータにする
+        FrameSynchronizer::Bundle bundle;
+        if ( !synchronizer.synchronize( bundle ) ){
             return;
         }
 
-        ComPtr<IAudioBeamFrame> audioBeamFrame;
-        ERROR_CHECK( audioBeamFrameList->OpenAudioBeamFrame( 0, &audioBeamFrame ) );
+        if ( bundle.slots[bodySync] >= 0 ){
+            bodySnapshot = bodySlots[bundle.slots[bodySync]];
+        }
+        if ( bundle.slots[bodyIndexSync] >= 0 ){
+            bodyIndexBuffer.swap( bodyIndexSlots[bundle.slots[bodyIndexSync]] );
+        }
+        if ( bundle.slots[audioSync] >= 0 ){
+            const AudioBeamInfo& audio = audioSlots[bundle.slots[audioSync]];
+            beamAngle = audio.beamAngle;
+            audioTrackingId = audio.bodyTrackingId;
+        }
+    }
 
-        ComPtr<IAudioBeamSubFrame> audioBeamSubFrame;
-        ERROR_CHECK( audioBeamFrame->GetSubFrame( 0, &audioBeamSubFrame ) );
+    // オーディオフレームの更新
+    void updateAudioFrame()
+    {
+        STAGE_TIMER( profiler, "updateAudioFrame" );
 
-        // 角度および角度の信頼性を取得する
-        ERROR_CHECK( audioBeamSubFrame->get_BeamAngle( &beamAngle ) );
+        // すべてのビームフレーム、サブフレームを取得する
+        {
+            STAGE_TIMER( profiler, "AudioBeamBatch" );
+            if ( !audioBatch.acquire( audioBeamFrameReader ) ){
+                return;
+            }
+        }
 
-        // ビーム方向にいる人の数を取得する
-        UINT32 count = 0;
-        ERROR_CHECK( audioBeamSubFrame->get_AudioBodyCorrelationCount( &count ) );
-        if ( count == 0 ){
-            audioTrackingId = (UINT64)-1;
+        int slot = synchronizer.beginWrite( audioSync );
+        if ( slot < 0 ){
             return;
         }
 
-        // ビーム方向の人のTrackingIdを取得する
-        ComPtr<IAudioBodyCorrelation> audioBodyCorrelation;
-        ERROR_CHECK( audioBeamSubFrame->GetAudioBodyCorrelation( 0, &audioBodyCorrelation ) );
+        // 角度を取得する(最後のサブフレームのもの)
+        AudioBeamInfo& audio = audioSlots[slot];
+        audio.beamAngle = audioBatch.getBeamAngle();
+
+        // ビーム方向の人のTrackingIdを取得する(いなければ(UINT64)-1)
+        audio.bodyTrackingId = audioBatch.getBodyTrackingId();
 
-        ERROR_CHECK( audioBodyCorrelation->get_BodyTrackingId( &audioTrackingId ) );
+        // まとめたサブフレームの終わりの時刻で対応付ける
+        synchronizer.endWrite( audioSync, audioBatch.getEndTime() );
     }
 
     // ボディフレームの更新
     void updateBodyFrame()
     {
+        STAGE_TIMER( profiler, "updateBodyFrame" );
+
         // フレームを取得する
         ComPtr<IBodyFrame> bodyFrame;
         auto ret = bodyFrameReader->AcquireLatestFrame( &bodyFrame );
         if ( ret == S_OK ){
+            int slot = synchronizer.beginWrite( bodySync );
+            if ( slot < 0 ){
+                return;
+            }
+
             // データを取得する
-            ERROR_CHECK( bodyFrame->GetAndRefreshBodyData( 6, &bodies[0] ) );
+            {
+                STAGE_TIMER( profiler, "GetAndRefreshBodyData" );
+                ERROR_CHECK( bodyFrame->GetAndRefreshBodyData( 6, &bodies[0] ) );
+            }
+
+            TIMESPAN relativeTime = 0;
+            ERROR_CHECK( bodyFrame->get_RelativeTime( &relativeTime ) );
+            ERROR_CHECK( bodySlots[slot].update( bodies, relativeTime ) );
+            synchronizer.endWrite( bodySync, relativeTime );
         }
     }
 
     // ボディインデックスフレームの更新
     void updateBodyIndexFrame()
     {
+        STAGE_TIMER( profiler, "updateBodyIndexFrame" );
+
         // フレームを取得する
         ComPtr<IBodyIndexFrame> bodyIndexFrame;
         auto ret = bodyIndexFrameReader->AcquireLatestFrame( &bodyIndexFrame );
@@ -169,51 +261,44 @@ private:
             return;
         }
 
+        int slot = synchronizer.beginWrite( bodyIndexSync );
+        if ( slot < 0 ){
+            return;
+        }
+
         // データを取得する
-        ERROR_CHECK( bodyIndexFrame->CopyFrameDataToArray( bodyIndexBuffer.size(), &bodyIndexBuffer[0] ) );
+        std::vector<BYTE>& buffer = bodyIndexSlots[slot];
+        {
+            STAGE_TIMER( profiler, "CopyFrameDataToArray" );
+            ERROR_CHECK( bodyIndexFrame->CopyFrameDataToArray( buffer.size(), &buffer[0] ) );
+        }
+
+        TIMESPAN relativeTime = 0;
+        ERROR_CHECK( bodyIndexFrame->get_RelativeTime( &relativeTime ) );
+        synchronizer.endWrite( bodyIndexSync, relativeTime );
     }
 
     void draw()
     {
-        cv::Mat image = cv::Mat::zeros( BodyIndexHeight, BodyIndexWidth, CV_8UC4 );
+        STAGE_TIMER( profiler, "draw" );
 
+        // ビーム方向の人のインデックスを探す(いなければ-1)
+        audioTrackingIndex = bodySnapshot.findSlot( audioTrackingId );
 
-        // ビーム方向の人のインデックスを探す
-        audioTrackingIndex = -1;
 
-        if ( audioTrackingId != (UINT64)-1 ){
-            for ( int i = 0; i < 6; ++i ){
-                UINT64 trackingId = 0;
-                bodies[i]->get_TrackingId( &trackingId );
-                if ( trackingId == audioTrackingId ){
-                    audioTrackingIndex = i;
-                    break;
-                }
+        // ビーム方向の人に色付けする(人は赤、ビーム方向の人は青)
+        for ( int i = 0; i < 6; ++i ){
+            if ( i == audioTrackingIndex ){
+                colorizer.setColor( i, BodyIndexColorizer::bgra( 255, 0, 0 ) );
+            }
+            else {
+                colorizer.setColor( i, BodyIndexColorizer::bgra( 0, 0, 255 ) );
             }
         }
 
-
-        // ビーム方向の人に色付けする
-        for ( int i = 0; i < BodyIndexWidth * BodyIndexHeight; ++i ){
-            int index = i * 4;
-            // 人がいれば255以外
-            if ( bodyIndexBuffer[i] != 255 ){
-                if ( bodyIndexBuffer[i] == audioTrackingIndex ){
-                    image.data[index + 0] = 255;
-                    image.data[index + 1] = 0;
-                    image.data[index + 2] = 0;
-                }
-                else {
-                    image.data[index + 0] = 0;
-                    image.data[index + 1] = 0;
-                    image.data[index + 2] = 255;
-                }
-            }
-            else{
-                image.data[index + 0] = 255;
-                image.data[index + 1] = 255;
-                image.data[index + 2] = 255;
-            }
+        {
+            STAGE_TIMER( profiler, "BodyIndexColorizer" );
+            colorizer.colorize( &bodyIndexBuffer[0], image.data, BodyIndexWidth * BodyIndexHeight );
         }
 
 
@@ -231,8 +316,23 @@ private:
         // 回転させた線を描画する
         cv::line( image, cv::Point( offsetX, 0 ), cv::Point( offsetX + X2, Y2 ), 0, 10 );
 
+        STAGE_TIMER( profiler, "imshow" );
         cv::imshow("AudioBeamAngle", image);
     }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
 };
 
 void main()
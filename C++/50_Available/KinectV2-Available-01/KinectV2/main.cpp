@@ -8,6 +8,8 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "StageProfiler.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -34,6 +36,10 @@ private:
 
     bool isAvailable = false;
 
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
+
 public:
 
     // 初期化
@@ -57,6 +63,8 @@ public:
 
     void run()
     {
+        profiler.setThreadName( "Main" );
+
         while ( 1 ) {
             update();
             draw();
@@ -65,6 +73,9 @@ public:
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
         }
     }
 
@@ -73,6 +84,8 @@ private:
     // データの更新処理
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
+
         // Kinectの状態更新
         updateKinectAvailable();
 
@@ -83,6 +96,8 @@ private:
     // Kinectの状態更新
     void updateKinectAvailable()
     {
+        STAGE_TIMER( profiler, "updateKinectAvailable" );
+
         ComPtr<IIsAvailableChangedEventArgs> args;
         auto ret = kinect->GetIsAvailableChangedEventData( waitableHandle, &args );
         if ( ret != S_OK ) {
@@ -124,6 +139,8 @@ private:
     // カラーフレームの更新
     void updateColorFrame()
     {
+        STAGE_TIMER( profiler, "updateColorFrame" );
+
         if ( colorFrameReader == nullptr ){
             return;
         }
@@ -133,11 +150,15 @@ private:
         auto ret = colorFrameReader->AcquireLatestFrame( &colorFrame );
         if ( ret == S_OK ){
             // BGRAの形式でデータを取得する
-            ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
-                colorBuffer.size(), &colorBuffer[0], ColorImageFormat::ColorImageFormat_Bgra ) );
+            {
+                STAGE_TIMER( profiler, "CopyConvertedFrameDataToArray" );
+                ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
+                    colorBuffer.size(), &colorBuffer[0], ColorImageFormat::ColorImageFormat_Bgra ) );
+            }
 
             // カラーデータを表示する
             cv::Mat colorImage( colorHeight, colorWidth, CV_8UC4, &colorBuffer[0] );
+            STAGE_TIMER( profiler, "imshow" );
             cv::imshow( "Color Image", colorImage );
 
             // スマートポインタを使ってない場合は、自分でフレームを解放する
@@ -148,6 +169,20 @@ private:
     void draw()
     {
     }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
+    }
 };
 
 void main()
@@ -0,0 +1,78 @@
+﻿#pragma once
+
+#include <new>
+#include <atomic>
+#include <cstdlib>
+
+// operator new を置き換えて、メモリーを確保した回数を数える(デバッグ版でもリリース版でも動く)
+//
+// 置き換えはプログラム全体で1つなので、main.cpp など1つの .cpp でだけ読み込んでください。
+// malloc を直接呼ぶもの(Kinect SDK、OpenCV の cv::Mat など)は数えません。
+//
+//   UINT64 before = AllocationCounter::count();
+//   ... 確かめたい処理 ...
+//   UINT64 allocations = AllocationCounter::count() - before;
+namespace AllocationCounter
+{
+    // 静的な領域なので、ほかの静的な初期化より先に0になっている
+    static std::atomic<unsigned long long> allocations;
+
+    inline unsigned long long count()
+    {
+        return allocations.load( std::memory_order_relaxed );
+    }
+
+    inline void* allocate( size_t size )
+    {
+        allocations.fetch_add( 1, std::memory_order_relaxed );
+        return malloc( (size != 0) ? size : 1 );
+    }
+}
+
+void* operator new( size_t size )
+{
+    void* p = AllocationCounter::allocate( size );
+    if ( p == nullptr ){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[]( size_t size )
+{
+    void* p = AllocationCounter::allocate( size );
+    if ( p == nullptr ){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) throw()
+{
+    return AllocationCounter::allocate( size );
+}
+
+void* operator new[]( size_t size, const std::nothrow_t& ) throw()
+{
+    return AllocationCounter::allocate( size );
+}
+
+void operator delete( void* p ) throw()
+{
+    free( p );
+}
+
+void operator delete[]( void* p ) throw()
+{
+    free( p );
+}
+
+void operator delete( void* p, const std::nothrow_t& ) throw()
+{
+    free( p );
+}
+
+void operator delete[]( void* p, const std::nothrow_t& ) throw()
+{
+    free( p );
+}
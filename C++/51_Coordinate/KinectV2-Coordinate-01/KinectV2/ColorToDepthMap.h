@@ -0,0 +1,271 @@
+﻿#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// カラー座標からDepth座標への対応表
+//
+// フレームごとに 1920x1080 の DepthSpacePoint を確保しないように、対応表はこのクラスが持ち続けます。
+// また、Depthが更新されたとき(invalidate()が呼ばれたとき)だけ再計算します。
+//
+// Mode_ColorFrame : MapColorFrameToDepthSpace でカラーの全画素を変換します(元の処理と同じ結果)
+// Mode_DepthTable : 起動時に一度だけ取得したDepthの画素ごとの方向(GetDepthFrameToCameraSpaceTable)から
+//                   有効なDepthの画素だけをカメラ座標にし、カラー座標に変換して対応表に書き込みます。
+//                   変換する点がDepthの画素数(512x424)以下になる代わりに、境界付近は近似になります。
+class ColorToDepthMap
+{
+public:
+
+    enum Mode
+    {
+        Mode_ColorFrame,
+        Mode_DepthTable,
+    };
+
+private:
+
+    // 1つのDepthの画素が覆うカラー画素の最大幅
+    static const int MaxFootprint = 8;
+
+    ICoordinateMapper* mapper = nullptr;
+
+    int colorWidth = 0;
+    int colorHeight = 0;
+    int depthWidth = 0;
+    int depthHeight = 0;
+
+    Mode mode = Mode_ColorFrame;
+    bool isDirty = true;
+
+    // カラーの画素ごとのDepth座標
+    std::vector<DepthSpacePoint> depthSpacePoints;
+
+    // Mode_DepthTable で使う作業領域
+    std::vector<PointF> depthRays;
+    std::vector<CameraSpacePoint> cameraSpacePoints;
+    std::vector<ColorSpacePoint> colorSpacePoints;
+    std::vector<ColorSpacePoint> depthColorPoints;
+    std::vector<int> validIndices;
+    std::vector<UINT16> nearestDepth;
+
+public:
+
+    void initialize( ICoordinateMapper* coordinateMapper, int colorW, int colorH, int depthW, int depthH )
+    {
+        mapper = coordinateMapper;
+
+        colorWidth = colorW;
+        colorHeight = colorH;
+        depthWidth = depthW;
+        depthHeight = depthH;
+
+        depthSpacePoints.resize( colorWidth * colorHeight );
+        isDirty = true;
+    }
+
+    void setMode( Mode newMode )
+    {
+        if ( mode != newMode ){
+            mode = newMode;
+            isDirty = true;
+        }
+    }
+
+    Mode getMode() const
+    {
+        return mode;
+    }
+
+    static const char* modeName( Mode mode )
+    {
+        return (mode == Mode_DepthTable) ? "DepthTable" : "ColorFrame";
+    }
+
+    // Depthが更新されたことを通知する
+    void invalidate()
+    {
+        isDirty = true;
+    }
+
+    // 必要なときだけ対応表を再計算する。再計算したらtrueを返す
+    bool update( const UINT16* depthBuffer )
+    {
+        if ( !isDirty ){
+            return false;
+        }
+
+        if ( (mode == Mode_DepthTable) && loadDepthRays() ){
+            mapFromDepthTable( depthBuffer );
+        }
+        else {
+            mapFromColorFrame( depthBuffer );
+        }
+
+        isDirty = false;
+        return true;
+    }
+
+    const DepthSpacePoint& operator [] ( int colorIndex ) const
+    {
+        return depthSpacePoints[colorIndex];
+    }
+
+    const DepthSpacePoint* data() const
+    {
+        return &depthSpacePoints[0];
+    }
+
+    size_t size() const
+    {
+        return depthSpacePoints.size();
+    }
+
+private:
+
+    void mapFromColorFrame( const UINT16* depthBuffer )
+    {
+        HRESULT ret = mapper->MapColorFrameToDepthSpace( depthWidth * depthHeight, depthBuffer,
+            depthSpacePoints.size(), &depthSpacePoints[0] );
+        if ( ret != S_OK ){
+            throw std::runtime_error( "MapColorFrameToDepthSpace に失敗しました" );
+        }
+    }
+
+    // Depthの画素ごとの方向を取得する(センサーが動き出すまでは取得できない)
+    bool loadDepthRays()
+    {
+        if ( !depthRays.empty() ){
+            return true;
+        }
+
+        UINT32 count = 0;
+        PointF* table = nullptr;
+        if ( mapper->GetDepthFrameToCameraSpaceTable( &count, &table ) != S_OK ){
+            return false;
+        }
+
+        if ( count == (UINT32)(depthWidth * depthHeight) ){
+            depthRays.assign( table, table + count );
+
+            cameraSpacePoints.resize( count );
+            colorSpacePoints.resize( count );
+            depthColorPoints.resize( count );
+            validIndices.resize( count );
+            nearestDepth.resize( colorWidth * colorHeight );
+        }
+
+        ::CoTaskMemFree( table );
+        return !depthRays.empty();
+    }
+
+    void mapFromDepthTable( const UINT16* depthBuffer )
+    {
+        // 有効なDepthの画素だけをカメラ座標にする
+        int validCount = 0;
+        for ( int i = 0; i < depthWidth * depthHeight; ++i ){
+            UINT16 depth = depthBuffer[i];
+            if ( depth == 0 ){
+                continue;
+            }
+
+            float z = depth / 1000.0f;
+            CameraSpacePoint& point = cameraSpacePoints[validCount];
+            point.X = depthRays[i].X * z;
+            point.Y = depthRays[i].Y * z;
+            point.Z = z;
+
+            validIndices[validCount] = i;
+            ++validCount;
+        }
+
+        // 対応表を「対応なし」で初期化する
+        DepthSpacePoint invalid = { -1.0f, -1.0f };
+        std::fill( depthSpacePoints.begin(), depthSpacePoints.end(), invalid );
+        std::fill( nearestDepth.begin(), nearestDepth.end(), (UINT16)0xFFFF );
+
+        if ( validCount == 0 ){
+            return;
+        }
+
+        HRESULT ret = mapper->MapCameraPointsToColorSpace( validCount, &cameraSpacePoints[0],
+            validCount, &colorSpacePoints[0] );
+        if ( ret != S_OK ){
+            throw std::runtime_error( "MapCameraPointsToColorSpace に失敗しました" );
+        }
+
+        // Depthの画素ごとのカラー座標に並べ直す
+        ColorSpacePoint noColor = { -1.0f, -1.0f };
+        std::fill( depthColorPoints.begin(), depthColorPoints.end(), noColor );
+        for ( int n = 0; n < validCount; ++n ){
+            depthColorPoints[validIndices[n]] = colorSpacePoints[n];
+        }
+
+        // Depthの画素が覆うカラーの範囲に書き込む(重なったら手前を優先する)
+        for ( int depthY = 0; depthY < depthHeight; ++depthY ){
+            for ( int depthX = 0; depthX < depthWidth; ++depthX ){
+                int depthIndex = (depthY * depthWidth) + depthX;
+                const ColorSpacePoint& color = depthColorPoints[depthIndex];
+                if ( !isValidColor( color ) ){
+                    continue;
+                }
+
+                // 右隣と下隣のDepthの画素までを、この画素が覆う範囲とする
+                int left = (int)color.X;
+                int top = (int)color.Y;
+                int right = left + 1;
+                int bottom = top + 1;
+                if ( depthX + 1 < depthWidth ){
+                    right = footprintEdge( left, depthColorPoints[depthIndex + 1].X );
+                }
+                if ( depthY + 1 < depthHeight ){
+                    bottom = footprintEdge( top, depthColorPoints[depthIndex + depthWidth].Y );
+                }
+
+                DepthSpacePoint point = { (float)depthX, (float)depthY };
+                UINT16 depth = depthBuffer[depthIndex];
+
+                for ( int y = clamp( top, colorHeight ); y < clamp( bottom, colorHeight ); ++y ){
+                    for ( int x = clamp( left, colorWidth ); x < clamp( right, colorWidth ); ++x ){
+                        int colorIndex = (y * colorWidth) + x;
+                        if ( depth < nearestDepth[colorIndex] ){
+                            nearestDepth[colorIndex] = depth;
+                            depthSpacePoints[colorIndex] = point;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // 隣のDepthの画素のカラー座標から、覆う範囲の端を求める
+    static int footprintEdge( int position, float neighbor )
+    {
+        // 隣が無効なら1画素だけ、離れすぎていれば MaxFootprint までにする
+        if ( !(neighbor > -1.0f) ){
+            return position + 1;
+        }
+
+        int edge = (int)neighbor;
+        if ( edge <= position ){
+            return position + 1;
+        }
+        if ( edge > position + MaxFootprint ){
+            return position + MaxFootprint;
+        }
+        return edge;
+    }
+
+    static int clamp( int value, int size )
+    {
+        return (value < 0) ? 0 : ((value > size) ? size : value);
+    }
+
+    static bool isValidColor( const ColorSpacePoint& point )
+    {
+        // 対応がない点は-infinityになる
+        return (point.X > -1.0f) && (point.Y > -1.0f);
+    }
+};
@@ -0,0 +1,158 @@
+﻿#pragma once
+
+#include <vector>
+
+#include <Kinect.h>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+#include "ThreadPool.h"
+
+// カラー画像にDepthやボディインデックスを重ねる
+//
+// カラー画像を行のタイルに分けてスレッドプールで並列に処理します。
+// 各行では4画素ずつ、Depth座標の整数化と範囲チェックをまとめて行い、
+// 4画素とも範囲外なら書き込みを飛ばします。結果は1画素ずつ処理した場合と同じです。
+class Compositor
+{
+private:
+
+    // 1つのタイルの行数
+    static const int TileRows = 16;
+
+    ThreadPool pool;
+
+    int colorWidth = 0;
+    int colorHeight = 0;
+    int depthWidth = 0;
+    int depthHeight = 0;
+
+public:
+
+    void initialize( int colorW, int colorH, int depthW, int depthH, int threadCount = 0 )
+    {
+        colorWidth = colorW;
+        colorHeight = colorH;
+        depthWidth = depthW;
+        depthHeight = depthH;
+
+        pool.resize( threadCount );
+    }
+
+    void setThreadCount( int threadCount )
+    {
+        pool.resize( threadCount );
+    }
+
+    int getThreadCount() const
+    {
+        return pool.size();
+    }
+
+    // Depthのグレーデータで上書きする(アルファはそのまま)
+    void drawDepth( BYTE* colorImage, const DepthSpacePoint* depthSpace, const BYTE* depthGray )
+    {
+        UINT32* color = (UINT32*)colorImage;
+
+        forEachMappedPixel( depthSpace, [=]( int colorIndex, int depthIndex ){
+            UINT32 gray = depthGray[depthIndex];
+            color[colorIndex] = (color[colorIndex] & 0xFF000000) | (gray * 0x00010101);
+        } );
+    }
+
+    // 人を検出した位置だけ白にする
+    void drawBodyMask( BYTE* colorImage, const DepthSpacePoint* depthSpace, const BYTE* bodyIndex )
+    {
+        UINT32* color = (UINT32*)colorImage;
+
+        forEachMappedPixel( depthSpace, [=]( int colorIndex, int depthIndex ){
+            if ( bodyIndex[depthIndex] != 255 ){
+                color[colorIndex] |= 0x00FFFFFF;
+            }
+        } );
+    }
+
+    // 人を検出した位置だけカラーを残す(それ以外は0、アルファも0)
+    void drawBackgroundRemoved( const BYTE* colorImage, const DepthSpacePoint* depthSpace, const BYTE* bodyIndex, BYTE* showImage )
+    {
+        const UINT32* color = (const UINT32*)colorImage;
+        UINT32* show = (UINT32*)showImage;
+
+        pool.parallelFor( colorHeight, TileRows, [=]( int beginRow, int endRow ){
+            // このタイルを0で埋めてから人の位置だけ書き込む
+            memset( show + (beginRow * colorWidth), 0, (endRow - beginRow) * colorWidth * sizeof( UINT32 ) );
+
+            forEachMappedPixelInRows( depthSpace, beginRow, endRow, [=]( int colorIndex, int depthIndex ){
+                if ( bodyIndex[depthIndex] != 255 ){
+                    show[colorIndex] = color[colorIndex] & 0x00FFFFFF;
+                }
+            } );
+        } );
+    }
+
+private:
+
+    // Depth座標がDepth画像の範囲内にあるカラー画素ごとに func( colorIndex, depthIndex ) を呼ぶ
+    template<typename Func>
+    void forEachMappedPixel( const DepthSpacePoint* depthSpace, Func func )
+    {
+        pool.parallelFor( colorHeight, TileRows, [=]( int beginRow, int endRow ){
+            forEachMappedPixelInRows( depthSpace, beginRow, endRow, func );
+        } );
+    }
+
+    template<typename Func>
+    void forEachMappedPixelInRows( const DepthSpacePoint* depthSpace, int beginRow, int endRow, Func func ) const
+    {
+        int begin = beginRow * colorWidth;
+        int end = endRow * colorWidth;
+        int i = begin;
+
+#if defined(_M_IX86) || defined(_M_X64)
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i width = _mm_set1_epi32( depthWidth );
+        const __m128i height = _mm_set1_epi32( depthHeight );
+
+        for ( ; i + 4 <= end; i += 4 ){
+            __m128 a = _mm_loadu_ps( &depthSpace[i].X );
+            __m128 b = _mm_loadu_ps( &depthSpace[i + 2].X );
+
+            // (int)X, (int)Y と同じく0方向に丸める(NaNや無限大は範囲外の値になる)
+            __m128i x = _mm_cvttps_epi32( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+            __m128i y = _mm_cvttps_epi32( _mm_shuffle_ps( a, b, _MM_SHUFFLE( 3, 1, 3, 1 ) ) );
+
+            __m128i inside = _mm_and_si128(
+                _mm_andnot_si128( _mm_cmplt_epi32( x, zero ), _mm_cmplt_epi32( x, width ) ),
+                _mm_andnot_si128( _mm_cmplt_epi32( y, zero ), _mm_cmplt_epi32( y, height ) ) );
+
+            int mask = _mm_movemask_ps( _mm_castsi128_ps( inside ) );
+            if ( mask == 0 ){
+                continue;
+            }
+
+            int xs[4];
+            int ys[4];
+            _mm_storeu_si128( (__m128i*)xs, x );
+            _mm_storeu_si128( (__m128i*)ys, y );
+
+            for ( int n = 0; n < 4; ++n ){
+                if ( mask & (1 << n) ){
+                    func( i + n, (ys[n] * depthWidth) + xs[n] );
+                }
+            }
+        }
+#endif
+
+        for ( ; i < end; ++i ){
+            int depthX = (int)depthSpace[i].X;
+            int depthY = (int)depthSpace[i].Y;
+            if ( (depthX < 0) || (depthWidth <= depthX) || (depthY < 0) || (depthHeight <= depthY) ){
+                continue;
+            }
+
+            func( i, (depthY * depthWidth) + depthX );
+        }
+    }
+};
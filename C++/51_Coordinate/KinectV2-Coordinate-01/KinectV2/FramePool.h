@@ -0,0 +1,297 @@
+﻿#pragma once
+
+#include <new>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <malloc.h>
+#include <Kinect.h>
+
+// フレームのデータを入れるバッファー(スラブ)を使い回す
+//
+// ストリームごとに1つ作り、IFrameDescription の幅、高さ、1画素のバイト数からスラブの大きさを決めます。
+// acquire() で受け取る FramePool::Frame は参照カウント付きのハンドルです。コピーしても同じデータを指し、
+// 最後のハンドルがなくなるとスラブがプールに戻ります。ほかのスレッドにハンドルを渡せば、
+// コピーせずにデータを持たせられます(ハンドルはプールより先に破棄してください)。
+//
+// スラブは管理情報とデータを1回の確保で64バイト境界に置き、プールを破棄するまで解放しません。
+// 同時に使う数の最大(high-water mark)まで確保した後は、フレームごとのメモリー確保はありません。
+class FramePool
+{
+public:
+
+    static const size_t Alignment = 64;
+
+    struct Statistics
+    {
+        size_t slabs;           // 確保したスラブ数
+        size_t inUse;           // 使っているスラブ数
+        size_t highWater;       // 同時に使ったスラブ数の最大
+        UINT64 allocations;     // スラブを確保した回数
+        UINT64 acquired;        // acquire() でスラブを渡した回数
+        UINT64 exhausted;       // 上限に達して渡せなかった回数
+    };
+
+private:
+
+    // 管理情報(データはこの後ろの64バイト境界から)
+    struct Slab
+    {
+        std::atomic<int> references;
+        FramePool* pool;
+    };
+
+    static const size_t HeaderSize = ((sizeof( Slab ) + Alignment - 1) / Alignment) * Alignment;
+
+public:
+
+    class Frame
+    {
+    private:
+
+        Slab* slab = nullptr;
+
+        friend class FramePool;
+
+        explicit Frame( Slab* s )
+            : slab( s )
+        {
+        }
+
+    public:
+
+        Frame()
+        {
+        }
+
+        Frame( const Frame& other )
+            : slab( other.slab )
+        {
+            if ( slab != nullptr ){
+                slab->references.fetch_add( 1, std::memory_order_relaxed );
+            }
+        }
+
+        Frame( Frame&& other )
+            : slab( other.slab )
+        {
+            other.slab = nullptr;
+        }
+
+        ~Frame()
+        {
+            reset();
+        }
+
+        Frame& operator = ( const Frame& other )
+        {
+            Frame( other ).swap( *this );
+            return *this;
+        }
+
+        Frame& operator = ( Frame&& other )
+        {
+            Frame( std::move( other ) ).swap( *this );
+            return *this;
+        }
+
+        void swap( Frame& other )
+        {
+            std::swap( slab, other.slab );
+        }
+
+        // 参照を手放す(最後の参照ならスラブをプールに戻す)
+        void reset()
+        {
+            if ( slab == nullptr ){
+                return;
+            }
+
+            if ( slab->references.fetch_sub( 1, std::memory_order_acq_rel ) == 1 ){
+                slab->pool->release( slab );
+            }
+            slab = nullptr;
+        }
+
+        bool isValid() const
+        {
+            return slab != nullptr;
+        }
+
+        BYTE* data() const
+        {
+            return (slab != nullptr) ? ((BYTE*)slab + HeaderSize) : nullptr;
+        }
+
+        template<typename T>
+        T* as() const
+        {
+            return (T*)data();
+        }
+
+        size_t size() const
+        {
+            return (slab != nullptr) ? slab->pool->slabSize : 0;
+        }
+    };
+
+private:
+
+    size_t slabSize = 0;
+    size_t maxSlabs = 0;
+
+    std::mutex mutex;
+    std::vector<Slab*> slabs;
+    std::vector<Slab*> freeSlabs;
+
+    Statistics statistics;
+
+public:
+
+    FramePool()
+    {
+        statistics = Statistics();
+    }
+
+    ~FramePool()
+    {
+        for ( auto slab : slabs ){
+            slab->~Slab();
+            _aligned_free( slab );
+        }
+    }
+
+    // フレームの大きさからスラブの大きさを決める(maxCount はスラブの数の上限)
+    void initialize( IFrameDescription* frameDescription, size_t maxCount )
+    {
+        int width = 0;
+        int height = 0;
+        unsigned int bytesPerPixel = 0;
+        check( frameDescription->get_Width( &width ), "get_Width" );
+        check( frameDescription->get_Height( &height ), "get_Height" );
+        check( frameDescription->get_BytesPerPixel( &bytesPerPixel ), "get_BytesPerPixel" );
+
+        initialize( (size_t)width * height * bytesPerPixel, maxCount );
+    }
+
+    void initialize( size_t size, size_t maxCount )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( statistics.inUse != 0 ){
+            throw std::runtime_error( "使っているフレームがあるので作り直せません" );
+        }
+
+        for ( auto slab : slabs ){
+            slab->~Slab();
+            _aligned_free( slab );
+        }
+        slabs.clear();
+        freeSlabs.clear();
+
+        slabSize = size;
+        maxSlabs = maxCount;
+        statistics = Statistics();
+
+        // 後からベクターが伸びてメモリーを確保しないようにする
+        slabs.reserve( maxSlabs );
+        freeSlabs.reserve( maxSlabs );
+    }
+
+    // count 個までスラブを先に確保しておく
+    void reserve( size_t count )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        while ( (slabs.size() < count) && (slabs.size() < maxSlabs) ){
+            freeSlabs.push_back( allocate() );
+        }
+    }
+
+    // 空いているスラブを渡す(上限に達していれば無効なフレームを返す)
+    Frame acquire()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+
+        Slab* slab = nullptr;
+        if ( !freeSlabs.empty() ){
+            slab = freeSlabs.back();
+            freeSlabs.pop_back();
+        }
+        else if ( slabs.size() < maxSlabs ){
+            slab = allocate();
+        }
+        else {
+            ++statistics.exhausted;
+            return Frame();
+        }
+
+        slab->references.store( 1, std::memory_order_relaxed );
+        ++statistics.acquired;
+        ++statistics.inUse;
+        if ( statistics.highWater < statistics.inUse ){
+            statistics.highWater = statistics.inUse;
+        }
+
+        return Frame( slab );
+    }
+
+    size_t getSlabSize() const
+    {
+        return slabSize;
+    }
+
+    Statistics getStatistics()
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        Statistics result = statistics;
+        result.slabs = slabs.size();
+        return result;
+    }
+
+    void print( std::ostream& out, const char* name )
+    {
+        auto s = getStatistics();
+        out << name << " : " << (slabSize / 1024) << "KB x " << s.slabs << " (上限 " << maxSlabs << "), 使用中 " << s.inUse
+            << ", 最大 " << s.highWater << ", 確保 " << s.allocations << ", 受け渡し " << s.acquired
+            << ", 不足 " << s.exhausted << std::endl;
+    }
+
+private:
+
+    // mutex をロックして呼ぶ
+    Slab* allocate()
+    {
+        void* memory = _aligned_malloc( HeaderSize + slabSize, Alignment );
+        if ( memory == nullptr ){
+            throw std::runtime_error( "フレームのバッファーを確保できません" );
+        }
+
+        Slab* slab = new (memory) Slab;
+        slab->references.store( 0, std::memory_order_relaxed );
+        slab->pool = this;
+
+        slabs.push_back( slab );
+        ++statistics.allocations;
+        return slab;
+    }
+
+    void release( Slab* slab )
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        freeSlabs.push_back( slab );
+        --statistics.inUse;
+    }
+
+    static void check( HRESULT ret, const char* name )
+    {
+        if ( ret != S_OK ){
+            std::stringstream ss;
+            ss << "failed " << name << " " << std::hex << ret;
+            throw std::runtime_error( ss.str() );
+        }
+    }
+};
@@ -0,0 +1,302 @@
+﻿#pragma once
+
+#include <atomic>
+#include <thread>
+#include <utility>
+#include <ostream>
+
+#include <Windows.h>
+
+// キューがいっぱいのときの書き込み側の動き
+enum QueuePolicy
+{
+    QueuePolicy_OverwriteOldest,    // いちばん古いものを捨てて積む(書き込み側は待たない)
+    QueuePolicy_Block,              // 読み出し側が取り出すまで待つ
+};
+
+inline const char* queuePolicyName( QueuePolicy policy )
+{
+    return (policy == QueuePolicy_Block) ? "Block" : "OverwriteOldest";
+}
+
+// スレッドの間でフレームのハンドル(FramePool::Frame など)を渡す、ロックを使わないリングバッファー
+//
+// セルごとに番号(sequence)を持ち、書き込み側はセルの番号が自分の位置と同じとき、
+// 読み出し側は位置+1のときにセルを使えます(D. Vyukov の有界MPMCキューと同じ方法)。
+//   IsMulti == false : 書き込み側、読み出し側とも1スレッド(SPSC)。位置はCASを使わずに進めます
+//   IsMulti == true  : 書き込み側、読み出し側とも複数スレッド(MPMC)。位置はCASで取り合います
+// QueuePolicy_OverwriteOldest では書き込み側も古いものを取り出して捨てるので、SPSCでも読み出し側の位置だけはCASで進めます。
+//
+// 書き込み側と読み出し側の位置は別のキャッシュラインに置きます。Capacity は2のべき乗にしてください。
+// 取り出したセルは T() で空にするので、ムーブ代入のない型(VS2013ではメンバーごとのムーブが自動で作られない)でも
+// キューがハンドルを持ち続けることはありません。
+template<typename T, int Capacity, bool IsMulti>
+class FrameQueue
+{
+    static_assert( (Capacity >= 2) && ((Capacity & (Capacity - 1)) == 0), "Capacity は2のべき乗にしてください" );
+
+public:
+
+    static const size_t CacheLineSize = 64;
+
+    struct Statistics
+    {
+        UINT64 pushed;          // 積んだ数
+        UINT64 popped;          // 読み出し側が取り出した数
+        UINT64 overwritten;     // いっぱいだったので捨てた数
+        UINT64 waits;           // いっぱいだったので待った回数
+    };
+
+private:
+
+    static const size_t Mask = Capacity - 1;
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T item;
+    };
+
+    // 書き込み側の位置と、書き込み側だけが数える数(ポリシーによって、捨てた数か待った回数)
+    struct Producer
+    {
+        std::atomic<size_t> position;
+        std::atomic<UINT64> count;
+        char padding[CacheLineSize - sizeof( std::atomic<size_t> ) - sizeof( std::atomic<UINT64> )];
+    };
+
+    // 読み出し側の位置
+    struct Consumer
+    {
+        std::atomic<size_t> position;
+        char padding[CacheLineSize - sizeof( std::atomic<size_t> )];
+    };
+
+    // それぞれを1つのキャッシュラインに置き、前後のメンバーとも共有しない
+    char padding[CacheLineSize];
+    Producer enqueue;
+    Consumer dequeue;
+    Cell cells[Capacity];
+
+    const QueuePolicy policy;
+    const bool isSharedDequeue;
+    std::atomic<bool> isClosed;
+
+    // 待つときに、スレッドを譲る前に回る回数
+    static const int SpinCount = 64;
+
+public:
+
+    explicit FrameQueue( QueuePolicy policy = QueuePolicy_OverwriteOldest )
+        : policy( policy )
+        , isSharedDequeue( IsMulti || (policy == QueuePolicy_OverwriteOldest) )
+    {
+        for ( int i = 0; i < Capacity; ++i ){
+            cells[i].sequence.store( (size_t)i, std::memory_order_relaxed );
+        }
+
+        enqueue.position.store( 0, std::memory_order_relaxed );
+        enqueue.count.store( 0, std::memory_order_relaxed );
+        dequeue.position.store( 0, std::memory_order_relaxed );
+        isClosed.store( false );
+    }
+
+    QueuePolicy getPolicy() const
+    {
+        return policy;
+    }
+
+    // 書き込み側 : 空いていれば積んでtrueを返す(falseのときは item をムーブしない)
+    bool tryPush( T&& item )
+    {
+        size_t position = enqueue.position.load( std::memory_order_relaxed );
+        Cell* cell;
+        for ( ;; ){
+            cell = &cells[position & Mask];
+            size_t sequence = cell->sequence.load( std::memory_order_acquire );
+            intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+            if ( difference == 0 ){
+                if ( !IsMulti ){
+                    enqueue.position.store( position + 1, std::memory_order_relaxed );
+                    break;
+                }
+                if ( enqueue.position.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ){
+                    break;
+                }
+            }
+            else if ( difference < 0 ){
+                // 1周前のものがまだ取り出されていない
+                return false;
+            }
+            else {
+                position = enqueue.position.load( std::memory_order_relaxed );
+            }
+        }
+
+        cell->item = std::move( item );
+        cell->sequence.store( position + 1, std::memory_order_release );
+        return true;
+    }
+
+    // 書き込み側 : ポリシーに従って積む(close() した後に Block で待っていたときだけfalse)
+    bool push( T&& item )
+    {
+        if ( tryPush( std::move( item ) ) ){
+            return true;
+        }
+
+        if ( policy == QueuePolicy_Block ){
+            enqueue.count.fetch_add( 1, std::memory_order_relaxed );
+            for ( int spin = 0; !tryPush( std::move( item ) ); ++spin ){
+                if ( isClosed.load( std::memory_order_relaxed ) ){
+                    return false;
+                }
+                pause( spin );
+            }
+            return true;
+        }
+
+        // いちばん古いものを取り出して捨てる(捨てたハンドルはすぐに手放す)
+        // 読み出し側がセルからムーブしている間だけは、空くのを待つことがあります
+        T discarded;
+        for ( int spin = 0; !tryPush( std::move( item ) ); ++spin ){
+            if ( tryPop( discarded ) ){
+                discarded = T();
+                enqueue.count.fetch_add( 1, std::memory_order_relaxed );
+            }
+            else {
+                pause( spin );
+            }
+        }
+        return true;
+    }
+
+    // 読み出し側 : 1つ取り出す(空ならfalse)
+    bool tryPop( T& item )
+    {
+        size_t position = dequeue.position.load( std::memory_order_relaxed );
+        Cell* cell;
+        for ( ;; ){
+            cell = &cells[position & Mask];
+            size_t sequence = cell->sequence.load( std::memory_order_acquire );
+            intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+            if ( difference == 0 ){
+                if ( !isSharedDequeue ){
+                    dequeue.position.store( position + 1, std::memory_order_relaxed );
+                    break;
+                }
+                if ( dequeue.position.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) ){
+                    break;
+                }
+            }
+            else if ( difference < 0 ){
+                return false;
+            }
+            else {
+                position = dequeue.position.load( std::memory_order_relaxed );
+            }
+        }
+
+        item = std::move( cell->item );
+        cell->item = T();
+        cell->sequence.store( position + Capacity, std::memory_order_release );
+        return true;
+    }
+
+    // 読み出し側 : 続けて取り出せるものを maxCount 個までまとめて取り出す(位置は1回で進める)
+    int popBatch( T* items, int maxCount )
+    {
+        if ( maxCount <= 0 ){
+            return 0;
+        }
+
+        size_t position = dequeue.position.load( std::memory_order_relaxed );
+        int count;
+        for ( ;; ){
+            size_t sequence = cells[position & Mask].sequence.load( std::memory_order_acquire );
+            intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+            if ( difference < 0 ){
+                return 0;
+            }
+            if ( difference > 0 ){
+                position = dequeue.position.load( std::memory_order_relaxed );
+                continue;
+            }
+
+            count = 1;
+            while ( (count < maxCount) && (count < Capacity) &&
+                (cells[(position + count) & Mask].sequence.load( std::memory_order_acquire ) == position + count + 1) ){
+                ++count;
+            }
+
+            if ( !isSharedDequeue ){
+                dequeue.position.store( position + count, std::memory_order_relaxed );
+                break;
+            }
+            if ( dequeue.position.compare_exchange_weak( position, position + count, std::memory_order_relaxed ) ){
+                break;
+            }
+        }
+
+        for ( int i = 0; i < count; ++i ){
+            Cell& cell = cells[(position + i) & Mask];
+            items[i] = std::move( cell.item );
+            cell.item = T();
+            cell.sequence.store( position + i + Capacity, std::memory_order_release );
+        }
+        return count;
+    }
+
+    // Block で待っている書き込み側を戻す(終了するとき)
+    void close()
+    {
+        isClosed.store( true );
+    }
+
+    // おおよその数(ほかのスレッドが書き換えている間は正確ではない)
+    size_t size() const
+    {
+        size_t head = enqueue.position.load( std::memory_order_relaxed );
+        size_t tail = dequeue.position.load( std::memory_order_relaxed );
+        return (head > tail) ? (head - tail) : 0;
+    }
+
+    Statistics getStatistics() const
+    {
+        UINT64 count = enqueue.count.load( std::memory_order_relaxed );
+
+        Statistics statistics;
+        statistics.pushed = enqueue.position.load( std::memory_order_relaxed );
+        statistics.overwritten = (policy == QueuePolicy_OverwriteOldest) ? count : 0;
+        statistics.popped = dequeue.position.load( std::memory_order_relaxed ) - statistics.overwritten;
+        statistics.waits = (policy == QueuePolicy_Block) ? count : 0;
+        return statistics;
+    }
+
+    void print( std::ostream& out, const char* name ) const
+    {
+        auto s = getStatistics();
+        out << name << " (" << (IsMulti ? "MPMC" : "SPSC") << ", " << queuePolicyName( policy ) << ", " << Capacity << ") : 積んだ数 " << s.pushed
+            << ", 取り出した数 " << s.popped << ", 捨てた数 " << s.overwritten << ", 待った回数 " << s.waits << std::endl;
+    }
+
+private:
+
+    static void pause( int spin )
+    {
+        if ( spin < SpinCount ){
+            YieldProcessor();
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+};
+
+// 書き込み側、読み出し側とも1スレッド
+template<typename T, int Capacity>
+using SpscFrameQueue = FrameQueue<T, Capacity, false>;
+
+// 書き込み側、読み出し側とも複数スレッド
+template<typename T, int Capacity>
+using MpmcFrameQueue = FrameQueue<T, Capacity, true>;
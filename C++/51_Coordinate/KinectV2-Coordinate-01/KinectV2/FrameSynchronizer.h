@@ -0,0 +1,345 @@
+﻿#pragma once
+
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <stdexcept>
+
+#include <Kinect.h>
+
+// 複数のストリームのフレームを RelativeTime で対応付けて、同じ時刻のフレームの組(Bundle)にする
+//
+// ストリームごとに Slots 個のスロットのリングバッファーを持ちます。書き込み側と読み出し側が1つずつなら
+// ロックなしで使えます。フレームのデータは呼び出し側がスロットの番号ごとに持ち、ここでは時刻と番号だけを扱います。
+//   書き込み側 : beginWrite() で空いているスロットの番号を取得し、データを書き込んで endWrite() で公開する
+//   読み出し側 : synchronize() で組ができたら、Bundle のスロットの番号からデータを読む
+//                (組にしたスロットは次に synchronize() を呼ぶまで書き換えられないので、
+//                 データを std::vector で持つなら swap() で受け取るとコピーしないで済みます)
+// 1つのストリームが持つのは、組にしたフレーム1つと、まだ組にしていないフレーム2つまでです。
+// それ以上届いたフレームは書き込まずに捨てます(読み出し側が止まったときだけ起こります)。
+//
+// 最初に追加したストリームを基準にし、基準のフレームごとに、ほかのストリームから時刻の差が
+// tolerance 以内でいちばん近いフレームを探します。
+//   Policy_WaitForAll : すべてのストリームがそろったときだけ組にします。
+//   Policy_Latest     : 基準のフレームが届いてから budget が過ぎてもそろわなければ、ほかのストリームは
+//                       いちばん近いフレームで組にします(フレームがなければスロットの番号は-1なので、
+//                       前の組のデータを使い続けてください)。
+// 組にならないまま次の基準のフレームが届いたら古いほうは捨てるので、遅れは1フレームまでです。
+class FrameSynchronizer
+{
+public:
+
+    enum Policy
+    {
+        Policy_WaitForAll,
+        Policy_Latest,
+    };
+
+    static const int MaxStreams = 8;
+    static const int Slots = 3;
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Bundle
+    {
+        TIMESPAN relativeTime;          // 基準のフレームの時刻
+        bool isComplete;                // すべてのストリームの時刻が tolerance 以内か
+
+        int slots[MaxStreams];          // ストリームごとのスロットの番号(フレームがなければ-1)
+        TIMESPAN times[MaxStreams];     // ストリームごとのフレームの時刻
+        bool isMatched[MaxStreams];     // 基準との時刻の差が tolerance 以内か
+    };
+
+    struct Statistics
+    {
+        UINT64 received;        // 受け取ったフレーム数
+        UINT64 dropped;         // 組にしないで捨てたフレーム数
+        UINT64 overflows;       // スロットが空いていなくて捨てたフレーム数
+        UINT64 mismatches;      // 時刻が合わないまま組にした回数
+    };
+
+private:
+
+    struct Slot
+    {
+        TIMESPAN relativeTime;
+        Clock::time_point arrivalTime;
+    };
+
+    struct Stream
+    {
+        std::string name;
+        Slot slots[Slots];
+
+        // head は書き込み側、tail は読み出し側だけが進める(どちらも増え続ける番号)
+        std::atomic<UINT32> head;
+        std::atomic<UINT32> tail;
+
+        // 前の組で使ったフレームの番号(次の synchronize() で返す)
+        bool hasUsed;
+        UINT32 used;
+
+        Statistics statistics;
+    };
+
+    Stream streams[MaxStreams];
+    int streamCount = 0;
+
+    Policy policy = Policy_WaitForAll;
+    TIMESPAN tolerance = 10000000 / 60;
+    Clock::duration budget = std::chrono::milliseconds( 10 );
+
+    UINT64 bundles = 0;
+    UINT64 completeBundles = 0;
+
+public:
+
+    // ストリームを追加する(最初に追加したものが基準になる)
+    int addStream( const std::string& name )
+    {
+        if ( streamCount == MaxStreams ){
+            throw std::runtime_error( "これ以上ストリームを追加できません : " + name );
+        }
+
+        Stream& stream = streams[streamCount];
+        stream.name = name;
+        stream.head.store( 0 );
+        stream.tail.store( 0 );
+        stream.hasUsed = false;
+        stream.used = 0;
+        stream.statistics = Statistics();
+
+        return streamCount++;
+    }
+
+    int getStreamCount() const
+    {
+        return streamCount;
+    }
+
+    void setPolicy( Policy newPolicy )
+    {
+        policy = newPolicy;
+    }
+
+    Policy getPolicy() const
+    {
+        return policy;
+    }
+
+    static const char* policyName( Policy policy )
+    {
+        return (policy == Policy_Latest) ? "Latest" : "WaitForAll";
+    }
+
+    // 同じ時刻と見なす差(100ns単位)
+    void setTolerance( TIMESPAN newTolerance )
+    {
+        tolerance = newTolerance;
+    }
+
+    // Policy_Latest で、そろうのを待つ時間
+    void setBudget( Clock::duration newBudget )
+    {
+        budget = newBudget;
+    }
+
+    // 書き込み側 : 空いているスロットの番号を返す(空いていなければ-1)
+    int beginWrite( int index )
+    {
+        Stream& stream = streams[index];
+        UINT32 head = stream.head.load( std::memory_order_relaxed );
+        UINT32 tail = stream.tail.load( std::memory_order_acquire );
+        if ( head - tail == Slots ){
+            ++stream.statistics.overflows;
+            return -1;
+        }
+
+        return head % Slots;
+    }
+
+    // 書き込み側 : beginWrite() で取得したスロットにフレームを書き込んだ
+    void endWrite( int index, TIMESPAN relativeTime )
+    {
+        Stream& stream = streams[index];
+        UINT32 head = stream.head.load( std::memory_order_relaxed );
+
+        Slot& slot = stream.slots[head % Slots];
+        slot.relativeTime = relativeTime;
+        slot.arrivalTime = Clock::now();
+        ++stream.statistics.received;
+
+        stream.head.store( head + 1, std::memory_order_release );
+    }
+
+    // 読み出し側 : 新しい組ができたら bundle に入れてtrueを返す(前の組のスロットはここで返す)
+    bool synchronize( Bundle& bundle )
+    {
+        if ( streamCount == 0 ){
+            return false;
+        }
+
+        UINT32 heads[MaxStreams];
+        for ( int s = 0; s < streamCount; ++s ){
+            Stream& stream = streams[s];
+            if ( stream.hasUsed ){
+                discard( s, stream.used + 1 );
+                stream.hasUsed = false;
+            }
+
+            heads[s] = stream.head.load( std::memory_order_acquire );
+        }
+
+        // 基準のフレームを、新しいものからそろうか調べる
+        Stream& reference = streams[0];
+        UINT32 tail = reference.tail.load( std::memory_order_relaxed );
+        if ( tail == heads[0] ){
+            return false;
+        }
+
+        UINT32 matches[MaxStreams];
+        for ( UINT32 i = heads[0]; i != tail; ){
+            --i;
+            if ( findMatches( reference.slots[i % Slots].relativeTime, heads, matches ) == streamCount ){
+                emit( i, heads, matches, bundle );
+                return true;
+            }
+        }
+
+        // そろわなかったので、いちばん新しい基準のフレームだけを残す
+        UINT32 newest = heads[0] - 1;
+        TIMESPAN time = reference.slots[newest % Slots].relativeTime;
+        discard( 0, newest );
+
+        // ほかのストリームは、これからの基準のフレームにも合わない古いものを捨てる(いちばん新しいものは残す)
+        for ( int s = 1; s < streamCount; ++s ){
+            Stream& stream = streams[s];
+            UINT32 i = stream.tail.load( std::memory_order_relaxed );
+            while ( (i != heads[s]) && (i + 1 != heads[s]) && (stream.slots[i % Slots].relativeTime < time - tolerance) ){
+                ++i;
+            }
+            discard( s, i );
+        }
+
+        // Policy_Latest なら、予算が過ぎたところでそろわないまま組にする
+        if ( (policy == Policy_Latest) && (Clock::now() - reference.slots[newest % Slots].arrivalTime >= budget) ){
+            findMatches( time, heads, matches );
+            emit( newest, heads, matches, bundle );
+            return true;
+        }
+
+        return false;
+    }
+
+    Statistics getStatistics( int index ) const
+    {
+        return streams[index].statistics;
+    }
+
+    UINT64 getBundleCount() const
+    {
+        return bundles;
+    }
+
+    UINT64 getCompleteBundleCount() const
+    {
+        return completeBundles;
+    }
+
+    void print( std::ostream& out ) const
+    {
+        out << "同期 (" << policyName( policy ) << ") : 組 " << bundles << ", そろった組 " << completeBundles << std::endl;
+        for ( int s = 0; s < streamCount; ++s ){
+            const Statistics& statistics = streams[s].statistics;
+            out << "  " << streams[s].name << " : 受信 " << statistics.received << ", 破棄 " << statistics.dropped
+                << ", あふれ " << statistics.overflows << ", 時刻の不一致 " << statistics.mismatches << std::endl;
+        }
+    }
+
+private:
+
+    // 基準の時刻 time にいちばん近いフレームを各ストリームから探して、差が tolerance 以内のストリームの数を返す
+    // (ほかのストリームは matches にいちばん近いフレームの番号を入れる。フレームがなければ heads と同じ番号)
+    int findMatches( TIMESPAN time, const UINT32* heads, UINT32* matches ) const
+    {
+        int count = 1;
+        for ( int s = 1; s < streamCount; ++s ){
+            const Stream& stream = streams[s];
+            TIMESPAN nearest = -1;
+            matches[s] = heads[s];
+            for ( UINT32 i = stream.tail.load( std::memory_order_relaxed ); i != heads[s]; ++i ){
+                TIMESPAN difference = stream.slots[i % Slots].relativeTime - time;
+                if ( difference < 0 ){
+                    difference = -difference;
+                }
+                if ( (nearest < 0) || (difference < nearest) ){
+                    nearest = difference;
+                    matches[s] = i;
+                }
+            }
+
+            if ( (nearest >= 0) && (nearest <= tolerance) ){
+                ++count;
+            }
+        }
+
+        return count;
+    }
+
+    void emit( UINT32 referenceIndex, const UINT32* heads, UINT32* matches, Bundle& bundle )
+    {
+        matches[0] = referenceIndex;
+
+        const Stream& reference = streams[0];
+        bundle.relativeTime = reference.slots[referenceIndex % Slots].relativeTime;
+        bundle.isComplete = true;
+
+        for ( int s = 0; s < streamCount; ++s ){
+            Stream& stream = streams[s];
+            if ( matches[s] == heads[s] ){
+                // このストリームにはフレームがない
+                bundle.slots[s] = -1;
+                bundle.times[s] = 0;
+                bundle.isMatched[s] = false;
+            }
+            else {
+                TIMESPAN time = stream.slots[matches[s] % Slots].relativeTime;
+                TIMESPAN difference = (time > bundle.relativeTime) ? (time - bundle.relativeTime) : (bundle.relativeTime - time);
+
+                bundle.slots[s] = matches[s] % Slots;
+                bundle.times[s] = time;
+                bundle.isMatched[s] = (difference <= tolerance);
+
+                // 組にしたフレームより古いものは、もう使わない
+                discard( s, matches[s] );
+                stream.hasUsed = true;
+                stream.used = matches[s];
+            }
+
+            if ( !bundle.isMatched[s] ){
+                bundle.isComplete = false;
+                ++stream.statistics.mismatches;
+            }
+        }
+
+        ++bundles;
+        if ( bundle.isComplete ){
+            ++completeBundles;
+        }
+    }
+
+    // ストリーム index の、番号 end より前のフレームを返す
+    void discard( int index, UINT32 end )
+    {
+        Stream& stream = streams[index];
+        UINT32 tail = stream.tail.load( std::memory_order_relaxed );
+        for ( ; tail != end; ++tail ){
+            if ( !stream.hasUsed || (tail != stream.used) ){
+                ++stream.statistics.dropped;
+            }
+        }
+
+        stream.tail.store( tail, std::memory_order_release );
+    }
+};
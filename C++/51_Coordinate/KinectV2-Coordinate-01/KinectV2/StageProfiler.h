@@ -0,0 +1,302 @@
+﻿#pragma once
+
+#include <map>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include <Windows.h>
+
+// 処理の段階(ステージ)ごとにかかった時間を記録する
+//
+// 計測する範囲に STAGE_TIMER( profiler, "updateColorFrame" ); のようにタイマーを置くと、スコープを抜けたときに
+// 開始と終了の時刻(QueryPerformanceCounter)を、そのスレッドのリングバッファーに書き込みます。
+// ロックもメモリーの確保もしないので(スレッドで最初に使うときだけバッファーを確保します)、
+// 1回の計測は QueryPerformanceCounter 2回とイベント1つの書き込みだけです。
+// ステージの名前はポインターだけを記録するので、文字列リテラルにしてください。
+// バッファーはプロファイラーが持つので、プロファイラーはそれを使うスレッドより後に破棄してください。
+//
+// print() でステージごとの回数と時間の百分位数を表示し、writeTrace() で Chrome のトレースイベント形式の
+// JSON (chrome://tracing や Perfetto で開けます) に書き出します。どちらもスレッドごとに最新の Capacity 個のイベントを使います。
+//
+// STAGE_PROFILER_DISABLED を定義してビルドすると、STAGE_TIMER は何もしません。
+class StageProfiler
+{
+public:
+
+    // スレッドごとに残すイベントの数
+    static const int Capacity = 1 << 14;
+
+private:
+
+    struct Event
+    {
+        const char* name;
+        LONGLONG begin;
+        LONGLONG end;
+    };
+
+    struct ThreadBuffer
+    {
+        StageProfiler* owner;
+        DWORD threadId;
+        std::string threadName;
+
+        // 書き込んだイベントの数(書き込むスレッドだけが進める)
+        std::atomic<UINT64> count;
+        Event events[Capacity];
+
+        void add( const char* name, LONGLONG begin, LONGLONG end )
+        {
+            UINT64 index = count.load( std::memory_order_relaxed );
+            Event& event = events[index % Capacity];
+            event.name = name;
+            event.begin = begin;
+            event.end = end;
+            count.store( index + 1, std::memory_order_release );
+        }
+    };
+
+    struct Record
+    {
+        const char* name;
+        LONGLONG begin;
+        LONGLONG end;
+        DWORD threadId;
+    };
+
+    // buffers の追加と読み出し、スレッドの名前
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+    std::atomic<bool> isEnabled;
+    LONGLONG startTime;
+    double millisecondsPerTick;
+
+public:
+
+    // スコープを抜けるまでの時間を記録する(STAGE_TIMER から使う)
+    class Scope
+    {
+    private:
+
+        ThreadBuffer* buffer;
+        const char* name;
+        LONGLONG begin;
+
+        Scope( const Scope& );
+        Scope& operator = ( const Scope& );
+
+    public:
+
+        Scope( StageProfiler& profiler, const char* name )
+            : buffer( profiler.isEnabled.load( std::memory_order_relaxed ) ? profiler.getThreadBuffer() : nullptr )
+            , name( name )
+            , begin( 0 )
+        {
+            if ( buffer != nullptr ){
+                begin = now();
+            }
+        }
+
+        ~Scope()
+        {
+            if ( buffer != nullptr ){
+                buffer->add( name, begin, now() );
+            }
+        }
+    };
+
+    StageProfiler()
+    {
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency( &frequency );
+        millisecondsPerTick = 1000.0 / frequency.QuadPart;
+        startTime = now();
+        isEnabled.store( true );
+    }
+
+    // 計測するかどうか(止めている間の STAGE_TIMER はフラグを1回読むだけ)
+    void setEnabled( bool enabled )
+    {
+        isEnabled.store( enabled );
+    }
+
+    bool getEnabled() const
+    {
+        return isEnabled.load();
+    }
+
+    // 呼び出したスレッドに、トレースで表示する名前を付ける
+    void setThreadName( const std::string& name )
+    {
+        ThreadBuffer* buffer = getThreadBuffer();
+
+        std::lock_guard<std::mutex> lock( mutex );
+        buffer->threadName = name;
+    }
+
+    // ステージごとの回数と、時間(ms)の 50% / 90% / 99% の百分位数と最大を表示する
+    void print( std::ostream& out )
+    {
+        std::map<std::string, std::vector<double>> stages;
+        for ( const auto& record : snapshot() ){
+            stages[record.name].push_back( (record.end - record.begin) * millisecondsPerTick );
+        }
+
+        out << "ステージ : 回数, 50% / 90% / 99% / 最大 (ms)" << std::endl;
+        for ( auto& stage : stages ){
+            auto& times = stage.second;
+            std::sort( times.begin(), times.end() );
+            out << "  " << stage.first << " : " << times.size() << ", " << percentile( times, 50 ) << " / "
+                << percentile( times, 90 ) << " / " << percentile( times, 99 ) << " / " << times.back() << std::endl;
+        }
+    }
+
+    // Chrome のトレースイベント形式で書き出す(時刻はプロファイラーを作ったときからのμs)
+    void writeTrace( const std::string& fileName )
+    {
+        auto records = snapshot();
+        std::sort( records.begin(), records.end(), []( const Record& a, const Record& b ){
+            return a.begin < b.begin;
+        } );
+
+        std::ofstream file( fileName );
+        if ( !file ){
+            throw std::runtime_error( "トレースのファイルを開けません : " + fileName );
+        }
+
+        file << std::fixed << std::setprecision( 3 );
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+
+        bool isFirst = true;
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            for ( const auto& buffer : buffers ){
+                if ( buffer->threadName.empty() ){
+                    continue;
+                }
+
+                file << (isFirst ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->threadId
+                    << ",\"args\":{\"name\":\"" << escape( buffer->threadName ) << "\"}}";
+                isFirst = false;
+            }
+        }
+
+        double microsecondsPerTick = millisecondsPerTick * 1000.0;
+        for ( const auto& record : records ){
+            file << (isFirst ? "" : ",\n") << "{\"name\":\"" << escape( record.name ) << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << record.threadId << ",\"ts\":" << ((record.begin - startTime) * microsecondsPerTick)
+                << ",\"dur\":" << ((record.end - record.begin) * microsecondsPerTick) << "}";
+            isFirst = false;
+        }
+
+        file << std::endl << "]}" << std::endl;
+        if ( !file ){
+            throw std::runtime_error( "トレースを書き込めません : " + fileName );
+        }
+    }
+
+private:
+
+    static LONGLONG now()
+    {
+        LARGE_INTEGER counter;
+        ::QueryPerformanceCounter( &counter );
+        return counter.QuadPart;
+    }
+
+    ThreadBuffer* getThreadBuffer()
+    {
+        // このスレッドで最後に使ったバッファー(ほかのプロファイラーのものなら探し直す)
+        static __declspec(thread) ThreadBuffer* current = nullptr;
+        if ( (current == nullptr) || (current->owner != this) ){
+            current = findBuffer();
+        }
+
+        return current;
+    }
+
+    ThreadBuffer* findBuffer()
+    {
+        DWORD threadId = ::GetCurrentThreadId();
+
+        std::lock_guard<std::mutex> lock( mutex );
+        for ( const auto& buffer : buffers ){
+            if ( buffer->threadId == threadId ){
+                return buffer.get();
+            }
+        }
+
+        std::unique_ptr<ThreadBuffer> buffer( new ThreadBuffer );
+        buffer->owner = this;
+        buffer->threadId = threadId;
+        buffer->count.store( 0 );
+        buffers.push_back( std::move( buffer ) );
+        return buffers.back().get();
+    }
+
+    // すべてのスレッドのバッファーから、残っているイベントを写す
+    std::vector<Record> snapshot()
+    {
+        std::vector<Record> records;
+
+        std::lock_guard<std::mutex> lock( mutex );
+        for ( const auto& buffer : buffers ){
+            UINT64 count = buffer->count.load( std::memory_order_acquire );
+            UINT64 first = (count > Capacity) ? (count - Capacity) : 0;
+
+            size_t start = records.size();
+            for ( UINT64 i = first; i < count; ++i ){
+                const Event& event = buffer->events[i % Capacity];
+                Record record = { event.name, event.begin, event.end, buffer->threadId };
+                records.push_back( record );
+            }
+
+            // 写している間に書き込まれたイベントの場所(書き込み中のものを含む)は捨てる
+            std::atomic_thread_fence( std::memory_order_acquire );
+            UINT64 after = buffer->count.load( std::memory_order_relaxed );
+            UINT64 valid = (after + 1 > Capacity) ? (after + 1 - Capacity) : 0;
+            if ( valid > first ){
+                size_t overwritten = (size_t)(((valid < count) ? valid : count) - first);
+                records.erase( records.begin() + start, records.begin() + start + overwritten );
+            }
+        }
+
+        return records;
+    }
+
+    static double percentile( const std::vector<double>& sorted, int percent )
+    {
+        return sorted[((sorted.size() - 1) * percent) / 100];
+    }
+
+    static std::string escape( const std::string& text )
+    {
+        std::string result;
+        for ( auto c : text ){
+            if ( (c == '"') || (c == '\\') ){
+                result += '\\';
+            }
+            result += c;
+        }
+        return result;
+    }
+};
+
+#define STAGE_TIMER_CONCAT2( a, b ) a##b
+#define STAGE_TIMER_CONCAT( a, b ) STAGE_TIMER_CONCAT2( a, b )
+
+// profiler に、このスコープを抜けるまでの時間をステージ name として記録する
+#ifdef STAGE_PROFILER_DISABLED
+#define STAGE_TIMER( profiler, name )
+#else
+#define STAGE_TIMER( profiler, name ) StageProfiler::Scope STAGE_TIMER_CONCAT( stageTimer, __LINE__ )( profiler, name )
+#endif
@@ -1,5 +1,12 @@
 ﻿#include <iostream>
 #include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 
 #include <Kinect.h>
 #include <opencv2\opencv.hpp>
@@ -8,6 +15,17 @@
 #include "ComPtr.h"
 //#include <atlbase.h>
 
+#include "ColorToDepthMap.h"
+#include "DepthConverter.h"
+#include "Compositor.h"
+#include "FrameFile.h"
+#include "FrameCache.h"
+#include "FrameSynchronizer.h"
+#include "FramePool.h"
+#include "FrameQueue.h"
+#include "StageProfiler.h"
+#include "AllocationCounter.h"
+
 // 次のように使います
 // ERROR_CHECK( ::GetDefaultKinectSensor( &kinect ) );
 // 書籍での解説のためにマクロにしています。実際には展開した形で使うことを検討してください。
@@ -27,28 +45,123 @@ private:
 
     // Kinect
     IKinectSensor* kinect = nullptr;
-    ICoordinateMapper *coordinateMapper;
+    ComPtr<ICoordinateMapper> coordinateMapper;
 
     // Color
     IColorFrameReader* colorFrameReader = nullptr;
-    std::vector<BYTE> colorBuffer;
+    WAITABLE_HANDLE colorFrameEvent = 0;
+    FramePool colorPool;
+    FramePool::Frame colorBuffer;
     int colorWidth;
     int colorHeight;
     unsigned int colorBytesPerPixel;
 
     // Depth
     IDepthFrameReader* depthFrameReader = nullptr;
-    std::vector<UINT16> depthBuffer;
+    WAITABLE_HANDLE depthFrameEvent = 0;
+    FramePool depthPool;
+    FramePool::Frame depthBuffer;
 
     int depthWidth;
     int depthHeight;
 
+    UINT16 minDepthReliableDistance;
+    UINT16 maxDepthReliableDistance;
+
     // BodyIndex
     IBodyIndexFrameReader* bodyIndexFrameReader = nullptr;
-    std::vector<BYTE> bodyIndexBuffer;
+    WAITABLE_HANDLE bodyIndexFrameEvent = 0;
+    FramePool bodyIndexPool;
+    FramePool::Frame bodyIndexBuffer;
+
+    // カラー座標からDepth座標への対応表
+    ColorToDepthMap colorToDepth;
+
+    // 重ね合わせ
+    Compositor compositor;
+    DepthConverter depthConverter;
+    std::vector<BYTE> depthGray;
+    cv::Mat showImage;
+
+    // 新しいフレームが届いたときだけ対応表や重ね合わせを作り直す
+    FrameCache cache;
+    int colorStream;
+    int depthStream;
+    int bodyIndexStream;
+    int mappingProduct;
+    int depthGrayProduct;
+    int compositeProduct;
+
+    // 同じ時刻のカラー、Depth、ボディインデックスを組にする(Depthが基準)
+    // フレームは取得スレッドでプールから受け取ってスロットに取得し、組になったらキューで表示スレッドに渡す
+    FrameSynchronizer synchronizer;
+    int depthSync;
+    int colorSync;
+    int bodyIndexSync;
+    FramePool::Frame colorSlots[FrameSynchronizer::Slots];
+    FramePool::Frame depthSlots[FrameSynchronizer::Slots];
+    FramePool::Frame bodyIndexSlots[FrameSynchronizer::Slots];
+
+    // 組にしたフレームを表示スレッドに渡すキュー
+    // 表示が遅れたら古い組を捨てるので、取得スレッドは待たずに次のフレームを取得できる
+    struct FrameSet
+    {
+        FramePool::Frame color;
+        FramePool::Frame depth;
+        FramePool::Frame bodyIndex;
+        TIMESPAN colorTime = 0;
+        TIMESPAN depthTime = 0;
+        TIMESPAN bodyIndexTime = 0;
+    };
+
+    static const int QueueSize = 2;
+    SpscFrameQueue<FrameSet, QueueSize> frameQueue;
+    FrameSet receivedSets[QueueSize];
+
+    // ストリームごとのスラブの数
+    // (スロット、キュー、表示中のフレームと、取得スレッドが積んでいる途中と捨てている途中のもの、
+    //  記録中に書き込み待ちになっているもの)
+    static const int RecordingFrames = 4;
+    const int PoolSize = FrameSynchronizer::Slots + QueueSize + 3 + RecordingFrames;
+
+    // フレームを取得するスレッド(表示スレッドとはキューと要求だけでやり取りする)
+    enum Request
+    {
+        Request_Recording = 1,      // 記録の開始・終了
+        Request_Policy = 2,         // 同期のポリシーの切り替え
+        Request_Statistics = 4,     // 同期の状態の表示
+    };
+
+    std::thread acquisitionThread;
+    HANDLE stopEvent = nullptr;
+    std::atomic<int> requests;
+
+    // 取得スレッドで起きたエラー(表示スレッドで例外にする)
+    std::mutex errorMutex;
+    std::string acquisitionError;
+
+    // フレームの記録(カラー、Depth、ボディインデックス)
+    // スラブのハンドルを渡してコピーしない(プールより後に宣言して、先に破棄する)
+    BasicFrameFileWriter<FramePool::Frame> recorder;
+    const char* RecordFileName = "coordinate.kfrm";
+
+    // 処理の段階ごとの時間('x' キーで表示して、トレースを書き出す)
+    // 取得スレッドより後に破棄するように、スレッドはデストラクターで止める
+    StageProfiler profiler;
+    const char* TraceFileName = "trace.json";
 
 public:
 
+    ~KinectApp()
+    {
+        // メンバーを破棄する前にスレッドを止める
+        stopAcquisition();
+
+        if ( stopEvent != nullptr ){
+            ::CloseHandle( stopEvent );
+        }
+    }
+
     // 初期化
     void initialize()
     {
@@ -65,28 +178,100 @@ public:
         }
 
         // 座標変換インタフェースを取得
-        kinect->get_CoordinateMapper( &coordinateMapper );
+        ERROR_CHECK( kinect->get_CoordinateMapper( &coordinateMapper ) );
 
         // フレームの初期化
         initializeColorFrame();
         initializeDepthFrame();
         initializeBodyIndexFrame();
+
+        // 座標の対応表を作成する
+        colorToDepth.initialize( coordinateMapper, colorWidth, colorHeight, depthWidth, depthHeight );
+
+        // 重ね合わせに使うスレッドとバッファーを作成する
+        compositor.initialize( colorWidth, colorHeight, depthWidth, depthHeight );
+        depthGray.resize( depthWidth * depthHeight );
+        showImage.create( colorHeight, colorWidth, CV_8UC4 );
+
+        // フレームから作るデータの依存関係
+        colorStream = cache.addStream( "Color" );
+        depthStream = cache.addStream( "Depth" );
+        bodyIndexStream = cache.addStream( "BodyIndex" );
+        mappingProduct = cache.addProduct( "対応表", { depthStream } );
+        depthGrayProduct = cache.addProduct( "Depthのグレー", { depthStream } );
+        compositeProduct = cache.addProduct( "重ね合わせ", { colorStream, mappingProduct, depthGrayProduct, bodyIndexStream } );
+
+        // フレームを組にするストリーム
+        depthSync = synchronizer.addStream( "Depth" );
+        colorSync = synchronizer.addStream( "Color" );
+        bodyIndexSync = synchronizer.addStream( "BodyIndex" );
+
+        // フレームの到着イベントに登録する(取得スレッドで待つ)
+        ERROR_CHECK( colorFrameReader->SubscribeFrameArrived( &colorFrameEvent ) );
+        ERROR_CHECK( depthFrameReader->SubscribeFrameArrived( &depthFrameEvent ) );
+        ERROR_CHECK( bodyIndexFrameReader->SubscribeFrameArrived( &bodyIndexFrameEvent ) );
+
+        stopEvent = ::CreateEvent( nullptr, TRUE, FALSE, nullptr );
+        if ( stopEvent == nullptr ){
+            throw std::runtime_error( "イベントを作成できません" );
+        }
+        requests.store( 0 );
     }
 
     void run()
     {
+        // 取得と同期は取得スレッドで行い、このスレッドは重ね合わせて表示する
+        profiler.setThreadName( "Display" );
+        ::ResetEvent( stopEvent );
+        acquisitionThread = std::thread( &KinectApp::acquire, this );
+
         while ( 1 ) {
-            update();
+            receive();
             draw();
 
             auto key = cv::waitKey( 10 );
             if ( key == 'q' ){
                 break;
             }
+            else if ( key == 'x' ){
+                writeProfile();
+            }
             else if ( (key >> 16) == VK_RIGHT ){
                 showState = (showState + 1) % 3;
             }
+            else if ( key == 'm' ){
+                // 対応表の作り方を切り替える
+                colorToDepth.setMode( (colorToDepth.getMode() == ColorToDepthMap::Mode_ColorFrame) ?
+                    ColorToDepthMap::Mode_DepthTable : ColorToDepthMap::Mode_ColorFrame );
+                std::cout << "座標の対応表 : " << ColorToDepthMap::modeName( colorToDepth.getMode() ) << std::endl;
+            }
+            else if ( key == 'b' ){
+                benchmarkCompositor();
+            }
+            else if ( key == 'r' ){
+                // 記録は取得スレッドで行うので、開始・終了も取得スレッドで行う
+                requests.fetch_or( Request_Recording );
+            }
+            else if ( key == 's' ){
+                cache.print( std::cout );
+                colorPool.print( std::cout, "Color" );
+                depthPool.print( std::cout, "Depth" );
+                bodyIndexPool.print( std::cout, "BodyIndex" );
+                frameQueue.print( std::cout, "キュー" );
+                requests.fetch_or( Request_Statistics );
+            }
+            else if ( key == 'a' ){
+                checkFrameAllocations();
+            }
+            else if ( key == 'p' ){
+                requests.fetch_or( Request_Policy );
+            }
+            else if ( key == 'k' ){
+                benchmarkQueues();
+            }
         }
+
+        stopAcquisition();
     }
 
 private:
@@ -107,7 +292,8 @@ private:
         ERROR_CHECK( colorFrameDescription->get_BytesPerPixel( &colorBytesPerPixel ) );
 
         // バッファーを作成する
-        colorBuffer.resize( colorWidth * colorHeight * colorBytesPerPixel );
+        colorPool.initialize( colorFrameDescription, PoolSize );
+        colorPool.reserve( PoolSize );
     }
 
     void initializeDepthFrame()
@@ -123,8 +309,13 @@ private:
         ERROR_CHECK( depthFrameDescription->get_Width( &depthWidth ) );
         ERROR_CHECK( depthFrameDescription->get_Height( &depthHeight ) );
 
+        // Depthの最大値、最小値を取得する(記録するファイルに入れる)
+        ERROR_CHECK( depthFrameSource->get_DepthMinReliableDistance( &minDepthReliableDistance ) );
+        ERROR_CHECK( depthFrameSource->get_DepthMaxReliableDistance( &maxDepthReliableDistance ) );
+
         // バッファーを作成する
-        depthBuffer.resize( depthWidth * depthHeight );
+        depthPool.initialize( depthFrameDescription, PoolSize );
+        depthPool.reserve( PoolSize );
     }
 
     void initializeBodyIndexFrame()
@@ -135,20 +326,162 @@ private:
         ERROR_CHECK( bodyIndexFrameSource->OpenReader( &bodyIndexFrameReader ) );
 
         // バッファーを作成する
-        bodyIndexBuffer.resize( depthWidth * depthHeight );
+        ComPtr<IFrameDescription> bodyIndexFrameDescription;
+        ERROR_CHECK( bodyIndexFrameSource->get_FrameDescription( &bodyIndexFrameDescription ) );
+        bodyIndexPool.initialize( bodyIndexFrameDescription, PoolSize );
+        bodyIndexPool.reserve( PoolSize );
+    }
+
+    // 取得スレッド : フレームが届くのを待って取得し、組ができたらキューに積む
+    void acquire()
+    {
+        profiler.setThreadName( "Acquisition" );
+
+        HANDLE handles[] = {
+            stopEvent,
+            reinterpret_cast<HANDLE>( colorFrameEvent ),
+            reinterpret_cast<HANDLE>( depthFrameEvent ),
+            reinterpret_cast<HANDLE>( bodyIndexFrameEvent ),
+        };
+
+        try {
+            while ( 1 ) {
+                // 終了のイベントを先に調べる(どれかのフレームが届いたら、すべてのリーダーから最新のフレームを取得する)
+                auto ret = ::WaitForMultipleObjects( _countof( handles ), handles, FALSE, INFINITE );
+                if ( (ret == WAIT_OBJECT_0) || (ret == WAIT_FAILED) ){
+                    break;
+                }
+
+                // 届いたリーダーのイベントのデータを受け取ってイベントを戻す
+                // (受け取らないとシグナルのままになり、待たずに戻り続けてCPUを使い切る)
+                resetFrameEvent( ret - WAIT_OBJECT_0 );
+
+                handleRequests();
+                update();
+            }
+        }
+        catch ( std::exception& ex ){
+            std::lock_guard<std::mutex> lock( errorMutex );
+            acquisitionError = ex.what();
+        }
+    }
+
+    // WaitForMultipleObjects() の handles の番号(1:カラー、2:Depth、3:ボディインデックス)のイベントを戻す
+    void resetFrameEvent( DWORD index )
+    {
+        if ( index == 1 ){
+            ComPtr<IColorFrameArrivedEventArgs> args;
+            colorFrameReader->GetFrameArrivedEventData( colorFrameEvent, &args );
+        }
+        else if ( index == 2 ){
+            ComPtr<IDepthFrameArrivedEventArgs> args;
+            depthFrameReader->GetFrameArrivedEventData( depthFrameEvent, &args );
+        }
+        else if ( index == 3 ){
+            ComPtr<IBodyIndexFrameArrivedEventArgs> args;
+            bodyIndexFrameReader->GetFrameArrivedEventData( bodyIndexFrameEvent, &args );
+        }
+    }
+
+    void stopAcquisition()
+    {
+        if ( !acquisitionThread.joinable() ){
+            return;
+        }
+
+        ::SetEvent( stopEvent );
+        acquisitionThread.join();
     }
 
-    // データの更新処理
+    // 表示スレッドからの要求を処理する(取得スレッド)
+    void handleRequests()
+    {
+        int request = requests.exchange( 0 );
+        if ( request & Request_Recording ){
+            toggleRecording();
+        }
+        if ( request & Request_Policy ){
+            // そろうまで待つか、予算内でそろわなければ組にするかを切り替える
+            synchronizer.setPolicy( (synchronizer.getPolicy() == FrameSynchronizer::Policy_WaitForAll) ?
+                FrameSynchronizer::Policy_Latest : FrameSynchronizer::Policy_WaitForAll );
+            std::cout << "同期 : " << FrameSynchronizer::policyName( synchronizer.getPolicy() ) << std::endl;
+        }
+        if ( request & Request_Statistics ){
+            synchronizer.print( std::cout );
+        }
+    }
+
+    // データの更新処理(取得スレッド)
     void update()
     {
+        STAGE_TIMER( profiler, "update" );
+
         updateColorFrame();
         updateDepthFrame();
         updateBodyIndexFrame();
+
+        // 同じ時刻のフレームがそろったら、表示スレッドに渡す(コピーはしない)
+        FrameSynchronizer::Bundle bundle;
+        if ( !synchronizer.synchronize( bundle ) ){
+            return;
+        }
+
+        FrameSet frameSet;
+        if ( bundle.slots[colorSync] >= 0 ){
+            frameSet.color = std::move( colorSlots[bundle.slots[colorSync]] );
+            frameSet.colorTime = bundle.times[colorSync];
+        }
+        if ( bundle.slots[depthSync] >= 0 ){
+            frameSet.depth = std::move( depthSlots[bundle.slots[depthSync]] );
+            frameSet.depthTime = bundle.times[depthSync];
+        }
+        if ( bundle.slots[bodyIndexSync] >= 0 ){
+            frameSet.bodyIndex = std::move( bodyIndexSlots[bundle.slots[bodyIndexSync]] );
+            frameSet.bodyIndexTime = bundle.times[bodyIndexSync];
+        }
+
+        // 表示が遅れていてキューがいっぱいなら、いちばん古い組を捨てて積む
+        STAGE_TIMER( profiler, "push" );
+        frameQueue.push( std::move( frameSet ) );
+    }
+
+    // 取得スレッドが積んだ組を受け取る(たまっていたら順に使うので、最後の組のフレームが残る)
+    void receive()
+    {
+        STAGE_TIMER( profiler, "receive" );
+
+        {
+            std::lock_guard<std::mutex> lock( errorMutex );
+            if ( !acquisitionError.empty() ){
+                throw std::runtime_error( acquisitionError.c_str() );
+            }
+        }
+
+        int count = frameQueue.popBatch( receivedSets, QueueSize );
+        for ( int i = 0; i < count; ++i ){
+            FrameSet& frameSet = receivedSets[i];
+            if ( frameSet.color.isValid() ){
+                colorBuffer = std::move( frameSet.color );
+                cache.touch( colorStream, frameSet.colorTime );
+            }
+            if ( frameSet.depth.isValid() ){
+                depthBuffer = std::move( frameSet.depth );
+                cache.touch( depthStream, frameSet.depthTime );
+            }
+            if ( frameSet.bodyIndex.isValid() ){
+                bodyIndexBuffer = std::move( frameSet.bodyIndex );
+                cache.touch( bodyIndexStream, frameSet.bodyIndexTime );
+            }
+
+            frameSet = FrameSet();
+        }
     }
 
     // カラーフレームの更新
     void updateColorFrame()
     {
+        STAGE_TIMER( profiler, "updateColorFrame" );
+
         // フレームを取得する
         ComPtr<IColorFrame> colorFrame;
         auto ret = colorFrameReader->AcquireLatestFrame( &colorFrame );
@@ -156,14 +489,42 @@ private:
             return;
         }
 
+        // 空いているスロットがなければこのフレームは使わない
+        int slot = synchronizer.beginWrite( colorSync );
+        if ( slot < 0 ){
+            return;
+        }
+
+        // 捨てたフレームのスラブを先に返してから、新しいスラブを受け取る
+        FramePool::Frame& buffer = colorSlots[slot];
+        buffer.reset();
+        buffer = colorPool.acquire();
+        if ( !buffer.isValid() ){
+            return;
+        }
+
         // BGRAの形式でデータを取得する
-        ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
-            colorBuffer.size(), &colorBuffer[0], ColorImageFormat::ColorImageFormat_Bgra ) );
+        {
+            STAGE_TIMER( profiler, "CopyConvertedFrameDataToArray" );
+            ERROR_CHECK( colorFrame->CopyConvertedFrameDataToArray(
+                buffer.size(), buffer.data(), ColorImageFormat::ColorImageFormat_Bgra ) );
+        }
+
+        TIMESPAN relativeTime = 0;
+        ERROR_CHECK( colorFrame->get_RelativeTime( &relativeTime ) );
+        synchronizer.endWrite( colorSync, relativeTime );
+
+        // 記録中ならスラブのハンドルを書き込み待ちに積む(コピーせず、圧縮と書き込みは別スレッドで行う)
+        if ( recorder.isOpen() ){
+            recorder.write( FrameStream_Color, relativeTime, buffer, buffer.data(), (UINT)buffer.size() );
+        }
     }
 
     // Depthフレームの更新
     void updateDepthFrame()
     {
+        STAGE_TIMER( profiler, "updateDepthFrame" );
+
         // Depthフレームを取得する
         ComPtr<IDepthFrame> depthFrame;
         auto ret = depthFrameReader->AcquireLatestFrame( &depthFrame );
@@ -171,98 +532,514 @@ private:
             return;
         }
 
+        int slot = synchronizer.beginWrite( depthSync );
+        if ( slot < 0 ){
+            return;
+        }
+
+        FramePool::Frame& buffer = depthSlots[slot];
+        buffer.reset();
+        buffer = depthPool.acquire();
+        if ( !buffer.isValid() ){
+            return;
+        }
+
         // データを取得する
-        ERROR_CHECK( depthFrame->CopyFrameDataToArray( depthBuffer.size(), &depthBuffer[0] ) );
+        {
+            STAGE_TIMER( profiler, "CopyFrameDataToArray" );
+            ERROR_CHECK( depthFrame->CopyFrameDataToArray( buffer.size() / sizeof( UINT16 ), buffer.as<UINT16>() ) );
+        }
+
+        TIMESPAN relativeTime = 0;
+        ERROR_CHECK( depthFrame->get_RelativeTime( &relativeTime ) );
+        synchronizer.endWrite( depthSync, relativeTime );
+
+        if ( recorder.isOpen() ){
+            recorder.write( FrameStream_Depth, relativeTime, buffer, buffer.data(), (UINT)buffer.size() );
+        }
     }
 
     // ボディインデックスフレームの更新
     void updateBodyIndexFrame()
     {
+        STAGE_TIMER( profiler, "updateBodyIndexFrame" );
+
         // フレームを取得する
         ComPtr<IBodyIndexFrame> bodyIndexFrame;
         auto ret = bodyIndexFrameReader->AcquireLatestFrame( &bodyIndexFrame );
         if ( ret == S_OK ){
+            int slot = synchronizer.beginWrite( bodyIndexSync );
+            if ( slot < 0 ){
+                return;
+            }
+
+            FramePool::Frame& buffer = bodyIndexSlots[slot];
+            buffer.reset();
+            buffer = bodyIndexPool.acquire();
+            if ( !buffer.isValid() ){
+                return;
+            }
+
             // データを取得する
-            ERROR_CHECK( bodyIndexFrame->CopyFrameDataToArray( bodyIndexBuffer.size(), &bodyIndexBuffer[0] ) );
+            {
+                STAGE_TIMER( profiler, "CopyFrameDataToArray" );
+                ERROR_CHECK( bodyIndexFrame->CopyFrameDataToArray( buffer.size(), buffer.data() ) );
+            }
+
+            TIMESPAN relativeTime = 0;
+            ERROR_CHECK( bodyIndexFrame->get_RelativeTime( &relativeTime ) );
+            synchronizer.endWrite( bodyIndexSync, relativeTime );
+
+            if ( recorder.isOpen() ){
+                recorder.write( FrameStream_BodyIndex, relativeTime, buffer, buffer.data(), (UINT)buffer.size() );
+            }
+        }
+    }
+
+    // 記録の開始・終了を切り替える
+    void toggleRecording()
+    {
+        if ( recorder.isOpen() ){
+            recorder.close();
+            std::cout << "記録を終了しました : " << RecordFileName << std::endl;
+
+            auto statistics = recorder.getStatistics();
+            std::cout << "記録したフレーム : " << statistics.written << ", 捨てたフレーム : " << statistics.dropped
+                << ", 空きを待った回数 : " << statistics.waited << " (" << statistics.waitedTime << "ms)"
+                << ", 圧縮率 : " << ((statistics.rawBytes > 0) ? ((double)statistics.storedBytes / statistics.rawBytes) : 1.0) << std::endl;
+            if ( !recorder.getError().empty() ){
+                std::cout << recorder.getError() << std::endl;
+            }
+        }
+        else {
+            FrameFormat formats[FrameStream_Count] = {};
+            formats[FrameStream_Color].width = colorWidth;
+            formats[FrameStream_Color].height = colorHeight;
+            formats[FrameStream_Color].bytesPerPixel = colorBytesPerPixel;
+            formats[FrameStream_Depth].width = depthWidth;
+            formats[FrameStream_Depth].height = depthHeight;
+            formats[FrameStream_Depth].bytesPerPixel = sizeof( UINT16 );
+            formats[FrameStream_BodyIndex].width = depthWidth;
+            formats[FrameStream_BodyIndex].height = depthHeight;
+            formats[FrameStream_BodyIndex].bytesPerPixel = sizeof( BYTE );
+
+            recorder.open( RecordFileName, formats, minDepthReliableDistance, maxDepthReliableDistance );
+            std::cout << "記録を開始しました : " << RecordFileName << std::endl;
         }
     }
 
     void draw()
     {
-        cv::Mat colorImage( colorHeight, colorWidth, CV_8UC4, &colorBuffer[0] );
+        STAGE_TIMER( profiler, "draw" );
 
-        std::vector<DepthSpacePoint> depthSpace( colorWidth * colorHeight );
-        coordinateMapper->MapColorFrameToDepthSpace( depthBuffer.size(), &depthBuffer[0], depthSpace.size(), &depthSpace[0] );
+        // すべてのストリームのフレームがそろうまでは表示しない
+        if ( !colorBuffer.isValid() || !depthBuffer.isValid() || !bodyIndexBuffer.isValid() ){
+            return;
+        }
+
+        // Depthか作り方が変わったときだけ対応表を作り直す
+        if ( cache.needsUpdate( mappingProduct, colorToDepth.getMode() ) ){
+            STAGE_TIMER( profiler, (colorToDepth.getMode() == ColorToDepthMap::Mode_ColorFrame) ?
+                "MapColorFrameToDepthSpace" : "mapFromDepthTable" );
+            colorToDepth.invalidate();
+            colorToDepth.update( depthBuffer.as<UINT16>() );
+        }
+
+        // Depthのグレーは、Depthを表示しているときだけ作る
+        if ( (showState == 0) && cache.needsUpdate( depthGrayProduct ) ){
+            STAGE_TIMER( profiler, "DepthConverter" );
+            depthConverter.convert( depthBuffer.as<UINT16>(), &depthGray[0], depthGray.size() );
+        }
+
+        // 入力も表示の状態も変わっていなければ、前に表示した画像のままにする
+        if ( !cache.needsUpdate( compositeProduct, showState ) ){
+            return;
+        }
+
+        cv::Mat colorImage( colorHeight, colorWidth, CV_8UC4, colorBuffer.data() );
 
         // Depth
         if ( showState == 0 ) {
-            for ( int i = 0; i < colorWidth * colorHeight; ++i ){
-                int depthX = (int)depthSpace[i].X;
-                int depthY = (int)depthSpace[i].Y;
-                if ( (depthX < 0) || (512 <= depthX) || (depthY < 0) || (424 <= depthY) ){
-                    continue;
-                }
+            STAGE_TIMER( profiler, "drawDepth" );
 
-                int depthIndex = (depthY * depthWidth) + depthX;
-                int depth = ~(uchar)((depthBuffer[depthIndex] * 255) / 8000);
-
-                // Depthで上書きする
-                int colorIndex = i * 4;
-                colorImage.data[colorIndex + 0] = depth;
-                colorImage.data[colorIndex + 1] = depth;
-                colorImage.data[colorIndex + 2] = depth;
-            }
+            // Depthで上書きする(カラーのバッファーは書き換えずに、表示用の画像に写してから重ねる)
+            colorImage.copyTo( showImage );
+            compositor.drawDepth( showImage.data, colorToDepth.data(), &depthGray[0] );
         }
         // BodyIndex
         else if ( showState == 1 ){
-            for ( int i = 0; i < colorWidth * colorHeight; ++i ){
-                int depthX = (int)depthSpace[i].X;
-                int depthY = (int)depthSpace[i].Y;
-                if ( (depthX < 0) || (512 <= depthX) || (depthY < 0) || (424 <= depthY) ){
-                    continue;
+            STAGE_TIMER( profiler, "drawBodyMask" );
+
+            // 人を検出した位置だけ色を消す
+            colorImage.copyTo( showImage );
+            compositor.drawBodyMask( showImage.data, colorToDepth.data(), bodyIndexBuffer.data() );
+        }
+        // BodyIndex(背景除去)
+        else {
+            STAGE_TIMER( profiler, "drawBackgroundRemoved" );
+
+            // 人を検出した位置だけ色を付ける
+            compositor.drawBackgroundRemoved( colorImage.data, colorToDepth.data(), bodyIndexBuffer.data(), showImage.data );
+        }
+
+        STAGE_TIMER( profiler, "imshow" );
+        cv::imshow( "Color Image", showImage );
+    }
+
+    // 取得、同期、キューでの受け渡しまでを繰り返して、フレームごとにメモリーを確保していないか確かめる
+    void checkFrameAllocations()
+    {
+        const int WarmUpCount = 10;
+        const int Count = 300;
+        const TIMESPAN Interval = 10000000 / 30;
+
+        FramePool depth;
+        FramePool color;
+        depth.initialize( depthPool.getSlabSize(), PoolSize );
+        color.initialize( colorPool.getSlabSize(), PoolSize );
+
+        // Depthを基準にし、カラーは少し遅れて届き、ときどき落ちる
+        FrameSynchronizer sync;
+        int depthIndex = sync.addStream( "Depth" );
+        int colorIndex = sync.addStream( "Color" );
+
+        FramePool::Frame depthSlots[FrameSynchronizer::Slots];
+        FramePool::Frame colorSlots[FrameSynchronizer::Slots];
+        FramePool::Frame depthFrame;
+        FramePool::Frame colorFrame;
+        FrameSynchronizer::Bundle bundle;
+
+        SpscFrameQueue<FrameSet, QueueSize> queue;
+        FrameSet received[QueueSize];
+
+        auto step = [&]( int n ){
+            writeFrame( sync, depthIndex, depth, depthSlots, n * Interval );
+            if ( (n % 7) != 3 ){
+                writeFrame( sync, colorIndex, color, colorSlots, (n * Interval) + (Interval / 8) );
+            }
+
+            if ( sync.synchronize( bundle ) ){
+                FrameSet frameSet;
+                if ( bundle.slots[depthIndex] >= 0 ){
+                    frameSet.depth = std::move( depthSlots[bundle.slots[depthIndex]] );
+                }
+                if ( bundle.slots[colorIndex] >= 0 ){
+                    frameSet.color = std::move( colorSlots[bundle.slots[colorIndex]] );
+                }
+                queue.push( std::move( frameSet ) );
+            }
+
+            int count = queue.popBatch( received, QueueSize );
+            for ( int i = 0; i < count; ++i ){
+                if ( received[i].depth.isValid() ){
+                    depthFrame = std::move( received[i].depth );
+                }
+                if ( received[i].color.isValid() ){
+                    colorFrame = std::move( received[i].color );
+                }
+                received[i] = FrameSet();
+            }
+        };
+
+        for ( int n = 0; n < WarmUpCount; ++n ){
+            step( n );
+        }
+
+        auto depthBefore = depth.getStatistics();
+        auto colorBefore = color.getStatistics();
+        auto allocationBefore = AllocationCounter::count();
+
+        for ( int n = WarmUpCount; n < WarmUpCount + Count; ++n ){
+            step( n );
+        }
+
+        std::cout << "メモリーの確保(operator new) : " << (AllocationCounter::count() - allocationBefore) << "回 / " << Count << "フレーム" << std::endl;
+
+        auto depthAfter = depth.getStatistics();
+        auto colorAfter = color.getStatistics();
+        auto allocations = (depthAfter.allocations - depthBefore.allocations) + (colorAfter.allocations - colorBefore.allocations);
+        std::cout << "スラブの確保 : " << allocations << "回 / " << Count << "フレーム"
+            << ((allocations == 0) ? "" : " (フレームごとに確保しています)") << std::endl;
+        depth.print( std::cout, "Depth" );
+        color.print( std::cout, "Color" );
+        sync.print( std::cout );
+    }
+
+    // スロットにプールのフレームを受け取って、時刻を付けて公開する
+    static void writeFrame( FrameSynchronizer& sync, int stream, FramePool& pool, FramePool::Frame* slots, TIMESPAN relativeTime )
+    {
+        int slot = sync.beginWrite( stream );
+        if ( slot < 0 ){
+            return;
+        }
+
+        slots[slot].reset();
+        slots[slot] = pool.acquire();
+        if ( !slots[slot].isValid() ){
+            return;
+        }
+
+        memset( slots[slot].data(), 0, slots[slot].size() );
+        sync.endWrite( stream, relativeTime );
+    }
+
+    // キューの処理量と遅延を、スレッド数、ポリシー、読み出し側の速さを変えて計測する
+    void benchmarkQueues()
+    {
+        std::cout << "積んだ数, 取り出した数, 遅延(50% / 99% / 最大), 書き込みで止まった最大の時間, 捨てた数" << std::endl;
+        benchmarkQueue<false>( "SPSC 1x1", QueuePolicy_OverwriteOldest, 1, 1, false );
+        benchmarkQueue<false>( "SPSC 1x1", QueuePolicy_Block, 1, 1, false );
+        benchmarkQueue<false>( "SPSC 1x1 (読み出しが遅い)", QueuePolicy_OverwriteOldest, 1, 1, true );
+        benchmarkQueue<false>( "SPSC 1x1 (読み出しが遅い)", QueuePolicy_Block, 1, 1, true );
+        benchmarkQueue<true>( "MPMC 2x3", QueuePolicy_OverwriteOldest, 2, 3, false );
+        benchmarkQueue<true>( "MPMC 2x3", QueuePolicy_Block, 2, 3, false );
+        benchmarkQueue<true>( "MPMC 2x3 (読み出しが遅い)", QueuePolicy_OverwriteOldest, 2, 3, true );
+    }
+
+    // キューに積むもの(小さいフレームと、積んだ時刻)
+    struct QueueItem
+    {
+        FramePool::Frame frame;
+        std::chrono::steady_clock::time_point time;
+    };
+
+    // 書き込み側は止まらずに積み続け、読み出し側はまとめて取り出す(遅い読み出し側は取り出すたびに2ms止まる)
+    template<bool IsMulti>
+    void benchmarkQueue( const char* name, QueuePolicy policy, int producers, int consumers, bool isSlow )
+    {
+        typedef std::chrono::steady_clock Clock;
+        typedef std::chrono::duration<double, std::milli> Milliseconds;
+
+        const int Capacity = 8;
+        const int BatchSize = 4;
+        const size_t MaxSamples = 1 << 20;
+        const auto Duration = std::chrono::milliseconds( 500 );
+
+        // キュー、読み出し側、書き込み側が持つ数だけフレームを用意する
+        FramePool pool;
+        size_t poolSize = Capacity + (consumers * BatchSize) + (producers * 2);
+        pool.initialize( 64, poolSize );
+        pool.reserve( poolSize );
+
+        FrameQueue<QueueItem, Capacity, IsMulti> queue( policy );
+        std::atomic<bool> isRunning( true );
+        std::atomic<int> runningProducers( producers );
+
+        // 書き込み側ごとの push() にかかった最大の時間と、読み出し側ごとの積んでから取り出すまでの時間(ms)
+        std::vector<double> stalls( producers, 0 );
+        std::vector<std::vector<double>> latencies( consumers );
+        for ( auto& samples : latencies ){
+            samples.reserve( MaxSamples );
+        }
+
+        std::vector<std::thread> threads;
+        auto begin = Clock::now();
+        for ( int p = 0; p < producers; ++p ){
+            threads.push_back( std::thread( [&, p]{
+                while ( isRunning ){
+                    QueueItem item;
+                    item.frame = pool.acquire();
+                    item.time = Clock::now();
+
+                    auto pushTime = item.time;
+                    if ( !queue.push( std::move( item ) ) ){
+                        break;
+                    }
+
+                    double stall = Milliseconds( Clock::now() - pushTime ).count();
+                    if ( stalls[p] < stall ){
+                        stalls[p] = stall;
+                    }
                 }
+                --runningProducers;
+            } ) );
+        }
 
-                int depthIndex = (depthY * depthWidth) + depthX;
-                int bodyIndex = bodyIndexBuffer[depthIndex];
+        for ( int c = 0; c < consumers; ++c ){
+            threads.push_back( std::thread( [&, c]{
+                QueueItem items[BatchSize];
+                while ( (runningProducers > 0) || (queue.size() > 0) ){
+                    int count = queue.popBatch( items, BatchSize );
+                    if ( count == 0 ){
+                        std::this_thread::yield();
+                        continue;
+                    }
 
-                // 人を検出した位置だけ色を消す
-                if ( bodyIndex != 255 ){
-                    int colorIndex = i * 4;
-                    colorImage.data[colorIndex + 0] = 255;
-                    colorImage.data[colorIndex + 1] = 255;
-                    colorImage.data[colorIndex + 2] = 255;
+                    auto now = Clock::now();
+                    for ( int i = 0; i < count; ++i ){
+                        if ( latencies[c].size() < MaxSamples ){
+                            latencies[c].push_back( Milliseconds( now - items[i].time ).count() );
+                        }
+                        items[i] = QueueItem();
+                    }
+
+                    if ( isSlow ){
+                        std::this_thread::sleep_for( std::chrono::milliseconds( 2 ) );
+                    }
                 }
+            } ) );
+        }
+
+        std::this_thread::sleep_for( Duration );
+        isRunning = false;
+        double seconds = Milliseconds( Clock::now() - begin ).count() / 1000.0;
+
+        // Block で待っている書き込み側を戻す
+        queue.close();
+        for ( auto& thread : threads ){
+            thread.join();
+        }
+
+        std::vector<double> samples;
+        for ( const auto& latency : latencies ){
+            samples.insert( samples.end(), latency.begin(), latency.end() );
+        }
+        std::sort( samples.begin(), samples.end() );
+
+        double maxStall = 0;
+        for ( auto stall : stalls ){
+            if ( maxStall < stall ){
+                maxStall = stall;
             }
         }
-        // BodyIndex(背景除去)
+
+        auto statistics = queue.getStatistics();
+        std::cout << name << " " << queuePolicyName( policy ) << " : " << (UINT64)(statistics.pushed / seconds) << "個/秒, "
+            << (UINT64)(statistics.popped / seconds) << "個/秒, ";
+        if ( samples.empty() ){
+            std::cout << "-, ";
+        }
         else {
-            // 表示用の画像データ
-            cv::Mat showImage = cv::Mat::zeros( colorHeight, colorWidth, CV_8UC4 );
-
-            for ( int i = 0; i < colorWidth * colorHeight; ++i ){
-                int depthX = (int)depthSpace[i].X;
-                int depthY = (int)depthSpace[i].Y;
-                if ( (depthX < 0) || (512 <= depthX) || (depthY < 0) || (424 <= depthY) ){
-                    continue;
-                }
+            std::cout << samples[samples.size() / 2] << "ms / " << samples[(samples.size() * 99) / 100] << "ms / " << samples.back() << "ms, ";
+        }
+        std::cout << maxStall << "ms, " << statistics.overwritten << std::endl;
+    }
 
-                int depthIndex = (depthY * depthWidth) + depthX;
-                int bodyIndex = bodyIndexBuffer[depthIndex];
+    // 重ね合わせの速度をスレッド数を変えて計測する
+    void benchmarkCompositor()
+    {
+        const int Count = 20;
 
-                // 人を検出した位置だけ色を付ける
-                if ( bodyIndex != 255 ){
-                    int colorIndex = i * 4;
-                    showImage.data[colorIndex + 0] = colorImage.data[colorIndex + 0];
-                    showImage.data[colorIndex + 1] = colorImage.data[colorIndex + 1];
-                    showImage.data[colorIndex + 2] = colorImage.data[colorIndex + 2];
+        // 疑似的なカラー、Depth、ボディインデックスを作成する
+        cv::Mat color( colorHeight, colorWidth, CV_8UC4 );
+        cv::randu( color, 0, 256 );
+
+        std::vector<UINT16> depth( depthWidth * depthHeight );
+        cv::randu( cv::Mat( depthHeight, depthWidth, CV_16UC1, &depth[0] ), 0, 8000 );
+
+        std::vector<BYTE> bodyIndex( depthWidth * depthHeight );
+        for ( int i = 0; i < (int)bodyIndex.size(); ++i ){
+            bodyIndex[i] = ((i % depthWidth) < (depthWidth / 2)) ? (i % 6) : 255;
+        }
+
+        // カラーの中央付近だけがDepthの範囲に入る対応表を作成する
+        std::vector<DepthSpacePoint> depthSpace( colorWidth * colorHeight );
+        for ( int y = 0; y < colorHeight; ++y ){
+            for ( int x = 0; x < colorWidth; ++x ){
+                DepthSpacePoint& point = depthSpace[(y * colorWidth) + x];
+                point.X = (x - (colorWidth / 8)) * depthWidth / (colorWidth * 0.75f);
+                point.Y = (y - (colorHeight / 16)) * depthHeight / (colorHeight * 0.875f);
+            }
+        }
+
+        std::vector<BYTE> gray( depth.size() );
+        depthConverter.convert( &depth[0], &gray[0], gray.size() );
+
+        // 元の処理で期待値を作る
+        std::vector<cv::Mat> expected( 3 );
+        std::vector<double> referenceTime( 3 );
+        for ( int state = 0; state < 3; ++state ){
+            double total = 0;
+            for ( int n = 0; n < Count; ++n ){
+                cv::Mat image = color.clone();
+                auto begin = cv::getTickCount();
+                expected[state] = composeReference( state, image, depthSpace, depth, bodyIndex );
+                total += cv::getTickCount() - begin;
+            }
+            referenceTime[state] = total * 1000.0 / cv::getTickFrequency() / Count;
+        }
+        std::cout << "Reference   : " << referenceTime[0] << "ms, " << referenceTime[1] << "ms, " << referenceTime[2] << "ms" << std::endl;
+
+        Compositor benchmark;
+        benchmark.initialize( colorWidth, colorHeight, depthWidth, depthHeight );
+        int maxThreads = benchmark.getThreadCount();
+
+        cv::Mat show( colorHeight, colorWidth, CV_8UC4 );
+        for ( int threads = 1; threads <= maxThreads; ++threads ){
+            benchmark.setThreadCount( threads );
+
+            std::cout << threads << " thread(s) : ";
+            for ( int state = 0; state < 3; ++state ){
+                double total = 0;
+                cv::Mat image;
+                for ( int n = 0; n < Count; ++n ){
+                    image = color.clone();
+                    auto begin = cv::getTickCount();
+                    if ( state == 0 ){
+                        benchmark.drawDepth( image.data, &depthSpace[0], &gray[0] );
+                    }
+                    else if ( state == 1 ){
+                        benchmark.drawBodyMask( image.data, &depthSpace[0], &bodyIndex[0] );
+                    }
+                    else {
+                        benchmark.drawBackgroundRemoved( image.data, &depthSpace[0], &bodyIndex[0], show.data );
+                        image = show;
+                    }
+                    total += cv::getTickCount() - begin;
                 }
+
+                bool isSame = memcmp( image.data, expected[state].data, image.total() * 4 ) == 0;
+                std::cout << (total * 1000.0 / cv::getTickFrequency() / Count) << "ms"
+                    << (isSame ? "" : "(結果が一致しません)") << ((state < 2) ? ", " : "");
             }
+            std::cout << std::endl;
+        }
+    }
+
+    // 1画素ずつ処理する元の重ね合わせ(結果の比較用)
+    cv::Mat composeReference( int state, cv::Mat colorImage, const std::vector<DepthSpacePoint>& depthSpace,
+        const std::vector<UINT16>& depth, const std::vector<BYTE>& bodyIndex )
+    {
+        cv::Mat showImage = cv::Mat::zeros( colorHeight, colorWidth, CV_8UC4 );
 
-            // 表示用の画像を差し換える
-            colorImage = showImage;
+        for ( int i = 0; i < colorWidth * colorHeight; ++i ){
+            int depthX = (int)depthSpace[i].X;
+            int depthY = (int)depthSpace[i].Y;
+            if ( (depthX < 0) || (depthWidth <= depthX) || (depthY < 0) || (depthHeight <= depthY) ){
+                continue;
+            }
+
+            int depthIndex = (depthY * depthWidth) + depthX;
+            int colorIndex = i * 4;
+            if ( state == 0 ){
+                int gray = ~(uchar)((depth[depthIndex] * 255) / 8000);
+                colorImage.data[colorIndex + 0] = gray;
+                colorImage.data[colorIndex + 1] = gray;
+                colorImage.data[colorIndex + 2] = gray;
+            }
+            else if ( bodyIndex[depthIndex] != 255 ){
+                cv::Mat& target = (state == 1) ? colorImage : showImage;
+                for ( int c = 0; c < 3; ++c ){
+                    target.data[colorIndex + c] = (state == 1) ? 255 : colorImage.data[colorIndex + c];
+                }
+            }
         }
 
-        cv::imshow( "Color Image", colorImage );
+        return (state == 2) ? showImage : colorImage;
+    }
+
+    // 計測した時間を表示して、トレースを書き出す
+    void writeProfile()
+    {
+        profiler.print( std::cout );
+
+        try {
+            profiler.writeTrace( TraceFileName );
+            std::cout << "トレースを書き出しました : " << TraceFileName << std::endl;
+        }
+        catch ( std::exception& ex ){
+            std::cout << ex.what() << std::endl;
+        }
     }
 };
 